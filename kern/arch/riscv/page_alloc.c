@@ -31,3 +31,8 @@ void base_arena_init(struct multiboot_info *mbi)
 	arena_add(base_arena, KADDR(first_free_page),
 	          first_invalid_page - first_free_page, MEM_WAIT);
 }
+
+/* No NUMA support; everything comes from the global arenas. */
+void numa_init(void)
+{
+}
@@ -26,6 +26,7 @@ static inline void reboot(void)
               __attribute__((always_inline)) __attribute__((noreturn));
 static inline void prefetch(void *addr);
 static inline void prefetchw(void *addr);
+static inline void zero_page_nt(void *kva);
 static inline void swap_gs(void);
 static inline void __attribute__((noreturn))
 __reset_stack_pointer(void *arg, uintptr_t sp, void (*f)(void *));
@@ -170,6 +171,18 @@ static inline void prefetchw(void *addr)
 	asm volatile("prefetchw (%0)" : : "r"(addr));
 }
 
+/* Zeroes a page with non-temporal stores, so we don't evict the cache for a
+ * page no one will touch for a while.  The sfence makes the stores visible
+ * before whoever we hand the page to. */
+static inline void zero_page_nt(void *kva)
+{
+	uint64_t *p = kva;
+
+	for (int i = 0; i < PGSIZE / sizeof(uint64_t); i++)
+		asm volatile("movnti %1, %0" : "=m"(p[i]) : "r"(0UL));
+	asm volatile("sfence" : : : "memory");
+}
+
 /* Guest VMs have a maximum physical address they can use.  Guest
  * physical addresses are mapped into this MCP 1:1, but limited to
  * this max address *in hardware*.  I.e., the MCP process can address
@@ -189,6 +189,8 @@ void print_cpuinfo(void)
 	#define CPUID_XSAVEOPT_SUPPORT      (1 << 0)
 	#define CPUID_MONITOR_MWAIT         (1 << 3)
 	#define CPUID_MWAIT_PWR_MGMT        (1 << 0)
+	#define CPUID_AVX_SUPPORT           (1 << 28)
+	#define CPUID_AVX2_SUPPORT          (1 << 5)
 
 	cpuid(0x01, 0x00, 0, 0, &ecx, &edx);
 	if (CPUID_FXSR_SUPPORT & edx)
@@ -206,6 +208,15 @@ void print_cpuinfo(void)
 		if (CPUID_MWAIT_PWR_MGMT & ecx)
 			cpu_set_feat(CPU_FEAT_X86_MWAIT);
 	}
+
+	/* AVX state is in X86_MAX_XCR0, so we'll enable it if we have XSAVE.
+	 * The kernel doesn't use it; this is for userspace. */
+	cpuid(0x01, 0x00, 0, 0, &ecx, 0);
+	if ((CPUID_AVX_SUPPORT & ecx) && (CPUID_XSAVE_SUPPORT & ecx)) {
+		cpuid(0x07, 0x00, 0, &ebx, 0, 0);
+		if (CPUID_AVX2_SUPPORT & ebx)
+			cpu_set_feat(CPU_FEAT_X86_AVX2);
+	}
 }
 
 #define BIT_SPACING "        "
@@ -8,6 +8,9 @@
 #include <kmalloc.h>
 #include <multiboot.h>
 #include <arena.h>
+#include <acpi.h>
+#include <smp.h>
+#include <arch/topology.h>
 
 /* Helper.  Adds free entries to the base arena.  Most entries are page aligned,
  * though on some machines below EXTPHYSMEM we may have some that aren't. */
@@ -142,3 +145,34 @@ void base_arena_init(struct multiboot_info *mbi)
 		account_for_pages(boot_freemem_paddr);
 	}
 }
+
+/* Hands each NUMA node's SRAT memory ranges to the page allocator.  Call after
+ * topology_init().  Memory in domains without cores stays in the global
+ * arenas. */
+void numa_init(void)
+{
+	struct Srat *st;
+	int node;
+	int nr_nodes = cpu_topology_info.num_numa;
+
+	if (!srat || nr_nodes <= 1)
+		return;
+	if (nr_nodes > MAX_NUMA_NODES) {
+		warn("%d NUMA nodes, but we only support %d.  Ignoring NUMA.",
+		     nr_nodes, MAX_NUMA_NODES);
+		return;
+	}
+	for (int i = 0; i < srat->nchildren; i++) {
+		st = srat->children[i]->tbl;
+		if (!st || st->type != SRmem)
+			continue;
+		node = numa_id_of_dom(st->mem.dom);
+		if (node < 0)
+			continue;
+		numa_add_mem(node, st->mem.addr, st->mem.len);
+	}
+	for (int i = 0; i < num_cores; i++)
+		per_cpu_info[i].numa_node =
+			cpu_topology_info.core_list[i].numa_id;
+	numa_pages_init(nr_nodes, numa_distance);
+}
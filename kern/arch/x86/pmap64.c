@@ -410,6 +410,37 @@ pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create)
 	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
 }
 
+/* Like pgdir_walk, but stops at the PML2, which is where a HUGE_PGSIZE user
+ * page lives.  The PTE may be unmapped, a jumbo, or point to a PML1. */
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create)
+{
+	int flags = PML2_SHIFT;
+
+	if (create == 1)
+		flags |= PG_WALK_CREATE;
+	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
+}
+
+/* Replaces a PML2 jumbo PTE with a PML1 of small PTEs for the same memory and
+ * settings.  The translations don't change, so any TLB flush can wait for
+ * whoever changes them next.  Hold the pte_lock. */
+void pte_split_jumbo(pte_t pte)
+{
+	kpte_t *kpte = pte;
+	epte_t *epte = kpte_to_epte(kpte);
+	physaddr_t pa = pte_get_paddr(pte);
+	int settings = pte_get_settings(pte) & ~PTE_PS;
+	kpte_t *new_pml;
+
+	assert(pte_is_jumbo(pte));
+	new_pml = kpages_zalloc(2 * PGSIZE, MEM_WAIT);
+	for (int i = 0; i < NPTENTRIES; i++)
+		pte_write(&new_pml[i], pa + i * PGSIZE, settings);
+	/* Same intermediate perms as __pml_walk() */
+	*kpte = PADDR(new_pml) | PTE_P | PTE_U | PTE_W;
+	*epte = (PADDR(new_pml) + PGSIZE) | EPTE_R | EPTE_X | EPTE_W;
+}
+
 static int pml_perm_walk(kpte_t *pml, const void *va, int pml_shift)
 {
 	kpte_t *kpte;
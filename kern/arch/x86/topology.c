@@ -380,6 +380,37 @@ void topology_init(void)
 		build_flat_topology();
 }
 
+/* Returns the numa_id of the cores in SRAT proximity domain dom, or -1 if no
+ * core is in that domain. */
+int numa_id_of_dom(int dom)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (find_numa_domain(core_list[i].apic_id) == dom)
+			return core_list[i].numa_id;
+	}
+	return -1;
+}
+
+static int dom_of_numa_id(int numa_id)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (core_list[i].numa_id == numa_id)
+			return find_numa_domain(core_list[i].apic_id);
+	}
+	return -1;
+}
+
+/* Distance between two numa_ids, in ACPI SLIT units (10 is local).  Without a
+ * SLIT, every other node is equally far away. */
+int numa_distance(int from, int to)
+{
+	int dist = acpi_slit_distance(dom_of_numa_id(from), dom_of_numa_id(to));
+
+	if (dist < 0)
+		return from == to ? 10 : 20;
+	return dist;
+}
+
 void print_cpu_topology(void)
 {
 	printk("num_numa: %d, num_sockets: %d, num_cpus: %d, num_cores: %d\n",
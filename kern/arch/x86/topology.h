@@ -38,6 +38,8 @@ extern int *os_coreid_lookup;
 
 void topology_init();
 void print_cpu_topology();
+int numa_id_of_dom(int dom);
+int numa_distance(int from, int to);
 
 static inline int get_hw_coreid(uint32_t coreid)
 {
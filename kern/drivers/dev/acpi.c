@@ -987,6 +987,18 @@ static struct Atable *parseslit(struct Atable *parent, char *name, uint8_t *raw,
 	return finatable_nochildren(t);
 }
 
+/* Returns the SLIT distance between two proximity domains, or -1 if we don't
+ * know it. */
+int acpi_slit_distance(int from_dom, int to_dom)
+{
+	if (slit == NULL)
+		return -1;
+	if (from_dom < 0 || from_dom >= slit->rowlen ||
+	    to_dom < 0 || to_dom >= slit->rowlen)
+		return -1;
+	return slit->e[from_dom][to_dom].dist;
+}
+
 int pickcore(int mycolor, int index)
 {
 	int color;
@@ -36,6 +36,8 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <trap.h>
+#include <hash.h>
 #include <net/ip.h>
 
 struct dev etherdevtab;
@@ -184,6 +186,8 @@ static void etherclose(struct chan *chan)
 		runlock(&ether->rwlock);
 		nexterror();
 	}
+	if (chan == ether->rxq_chan)
+		ether_rxq_detach(chan);
 	netifclose(ether, chan);
 	poperror();
 	runlock(&ether->rwlock);
@@ -300,7 +304,152 @@ static inline int eaddrcmp(uint8_t *x, uint8_t *y)
 	return (a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]);
 }
 
+static void __ether_rxq_input(uint32_t srcid, long a0, long a1, long a2);
+
+/* Whoever sets rxq_busy[rxq] is the only one draining that queue: the drain
+ * kmsg or a busy-poller. */
+static bool __ether_rxq_claim(struct ether *ether, int rxq)
+{
+	return atomic_cas(&ether->rxq_busy[rxq], 0, 1);
+}
+
+/* A drain kmsg that ran while we were busy gave up, so frames still queued
+ * need another one. */
+static void __ether_rxq_release(struct ether *ether, int rxq)
+{
+	atomic_set(&ether->rxq_busy[rxq], 0);
+	mb();
+	if (qlen(ether->rxq_in[rxq]) &&
+	    !atomic_swap(&ether->rxq_sched[rxq], 1))
+		send_kernel_message(core_id(), __ether_rxq_input, (long)ether,
+				    rxq, 0, KMSG_ROUTINE);
+}
+
+/* Drains one RX queue's input, on the core whose driver filled it. */
+static void __ether_rxq_input(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct ether *ether = (struct ether*)a0;
+	int rxq = a1;
+	struct queue *q = ether->rxq_in[rxq];
+
+	atomic_set(&ether->rxq_sched[rxq], 0);
+	mb();
+	/* If someone else is draining, they kick us again when they're done. */
+	if (!__ether_rxq_claim(ether, rxq))
+		return;
+	if (qlen(q))
+		ether->rxq_input(ether->rxq_arg, rxq, q);
+	__ether_rxq_release(ether, rxq);
+}
+
+/* Passes bp to netfile f.  Frames from RX queue rxq for the file a medium
+ * attached to are processed on this core; the rest wait for f's reader. */
+static int ether_fpass(struct ether *ether, struct netfile *f,
+		       struct block *bp, int rxq)
+{
+	if (rxq < 0 || rxq >= MaxEtherQueues || f != ether->rxq_f ||
+	    !ether->rxq_in[rxq])
+		return qpass(f->in, bp);
+	if (qpass(ether->rxq_in[rxq], bp) < 0)
+		return -1;
+	if (!atomic_swap(&ether->rxq_sched[rxq], 1))
+		send_kernel_message(core_id(), __ether_rxq_input, (long)ether,
+				    rxq, 0, KMSG_ROUTINE);
+	return 0;
+}
+
+/* Attaches input to the data file behind chan c.  From then on, frames the
+ * driver received on RX ring i for that file are handed to input(arg, i, q) in
+ * a routine kmsg on the receiving core, where input drains q.  With
+ * ether_add_rxq() putting each ring's IRQ on its own core, each ring is
+ * processed on its own core.  Single-queue NICs aren't attached, and their
+ * frames keep going to c.  Returns the number of RX queues, or -1 if c isn't
+ * one of our data files. */
+int ether_rxq_attach(struct chan *c,
+		     void (*input)(void *, int, struct queue *), void *arg)
+{
+	struct ether *ether;
+	struct netfile *f;
+	int i;
+
+	if (&devtab[c->type] != &etherdevtab)
+		return -1;
+	ether = c->aux;
+	if (ether->vlanid)
+		return -1;
+	if (ether->nr_rxq <= 1 || ether->rxq_chan)
+		return ether->nr_rxq;
+	f = ether->f[NETID(c->qid.path)];
+	for (i = 0; i < ether->nr_rxq; i++) {
+		if (!ether->rxq_in[i]) {
+			ether->rxq_in[i] = qopen(ether->limit, Qmsg, 0, 0);
+			if (!ether->rxq_in[i])
+				error(ENOMEM, "unable to open RX queue %d", i);
+		}
+		/* A detach left it claimed. */
+		atomic_set(&ether->rxq_busy[i], 0);
+	}
+	ether->rxq_input = input;
+	ether->rxq_arg = arg;
+	ether->rxq_chan = c;
+	wmb();
+	ether->rxq_f = f;
+	return ether->nr_rxq;
+}
+
+/* Undoes ether_rxq_attach() for chan c.  Later frames go to c's file, and the
+ * ones still waiting in the RX queues are dropped.  Waits for running drains,
+ * so the caller can tear down whatever input uses. */
+void ether_rxq_detach(struct chan *c)
+{
+	struct ether *ether = c->aux;
+	struct queue *q;
+
+	if (&devtab[c->type] != &etherdevtab || ether->rxq_chan != c)
+		return;
+	ether->rxq_f = NULL;
+	mb();
+	for (int i = 0; i < MaxEtherQueues; i++) {
+		q = ether->rxq_in[i];
+		if (!q)
+			continue;
+		/* We keep it claimed, so late drain kmsgs leave it alone. */
+		while (!__ether_rxq_claim(ether, i))
+			kthread_yield();
+		qflush(q);
+	}
+	ether->rxq_chan = NULL;
+}
+
+/* Busy-poll helpers: claims RX queue rxq of the medium's chan c, so the caller
+ * can drain it inline like its input function would.  Returns the queue, or 0
+ * if there is none or someone else is draining it. */
+struct queue *ether_rxq_claim(struct chan *c, int rxq)
+{
+	struct ether *ether = c->aux;
+
+	if (&devtab[c->type] != &etherdevtab || ether->rxq_chan != c)
+		return NULL;
+	if (rxq < 0 || rxq >= MaxEtherQueues || !ether->rxq_in[rxq])
+		return NULL;
+	if (!__ether_rxq_claim(ether, rxq))
+		return NULL;
+	return ether->rxq_in[rxq];
+}
+
+void ether_rxq_release(struct chan *c, int rxq)
+{
+	__ether_rxq_release(c->aux, rxq);
+}
+
 struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
+{
+	return etheriq_rxq(ether, bp, fromwire, -1);
+}
+
+/* Like etheriq, for a frame off RX ring rxq of a multiqueue driver. */
+struct block *etheriq_rxq(struct ether *ether, struct block *bp, int fromwire,
+			  int rxq)
 {
 	struct etherpkt *pkt;
 	uint16_t type;
@@ -380,13 +529,13 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 					ether->soverflows++;
 					continue;
 				}
-				if (qpass(f->in, xbp) < 0)
+				if (ether_fpass(ether, f, xbp, rxq) < 0)
 					ether->soverflows++;
 			}
 	}
 
 	if (fx) {
-		if (qpass(fx->in, bp) < 0)
+		if (ether_fpass(ether, fx, bp, rxq) < 0)
 			ether->soverflows++;
 		return 0;
 	}
@@ -398,10 +547,120 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	return bp;
 }
 
+/* Hashes the addresses and, for unfragmented TCP and UDP, the ports of an
+ * outbound frame.  Returns 0 for anything we don't parse, which keeps non-IP
+ * traffic on the first queue. */
+static uint32_t ether_flow_hash(struct block *bp)
+{
+	uint8_t *p = bp->rp + ETHERHDRSIZE;
+	size_t len = BHLEN(bp);
+	uint32_t h = 0;
+	int proto, hl;
+
+	if (len < ETHERHDRSIZE)
+		return 0;
+	len -= ETHERHDRSIZE;
+	switch (nhgets(bp->rp + 2 * Eaddrlen)) {
+	case 0x0800:
+		if (len < IPV4HDR_LEN)
+			return 0;
+		h = nhgetl(p + 12) ^ nhgetl(p + 16);
+		proto = p[9];
+		hl = (p[0] & 0xF) << 2;
+		/* Fragments after the first have no ports; keep them all with
+		 * the first by hashing only the addresses. */
+		if (nhgets(p + 6) & 0x3FFF)
+			proto = 0;
+		break;
+	case 0x86DD:
+		if (len < IPV6HDR_LEN)
+			return 0;
+		for (int i = 8; i < 40; i += 4)
+			h ^= nhgetl(p + i);
+		proto = p[6];
+		hl = IPV6HDR_LEN;
+		break;
+	default:
+		return 0;
+	}
+	if ((proto == TCP || proto == UDP) && len >= hl + 4)
+		h ^= nhgetl(p + hl);
+	return hash_32(h, 32);
+}
+
+/* Routes a driver's RX ring IRQ to a core.  Rings are dealt round-robin over
+ * all cores but core 0, which is busy enough with timers and the LL work, so
+ * each ring's interrupts and the work they kick off run on their own core.
+ * The 'rxq' ctl moves a ring later. */
+void ether_add_rxq(struct ether *ether, int apic_vector)
+{
+	int i = ether->nr_rxq;
+	int core = 0;
+
+	if (i >= MaxEtherQueues) {
+		printk("#l%d: dropping RX queue %d, max %d\n", ether->ctlrno,
+		       i, MaxEtherQueues);
+		return;
+	}
+	if (num_cores > 1)
+		core = 1 + i % (num_cores - 1);
+	if (route_irqs(apic_vector, core))
+		core = -1;
+	ether->rxq_vec[i] = apic_vector;
+	ether->rxq_core[i] = core;
+	ether->nr_rxq = i + 1;
+}
+
+/* Busy-poll entry point for the IP stack: runs the driver's RX processing on
+ * the calling core for the controller behind chan c, which is one of our data
+ * files.  Returns the number of frames received, or -1 if the driver can't
+ * poll. */
+int ether_poll_rx(struct chan *c)
+{
+	struct ether *ether;
+
+	if (&devtab[c->type] != &etherdevtab)
+		return -1;
+	ether = c->aux;
+	if (ether->vlanid)
+		ether = ether->ctlr;
+	if (!ether->poll)
+		return -1;
+	return ether->poll(ether);
+}
+
+/* Returns the next frame already queued on data chan c, or 0 if there isn't
+ * one.  Unlike setting O_NONBLOCK on c, this doesn't affect anyone else reading
+ * or writing c. */
+struct block *ether_bread_nonblock(struct chan *c)
+{
+	struct ether *ether = c->aux;
+	struct block *bp;
+
+	if (&devtab[c->type] != &etherdevtab)
+		return NULL;
+	rlock(&ether->rwlock);
+	bp = qget(ether->f[NETID(c->qid.path)]->in);
+	runlock(&ether->rwlock);
+	return bp;
+}
+
+static void ether_route_rxq(struct ether *ether, int i, int core)
+{
+	if (i < 0 || i >= ether->nr_rxq)
+		error(EINVAL, "no RX queue %d", i);
+	if (core < 0 || core >= num_cores)
+		error(EINVAL, "no core %d", core);
+	if (route_irqs(ether->rxq_vec[i], core))
+		error(EFAIL, "unable to route RX queue %d to core %d", i, core);
+	ether->rxq_core[i] = core;
+}
+
 static int etheroq(struct ether *ether, struct block *bp)
 {
-	int len, loopback;
+	int len, loopback, txq = 0;
 	struct etherpkt *pkt;
+	struct ether *dev;
 	int8_t irq_state = 0;
 
 	ether->outpackets++;
@@ -431,6 +690,12 @@ static int etheroq(struct ether *ether, struct block *bp)
 		}
 	}
 
+	/* Hash before the VLAN tag goes on, since the parser only knows about
+	 * untagged frames. */
+	dev = ether->vlanid ? ether->ctlr : ether;
+	if (dev->nr_txq > 1)
+		txq = ((uint64_t)ether_flow_hash(bp) * dev->nr_txq) >> 32;
+
 	if (ether->vlanid) {
 		/* add tag */
 		bp = padblock(bp, 2 + 2);
@@ -444,9 +709,16 @@ static int etheroq(struct ether *ether, struct block *bp)
 	if ((ether->feat & NETF_PADMIN) == 0 && BLEN(bp) < ether->min_mtu)
 		bp = adjustblock(bp, ether->min_mtu);
 
-	qbwrite(ether->oq, bp);
-	if (ether->transmit != NULL)
-		ether->transmit(ether);
+	if (txq) {
+		qbwrite(ether->txqs[txq], bp);
+		ether->transmit_txq(ether, txq);
+	} else {
+		qbwrite(ether->oq, bp);
+		if (ether->transmit_txq != NULL)
+			ether->transmit_txq(ether, 0);
+		else if (ether->transmit != NULL)
+			ether->transmit(ether);
+	}
 
 	return len;
 }
@@ -459,6 +731,7 @@ static size_t etherwrite(struct chan *chan, void *buf, size_t n, off64_t unused)
 	int onoff;
 	struct cmdbuf *cb;
 	long l;
+	int i;
 
 	ether = chan->aux;
 	rlock(&ether->rwlock);
@@ -482,6 +755,20 @@ static size_t etherwrite(struct chan *chan, void *buf, size_t n, off64_t unused)
 				onoff = atoi(cb->f[1]);
 			if (ether->oq != NULL)
 				qdropoverflow(ether->oq, onoff);
+			for (i = 1; i < ether->nr_txq; i++)
+				qdropoverflow(ether->txqs[i], onoff);
+			kfree(cb);
+			goto out;
+		}
+		if (strcmp(cb->f[0], "rxq") == 0) {
+			if (waserror()) {
+				kfree(cb);
+				nexterror();
+			}
+			if (cb->nf != 3)
+				error(EINVAL, "usage: rxq QUEUE CORE");
+			ether_route_rxq(ether, atoi(cb->f[1]), atoi(cb->f[2]));
+			poperror();
 			kfree(cb);
 			goto out;
 		}
@@ -703,6 +990,7 @@ static void etherreset(void)
 		ether->mtu = ETHERMAXTU;
 		ether->min_mtu = ETHERMINTU;
 		ether->max_mtu = ETHERMAXTU;
+		ether->nr_txq = 1;
 		/* looked like irq type, we don't have these yet */
 		//ether->netif.itype = -1;
 
@@ -777,6 +1065,16 @@ static void etherreset(void)
 				ether->oq = qopen(qsize, Qmsg, 0, 0);
 			if (ether->oq == 0)
 				panic("etherreset %s", name);
+			ether->nr_txq = MAX(1, MIN(ether->nr_txq,
+						   MaxEtherQueues));
+			if (!ether->transmit_txq)
+				ether->nr_txq = 1;
+			ether->txqs[0] = ether->oq;
+			for (i = 1; i < ether->nr_txq; i++) {
+				ether->txqs[i] = qopen(qsize, Qmsg, 0, 0);
+				if (!ether->txqs[i])
+					panic("etherreset %s txq %d", name, i);
+			}
 			ether->alen = Eaddrlen;
 			memmove(ether->addr, ether->ea, Eaddrlen);
 			memset(ether->bcast, 0xFF, Eaddrlen);
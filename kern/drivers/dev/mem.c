@@ -13,6 +13,7 @@
 #include <error.h>
 #include <syscall.h>
 #include <sys/queue.h>
+#include <page_alloc.h>
 
 struct dev mem_devtab;
 
@@ -28,6 +29,9 @@ enum {
 	Qfree,
 	Qkmemstat,
 	Qslab_trace,
+	Qblock_stats,
+	Qnuma_stats,
+	Qzero_pool,
 };
 
 static struct dirtab mem_dir[] = {
@@ -37,6 +41,9 @@ static struct dirtab mem_dir[] = {
 	{"free", {Qfree, 0, QTFILE}, 0, 0444},
 	{"kmemstat", {Qkmemstat, 0, QTFILE}, 0, 0444},
 	{"slab_trace", {Qslab_trace, 0, QTFILE}, 0, 0444},
+	{"block_stats", {Qblock_stats, 0, QTFILE}, 0, 0444},
+	{"numa_stats", {Qnuma_stats, 0, QTFILE}, 0, 0444},
+	{"zero_pool", {Qzero_pool, 0, QTFILE}, 0, 0444},
 };
 
 /* Protected by the arenas_and_slabs_lock */
@@ -364,6 +371,15 @@ static struct chan *mem_open(struct chan *c, int omode)
 	case Qkmemstat:
 		c->synth_buf = build_kmemstat();
 		break;
+	case Qblock_stats:
+		c->synth_buf = block_cache_stats();
+		break;
+	case Qnuma_stats:
+		c->synth_buf = numa_stats();
+		break;
+	case Qzero_pool:
+		c->synth_buf = zero_pool_stats();
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -380,6 +396,9 @@ static void mem_close(struct chan *c)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qblock_stats:
+	case Qnuma_stats:
+	case Qzero_pool:
 		kfree(c->synth_buf);
 		c->synth_buf = NULL;
 		break;
@@ -410,6 +429,9 @@ static size_t mem_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qblock_stats:
+	case Qnuma_stats:
+	case Qzero_pool:
 		sza = c->synth_buf;
 		return readstr(offset, ubuf, n, sza->buf);
 	case Qslab_trace:
@@ -57,8 +57,11 @@ static char *devname(void)
  * connection.
  */
 
-#define MAXRPC (IOHDRSZ+8192)
+/* Our default msize.  Servers can negotiate it down in Rversion. */
+#define MAXRPC (IOHDRSZ+128*1024)
 #define MAXTAG MAX_U16_POOL_SZ
+/* Max Tread/Twrite RPCs a single mntrdwr will have in flight at once. */
+#define MNT_MAX_INFLIGHT 8
 
 static __inline int isxdigit(int c)
 {
@@ -117,6 +120,9 @@ struct mntrpc *mntralloc(struct chan *, uint32_t);
 size_t mntrdwr(int unused_int, struct chan *, void *, size_t, off64_t);
 int mntrpcread(struct mnt *, struct mntrpc *);
 void mountio(struct mnt *, struct mntrpc *);
+static void __mountio(struct mnt *m, struct mntrpc *r, bool sent);
+static void mountio_send(struct mnt *m, struct mntrpc *r);
+static void mountrpc_check(struct mnt *m, struct mntrpc *r);
 void mountmux(struct mnt *, struct mntrpc *);
 void mountrpc(struct mnt *, struct mntrpc *);
 int rpcattn(void *);
@@ -264,6 +270,7 @@ long mntversion(struct chan *c, char *version, int msize, int returnlen)
 	m->id = mntalloc.id++;
 	m->q = qopen(10 * MAXRPC, 0, NULL, NULL);
 	m->msize = f.msize;
+	m->flags = 0;
 	spin_unlock(&mntalloc.l);
 
 	poperror();	/* msg */
@@ -365,6 +372,10 @@ static struct chan *mntattach(char *muxattach)
 		if (m == NULL)
 			error(EINVAL, ERROR_FIXME);
 	}
+	/* A cached mount is a file server whose files mind their offsets, so
+	 * mntrdwr can pipeline I/O to it. */
+	if (params->flags & MCACHE)
+		m->flags |= MCACHE;
 
 	c = mntchan();
 	if (waserror()) {
@@ -725,62 +736,143 @@ static size_t mntwrite(struct chan *c, void *buf, size_t n, off64_t off)
 	return mntrdwr(Twrite, c, buf, n, off);
 }
 
+/* Waits for an RPC that we're giving up on, so that its tag is no longer in
+ * use at the server when we free it.  Errors are ignored; the RPC is flushed or
+ * removed from the queue either way. */
+static void mntrpc_drain(struct mnt *m, struct mntrpc *r)
+{
+	ERRSTACK(1);
+
+	if (!waserror())
+		__mountio(m, r, true);
+	poperror();
+}
+
+/* Cleans up a mntrdwr's outstanding RPCs after an error.  busy is the RPC we
+ * were sending or waiting on when we errored; it's already done or was never
+ * answered. */
+static void mntrdwr_abort(struct mnt *m, struct mntrpc **rpcs, int head,
+                          int nr_inflight, struct mntrpc *busy)
+{
+	struct mntrpc *r;
+
+	for (int i = 0; i < nr_inflight; i++) {
+		r = rpcs[(head + i) % MNT_MAX_INFLIGHT];
+		if (r == busy) {
+			if (!r->done)
+				mntqrm(m, r);
+		} else {
+			mntrpc_drain(m, r);
+		}
+		mntfree(r);
+	}
+}
+
+/* Splits the I/O into msize-sized Tread/Twrites and, for plain files on a
+ * cached mount, keeps up to MNT_MAX_INFLIGHT of them outstanding on the mux,
+ * so we're not bound by the server's latency.  Replies are consumed in order; the first short one ends
+ * the I/O, and we drain any RPCs that were sent after it.
+ *
+ * A short Twrite is different: the server may already have applied the writes
+ * we sent after it, so we can't report a partial count.  If any were in
+ * flight, the whole write fails. */
 size_t mntrdwr(int type, struct chan *c, void *buf, size_t n, off64_t off)
 {
 	ERRSTACK(1);
 	struct mnt *m;
-	struct mntrpc *r;	/* TO DO: volatile struct { Mntrpc *r; } r; */
+	struct mntrpc *r;
+	struct mntrpc *rpcs[MNT_MAX_INFLIGHT];
+	/* volatile for waserror */
+	volatile int head = 0, nr_inflight = 0;
+	struct mntrpc *volatile busy = NULL;
 	char *uba;
-	uint32_t cnt, nr, nreq;
+	uint32_t cnt, nr, nreq, iounit;
+	int max_inflight;
 
 	m = mntchk(c);
 	uba = buf;
 	cnt = 0;
+	iounit = m->msize - IOHDRSZ;
+	/* Only plain files on a cached mount are known to honor the offset.
+	 * Pipes, cons, ctl and network files ignore it, and could leave later
+	 * RPCs waiting on data (or apply writes out of order), so everything
+	 * else goes one at a time. */
+	max_inflight = 1;
+	if ((m->flags & MCACHE) && c->qid.type == QTFILE)
+		max_inflight = MNT_MAX_INFLIGHT;
+	if (waserror()) {
+		mntrdwr_abort(m, rpcs, head, nr_inflight, busy);
+		nexterror();
+	}
 	for (;;) {
-		r = mntralloc(c, m->msize);
-		if (waserror()) {
-			mntfree(r);
-			nexterror();
+		while (n && nr_inflight < max_inflight) {
+			r = mntralloc(c, m->msize);
+			rpcs[(head + nr_inflight) % MNT_MAX_INFLIGHT] = r;
+			nr_inflight++;
+			busy = r;
+			r->request.type = type;
+			r->request.fid = c->fid;
+			r->request.offset = off;
+			r->request.data = uba;
+			nr = MIN(n, iounit);
+			r->request.count = nr;
+			r->reply.tag = 0;
+			r->reply.type = Tmax;
+			mountio_send(m, r);
+			busy = NULL;
+			off += nr;
+			uba += nr;
+			n -= nr;
 		}
-		r->request.type = type;
-		r->request.fid = c->fid;
-		r->request.offset = off;
-		r->request.data = uba;
-		nr = n;
-		if (nr > m->msize - IOHDRSZ)
-			nr = m->msize - IOHDRSZ;
-		r->request.count = nr;
-		mountrpc(m, r);
+		if (!nr_inflight)
+			break;
+		r = rpcs[head];
+		busy = r;
+		__mountio(m, r, true);
+		mountrpc_check(m, r);
+		busy = NULL;
 		nreq = r->request.count;
 		nr = r->reply.count;
 		if (nr > nreq)
 			nr = nreq;
 
 		if (type == Tread)
-			r->b = bl2mem((uint8_t *) uba, r->b, nr);
+			r->b = bl2mem((uint8_t *) r->request.data, r->b, nr);
 
-		poperror();
+		head = (head + 1) % MNT_MAX_INFLIGHT;
+		nr_inflight--;
 		mntfree(r);
-		off += nr;
-		uba += nr;
 		cnt += nr;
-		n -= nr;
-		if (nr != nreq || n == 0 /*|| current->killed */ )
+		if (nr != nreq /*|| current->killed */ ) {
+			bool torn = type == Twrite && nr_inflight;
+
+			mntrdwr_abort(m, rpcs, head, nr_inflight, NULL);
+			nr_inflight = 0;
+			if (torn)
+				error(EIO, "short write (%u of %u) in a batch",
+				      nr, nreq);
 			break;
+		}
 	}
+	poperror();
 	return cnt;
 }
 
 void mountrpc(struct mnt *m, struct mntrpc *r)
 {
-	char *sn, *cn;
-	int t;
-	char *e;
-
 	r->reply.tag = 0;
 	r->reply.type = Tmax;	/* can't ever be a valid message type */
 
 	mountio(m, r);
+	mountrpc_check(m, r);
+}
+
+/* Throws if r's reply was an error or not the reply to r's request. */
+static void mountrpc_check(struct mnt *m, struct mntrpc *r)
+{
+	char *sn, *cn;
+	int t;
+	char *e;
 
 	t = r->reply.type;
 	switch (t) {
@@ -823,10 +915,41 @@ static bool kth_proc_is_dying(struct kthread *kth)
 	return kth->proc ? proc_is_dying(kth->proc) : false;
 }
 
+/* Puts r on the mux's queue and transmits its request.  Its reply will be
+ * picked up by whoever holds the gate, and r will be marked done.  Once this is
+ * called, r must be waited on with __mountio() or removed with mntqrm(). */
+static void mountio_send(struct mnt *m, struct mntrpc *r)
+{
+	int n;
+
+	spin_lock(&m->lock);
+	r->m = m;
+	r->list = m->queue;
+	m->queue = r;
+	spin_unlock(&m->lock);
+
+	/* Transmit a file system rpc */
+	if (m->msize == 0)
+		panic("msize");
+	n = convS2M(&r->request, r->rpc, m->msize);
+	if (n < 0)
+		panic("bad message type in mountio");
+	if (devtab[m->c->type].write(m->c, r->rpc, n, 0) != n)
+		error(EIO, ERROR_FIXME);
+/*	r->stime = fastticks(NULL); */
+	r->reqlen = n;
+}
+
 void mountio(struct mnt *m, struct mntrpc *r)
+{
+	__mountio(m, r, false);
+}
+
+/* Sends r, unless it was already sent with mountio_send(), and waits for its
+ * reply. */
+static void __mountio(struct mnt *m, struct mntrpc *r, bool sent)
 {
 	ERRSTACK(1);
-	int n;
 
 	while (waserror()) {
 		if (m->rip == current_kthread)
@@ -852,26 +975,13 @@ void mountio(struct mnt *m, struct mntrpc *r)
 		/* try again.  this is where you can get the "rpc tags" errstr.
 		 */
 		r = mntflushalloc(r, m->msize);
+		sent = false;
 		/* need one for every waserror call; so this plus one outside */
 		poperror();
 	}
 
-	spin_lock(&m->lock);
-	r->m = m;
-	r->list = m->queue;
-	m->queue = r;
-	spin_unlock(&m->lock);
-
-	/* Transmit a file system rpc */
-	if (m->msize == 0)
-		panic("msize");
-	n = convS2M(&r->request, r->rpc, m->msize);
-	if (n < 0)
-		panic("bad message type in mountio");
-	if (devtab[m->c->type].write(m->c, r->rpc, n, 0) != n)
-		error(EIO, ERROR_FIXME);
-/*	r->stime = fastticks(NULL); */
-	r->reqlen = n;
+	if (!sent)
+		mountio_send(m, r);
 
 	/* Gate readers onto the mount point one at a time */
 	for (;;) {
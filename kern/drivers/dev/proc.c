@@ -63,6 +63,8 @@ enum { Qdir,
        Qstrace_traceset,
        Qvmstatus,
        Qtext,
+       Qtlb,
+       Qpages,
        Qwait,
        Qprofile,
        Qsyscall,
@@ -75,6 +77,7 @@ enum { CMclose,
        CMstraceme,
        CMstraceall,
        CMstrace_drop,
+       CMmempolicy,
 };
 
 enum { Nevents = 0x4000,
@@ -109,6 +112,8 @@ struct dirtab procdir[] = {
     {"strace_traceset", {Qstrace_traceset}, 0, 0666},
     {"vmstatus", {Qvmstatus}, 0, 0444},
     {"text", {Qtext}, 0, 0000},
+    {"tlb", {Qtlb}, 0, 0444},
+    {"pages", {Qpages}, 0, 0444},
     {"wait", {Qwait}, 0, 0400},
     {"profile", {Qprofile}, 0, 0400},
     {"syscall", {Qsyscall}, 0, 0400},
@@ -119,6 +124,7 @@ static struct cmdtab proccmd[] = {
     {CMclose, "close", 2},         {CMclosefiles, "closefiles", 0},
     {CMhang, "hang", 0},           {CMstraceme, "straceme", 0},
     {CMstraceall, "straceall", 0}, {CMstrace_drop, "strace_drop", 2},
+    {CMmempolicy, "mempolicy", 0},
 };
 
 /*
@@ -573,6 +579,8 @@ static struct chan *procopen(struct chan *c, int omode)
 	case Quser:
 	case Qstatus:
 	case Qvmstatus:
+	case Qtlb:
+	case Qpages:
 	case Qctl:
 		break;
 
@@ -990,6 +998,39 @@ static size_t procread(struct chan *c, void *va, size_t n, off64_t off)
 		kfree(buf);
 		return n;
 	}
+	case Qtlb: {
+		struct tlb_shootdown *ts = &p->tlbsd;
+		char *buf = kmalloc(512, MEM_WAIT);
+		char *s = buf, *e = buf + 512;
+		int i;
+
+		/* Racy snapshot; they're just counters */
+		s = seprintf(s, e, "shootdowns: %llu\n", ts->nr_shootdowns);
+		s = seprintf(s, e, "kmsgs: %llu\n", ts->nr_kmsgs);
+		s = seprintf(s, e, "coalesced: %llu\n", ts->nr_coalesced);
+		s = seprintf(s, e, "range_flushes: %llu\n",
+		             ts->nr_range_flushes);
+		s = seprintf(s, e, "full_flushes: %llu\n", ts->nr_full_flushes);
+		proc_decref(p);
+		i = readstr(off, va, n, buf);
+		kfree(buf);
+		return i;
+	}
+	case Qpages: {
+		struct thp_stats *ts = &p->thp_stats;
+		char *buf = kmalloc(256, MEM_WAIT);
+		char *s = buf, *e = buf + 256;
+		int i;
+
+		/* Racy snapshot; they're just counters */
+		s = seprintf(s, e, "huge: %llu\n", ts->nr_huge);
+		s = seprintf(s, e, "small: %llu\n", ts->nr_small);
+		s = seprintf(s, e, "splits: %llu\n", ts->nr_splits);
+		proc_decref(p);
+		i = readstr(off, va, n, buf);
+		kfree(buf);
+		return i;
+	}
 	case Qns:
 		// qlock(&p->debug);
 		if (waserror()) {
@@ -1309,6 +1350,32 @@ static void strace_release(struct kref *a)
 	kfree(strace);
 }
 
+#define MEMPOLICY_USAGE "mempolicy local|interleave|bind NODE"
+
+/* Sets where p's user pages come from.  Pages already mapped stay put. */
+static void procctlmempolicy(struct proc *p, struct cmdbuf *cb)
+{
+	int node;
+
+	if (cb->nf < 2)
+		error(EINVAL, MEMPOLICY_USAGE);
+	if (!strcmp(cb->f[1], "local")) {
+		p->mem_policy.mode = MPOL_LOCAL;
+	} else if (!strcmp(cb->f[1], "interleave")) {
+		p->mem_policy.mode = MPOL_INTERLEAVE;
+	} else if (!strcmp(cb->f[1], "bind")) {
+		if (cb->nf < 3)
+			error(EINVAL, MEMPOLICY_USAGE);
+		node = atoi(cb->f[2]);
+		if (node < 0 || node >= MAX(numa_nr_nodes(), 1))
+			error(EINVAL, "No NUMA node %d", node);
+		p->mem_policy.node = node;
+		p->mem_policy.mode = MPOL_BIND;
+	} else {
+		error(EINVAL, MEMPOLICY_USAGE);
+	}
+}
+
 static void procctlreq(struct proc *p, char *va, size_t n)
 {
 	ERRSTACK(1);
@@ -1396,6 +1463,9 @@ static void procctlreq(struct proc *p, char *va, size_t n)
 		else
 			error(EINVAL, "strace_drop takes on|off %s", cb->f[1]);
 		break;
+	case CMmempolicy:
+		procctlmempolicy(p, cb);
+		break;
 	}
 	poperror();
 	kfree(cb);
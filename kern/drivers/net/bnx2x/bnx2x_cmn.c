@@ -1075,7 +1075,7 @@ reuse_rx:
 		else
 			napi_gro_receive(&fp->napi, skb);
 #endif
-		etheriq(bp->edev, block, TRUE);
+		etheriq_rxq(bp->edev, block, TRUE, fp->index);
 next_rx:
 		rx_buf->data = NULL;
 
@@ -1772,6 +1772,8 @@ static int bnx2x_req_msix_irqs(struct bnx2x *bp)
 		}
 	}
 
+	/* Each fastpath gets its own core for its RX ring; see ether_add_rxq. */
+	bp->dev->nr_rxq = 0;
 	for_each_eth_queue(bp, i) {
 		struct bnx2x_fastpath *fp = &bp->fp[i];
 		snprintf(fp->name, sizeof(fp->name), "%s-fp-%d",
@@ -1786,6 +1788,7 @@ static int bnx2x_req_msix_irqs(struct bnx2x *bp)
 			bnx2x_free_msix_irqs(bp, offset);
 			return -EBUSY;
 		}
+		ether_add_rxq(bp->dev, irq_h->apic_vector);
 
 		offset++;
 	}
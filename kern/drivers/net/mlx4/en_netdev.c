@@ -2972,6 +2972,9 @@ int mlx4_en_init_netdev(struct mlx4_en_dev *mdev, int port,
 			{}
 	netif_set_real_num_tx_queues(dev, priv->tx_ring_num);
 	netif_set_real_num_rx_queues(dev, priv->rx_ring_num);
+#else
+	/* One devether TX queue per ring; etheroq spreads flows over them. */
+	dev->nr_txq = MIN(priv->tx_ring_num, MaxEtherQueues);
 #endif
 
 	/*
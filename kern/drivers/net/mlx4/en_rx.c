@@ -604,7 +604,7 @@ static void dump_packet(struct mlx4_en_priv *priv,
 static void recv_packet(struct mlx4_en_priv *priv,
 			struct mlx4_en_rx_desc *rx_desc,
 			struct mlx4_en_rx_alloc *frags,
-			unsigned int length)
+			unsigned int length, int ring)
 {
 	struct block *block;
 	void *va;
@@ -622,7 +622,7 @@ static void recv_packet(struct mlx4_en_priv *priv,
 	memcpy(block->wp, va, length);
 	block->wp += length;
 
-	etheriq(priv->dev, block, 1 /* fromwire */);
+	etheriq_rxq(priv->dev, block, 1 /* fromwire */, ring);
 }
 
 #if 0 // AKAROS_PORT
@@ -939,7 +939,7 @@ int mlx4_en_process_rx_cq(struct ether *dev, struct mlx4_en_cq *cq,
 		printd("length %d ring %p bytes %d packets %d ip_summed %d\n",
 		       length, ring, ring->bytes, ring->packets, ip_summed);
 		//dump_packet(priv, rx_desc, frags, length);
-		recv_packet(priv, rx_desc, frags, length);
+		recv_packet(priv, rx_desc, frags, length, cq->ring);
 		goto next;
 
 #if 0 // AKAROS_PORT
@@ -1149,6 +1149,27 @@ static void mlx4_en_poll_rx_cq(uint32_t srcid, long a0, long a1, long a2)
 	mlx4_en_arm_cq(priv, cq);
 }
 
+/* Busy-poll hook (edev->poll): processes every RX CQ that the IRQ path isn't
+ * already on.  Returns the number of packets received. */
+int mlx4_en_poll_rx(struct ether *dev)
+{
+	struct mlx4_en_priv *priv = netdev_priv(dev);
+	struct mlx4_en_cq *cq;
+	int done = 0;
+
+	if (!priv->port_up)
+		return 0;
+	for (int i = 0; i < priv->rx_ring_num; i++) {
+		cq = priv->rx_cq[i];
+		if (!mlx4_en_cq_lock_poll(cq))
+			continue;
+		done += mlx4_en_process_rx_cq(dev, cq, 4);
+		if (mlx4_en_cq_unlock_poll(cq))
+			mlx4_en_arm_cq(priv, cq);
+	}
+	return done;
+}
+
 static const int frag_sizes[] = {
 	FRAG_SZ0,
 	FRAG_SZ1,
@@ -1298,10 +1298,13 @@ void __mlx4_xmit_poke(void *args)
 	struct ether *edev = ((struct mlx4_poke_args*)args)->edev;
 	struct mlx4_en_priv *priv = ((struct mlx4_poke_args*)args)->priv;
 	struct mlx4_en_tx_ring *ring = ((struct mlx4_poke_args*)args)->ring;
+	struct queue *q = edev->oq;
 	struct block *block;
 
+	if (ring->queue_index < edev->nr_txq)
+		q = edev->txqs[ring->queue_index];
 	while (!mlx4_en_ring_is_full(ring)) {
-		block = qget(edev->oq);
+		block = qget(q);
 		if (!block)
 			break;
 		/* This estimate might be off a little.  I think the driver is expecting
@@ -1313,16 +1316,20 @@ void __mlx4_xmit_poke(void *args)
 	}
 }
 
-void mlx4_transmit(struct ether *edev)
+void mlx4_transmit_txq(struct ether *edev, int txq)
 {
 	struct mlx4_en_priv *priv = netdev_priv(edev);
 	struct mlx4_en_tx_ring *ring;
 	struct mlx4_poke_args args;
 
-	/* TODO multi-queue support. */
-	ring = priv->tx_ring[0];
+	ring = priv->tx_ring[txq];
 	args.edev = edev;
 	args.priv = priv;
 	args.ring = ring;
 	poke(&ring->poker, &args);
 }
+
+void mlx4_transmit(struct ether *edev)
+{
+	mlx4_transmit_txq(edev, 0);
+}
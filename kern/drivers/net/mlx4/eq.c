@@ -1271,6 +1271,7 @@ int mlx4_init_eq_table(struct mlx4_dev *dev)
 				goto err_out_async;
 
 			priv->eq_table.eq[i].have_irq = 1;
+			priv->eq_table.eq[i].apic_vector = irq_h->apic_vector;
 		}
 	} else {
 		panic("Disabled");
@@ -3891,6 +3891,8 @@ static void mlx4_attach(struct ether *edev)
 
 /* The organization of this driver is a fucking catastrophe */
 extern void mlx4_transmit(struct ether *edev);
+extern void mlx4_transmit_txq(struct ether *edev, int txq);
+extern int mlx4_en_poll_rx(struct ether *dev);
 
 static long mlx4_ifstat(struct ether *edev, void *a, long n, uint32_t offset)
 {
@@ -3914,6 +3916,7 @@ static int mlx4_pnp(struct ether *edev)
 	struct mlx4_dev_persistent *persist;
 	const struct pci_device_id *pci_id;
 	struct pci_device *pdev;
+	struct mlx4_priv *priv;
 
 	if (probed)
 		return -1;
@@ -3978,6 +3981,8 @@ static int mlx4_pnp(struct ether *edev)
 
 	edev->attach = mlx4_attach;
 	edev->transmit = mlx4_transmit;
+	edev->transmit_txq = mlx4_transmit_txq;
+	edev->poll = mlx4_en_poll_rx;
 	edev->ifstat = mlx4_ifstat;
 	edev->ctl = mlx4_ctl;
 	edev->shutdown = mlx4_shutdown;
@@ -3986,6 +3991,14 @@ static int mlx4_pnp(struct ether *edev)
 	edev->promiscuous = NULL;
 	edev->multicast = NULL;
 
+	/* Each completion vector serves its own RX and TX CQs; give each one a
+	 * core. */
+	priv = mlx4_priv(persist->dev);
+	for (int i = 0; i < persist->dev->caps.num_comp_vectors; i++) {
+		if (priv->eq_table.eq[i].have_irq)
+			ether_add_rxq(edev, priv->eq_table.eq[i].apic_vector);
+	}
+
 	return 0;
 }
 
@@ -380,6 +380,7 @@ struct mlx4_eq {
 	uint32_t			cons_index;
 	uint16_t			irq;
 	uint16_t			have_irq;
+	int			apic_vector;
 	int			nent;
 	struct mlx4_buf_list   *page_list;
 	struct mlx4_mtt		mtt;
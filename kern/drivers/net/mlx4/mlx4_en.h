@@ -290,6 +290,7 @@ struct mlx4_poke_args {
 };
 
 void __mlx4_xmit_poke(void *args);
+int mlx4_en_poll_rx(struct ether *dev);
 
 struct mlx4_en_rx_desc {
 	/* actual number of entries depends on rx ring stride */
@@ -340,7 +341,7 @@ struct mlx4_en_cq {
 	struct mlx4_cqe *buf;
 #define MLX4_EN_OPCODE_ERROR	0x1e
 
-#ifdef CONFIG_NET_RX_BUSY_POLL
+	/* Akaros uses these for busy-poll sockets too, without the config. */
 	unsigned int state;
 #define MLX4_EN_CQ_STATE_IDLE        0
 #define MLX4_EN_CQ_STATE_NAPI     1    /* NAPI owns this CQ */
@@ -351,7 +352,6 @@ struct mlx4_en_cq {
 #define CQ_YIELD (MLX4_EN_CQ_STATE_NAPI_YIELD | MLX4_EN_CQ_STATE_POLL_YIELD)
 #define CQ_USER_PEND (MLX4_EN_CQ_STATE_POLL | MLX4_EN_CQ_STATE_POLL_YIELD)
 	spinlock_t poll_lock; /* protects from LLS/napi conflicts */
-#endif  /* CONFIG_NET_RX_BUSY_POLL */
 	struct irq_desc *irq_desc;
 };
 
@@ -708,28 +708,63 @@ static inline bool mlx4_en_cq_busy_polling(struct mlx4_en_cq *cq)
 	return cq->state & CQ_USER_PEND;
 }
 #else
+/* Akaros has no NAPI.  The IRQ's routine KMSG (mlx4_en_poll_rx_cq()) and
+ * busy-polling readers (mlx4_en_poll_rx()) take turns on a CQ.  Whoever loses
+ * just skips it; if the KMSG lost, it didn't rearm the CQ, so the poller does
+ * that when it unlocks. */
 static inline void mlx4_en_cq_init_lock(struct mlx4_en_cq *cq)
 {
+	spinlock_init(&cq->poll_lock);
+	cq->state = MLX4_EN_CQ_STATE_IDLE;
 }
 
 static inline bool mlx4_en_cq_lock_napi(struct mlx4_en_cq *cq)
 {
-	return true;
+	bool rc = true;
+
+	spin_lock(&cq->poll_lock);
+	if (cq->state & MLX4_CQ_LOCKED) {
+		cq->state |= MLX4_EN_CQ_STATE_NAPI_YIELD;
+		rc = false;
+	} else {
+		cq->state = MLX4_EN_CQ_STATE_NAPI;
+	}
+	spin_unlock(&cq->poll_lock);
+	return rc;
 }
 
 static inline bool mlx4_en_cq_unlock_napi(struct mlx4_en_cq *cq)
 {
+	spin_lock(&cq->poll_lock);
+	cq->state = MLX4_EN_CQ_STATE_IDLE;
+	spin_unlock(&cq->poll_lock);
 	return false;
 }
 
 static inline bool mlx4_en_cq_lock_poll(struct mlx4_en_cq *cq)
 {
-	return false;
+	bool rc = true;
+
+	spin_lock(&cq->poll_lock);
+	if (cq->state & MLX4_CQ_LOCKED)
+		rc = false;
+	else
+		cq->state = MLX4_EN_CQ_STATE_POLL;
+	spin_unlock(&cq->poll_lock);
+	return rc;
 }
 
+/* Unlike Linux's, returns true if the KMSG skipped the CQ while we had it, and
+ * the caller needs to rearm it. */
 static inline bool mlx4_en_cq_unlock_poll(struct mlx4_en_cq *cq)
 {
-	return false;
+	bool rc;
+
+	spin_lock(&cq->poll_lock);
+	rc = cq->state & MLX4_EN_CQ_STATE_NAPI_YIELD;
+	cq->state = MLX4_EN_CQ_STATE_IDLE;
+	spin_unlock(&cq->poll_lock);
+	return rc;
 }
 
 static inline bool mlx4_en_cq_busy_polling(struct mlx4_en_cq *cq)
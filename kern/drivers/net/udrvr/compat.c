@@ -116,8 +116,9 @@ int get_user_page(struct proc *p, unsigned long uvastart, int write, int force,
 		if (upage_alloc(p, &pp, 0))
 			goto err1;
 		pte_write(pte, page2pa(pp), prot);
+		p->thp_stats.nr_small++;
 	} else {
-		pp = pa2page(pte_get_paddr(pte));
+		pp = page_lookup(p->env_pgdir, (void*)uvastart, NULL);
 
 		/* __vmr_free_pgs() refcnt's pagemap pages differently */
 		if (atomic_read(&pp->pg_flags) & PG_PAGEMAP) {
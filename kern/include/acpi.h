@@ -541,6 +541,7 @@ struct Atable *finatable_nochildren(struct Atable *t);
 
 int get_early_num_cores(void);
 physaddr_t acpi_pci_get_mmio_cfg_addr(int segment, int bus, int dev, int func);
+int acpi_slit_distance(int from_dom, int to_dom);
 
 extern struct Atable *apics;
 extern struct Atable *dmar;
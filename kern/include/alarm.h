@@ -8,8 +8,9 @@
  * is a function pointer which runs in interrupt context when the alarm goes off
  * (picture running the ksched then).
  *
- * Like with most systems, you won't wake up til after the time you specify (for
- * now).  This might change, esp if we tweak things to coalesce alarms.
+ * Like with most systems, you won't wake up til after the time you specify.  If
+ * you give an awaiter some slack, the tchain may fire it up to that much later,
+ * so that alarms with nearby deadlines can share a single interrupt.
  *
  * All tchains come with locks.  Originally, I left these out, since the pcpu
  * tchains didn't need them (disable_irq was sufficient).  However, disabling
@@ -63,27 +64,49 @@
 #include <kthread.h>
 
 /* These structures allow code to defer work for a certain amount of time.
- * Timer chains (like off a per-core timer) are made of lists/trees of these. */
+ * Timer chains (like off a per-core timer) are made of wheels of these. */
 struct alarm_waiter {
 	uint64_t 			wake_up_time;
+	uint64_t			slack;
+	uint64_t			fire_time;
 	void (*func) (struct alarm_waiter *waiter);
 	void				*data;
-	TAILQ_ENTRY(alarm_waiter)	next;
+	BSD_LIST_ENTRY(alarm_waiter)	next;
+	unsigned int			wheel_idx;
 	bool				on_tchain;
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
+BSD_LIST_HEAD(awaiters_list, alarm_waiter);
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
+/* Timer chains are hierarchical timing wheels.  A wheel tick is
+ * 1 << TCHAIN_TICK_SHIFT TSC cycles, and each level has TCHAIN_WHEEL_SIZE
+ * slots, where a slot at level L spans TCHAIN_WHEEL_SIZE^L ticks.  Waiters
+ * cascade down a level when the wheel reaches their slot, so insertion and
+ * removal are O(1).  The top level covers about 2^46 cycles; waiters past that
+ * park in its farthest slot until they cascade back into range. */
+#define TCHAIN_TICK_SHIFT		10
+#define TCHAIN_WHEEL_BITS		6
+#define TCHAIN_WHEEL_SIZE		(1 << TCHAIN_WHEEL_BITS)
+#define TCHAIN_WHEEL_MASK		(TCHAIN_WHEEL_SIZE - 1)
+#define TCHAIN_NR_LEVELS		6
+
 /* One of these per alarm source, such as a per-core timer.  All tchains come
  * with a lock, even if its rarely needed (like the pcpu tchains).
- * set_interrupt() is a method for setting the interrupt source. */
+ * set_interrupt() is a method for setting the interrupt source.
+ *
+ * pending has a bit set for every non-empty slot.  slot_min is the earliest
+ * time any waiter in a slot needs the tchain to run, or 0 if we need to rescan
+ * the slot.  clk is the wheel tick the tchain has been run up to. */
 struct timer_chain {
 	spinlock_t			lock;
-	struct awaiters_tailq		waiters;
+	struct awaiters_list	wheel[TCHAIN_NR_LEVELS][TCHAIN_WHEEL_SIZE];
+	uint64_t		slot_min[TCHAIN_NR_LEVELS][TCHAIN_WHEEL_SIZE];
+	uint64_t			pending[TCHAIN_NR_LEVELS];
+	uint64_t			clk;
+	unsigned int			nr_waiters;
 	struct alarm_waiter		*running;
 	uint64_t			earliest_time;
-	uint64_t			latest_time;
 	struct cond_var			cv;
 	void (*set_interrupt)(struct timer_chain *);
 };
@@ -98,6 +121,8 @@ void init_awaiter(struct alarm_waiter *waiter,
 void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
+/* Lets the alarm go off up to usec late, to share an interrupt with others */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec);
 /* Arms/disarms the alarm.  Can be called from within a handler.*/
 void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
 /* Unset and reset may block if the alarm is not IRQ.  Do not call from within a
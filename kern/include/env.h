@@ -42,6 +42,52 @@ struct iommu_proc_link {
 	unsigned int nr_devices;
 };
 
+/* Recent TLB shootdowns of an address space.  Every shootdown gets a
+ * generation number, and we remember the ranges of the last few.  A core
+ * catching up flushes the ranges newer than the last generation it applied, or
+ * the whole TLB if some of those fell out of the ring. */
+#define TLB_SHOOTDOWN_RING		8
+
+struct tlb_shootdown_range {
+	uint64_t			gen;
+	uintptr_t			start;
+	uintptr_t			end;
+};
+
+struct tlb_shootdown {
+	spinlock_t			lock;
+	uint64_t			gen;
+	uint64_t			lost_gen;
+	unsigned int			ring_idx;
+	struct tlb_shootdown_range	ranges[TLB_SHOOTDOWN_RING];
+	/* Stats, for devproc.  kmsgs and coalesced are under the proc_lock */
+	uint64_t			nr_shootdowns;
+	uint64_t			nr_kmsgs;
+	uint64_t			nr_coalesced;
+	uint64_t			nr_range_flushes;
+	uint64_t			nr_full_flushes;
+};
+
+/* Where a process's user pages come from, once we know about NUMA nodes.
+ * Children inherit their parent's policy. */
+#define MPOL_LOCAL		0	/* node of the faulting core */
+#define MPOL_INTERLEAVE		1	/* round-robin across all nodes */
+#define MPOL_BIND		2	/* only from mem_policy.node */
+
+struct mem_policy {
+	int				mode;
+	int				node;
+	atomic_t			il_next;
+};
+
+/* Anonymous memory mapped with huge and small pages, for devproc.  Protected
+ * by the pte_lock. */
+struct thp_stats {
+	uint64_t			nr_huge;
+	uint64_t			nr_small;
+	uint64_t			nr_splits;
+};
+
 #define PROC_PROGNAME_SZ 20
 // TODO: clean this up.
 struct proc {
@@ -93,6 +139,9 @@ struct proc {
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
 	struct vmr_tailq vm_regions;
 	int vmr_history;
+	struct tlb_shootdown tlbsd;
+	struct mem_policy mem_policy;
+	struct thp_stats thp_stats;
 
 	// Per process info and data pages
  	procinfo_t *procinfo;       // KVA of per-process shared info table (RO)
@@ -10,14 +10,25 @@
 #include <ros/common.h>
 #include <kref.h>
 
-#define NUM_KMALLOC_CACHES 6
+struct kmem_cache;
+
+/* kmalloc's size classes (which include the tag) start at KMALLOC_SMALLEST.
+ * Each power of two above that is split into KMALLOC_CLASSES_PER_PWR2 evenly
+ * spaced classes, up to KMALLOC_LARGEST.  A class is at most 1.25x the one
+ * below it, so we waste less than 20% of a buffer, instead of up to 50% with
+ * power-of-two classes.  Bigger allocations come from kpages. */
 #define KMALLOC_ALIGNMENT 16
 #define KMALLOC_SMALLEST (sizeof(struct kmalloc_tag) << 1)
-#define KMALLOC_LARGEST KMALLOC_SMALLEST << NUM_KMALLOC_CACHES
+#define KMALLOC_CLASS_SHIFT 2
+#define KMALLOC_CLASSES_PER_PWR2 (1 << KMALLOC_CLASS_SHIFT)
+#define KMALLOC_NR_PWR2 7
+#define NUM_KMALLOC_CACHES (1 + KMALLOC_CLASSES_PER_PWR2 * KMALLOC_NR_PWR2)
+#define KMALLOC_LARGEST (KMALLOC_SMALLEST << KMALLOC_NR_PWR2)
 
 void kmalloc_init(void);
 void *kmalloc(size_t size, int flags);
 void *kmalloc_array(size_t nmemb, size_t size, int flags);
+void *kmalloc_from_cache(struct kmem_cache *kc, int flags);
 void *kzmalloc(size_t size, int flags);
 void *kmalloc_align(size_t size, int flags, size_t align);
 void *kzmalloc_align(size_t size, int flags, size_t align);
@@ -131,6 +131,7 @@ void restart_kthread(struct kthread *kthread);
 void kthread_runnable(struct kthread *kthread);
 void kthread_yield(void);
 void kthread_usleep(uint64_t usec);
+void kthread_usleep_slack(uint64_t usec, uint64_t slack);
 void ktask(char *name, void (*fn)(void*), void *arg);
 
 static inline bool is_ktask(struct kthread *kthread)
@@ -29,11 +29,13 @@
 
 #pragma once
 #include <ns.h>
+#include <rcu.h>
+#include <alarm.h>
+#include <hash_helper.h>
 
 enum {
 	Addrlen = 64,
 	Maxproto = 20,
-	Nhash = 64,
 	Maxincall = 500,
 	Nchans = 256,
 	MAClen = 16,	/* longest mac address */
@@ -87,6 +89,7 @@ struct conv {
 	uint32_t ttl;		/* max time to live */
 	uint32_t tos;		/* type of service */
 	int ignoreadvice;	/* don't terminate connection on icmp errors */
+	uint32_t busypoll_us;	/* poll the NICs this long before a read blocks */
 
 	uint8_t ipversion;
 	uint8_t laddr[IPaddrlen];/* local IP address */
@@ -101,6 +104,7 @@ struct conv {
 	int state;
 	struct queue *rq_save;	/* rq created by proto, saved during bypass */
 	struct queue *wq_save;	/* wq created by proto, saved during bypass */
+	uint16_t bypass_tso_mss;	/* TCP over the bypass is TSO, see "tso" */
 
 	/* udp specific */
 	int headers;		/* data src/dst headers in udp */
@@ -131,6 +135,7 @@ struct conv {
 
 	struct route *r;	/* last route used */
 	uint32_t rgen;		/* routetable generation for *r */
+	uint8_t rdst[IPaddrlen];	/* destination *r was looked up for */
 };
 
 struct Ipifc;
@@ -175,6 +180,10 @@ struct medium {
 	/* v6 address generation */
 	void (*pref2addr) (uint8_t * pref, uint8_t * ea);
 
+	/* busy-poll: pull in whatever the device has received, without
+	 * waiting for its interrupt */
+	void (*poll) (struct Ipifc * ifc);
+
 	int unbindonclose;	/* if non-zero, unbind on last close */
 };
 
@@ -246,6 +255,8 @@ struct Ipifc {
 	uint32_t in, out;	/* message statistics */
 	uint32_t inerr, outerr;	/* ... */
 	uint32_t tracedrop;
+	uint32_t grosegs;	/* TCP segments that went through GRO */
+	uint32_t groblocks;	/* blocks GRO passed up for them */
 
 	uint8_t sendra6;	/* == 1 => send router advs on this ifc */
 	uint8_t recvra6;	/* == 1 => recv router advs on this ifc */
@@ -264,10 +275,13 @@ struct Ipmulti {
 
 /*
  *  hash table for 2 ip addresses + 2 ports
+ *
+ *  Lookups are lockless, under RCU.  Adds and removes lock a bucket.  When the
+ *  table gets too full, we copy it into a new, larger one and publish it.
+ *  Buckets are marked 'moved' once they are copied, and writers that find a
+ *  moved bucket wait on the resize_qlock for the new table.
  */
 enum {
-	Nipht = 521,		/* convenient prime */
-
 	IPmatchexact = 0,	/* match on 4 tuple */
 	IPmatchany,	/* *!* */
 	IPmatchport,	/* *!port */
@@ -278,13 +292,28 @@ struct Iphash {
 	struct Iphash *next;
 	struct conv *c;
 	int match;
+	uint64_t key;
+	struct rcu_head rcu;
 };
 
-struct Iphash;
-struct Ipht {
+struct Iphtbucket {
 	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	bool moved;
+	struct Iphash *head;
+};
+
+struct Iphtab {
+	struct hash_helper hh;
+	struct rcu_head rcu;
+	struct Iphtbucket b[];
 };
+
+struct Ipht {
+	struct Iphtab *tab;	/* RCU protected */
+	atomic_t nr_items;
+	qlock_t resize_qlock;
+};
+void iphtinit(struct Ipht *);
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
@@ -312,6 +341,8 @@ struct Proto {
 	void (*ctl)(struct conv *, char **, int);
 	void (*advise) (struct Proto *, struct block *, char *unused_char_p_t);
 	int (*stats) (struct Proto *, char *unused_char_p_t, int);
+	/* protocol-wide ctl messages, written to the stats file by eve */
+	void (*statsctl) (struct Proto *, char **, int);
 	int (*local) (struct conv *, char *unused_char_p_t, int);
 	int (*remote) (struct conv *, char *unused_char_p_t, int);
 	int (*inuse) (struct conv *);
@@ -361,6 +392,13 @@ struct Fs {
 	struct route *v4root[1 << Lroot];	/* v4 routing forest */
 	struct route *v6root[1 << Lroot];	/* v6 routing forest */
 	struct route *queue;	/* used as temp when reinjecting routes */
+	struct rtrie *v4trie;	/* LPM lookup tables, rebuilt from the */
+	struct rtrie *v6trie;	/* forests, RCU protected */
+	struct alarm_waiter rtrie_waiter;	/* deferred trie rebuilds, */
+	uint64_t rtrie_changed;			/* protected by routelock */
+	bool v4trie_stale;
+	bool v6trie_stale;
+	bool rtrie_pending;
 
 	struct Netlog *alog;
 	struct Ifclog *ilog;
@@ -515,6 +553,7 @@ extern long routewrite(struct Fs *f, struct chan *, char *unused_char_p_t,
 		       size_t);
 extern void routetype(int unused_int, char *unused_char_p_t);
 extern void ipwalkroutes(struct Fs *, struct routewalk *);
+extern void routeinit(struct Fs *f);
 extern void convroute(struct route *r, uint8_t * u8pt, uint8_t * u8pt1,
 		      uint8_t * u8pt2, char *unused_char_p_t, int *intp);
 
@@ -652,6 +691,7 @@ extern void ipifcremroute(struct Fs *, int unused_int, uint8_t * u8pt,
 			  uint8_t * u8pt2);
 extern void ipifcremmulti(struct conv *c, uint8_t * ma, uint8_t * ia);
 extern void ipifcaddmulti(struct conv *c, uint8_t * ma, uint8_t * ia);
+extern void ipifcpoll(struct Fs *f);
 extern void ipifc_trace_block(struct Ipifc *ifc, struct block *bp);
 extern long ipselftabread(struct Fs *, char *a, uint32_t offset, int n);
 extern void ipsendra6(struct Fs *f, int on);
@@ -1151,6 +1191,7 @@ enum {
 	MaxEther = 32,
 	MaxFID = 16,
 	Ntypes = 8,
+	MaxEtherQueues = 16,
 };
 
 struct ether {
@@ -1170,6 +1211,7 @@ struct ether {
 	void (*closed) (struct ether *);
 	void (*detach) (struct ether *);
 	void (*transmit) (struct ether *);
+	int (*poll) (struct ether *);	/* reap the RX rings, for busy-poll */
 	long (*ifstat) (struct ether *, void *, long, uint32_t);
 	long (*ctl) (struct ether *, void *, size_t); /* custom ctl messages */
 	void (*power) (struct ether *, int);	/* power on/off */
@@ -1181,6 +1223,30 @@ struct ether {
 
 	struct queue *oq;
 
+	/* Multiqueue NICs.  A driver that has more than one TX ring sets nr_txq
+	 * and transmit_txq in its reset routine; etheroq then picks txqs[i] by
+	 * flow hash so a flow stays on one ring.  txqs[0] is oq.  RX rings are
+	 * registered with ether_add_rxq(), which spreads their IRQs over the
+	 * cores. */
+	int nr_txq;
+	struct queue *txqs[MaxEtherQueues];
+	void (*transmit_txq) (struct ether *, int);
+	int nr_rxq;
+	int rxq_vec[MaxEtherQueues];
+	int rxq_core[MaxEtherQueues];
+
+	/* Per-RX-queue input.  A medium attaches to one of its data files with
+	 * ether_rxq_attach().  Frames for that file that a driver passes to
+	 * etheriq_rxq() then go to rxq_in[] instead of the file's queue, and
+	 * rxq_input drains them on the core that received them. */
+	struct netfile *rxq_f;
+	struct chan *rxq_chan;		/* the medium's chan for rxq_f */
+	void (*rxq_input) (void *, int, struct queue *);
+	void *rxq_arg;
+	struct queue *rxq_in[MaxEtherQueues];
+	atomic_t rxq_sched[MaxEtherQueues];	/* drain kmsg pending */
+	atomic_t rxq_busy[MaxEtherQueues];	/* someone is draining */
+
 	qlock_t vlq;				/* array change */
 	int nvlan;
 	struct ether *vlans[MaxFID];
@@ -1188,6 +1254,15 @@ struct ether {
 	struct netif;
 };
 
+void ether_add_rxq(struct ether *ether, int apic_vector);
+int ether_poll_rx(struct chan *c);
+struct block *ether_bread_nonblock(struct chan *c);
+int ether_rxq_attach(struct chan *c,
+		     void (*input)(void *, int, struct queue *), void *arg);
+void ether_rxq_detach(struct chan *c);
+struct queue *ether_rxq_claim(struct chan *c, int rxq);
+void ether_rxq_release(struct chan *c, int rxq);
+
 static inline void netif_carrier_on(struct ether *edev)
 {
 	edev->link_is_up = TRUE;
@@ -1210,6 +1285,7 @@ static void netif_wait_for_carrier(struct ether *edev)
 }
 
 extern struct block *etheriq(struct ether *, struct block *, int);
+extern struct block *etheriq_rxq(struct ether *, struct block *, int, int);
 extern void addethercard(char *unused_char_p_t, int (*)(struct ether *));
 extern int archether(int unused_int, struct ether *);
 
@@ -49,6 +49,9 @@ enum {
 	TcptimerOFF = 0,
 	TcptimerON = 1,
 	TcptimerDONE = 2,
+	TCP_TW_BITS = 6,	/* Slots per timer wheel level (log2) */
+	TCP_TW_SIZE = 1 << TCP_TW_BITS,
+	TCP_TW_LEVELS = 4,	/* Wheel covers 2^24 ticks, ~9 days */
 	MAX_TIME = (1 << 20),	/* Forever */
 	TCP_ACK = 50,	/* Timed ack sequence in ms */
 	MAXBACKMS = 9 * 60 * 1000, /* longest backoff time (ms) before hangup */
@@ -124,10 +127,12 @@ typedef struct tcptimer Tcptimer;
 struct tcptimer {
 	Tcptimer *next;
 	Tcptimer *prev;
+	Tcptimer **slot;	/* wheel slot we're on, while ON */
 	Tcptimer *readynext;
 	int state;
 	uint64_t start;
-	uint64_t count;
+	uint64_t count;		/* ticks left, updated when turned off */
+	uint64_t expire;	/* wheel tick we fire on, while ON */
 	void (*func) (void *);
 	void *arg;
 };
@@ -220,10 +225,33 @@ struct reseq {
 	uint16_t length;
 };
 
+typedef struct tcpctl Tcpctl;
+
+/* Congestion control algorithms (tcp_cc.c).  tcp.c calls these with the conv
+ * qlocked.
+ *
+ * on_ack() gets every ACK that advances snd.una.  By then, una, in_flight, and
+ * the RTT estimate are up to date.  rtt is the ACK's sample in msec, or -1 if
+ * it had none.  pacing_rate() is in bytes per second, with 0 meaning
+ * unpaced.  Algorithms that don't pace leave it NULL. */
+struct tcp_cc_ops {
+	char *name;
+	void (*init)(Tcpctl *tcb);
+	void (*on_ack)(Tcpctl *tcb, uint32_t acked, int rtt);
+	void (*on_loss)(Tcpctl *tcb);
+	void (*on_rto)(Tcpctl *tcb);
+	uint64_t (*pacing_rate)(Tcpctl *tcb);
+};
+
+#define TCP_CC_PRIV_SZ		256
+
+extern struct tcp_cc_ops *tcp_cc_default;
+struct tcp_cc_ops *tcp_cc_find(const char *name);
+void tcp_cc_grow_cwnd(Tcpctl *tcb, uint32_t expand);
+
 /*
  *  the qlock in the Conv locks this structure
  */
-typedef struct tcpctl Tcpctl;
 struct tcpctl {
 	uint8_t state;		/* Connection state */
 	uint8_t type;		/* Listening or active connection */
@@ -285,6 +313,10 @@ struct tcpctl {
 	uint32_t last_ack_sent;	/* to determine when to update timestamp */
 	bool sack_ok;		/* Can use SACK for this connection */
 	struct Ipifc *ifc;	/* Uncounted ref */
+	struct tcp_cc_ops *cc;	/* Congestion control algorithm */
+	struct tcp_cc_ops *cc_req;	/* "cc" picked before we started */
+	uint64_t cc_priv[TCP_CC_PRIV_SZ / sizeof(uint64_t)];
+	uint64_t pace_next;	/* nsec, when pacing allows our next send */
 
 	union {
 		Tcp4hdr tcp4hdr;
@@ -350,9 +382,10 @@ enum {
 
 typedef struct tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
+	/* Hierarchical timing wheel of active timers */
 	qlock_t tl;
-	Tcptimer *timers;
+	uint64_t tick;		/* next tick tcpackproc will run */
+	Tcptimer *wheel[TCP_TW_LEVELS][TCP_TW_SIZE];
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
@@ -408,6 +408,7 @@ enum {
 #define NS_SHIFT_MAX 6
 
 enum {
+	Bcached = (1 << 0),	/* from a block_cache, base/lim set on alloc */
 	BFREE = (1 << 1),
 	Bipck = (1 << NS_IPCK_SHIFT),	/* ip checksum (rx) */
 	Budpck = (1 << NS_UDPCK_SHIFT),	/* udp checksum (rx), needed (tx) */
@@ -608,6 +609,7 @@ struct mntparam {
 	struct chan *chan;
 	struct chan *authchan;
 	char *spec;
+	int flags;			/* MCACHE, etc. */
 };
 
 struct pgrp {
@@ -778,6 +780,7 @@ void block_transfer_extras(struct block *new, struct block *old);
 void block_replace_extras(struct block *new, struct block *old);
 struct block *block_realloc(struct block *b, size_t header_space);
 size_t block_copy_to_body(struct block *to, void *from, size_t copy_amt);
+struct sized_alloc *block_cache_stats(void);
 int anyhigher(void);
 int anyready(void);
 void _assert(char *unused_char_p_t);
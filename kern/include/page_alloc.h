@@ -32,6 +32,15 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_HUGE			0x040	/* part of a HUGE_PGSIZE user page */
+
+/* Transparent huge pages for anonymous memory.  A jumbo PTE holds a reference
+ * on each small page of the block, just like a small PTE holds one on its page,
+ * so splitting a jumbo doesn't change any counts.  The head (first) page of the
+ * block counts how many of its small pages are still in use. */
+#define HUGE_PGSIZE		PML2_PTE_REACH
+#define HUGE_NR_PGS		(HUGE_PGSIZE >> PGSHIFT)
+#define PGOFF_HUGE(va)		((uintptr_t)(va) & (HUGE_PGSIZE - 1))
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -47,6 +56,9 @@ struct page {
 	void				*pg_private;
 	struct semaphore 		pg_sem;	
 	uint64_t			gpa;	/* physical address in guest */
+	atomic_t			pg_cow_refs;	/* extra CoW mappers */
+	uint8_t				pg_numa_node;	/* node + 1, if node kpages */
+	atomic_t			pg_huge_refs;	/* head of a PG_HUGE block */
 
 	bool				pg_is_free;	/* TODO: will remove */
 };
@@ -55,10 +67,24 @@ struct page {
 extern spinlock_t page_list_lock;
 extern page_list_t page_free_list;
 
+/* Each NUMA node gets its own base and kpages arenas.  The node's base arena
+ * imports from the global base_arena, restricted to the node's memory ranges.
+ * Until numa_init() finds more than one node, everything comes from the global
+ * kpages_arena. */
+#define MAX_NUMA_NODES		8
+
 /*************** Functional Interface *******************/
 void base_arena_init(struct multiboot_info *mbi);
+void numa_init(void);
+void numa_add_mem(int node, physaddr_t start, size_t len);
+void numa_pages_init(int nr_nodes, int (*distance)(int from, int to));
+int numa_nr_nodes(void);
+struct sized_alloc *numa_stats(void);
+bool zero_pool_refill(void);
+struct sized_alloc *zero_pool_stats(void);
 
 error_t upage_alloc(struct proc *p, page_t **page, bool zero);
+error_t upage_alloc_huge(struct proc *p, page_t **page, bool zero);
 error_t kpage_alloc(page_t **page);
 void *kpage_alloc_addr(void);
 void *kpage_zalloc_addr(void);
@@ -73,14 +99,37 @@ void *get_cont_pages(size_t order, int flags);
 void free_cont_pages(void *buf, size_t order);
 
 void page_decref(page_t *page);
+void page_cow_share(struct page *page);
+void page_cow_share_huge(struct page *head);
+void page_decref_huge(struct page *head);
 
 int page_is_free(size_t ppn);
 void lock_page(struct page *page);
 void unlock_page(struct page *page);
 void print_pageinfo(struct page *page);
 static inline bool page_is_pagemap(struct page *page);
+static inline bool page_is_cow_shared(struct page *page);
+static inline bool page_is_cow_shared_huge(struct page *head);
 
 static inline bool page_is_pagemap(struct page *page)
 {
 	return atomic_read(&page->pg_flags) & PG_PAGEMAP ? true : false;
 }
+
+/* Anonymous pages can be mapped copy-on-write by several address spaces after a
+ * fork.  pg_cow_refs counts the mappers beyond the first one. */
+static inline bool page_is_cow_shared(struct page *page)
+{
+	return atomic_read(&page->pg_cow_refs) > 0;
+}
+
+/* A jumbo PTE is shared if any page of its block is mapped by someone else,
+ * either by another jumbo or by small PTEs after they split theirs. */
+static inline bool page_is_cow_shared_huge(struct page *head)
+{
+	for (int i = 0; i < HUGE_NR_PGS; i++) {
+		if (page_is_cow_shared(head + i))
+			return true;
+	}
+	return false;
+}
@@ -12,12 +12,32 @@
 #include <radix.h>
 #include <atomic.h>
 #include <mm.h>
+#include <kthread.h>
 
 /* Need to be careful, due to some ghetto circular references */
 struct page;
 struct chan;
 struct page_map_operations;
 
+/* Readahead state for a page_map.  Sequential readers get a window of pages
+ * read asynchronously ahead of them.  When the reader hits async_idx, the first
+ * page of the latest window, we start the next one, so we stay a full window
+ * ahead.  The window doubles while readahead keeps up, up to PM_RA_MAX_PGS,
+ * halves if our pages got evicted before the reader got to them, and resets on
+ * random access. */
+struct pm_readahead {
+	spinlock_t			lock;
+	unsigned long			next_idx;	/* expected next read */
+	unsigned long			async_idx;	/* triggers next window */
+	unsigned long			end_idx;	/* 1 past the window */
+	unsigned long			nr_pgs;		/* window size */
+	unsigned int			nr_inflight;	/* batches being read */
+	struct cond_var			inflight_cv;	/* uses lock */
+};
+
+#define PM_RA_MIN_PGS			4
+#define PM_RA_MAX_PGS			128
+
 /* Every object that has pages has a page_map, tracking which of its pages are
  * currently in memory.  It is a map, per object, from index to physical page
  * frame. */
@@ -29,6 +49,7 @@ struct page_map {
 	struct page_map_operations	*pm_op;
 	spinlock_t			pm_lock;	/* for the VMR list */
 	struct vmr_tailq		pm_vmrs;
+	struct pm_readahead		pm_ra;
 };
 
 /* Operations performed on a page_map.  These are usually FS specific, which
@@ -55,6 +76,8 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
+void pm_readahead(struct page_map *pm, unsigned long index,
+                  unsigned long nr_file_pgs);
 void pm_put_page(struct page *page);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
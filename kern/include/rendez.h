@@ -53,5 +53,7 @@ void rendez_init(struct rendez *rv);
 void rendez_sleep(struct rendez *rv, int (*cond)(void*), void *arg);
 bool rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
                           uint64_t usec);
+bool rendez_sleep_timeout_slack(struct rendez *rv, int (*cond)(void*),
+                                void *arg, uint64_t usec, uint64_t slack);
 bool rendez_wakeup(struct rendez *rv);
 void rendez_debug_waiter(struct alarm_waiter *awaiter);
@@ -65,11 +65,16 @@ struct per_cpu_info {
 	taskstate_t *tss;
 	segdesc_t *gdt;
 #endif
-	/* KMSGs */
-	spinlock_t immed_amsg_lock;
+	/* KMSGs.  Remote cores push onto the inboxes (LIFO, lock-free).  This
+	 * core moves them, in order, onto its private lists. */
+	struct kernel_message *immed_amsg_inbox;
 	struct kernel_msg_list immed_amsgs;
-	spinlock_t routine_amsg_lock;
+	struct kernel_message *routine_amsg_inbox;
 	struct kernel_msg_list routine_amsgs;
+	/* TLB shootdowns: whether one is on the way, and the last one applied */
+	atomic_t tlb_kmsg_pending;
+	uint64_t tlb_gen;
+	int numa_node;			/* for the page allocator */
 	/* profiling -- opaque to all but the profiling code. */
 	void *profiling;
 }__attribute__((aligned(ARCH_CL_SIZE)));
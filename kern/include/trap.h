@@ -9,6 +9,7 @@
 #include <arch/mmu.h>
 #include <sys/queue.h>
 #include <arch/trap.h>
+#include <core_set.h>
 
 // func ptr for interrupt service routines
 typedef void (*isr_t)(struct hw_trapframe *hw_tf, void *data);
@@ -95,7 +96,13 @@ void copy_current_ctx_to(struct user_context *to_ctx);
  * Also, a big difference is that smp_calls can use the same message (registered
  * in the interrupt_handlers[] for x86) for every recipient, but the kernel
  * messages require a unique message.  Also for now, but it might be like that
- * for a while on x86 (til we have a broadcast). */
+ * for a while on x86 (til we have a broadcast).
+ *
+ * Senders push messages onto a lock-free inbox on the destination core, which
+ * only that core drains.  Only the sender that finds the inbox empty sends the
+ * IPI; anyone else knows the core will get to their message.  If you are
+ * sending a bunch of messages, use a kmsg_batch, which sends at most one IPI
+ * per destination core when you kmsg_batch_send(). */
 
 #define KMSG_IMMEDIATE 			1
 #define KMSG_ROUTINE 			2
@@ -116,9 +123,18 @@ struct kernel_message
 STAILQ_HEAD(kernel_msg_list, kernel_message);
 typedef struct kernel_message kernel_message_t;
 
+/* The cores a batch of kmsgs still owes an IPI */
+struct kmsg_batch {
+	struct core_set			ipi_cores;
+};
+
 void kernel_msg_init(void);
 uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
                              long arg2, int type);
+void kmsg_batch_init(struct kmsg_batch *batch);
+void kmsg_batch_add(struct kmsg_batch *batch, uint32_t dst, amr_t pc,
+                    long arg0, long arg1, long arg2, int type);
+void kmsg_batch_send(struct kmsg_batch *batch);
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data);
 bool has_routine_kmsg(void);
 void process_routine_kmsg(void);
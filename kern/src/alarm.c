@@ -5,13 +5,11 @@
  *
  * Alarms.  This includes ways to defer work on a specific timer.  These can be
  * per-core, global or whatever.  Like with most systems, you won't wake up til
- * after the time you specify. (for now, this might change).
+ * after the time you specify, plus whatever slack you allow.
  *
  * TODO:
  * - have a kernel sense of time, instead of just the TSC or whatever timer the
- *   chain uses...
- * - coalesce or otherwise deal with alarms that are close to cut down on
- *   interrupt overhead. */
+ *   chain uses... */
 
 #include <ros/common.h>
 #include <sys/queue.h>
@@ -21,28 +19,206 @@
 #include <smp.h>
 #include <kmalloc.h>
 
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
+static bool __remove_awaiter(struct timer_chain *tchain,
+                             struct alarm_waiter *waiter);
+
+/* Number of wheel ticks a slot at lvl spans */
+static uint64_t lvl_ticks(int lvl)
+{
+	return 1ULL << (lvl * TCHAIN_WHEEL_BITS);
+}
+
+static uint64_t ror64(uint64_t x, unsigned int n)
+{
+	n &= 63;
+	return n ? (x >> n) | (x << (64 - n)) : x;
+}
+
+/* Helper, finds the first non-empty slot at lvl in the order the wheel will
+ * reach them, and the tick at which it gets there.  Level 0's current slot is
+ * due now.  The higher levels cascaded their current slot when the wheel got
+ * to it, so anything in there is for the next lap.  lvl must have a pending
+ * slot. */
+static int __tchain_first_slot(struct timer_chain *tchain, int lvl,
+                               uint64_t *tick)
+{
+	int shift = lvl * TCHAIN_WHEEL_BITS;
+	uint64_t lap = (tchain->clk >> shift) + (lvl ? 1 : 0);
+	unsigned int k;
+
+	k = __builtin_ctzll(ror64(tchain->pending[lvl], lap));
+	*tick = (lap + k) << shift;
+	return (lap + k) & TCHAIN_WHEEL_MASK;
+}
+
+/* Helper, the time a waiter needs its slot (which the wheel reaches at tick
+ * start) to run.  That's when it fires, unless the waiter was parked past the
+ * end of the wheel, in which case the slot needs to run to cascade it. */
+static uint64_t __slot_key(struct alarm_waiter *waiter, uint64_t start, int lvl)
+{
+	if ((waiter->fire_time >> TCHAIN_TICK_SHIFT) >= start + lvl_ticks(lvl))
+		return start << TCHAIN_TICK_SHIFT;
+	return waiter->fire_time;
+}
+
+/* Helper, puts waiter in its slot, relative to the tchain's clk.  Returns the
+ * time the slot needs to run for the waiter.  Caller holds the lock. */
+static uint64_t __wheel_insert(struct timer_chain *tchain,
+                               struct alarm_waiter *waiter)
+{
+	uint64_t expires = MAX(waiter->fire_time >> TCHAIN_TICK_SHIFT,
+	                       tchain->clk);
+	uint64_t delta = expires - tchain->clk;
+	uint64_t start, key, *slot_min;
+	int lvl, slot;
+
+	for (lvl = 0; lvl < TCHAIN_NR_LEVELS - 1; lvl++) {
+		if (delta < lvl_ticks(lvl + 1))
+			break;
+	}
+	if (delta >= lvl_ticks(TCHAIN_NR_LEVELS))
+		expires = tchain->clk + lvl_ticks(TCHAIN_NR_LEVELS) - 1;
+	start = ROUNDDOWN(expires, lvl_ticks(lvl));
+	slot = (expires >> (lvl * TCHAIN_WHEEL_BITS)) & TCHAIN_WHEEL_MASK;
+	key = __slot_key(waiter, start, lvl);
+	slot_min = &tchain->slot_min[lvl][slot];
+	if (!(tchain->pending[lvl] & (1ULL << slot))) {
+		tchain->pending[lvl] |= 1ULL << slot;
+		*slot_min = key;
+	} else if (*slot_min && key < *slot_min) {
+		*slot_min = key;
+	}
+	BSD_LIST_INSERT_HEAD(&tchain->wheel[lvl][slot], waiter, next);
+	waiter->wheel_idx = lvl * TCHAIN_WHEEL_SIZE + slot;
+	return key;
+}
+
+/* Helper, pulls waiter out of its slot.  Caller holds the lock. */
+static void __wheel_remove(struct timer_chain *tchain,
+                           struct alarm_waiter *waiter)
+{
+	int lvl = waiter->wheel_idx / TCHAIN_WHEEL_SIZE;
+	int slot = waiter->wheel_idx % TCHAIN_WHEEL_SIZE;
+
+	BSD_LIST_REMOVE(waiter, next);
+	if (BSD_LIST_EMPTY(&tchain->wheel[lvl][slot]))
+		tchain->pending[lvl] &= ~(1ULL << slot);
+	else if (waiter->fire_time <= tchain->slot_min[lvl][slot])
+		tchain->slot_min[lvl][slot] = 0;
+}
+
+/* Helper, resets the earliest time, based on the first pending slot of each
+ * level.  Only slots whose earliest waiter left get rescanned.  If the tchain
+ * is empty, we set the time to be the 12345 poison time.  Since the tchain is
+ * empty, the alarm shouldn't be going off. */
 static void reset_tchain_times(struct timer_chain *tchain)
 {
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	struct alarm_waiter *i;
+	uint64_t earliest = UINT64_MAX;
+	uint64_t tick, *slot_min;
+	int slot;
+
+	if (!tchain->nr_waiters) {
 		tchain->earliest_time = ALARM_POISON_TIME;
-		tchain->latest_time = ALARM_POISON_TIME;
-	} else {
-		tchain->earliest_time =
-		    TAILQ_FIRST(&tchain->waiters)->wake_up_time;
-		tchain->latest_time =
-		    TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
+		return;
+	}
+	for (int lvl = 0; lvl < TCHAIN_NR_LEVELS; lvl++) {
+		if (!tchain->pending[lvl])
+			continue;
+		slot = __tchain_first_slot(tchain, lvl, &tick);
+		slot_min = &tchain->slot_min[lvl][slot];
+		if (!*slot_min) {
+			*slot_min = UINT64_MAX;
+			BSD_LIST_FOREACH(i, &tchain->wheel[lvl][slot], next)
+				*slot_min = MIN(*slot_min,
+				                __slot_key(i, tick, lvl));
+		}
+		earliest = MIN(earliest, *slot_min);
+	}
+	tchain->earliest_time = earliest;
+}
+
+/* Helper, moves the waiters out of any higher level slots the wheel just
+ * reached.  They all land in lower levels (or, if they were parked past the
+ * end of the wheel, in another top level slot). */
+static void __tchain_cascade(struct timer_chain *tchain)
+{
+	struct alarm_waiter *i, *temp;
+	int slot;
+
+	for (int lvl = 1; lvl < TCHAIN_NR_LEVELS; lvl++) {
+		if (tchain->clk & (lvl_ticks(lvl) - 1))
+			break;
+		slot = (tchain->clk >> (lvl * TCHAIN_WHEEL_BITS)) &
+		       TCHAIN_WHEEL_MASK;
+		if (!(tchain->pending[lvl] & (1ULL << slot)))
+			continue;
+		tchain->pending[lvl] &= ~(1ULL << slot);
+		BSD_LIST_FOREACH_SAFE(i, &tchain->wheel[lvl][slot], next,
+		                      temp) {
+			BSD_LIST_REMOVE(i, next);
+			__wheel_insert(tchain, i);
+		}
+	}
+}
+
+/* Helper, returns a waiter that is due to fire at now, or 0 if there are none.
+ * This advances the wheel up to now, jumping straight to the next slot with
+ * anything in it. */
+static struct alarm_waiter *__tchain_get_expired(struct timer_chain *tchain,
+                                                 uint64_t now)
+{
+	uint64_t now_tick = now >> TCHAIN_TICK_SHIFT;
+	uint64_t next, tick;
+	struct alarm_waiter *i;
+
+	for (;;) {
+		BSD_LIST_FOREACH(i, &tchain->wheel[0][tchain->clk &
+		                                      TCHAIN_WHEEL_MASK], next) {
+			if (i->fire_time <= now)
+				return i;
+		}
+		if (tchain->clk >= now_tick)
+			return NULL;
+		/* Everything in the current slot was due, so it's empty and the
+		 * next tick with work is in the future. */
+		next = now_tick;
+		for (int lvl = 0; lvl < TCHAIN_NR_LEVELS; lvl++) {
+			if (!tchain->pending[lvl])
+				continue;
+			__tchain_first_slot(tchain, lvl, &tick);
+			next = MIN(next, tick);
+		}
+		tchain->clk = next;
+		__tchain_cascade(tchain);
 	}
 }
 
+/* Helper, when the tchain will actually fire waiter.  With slack, we round the
+ * deadline down to the largest power of two that keeps it within [wake_up_time,
+ * wake_up_time + slack], so that waiters with overlapping windows tend to land
+ * on the same time and share an interrupt. */
+static uint64_t __awaiter_fire_time(struct alarm_waiter *waiter)
+{
+	uint64_t latest = waiter->wake_up_time + waiter->slack;
+
+	if (!waiter->slack || latest < waiter->wake_up_time)
+		return waiter->wake_up_time;
+	return ROUNDDOWN(latest, 1ULL << LOG2_DOWN(waiter->slack));
+}
+
 /* One time set up of a tchain, currently called in per_cpu_init() */
 void init_timer_chain(struct timer_chain *tchain,
                       void (*set_interrupt)(struct timer_chain *))
 {
 	spinlock_init_irqsave(&tchain->lock);
-	TAILQ_INIT(&tchain->waiters);
+	for (int lvl = 0; lvl < TCHAIN_NR_LEVELS; lvl++) {
+		for (int slot = 0; slot < TCHAIN_WHEEL_SIZE; slot++)
+			BSD_LIST_INIT(&tchain->wheel[lvl][slot]);
+		tchain->pending[lvl] = 0;
+	}
+	tchain->clk = read_tsc() >> TCHAIN_TICK_SHIFT;
+	tchain->nr_waiters = 0;
 	tchain->set_interrupt = set_interrupt;
 	reset_tchain_times(tchain);
 	cv_init_irqsave_with_lock(&tchain->cv, &tchain->lock);
@@ -54,6 +230,7 @@ void init_awaiter(struct alarm_waiter *waiter,
 	assert(func);
 	waiter->func = func;
 	waiter->wake_up_time = ALARM_POISON_TIME;
+	waiter->slack = 0;
 	waiter->on_tchain = false;
 }
 
@@ -87,12 +264,19 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 	waiter->wake_up_time += usec2tsc(usleep);
 }
 
+/* Allow the alarm to go off up to usec after its wake up time, so the tchain
+ * can coalesce it with other alarms.  Takes effect the next time it is set. */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec)
+{
+	waiter->slack = usec2tsc(usec);
+}
+
 /* Helper, makes sure the interrupt is turned on at the right time.  Most of the
  * heavy lifting is in the timer-source specific function pointer. */
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
 	assert(!irq_is_enabled());
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (!tchain->nr_waiters) {
 		/* Turn it off */
 		printd("Turning alarm off\n");
 		tchain->set_interrupt(tchain);
@@ -119,19 +303,11 @@ static void __run_tchain(uint32_t srcid, long a0, long a1, long a2)
 		spin_unlock_irqsave(&tchain->lock);
 		return;
 	}
-	while ((i = TAILQ_FIRST(&tchain->waiters))) {
-		/* TODO: Could also do something in cases where it's close to
-		 * expiring. */
-		if (i->wake_up_time > read_tsc())
-			break;
-		TAILQ_REMOVE(&tchain->waiters, i, next);
-		i->on_tchain = false;
+	while ((i = __tchain_get_expired(tchain, read_tsc()))) {
+		/* Keeps the earliest time in sync when unlocked. */
+		__remove_awaiter(tchain, i);
 		tchain->running = i;
 
-		/* Need the tchain times (earliest/latest) in sync when
-		 * unlocked. */
-		reset_tchain_times(tchain);
-
 		spin_unlock_irqsave(&tchain->lock);
 
 		/* Don't touch the waiter after running it, since the memory can
@@ -148,6 +324,9 @@ static void __run_tchain(uint32_t srcid, long a0, long a1, long a2)
 		__cv_signal(&tchain->cv);
 		warn_on(tchain->cv.nr_waiters);
 	}
+	/* Cascading can move the earliest time for waiters parked past the end
+	 * of the wheel. */
+	reset_tchain_times(tchain);
 	reset_tchain_interrupt(tchain);
 	spin_unlock_irqsave(&tchain->lock);
 }
@@ -165,44 +344,21 @@ void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 static bool __insert_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *i, *temp;
-
+	uint64_t key;
+
+	/* Nothing on the wheel to skip past, so we can catch it up to now.
+	 * This keeps an idle tchain's waiters from starting out at the top. */
+	if (!tchain->nr_waiters)
+		tchain->clk = MAX(tchain->clk, read_tsc() >> TCHAIN_TICK_SHIFT);
+	waiter->fire_time = __awaiter_fire_time(waiter);
+	key = __wheel_insert(tchain, waiter);
 	waiter->on_tchain = TRUE;
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
-		return TRUE;
-	}
-	/* If not, either we're first, last, or in the middle.  Reset the
-	 * interrupt and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Changed the first entry; we'll need to reset the interrupt
-		 * later */
-		return TRUE;
-	}
-	/* If there is a tie for last, the newer one will really go last.  We
-	 * need to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
+	if (tchain->nr_waiters++ && key >= tchain->earliest_time)
 		return FALSE;
-	}
-	/* Insert before the first one you are earlier than.  This won't scale
-	 * well (TODO) if we have a lot of inserts.  The proactive insert_tail
-	 * up above will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			return FALSE;
-		}
-	}
-	panic("Could not find a spot for awaiter %p\n", waiter);
+	/* Either the tchain was empty, or we're first.  We'll need to reset
+	 * the interrupt later. */
+	tchain->earliest_time = key;
+	return TRUE;
 }
 
 /* Sets the alarm.  If it is a kthread-style alarm (func == 0), sleep on it
@@ -218,31 +374,20 @@ void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 	spin_unlock_irqsave(&tchain->lock);
 }
 
-/* Helper, rips the waiter from the tchain, knowing that it is on the list.
+/* Helper, rips the waiter from the tchain, knowing that it is on the wheel.
  * Returns TRUE if the tchain interrupt needs to be reset.  Callers hold the
  * lock. */
 static bool __remove_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *temp;
-	bool reset_int = FALSE;	/* whether or not to reset the interrupt */
-
-	/* Need to make sure earliest and latest are set, in case we're mucking
-	 * with the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time
-					       : ALARM_POISON_TIME;
-		reset_int = TRUE; /* we'll need to reset the timer later */
-	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time
-				             : ALARM_POISON_TIME;
-	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
+	__wheel_remove(tchain, waiter);
 	waiter->on_tchain = FALSE;
-	return reset_int;
+	tchain->nr_waiters--;
+	if (waiter->fire_time > tchain->earliest_time)
+		return FALSE;
+	/* We might have been the earliest; we'll need to reset the timer */
+	reset_tchain_times(tchain);
+	return TRUE;
 }
 
 /* Removes waiter from the tchain before it goes off.  Returns TRUE if we
@@ -351,7 +496,7 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 		send_ipi(rem_pcpui - &per_cpu_info[0], IdtLAPIC_TIMER);
 		return;
 	}
-	time = TAILQ_EMPTY(&tchain->waiters) ? 0 : tchain->earliest_time;
+	time = tchain->nr_waiters ? tchain->earliest_time : 0;
 	if (time) {
 		/* Arm the alarm.  For times in the past, we just need to make
 		 * sure it goes off. */
@@ -375,25 +520,28 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 void print_chain(struct timer_chain *tchain)
 {
 	struct alarm_waiter *i;
-	struct timespec x = {0}, y = {0};
+	struct timespec x = {0};
 
 	spin_lock_irqsave(&tchain->lock);
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (!tchain->nr_waiters) {
 		printk("Chain %p is empty\n", tchain);
 		spin_unlock_irqsave(&tchain->lock);
 		return;
 	}
 	x = tsc2timespec(tchain->earliest_time);
-	y = tsc2timespec(tchain->latest_time);
-	printk("Chain %p:  earliest: [%7d.%09d] latest: [%7d.%09d]\n",
-	       tchain, x.tv_sec, x.tv_nsec, y.tv_sec, y.tv_nsec);
-	TAILQ_FOREACH(i, &tchain->waiters, next) {
-		uintptr_t f = (uintptr_t)i->func;
-
-		x = tsc2timespec(i->wake_up_time);
-		printk("\tWaiter %p, time [%7d.%09d] (%p), func %p (%s)\n",
-		       i, x.tv_sec, x.tv_nsec, i->wake_up_time, f,
-		       get_fn_name(f));
+	printk("Chain %p:  earliest: [%7d.%09d] waiters: %u clk: %p\n",
+	       tchain, x.tv_sec, x.tv_nsec, tchain->nr_waiters, tchain->clk);
+	for (int lvl = 0; lvl < TCHAIN_NR_LEVELS; lvl++) {
+		for (int slot = 0; slot < TCHAIN_WHEEL_SIZE; slot++) {
+			BSD_LIST_FOREACH(i, &tchain->wheel[lvl][slot], next) {
+				uintptr_t f = (uintptr_t)i->func;
+
+				x = tsc2timespec(i->wake_up_time);
+				printk("\tWaiter %p, lvl %d slot %2d, time [%7d.%09d] (%p), func %p (%s)\n",
+				       i, lvl, slot, x.tv_sec, x.tv_nsec,
+				       i->wake_up_time, f, get_fn_name(f));
+			}
+		}
 	}
 	spin_unlock_irqsave(&tchain->lock);
 }
@@ -141,6 +141,7 @@ void kernel_init(multiboot_info_t *mboot_info)
 	dma_arena_init();
 	acpiinit();
 	topology_init();
+	numa_init();
 	percpu_init();
 	kthread_init();		/* might need to tweak when this happens */
 	vmr_init();
@@ -21,26 +21,52 @@ static page_list_t pages_list;
 
 struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
 
+/* Maps a ksize, in KMALLOC_ALIGNMENT units (rounded up), to its cache_id. */
+static uint8_t kmalloc_size_to_id[KMALLOC_LARGEST / KMALLOC_ALIGNMENT + 1];
+
 static void __kfree_release(struct kref *kref);
 
+/* Size of the objects (tag included) in kmalloc_caches[cache_id]. */
+static size_t kmalloc_class_size(int cache_id)
+{
+	size_t base, step;
+
+	if (!cache_id)
+		return KMALLOC_SMALLEST;
+	cache_id--;
+	base = KMALLOC_SMALLEST << (cache_id >> KMALLOC_CLASS_SHIFT);
+	step = base >> KMALLOC_CLASS_SHIFT;
+	return base + step * ((cache_id & (KMALLOC_CLASSES_PER_PWR2 - 1)) + 1);
+}
+
 void kmalloc_init(void)
 {
 	char kc_name[KMC_NAME_SZ];
+	size_t ksize;
+	int cache_id = 0;
 
 	/* we want at least a 16 byte alignment of the tag so that the bufs
 	 * kmalloc returns are 16 byte aligned.  we used to check the actual
 	 * size == 16, since we adjusted the KMALLOC_SMALLEST based on that. */
 	static_assert(ALIGNED(sizeof(struct kmalloc_tag), 16));
+	/* the smallest step between classes must keep that alignment */
+	static_assert(ALIGNED(KMALLOC_SMALLEST >> KMALLOC_CLASS_SHIFT,
+			      KMALLOC_ALIGNMENT));
+	static_assert(NUM_KMALLOC_CACHES <= UINT8_MAX);
 	/* build caches of common sizes.  this size will later include the tag
 	 * and the actual returned buffer. */
-	size_t ksize = KMALLOC_SMALLEST;
-
 	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
+		ksize = kmalloc_class_size(i);
 		snprintf(kc_name, KMC_NAME_SZ, "kmalloc_%d", ksize);
 		kmalloc_caches[i] = kmem_cache_create(kc_name, ksize,
 						      KMALLOC_ALIGNMENT, 0,
 						      NULL, 0, 0, NULL);
-		ksize <<= 1;
+	}
+	assert(kmalloc_class_size(NUM_KMALLOC_CACHES - 1) == KMALLOC_LARGEST);
+	for (int i = 0; i < ARRAY_SIZE(kmalloc_size_to_id); i++) {
+		while (i * KMALLOC_ALIGNMENT > kmalloc_class_size(cache_id))
+			cache_id++;
+		kmalloc_size_to_id[i] = cache_id;
 	}
 }
 
@@ -50,13 +76,9 @@ void *kmalloc(size_t size, int flags)
 	size_t ksize = size + sizeof(struct kmalloc_tag);
 	void *buf;
 	int cache_id;
-	// determine cache to pull from
-	if (ksize <= KMALLOC_SMALLEST)
-		cache_id = 0;
-	else
-		cache_id = LOG2_UP(ksize) - LOG2_UP(KMALLOC_SMALLEST);
+
 	// if we don't have a cache to handle it, alloc cont pages
-	if (cache_id >= NUM_KMALLOC_CACHES) {
+	if (ksize > KMALLOC_LARGEST) {
 		/* The arena allocator will round up too, but we want to know in
 		 * advance so that krealloc can avoid extra allocations. */
 		size_t amt_alloc = ROUNDUP(size + sizeof(struct kmalloc_tag),
@@ -74,6 +96,7 @@ void *kmalloc(size_t size, int flags)
 		return buf + sizeof(struct kmalloc_tag);
 	}
 	// else, alloc from the appropriate cache
+	cache_id = kmalloc_size_to_id[DIV_ROUND_UP(ksize, KMALLOC_ALIGNMENT)];
 	buf = kmem_cache_alloc(kmalloc_caches[cache_id], flags);
 	if (!buf)
 		panic("Kmalloc failed!  Handle me!");
@@ -86,6 +109,26 @@ void *kmalloc(size_t size, int flags)
 	return buf + sizeof(struct kmalloc_tag);
 }
 
+/* Allocates a kfree()able buffer from kc, whose objects must have room for a
+ * kmalloc_tag in front of the buffer.  This is for subsystems that want their
+ * own slab (e.g. with a ctor), but whose buffers get refcounted and freed like
+ * any other kmalloc buffer.  The tag's kref is the only part of the object we
+ * touch, other than the constant fields. */
+void *kmalloc_from_cache(struct kmem_cache *kc, int flags)
+{
+	struct kmalloc_tag *tag;
+
+	assert(kc->obj_size > sizeof(struct kmalloc_tag));
+	tag = kmem_cache_alloc(kc, flags);
+	if (!tag)
+		return NULL;
+	tag->flags = KMALLOC_TAG_CACHE;
+	tag->my_cache = kc;
+	tag->canary = KMALLOC_CANARY;
+	kref_init(&tag->kref, __kfree_release, 1);
+	return (void*)tag + sizeof(struct kmalloc_tag);
+}
+
 void *kzmalloc(size_t size, int flags)
 {
 	void *v = kmalloc(size, flags);
@@ -172,7 +215,9 @@ void *krealloc(void* buf, size_t size, int flags)
 			panic("krealloc of a kmalloc_align not supported");
 		tag = __get_km_tag(buf);
 		/* whatever we got from either a slab or the page allocator is
-		 * meant for both the buf+size as well as the kmalloc tag */
+		 * meant for both the buf+size as well as the kmalloc tag.  For
+		 * slabs, that's the whole size class, so we can grow into the
+		 * class's slack without moving. */
 		if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE) {
 			osize = tag->my_cache->obj_size
 				- sizeof(struct kmalloc_tag);
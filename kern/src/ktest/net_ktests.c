@@ -80,10 +80,80 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+#define CSUM_EXTRA_HDR 54
+#define CSUM_EXTRA_LEN (64 * 1024)
+
+/* Builds a block of CSUM_EXTRA_LEN bytes matching flat, with headers in the
+ * main body and the payload spread over odd-sized extra_data buffers, like the
+ * blocks from TSO and GRO. */
+static struct block *csum_extra_block(const uint8_t *flat)
+{
+	struct block *bp = block_alloc(CSUM_EXTRA_HDR, MEM_WAIT);
+	size_t off = CSUM_EXTRA_HDR, len;
+	uint8_t *buf;
+
+	block_copy_to_body(bp, (void*)flat, CSUM_EXTRA_HDR);
+	for (int i = 0; off < CSUM_EXTRA_LEN; i++) {
+		len = MIN(1447 + i * 3, CSUM_EXTRA_LEN - off);
+		/* Start the data at an odd offset into the buffer */
+		buf = kmalloc(len + 1, MEM_WAIT);
+		memcpy(buf + 1, flat + off, len);
+		block_append_extra(bp, (uintptr_t)buf, 1, len, MEM_WAIT);
+		off += len;
+	}
+	return bp;
+}
+
+bool test_ptclcsum_extra(void)
+{
+	uint8_t *flat = kmalloc(CSUM_EXTRA_LEN, MEM_WAIT);
+	struct block *bp;
+	uint16_t csum, expected;
+	int len;
+	bool ret = true;
+
+	for (int i = 0; i < CSUM_EXTRA_LEN; i++)
+		flat[i] = (i * 7) & 0xff;
+	bp = csum_extra_block(flat);
+	for (int off = 0; off < 200 && ret; off += 7) {
+		for (len = 1; off + len <= CSUM_EXTRA_LEN; len = len * 3 + 1) {
+			csum = ptclcsum(bp, off, len);
+			expected = ~simplesum(flat + off, len) & 0xffff;
+			if (csum != expected) {
+				printk("off %d len %d csum %04x expected %04x\n",
+				       off, len, csum, expected);
+				ret = false;
+				break;
+			}
+		}
+	}
+	freeb(bp);
+	kfree(flat);
+	return ret;
+}
+
+bool test_ptclcsum_bench(void)
+{
+	uint8_t *flat = kmalloc(CSUM_EXTRA_LEN, MEM_WAIT);
+	struct block *bp;
+	uint16_t csum = 0;
+
+	for (int i = 0; i < CSUM_EXTRA_LEN; i++)
+		flat[i] = i & 0xff;
+	bp = csum_extra_block(flat);
+	for (int i = 0; i < 10000; i++)
+		csum += ptclcsum(bp, i & 7, CSUM_EXTRA_LEN - 8);
+	freeb(bp);
+	kfree(flat);
+	return true;
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,		CONFIG_TEST_ptclbsum),
 	KTEST_REG(simplesum_bench,	CONFIG_TEST_simplesum_bench),
 	KTEST_REG(ptclbsum_bench,	CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(ptclcsum_extra,	CONFIG_TEST_ptclcsum_extra),
+	KTEST_REG(ptclcsum_bench,	CONFIG_TEST_ptclcsum_bench),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
@@ -1617,6 +1617,59 @@ bool test_alarm(void)
 	return true;
 }
 
+/* Two alarms whose slack windows overlap should be given the same fire time,
+ * and both go off no earlier than asked.  Peeks at the tchain's fire_time. */
+bool test_alarm_slack(void)
+{
+	struct alarm_waiter await1, await2, await3;
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+	uint64_t slack_usec = 1000;
+	uint64_t slack = usec2tsc(slack_usec);
+	uint64_t gran = 1ULL << LOG2_DOWN(slack);
+	uint64_t base;
+	atomic_t nr_ran;
+
+	void slack_run(struct alarm_waiter *awaiter)
+	{
+		if (read_tsc() >= awaiter->wake_up_time)
+			atomic_inc(&nr_ran);
+	}
+
+	atomic_init(&nr_ran, 0);
+	/* Both wake up times + slack land in [base, base + gran), so they both
+	 * round down to base. */
+	base = ROUNDUP(read_tsc() + usec2tsc(10000), gran);
+	init_awaiter(&await1, slack_run);
+	set_awaiter_abs(&await1, base - slack + 1);
+	set_awaiter_slack(&await1, slack_usec);
+	init_awaiter(&await2, slack_run);
+	set_awaiter_abs(&await2, base - slack + gran / 2);
+	set_awaiter_slack(&await2, slack_usec);
+	/* No slack, fires when asked */
+	init_awaiter(&await3, slack_run);
+	set_awaiter_abs(&await3, base - slack + 1);
+
+	set_alarm(tchain, &await1);
+	set_alarm(tchain, &await2);
+	set_alarm(tchain, &await3);
+	KT_ASSERT_M("Overlapping slack should coalesce",
+	            await1.fire_time == await2.fire_time);
+	KT_ASSERT_M("Slack should round to the shared time",
+	            await1.fire_time == base);
+	KT_ASSERT_M("Alarm without slack should not move",
+	            await3.fire_time == await3.wake_up_time);
+
+	/* Handlers run as routine kmsgs, so block instead of spinning */
+	kthread_usleep(20000);
+	KT_ASSERT_M("All alarms should have fired, none early",
+	            atomic_read(&nr_ran) == 3);
+	unset_alarm(tchain, &await1);
+	unset_alarm(tchain, &await2);
+	unset_alarm(tchain, &await3);
+
+	return true;
+}
+
 bool test_kmalloc_incref(void)
 {
 	/* this test is a bit invasive of the kmalloc internals */
@@ -2088,6 +2141,7 @@ static struct ktest ktests[] = {
 	KTEST_REG(rwlock,             CONFIG_TEST_rwlock),
 	KTEST_REG(rv,                 CONFIG_TEST_rv),
 	KTEST_REG(alarm,              CONFIG_TEST_alarm),
+	KTEST_REG(alarm_slack,        CONFIG_TEST_alarm_slack),
 	KTEST_REG(kmalloc_incref,     CONFIG_TEST_kmalloc_incref),
 	KTEST_REG(u16pool,            CONFIG_TEST_u16pool),
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
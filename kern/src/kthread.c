@@ -251,7 +251,10 @@ void kthread_yield(void)
 	sem_down(sem);
 }
 
-void kthread_usleep(uint64_t usec)
+/* Sleeps for at least usec, and at most usec + slack.  Periodic pollers that
+ * don't care exactly when they run should pass some slack, so their wakeups can
+ * share an alarm interrupt with other timers on the core. */
+void kthread_usleep_slack(uint64_t usec, uint64_t slack)
 {
 	ERRSTACK(1);
 	/* TODO: classic ksched issue: where do we want the wake up to happen?
@@ -267,11 +270,16 @@ void kthread_usleep(uint64_t usec)
 	/* "discard the error" style (we run the conditional code) */
 	if (!waserror()) {
 		rendez_init(&rv);
-		rendez_sleep_timeout(&rv, ret_zero, 0, usec);
+		rendez_sleep_timeout_slack(&rv, ret_zero, 0, usec, slack);
 	}
 	poperror();
 }
 
+void kthread_usleep(uint64_t usec)
+{
+	kthread_usleep_slack(usec, 0);
+}
+
 static void __ktask_wrapper(uint32_t srcid, long a0, long a1, long a2)
 {
 	ERRSTACK(1);
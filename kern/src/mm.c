@@ -28,8 +28,10 @@
 #include <tree_file.h>
 
 /* These are the only mmap flags that are saved in the VMR.  If we implement
- * more of the mmap interface, we may need to grow this. */
-#define MAP_PERSIST_FLAGS	(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)
+ * more of the mmap interface, we may need to grow this.  fork() looks at
+ * POPULATE and LOCKED to decide what it can share copy-on-write. */
+#define MAP_PERSIST_FLAGS	(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | \
+				 MAP_POPULATE | MAP_LOCKED)
 
 struct kmem_cache *vmr_kcache;
 
@@ -456,11 +458,140 @@ static struct vm_region *find_first_vmr(struct proc *p, uintptr_t va)
 	return 0;
 }
 
+/* Transparent huge pages.  Anonymous VMRs get HUGE_PGSIZE pages for every
+ * aligned block that fits entirely in the VMR, so long as nothing is mapped in
+ * that block yet.  A huge page lives in a single PML2 PTE, which
+ * env_user_mem_walk() doesn't see, so we walk those separately.  Anything that
+ * needs to work on part of a huge page (a VMR split, a write to a CoW-shared
+ * huge page) splits it into small pages first. */
+
+/* Helper: can the aligned block at va be a huge page in vmr? */
+static bool vmr_huge_ok(struct vm_region *vmr, uintptr_t va)
+{
+	if (vmr_has_file(vmr))
+		return FALSE;
+	return vmr->vm_base <= va && va + HUGE_PGSIZE <= vmr->vm_end;
+}
+
+/* Helper: is nothing mapped in the aligned block at va, not even a PML1? */
+static bool huge_block_empty(struct proc *p, uintptr_t va)
+{
+	pte_t pte;
+	bool ret;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+	ret = !pte_walk_okay(pte) || pte_is_unmapped(pte);
+	spin_unlock(&p->pte_lock);
+	return ret;
+}
+
+/* Helper: maps the huge page at the aligned va, if the block is still empty.
+ * Takes ownership of the page either way.  Returns 0 if a huge page is mapped
+ * there, not necessarily ours, -EEXIST if small pages got there first. */
+static int map_huge_at_addr(struct proc *p, struct page *page, uintptr_t va,
+                            int pte_prot)
+{
+	pte_t pte;
+	int ret = 0;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, TRUE);
+	if (!pte_walk_okay(pte)) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+	if (pte_is_mapped(pte)) {
+		ret = pte_is_jumbo(pte) ? 0 : -EEXIST;
+		goto out_put;
+	}
+	pte_write(pte, page2pa(page), pte_prot | PTE_PS);
+	p->thp_stats.nr_huge++;
+	spin_unlock(&p->pte_lock);
+	return 0;
+out_put:
+	spin_unlock(&p->pte_lock);
+	page_decref_huge(page);
+	return ret;
+}
+
+/* Helper: tries to back the aligned block at va with a zeroed huge page.
+ * Returns 0 on success, o/w the caller should use small pages. */
+static int populate_huge_va(struct proc *p, uintptr_t va, int pte_prot)
+{
+	struct page *page;
+
+	if (!huge_block_empty(p, va))
+		return -EEXIST;
+	if (upage_alloc_huge(p, &page, TRUE))
+		return -ENOMEM;
+	return map_huge_at_addr(p, page, va, pte_prot);
+}
+
+/* Helper: splits the huge page at the aligned va, if there is one.  The
+ * translations don't change, so the caller only needs a TLB shootdown if it
+ * changes the small PTEs.  Hold the pte_lock. */
+static void __split_huge(struct proc *p, uintptr_t va)
+{
+	pte_t pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+
+	if (!pte_walk_okay(pte) || !pte_is_mapped(pte) || !pte_is_jumbo(pte))
+		return;
+	pte_split_jumbo(pte);
+	p->thp_stats.nr_huge--;
+	p->thp_stats.nr_small += HUGE_NR_PGS;
+	p->thp_stats.nr_splits++;
+}
+
+/* Helper: calls cb on every huge page PTE in [start, end).  Hold the
+ * pte_lock. */
+static void __huge_walk(struct proc *p, uintptr_t start, uintptr_t end,
+                        void (*cb)(struct proc *p, pte_t pte, void *arg),
+                        void *arg)
+{
+	pte_t pte;
+
+	for (uintptr_t va = ROUNDUP(start, HUGE_PGSIZE);
+	     va + HUGE_PGSIZE <= end; va += HUGE_PGSIZE) {
+		pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+		if (pte_walk_okay(pte) && pte_is_mapped(pte) &&
+		    pte_is_jumbo(pte))
+			cb(p, pte, arg);
+	}
+}
+
+static void __munmap_huge(struct proc *p, pte_t pte, void *arg)
+{
+	bool *shootdown_needed = (bool*)arg;
+
+	if (!pte_is_present(pte))
+		return;
+	pte_clear_present(pte);
+	*shootdown_needed = TRUE;
+}
+
+static void __free_huge(struct proc *p, pte_t pte, void *arg)
+{
+	struct page *head = pa2page(pte_get_paddr(pte));
+
+	pte_clear(pte);
+	page_decref_huge(head);
+	p->thp_stats.nr_huge--;
+}
+
 /* Makes sure that no VMRs cross either the start or end of the given region
- * [va, va + len), splitting any VMRs that are on the endpoints. */
+ * [va, va + len), splitting any VMRs that are on the endpoints.  Huge pages
+ * can't cross VMRs either. */
 static void isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
 {
 	struct vm_region *vmr;
+
+	spin_lock(&p->pte_lock);
+	if (PGOFF_HUGE(va))
+		__split_huge(p, ROUNDDOWN(va, HUGE_PGSIZE));
+	if (PGOFF_HUGE(va + len))
+		__split_huge(p, ROUNDDOWN(va + len, HUGE_PGSIZE));
+	spin_unlock(&p->pte_lock);
 	if ((vmr = find_vmr(p, va)))
 		split_vmr(vmr, va);
 	/* TODO: don't want to do another find (linear search) */
@@ -483,6 +614,9 @@ void unmap_and_destroy_vmrs(struct proc *p)
 		env_user_mem_walk(p, (void*)vmr_i->vm_base,
 				  vmr_i->vm_end - vmr_i->vm_base,
 				  __vmr_free_pgs, 0);
+		if (!vmr_has_file(vmr_i))
+			__huge_walk(p, vmr_i->vm_base, vmr_i->vm_end,
+				    __free_huge, NULL);
 	}
 	spin_unlock(&p->pte_lock);
 	/* need the safe style, since destroy_vmr modifies the list.  also, we
@@ -492,11 +626,51 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	spin_unlock(&p->vmr_lock);
 }
 
-/* Helper: copies the contents of pages from p to new p.  For pages that aren't
- * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+/* Helper: gives new_p the huge page pte maps at va, like copy_pages() does for
+ * small pages.  With cow, the whole block is shared read-only, and a write
+ * fault splits it (see __hpf_break_cow()).  Without cow, new_p gets its own
+ * huge page.  If there isn't one, we split p's instead and let the small page
+ * walk copy it.  Hold p's pte_lock. */
+static int copy_huge(struct proc *p, struct proc *new_p, pte_t pte,
+                     uintptr_t va, bool cow, bool *wp_needed)
+{
+	struct page *head = pa2page(pte_get_paddr(pte));
+	struct page *copy;
+	pte_t new_pte;
+
+	new_pte = pgdir_walk_jumbo(new_p->env_pgdir, (void*)va, TRUE);
+	if (!pte_walk_okay(new_pte))
+		return -ENOMEM;
+	if (!cow) {
+		if (upage_alloc_huge(new_p, &copy, FALSE)) {
+			__split_huge(p, va);
+			return 0;
+		}
+		memcpy(page2kva(copy), page2kva(head), HUGE_PGSIZE);
+		head = copy;
+	} else {
+		if (pte_has_perm_urw(pte)) {
+			pte_replace_perm(pte, PTE_USER_RO);
+			*wp_needed = TRUE;
+		}
+		page_cow_share_huge(head);
+	}
+	pte_write(new_pte, page2pa(head), pte_get_settings(pte));
+	new_p->thp_stats.nr_huge++;
+	return 0;
+}
+
+/* Helper: gives new_p the pages from p.  With cow, they are shared
+ * copy-on-write: both PTEs end up read-only, and the first write fault from
+ * either process gets its own copy (see __hpf_break_cow()).  Without cow, new_p
+ * gets its own copy now.  For pages that aren't present, once we support
+ * swapping, we can do something more intelligent.  0 on success, -ERROR on
+ * failure.  Huge pages stay huge in new_p (see copy_huge()).
+ *
+ * The caller needs to shootdown p's TLB if we set *wp_needed, since we might
+ * have write-protected p's PTEs. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
-                      uintptr_t va_end)
+                      uintptr_t va_end, bool cow, bool *wp_needed)
 {
 	int ret;
 
@@ -520,15 +694,36 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		 * VMRs undergoing page removal, which isn't the caller of
 		 * copy_pages. */
 		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
-			if (upage_alloc(new_p, &pp, 0))
-				return -ENOMEM;
-			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
+			pp = pa2page(pte_get_paddr(pte));
+			/* Private file pages were copied when they were
+			 * faulted in, so everything here is anonymous. */
+			assert(!page_is_pagemap(pp));
+			if (!cow) {
+				if (upage_alloc(new_p, &pp, 0))
+					return -ENOMEM;
+				memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)),
+				       PGSIZE);
+				if (page_insert(new_p->env_pgdir, pp, va,
+						pte_get_settings(pte))) {
+					page_decref(pp);
+					return -ENOMEM;
+				}
+				new_p->thp_stats.nr_small++;
+				return 0;
+			}
+			if (pte_has_perm_urw(pte)) {
+				pte_replace_perm(pte, PTE_USER_RO);
+				*wp_needed = TRUE;
+			}
+			/* Take the ref before new_p can see it, o/w an error
+			 * teardown of new_p could free the parent's page. */
+			page_cow_share(pp);
 			if (page_insert(new_p->env_pgdir, pp, va,
 					pte_get_settings(pte))) {
 				page_decref(pp);
 				return -ENOMEM;
 			}
+			new_p->thp_stats.nr_small++;
 		} else if (pte_is_paged_out(pte)) {
 			/* TODO: (SWAP) will need to either make a copy or
 			 * CoW/refcnt the backend store.  For now, this PTE will
@@ -541,20 +736,38 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		return 0;
 	}
 	spin_lock(&p->pte_lock);	/* walking and changing PTEs */
+	for (uintptr_t va = ROUNDUP(va_start, HUGE_PGSIZE);
+	     va + HUGE_PGSIZE <= va_end; va += HUGE_PGSIZE) {
+		pte_t pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+
+		if (!pte_walk_okay(pte) || !pte_is_mapped(pte) ||
+		    !pte_is_jumbo(pte))
+			continue;
+		ret = copy_huge(p, new_p, pte, va, cow, wp_needed);
+		if (ret)
+			goto out;
+	}
 	ret = env_user_mem_walk(p, (void*)va_start, va_end - va_start,
 				&copy_page, new_p);
+out:
 	spin_unlock(&p->pte_lock);
 	return ret;
 }
 
-static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
+static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr,
+                    bool *wp_needed)
 {
 	int ret = 0;
 
 	if (!vmr_has_file(vmr) || (vmr->vm_flags & MAP_PRIVATE)) {
 		/* We don't support ANON + SHARED yet */
 		assert(!(vmr->vm_flags & MAP_SHARED));
-		ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end);
+		/* The kernel writes to populated/locked memory (ucqs, vcore
+		 * stacks and TLS) from contexts that can't take a CoW fault,
+		 * so those get copied now. */
+		ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end,
+				 !(vmr->vm_flags & (MAP_POPULATE | MAP_LOCKED)),
+				 wp_needed);
 	} else {
 		/* non-private file, i.e. page cacheable.  we have to honor
 		 * MAP_LOCKED, (but we might be able to ignore MAP_POPULATE). */
@@ -580,13 +793,17 @@ static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
 		env_user_mem_walk(new_p, (void*)vmr->vm_base,
 				  vmr->vm_end - vmr->vm_base,
 				  __vmr_free_pgs, NULL);
+		if (!vmr_has_file(vmr))
+			__huge_walk(new_p, vmr->vm_base, vmr->vm_end,
+				    __free_huge, NULL);
 		spin_unlock(&new_p->pte_lock);
 	}
 	return ret;
 }
 
 /* This will make new_p have the same VMRs as p, and it will make sure all
- * physical pages are copied over, with the exception of MAP_SHARED files.
+ * physical pages are shared copy-on-write, with the exception of MAP_SHARED
+ * files and MAP_POPULATE or MAP_LOCKED regions, which are copied.
  * MAP_SHARED files that are also MAP_LOCKED will be attached to the process -
  * presumably they are in the page cache since the parent locked them.  This is
  * all pretty nasty.
@@ -599,6 +816,7 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 {
 	int ret = 0;
 	struct vm_region *vmr, *vm_i;
+	bool wp_needed = FALSE;
 
 	TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
 		vmr = kmem_cache_alloc(vmr_kcache, 0);
@@ -615,18 +833,22 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 			foc_incref(vm_i->__vm_foc);
 			pm_add_vmr(vmr_to_pm(vm_i), vmr);
 		}
-		ret = fill_vmr(p, new_p, vmr);
+		ret = fill_vmr(p, new_p, vmr, &wp_needed);
 		if (ret) {
 			if (vmr_has_file(vm_i)) {
 				pm_remove_vmr(vmr_to_pm(vm_i), vmr);
 				foc_decref(vm_i->__vm_foc);
 			}
 			vmr_free(vmr);
-			return ret;
+			break;
 		}
 		TAILQ_INSERT_TAIL(&new_p->vm_regions, vmr, vm_link);
 	}
-	return 0;
+	/* Even on failure, some of p's pages might be read-only now.  That's
+	 * fine; they'll get write-faulted back in place. */
+	if (wp_needed)
+		proc_tlbshootdown(p, 0, UMAPTOP);
+	return ret;
 }
 
 void print_vmrs(struct proc *p)
@@ -791,6 +1013,8 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	/* We have a ref to page (for non PMs), which we are storing in the PTE
 	 */
 	pte_write(pte, page2pa(page), pte_prot);
+	if (!page_is_pagemap(page))
+		p->thp_stats.nr_small++;
 	spin_unlock(&p->pte_lock);
 	return 0;
 }
@@ -810,7 +1034,8 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 }
 
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
- * mappable, which isn't true if there are concurrent changes to the VMRs. */
+ * mappable, which isn't true if there are concurrent changes to the VMRs.
+ * Aligned blocks within the range get huge pages when possible. */
 static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                             int pte_prot)
 {
@@ -818,6 +1043,11 @@ static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 	int ret;
 
 	for (long i = 0; i < nr_pgs; i++) {
+		if (!PGOFF_HUGE(va + i * PGSIZE) && nr_pgs - i >= HUGE_NR_PGS &&
+		    !populate_huge_va(p, va + i * PGSIZE, pte_prot)) {
+			i += HUGE_NR_PGS - 1;
+			continue;
+		}
 		if (upage_alloc(p, &page, TRUE))
 			return -ENOMEM;
 		/* could imagine doing a memwalk instead of a for loop */
@@ -1030,6 +1260,22 @@ int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	return ret;
 }
 
+/* Helper: CoW-shared pages must stay read-only, even in a writable VMR.  The
+ * first write will fault and break the sharing. */
+static int __cow_pte_prot(pte_t pte, int pte_prot)
+{
+	struct page *page;
+
+	if (pte_prot != PTE_USER_RW)
+		return pte_prot;
+	page = pa2page(pte_get_paddr(pte));
+	if (pte_is_jumbo(pte))
+		return page_is_cow_shared_huge(page) ? PTE_USER_RO : pte_prot;
+	if (!page_is_pagemap(page) && page_is_cow_shared(page))
+		return PTE_USER_RO;
+	return pte_prot;
+}
+
 /* This does not care if the region is not mapped.  POSIX says you should return
  * ENOMEM if any part of it is unmapped.  Can do this later if we care, based on
  * the VMRs, not the actual page residency. */
@@ -1068,8 +1314,13 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 		     va += PGSIZE) {
 			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
-				pte_replace_perm(pte, pte_prot);
+				pte_replace_perm(pte, __cow_pte_prot(pte,
+								     pte_prot));
 				shootdown_needed = TRUE;
+				/* One jumbo covers the rest of the block */
+				if (pte_is_jumbo(pte))
+					va = ROUNDDOWN(va, HUGE_PGSIZE) +
+					     HUGE_PGSIZE - PGSIZE;
 			}
 		}
 		spin_unlock(&p->pte_lock);
@@ -1153,8 +1404,10 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 		return 0;
 	page = pa2page(pte_get_paddr(pte));
 	pte_clear(pte);
-	if (!page_is_pagemap(page))
+	if (!page_is_pagemap(page)) {
 		page_decref(page);
+		p->thp_stats.nr_small--;
+	}
 	return 0;
 }
 
@@ -1176,6 +1429,9 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 		env_user_mem_walk(p, (void*)vmr->vm_base,
 				  vmr->vm_end - vmr->vm_base, __munmap_pte,
 				  &shootdown_needed);
+		if (!vmr_has_file(vmr))
+			__huge_walk(p, vmr->vm_base, vmr->vm_end,
+				    __munmap_huge, &shootdown_needed);
 		vmr = TAILQ_NEXT(vmr, vm_link);
 	}
 	spin_unlock(&p->pte_lock);
@@ -1193,6 +1449,9 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 		env_user_mem_walk(p, (void*)vmr->vm_base,
 				  vmr->vm_end - vmr->vm_base, __vmr_free_pgs,
 				  0);
+		if (!vmr_has_file(vmr))
+			__huge_walk(p, vmr->vm_base, vmr->vm_end, __free_huge,
+				    NULL);
 		spin_unlock(&p->pte_lock);
 		next_vmr = TAILQ_NEXT(vmr, vm_link);
 		destroy_vmr(vmr);
@@ -1264,6 +1523,67 @@ static int __hpf_load_page(struct proc *p, struct page_map *pm,
 	return 0;
 }
 
+/* Helper: handles a write fault on a present, read-only PTE in a writable VMR.
+ * That's a page we share copy-on-write with another process (after a fork).
+ * If we are the last sharer, we just make the PTE writable.  O/W, we get our
+ * own copy and drop our ref on the shared page.  A shared huge page gets split,
+ * and only the page we wrote to is copied.
+ *
+ * Returns TRUE if the fault was for a present PTE, meaning there's nothing for
+ * the normal fault path to do, with *ret set.  Hold the vmr_lock. */
+static bool __hpf_break_cow(struct proc *p, uintptr_t va, int *ret)
+{
+	pte_t pte;
+	struct page *old_page, *new_page;
+	bool shootdown_needed = FALSE;
+
+	*ret = 0;
+	spin_lock(&p->pte_lock);	/* walking and changing PTEs */
+	pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+	if (!pte_walk_okay(pte) || !pte_is_present(pte)) {
+		spin_unlock(&p->pte_lock);
+		return FALSE;
+	}
+	if (pte_is_jumbo(pte) && !pte_has_perm_urw(pte)) {
+		if (!page_is_cow_shared_huge(pa2page(pte_get_paddr(pte)))) {
+			pte_replace_perm(pte, PTE_USER_RW);
+			goto out;
+		}
+		/* The translations don't change, so no shootdown yet */
+		__split_huge(p, ROUNDDOWN(va, HUGE_PGSIZE));
+		pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+	}
+	/* Spurious fault, e.g. we raced with another core breaking the CoW.
+	 * Also, pagemap pages are never CoW-shared; a RO PTE here is a race
+	 * with mprotect, which will shootdown soon. */
+	if (pte_has_perm_urw(pte))
+		goto out;
+	old_page = pa2page(pte_get_paddr(pte));
+	if (page_is_pagemap(old_page))
+		goto out;
+	/* Only we can add sharers (by forking), and we hold our pte_lock.  So
+	 * once we see no other sharers, the page is ours. */
+	if (!page_is_cow_shared(old_page)) {
+		pte_replace_perm(pte, PTE_USER_RW);
+		goto out;
+	}
+	if (upage_alloc(p, &new_page, FALSE)) {
+		*ret = -ENOMEM;
+		goto out;
+	}
+	memcpy(page2kva(new_page), page2kva(old_page), PGSIZE);
+	pte_write(pte, page2pa(new_page), PTE_USER_RW);
+	page_decref(old_page);
+	shootdown_needed = TRUE;
+out:
+	spin_unlock(&p->pte_lock);
+	/* Other cores could still be reading the old page through the old PTE.
+	 */
+	if (shootdown_needed)
+		proc_tlbshootdown(p, va, va + PGSIZE);
+	return TRUE;
+}
+
 /* Returns 0 on success, or an appropriate -error code.
  *
  * Notes: if your TLB caches negative results, you'll need to flush the
@@ -1296,8 +1616,17 @@ refault:
 		ret = -EPERM;
 		goto out;
 	}
+	/* CoW pages are anonymous or private copies, even in file VMRs, so
+	 * this is OK for !file_ok. */
+	if ((prot & PROT_WRITE) && __hpf_break_cow(p, va, &ret))
+		goto out;
+	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	if (!vmr_has_file(vmr)) {
-		/* No file - just want anonymous memory */
+		/* No file - just want anonymous memory, huge if we can */
+		if (vmr_huge_ok(vmr, ROUNDDOWN(va, HUGE_PGSIZE)) &&
+		    !populate_huge_va(p, ROUNDDOWN(va, HUGE_PGSIZE), pte_prot))
+			goto out;
 		if (upage_alloc(p, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
@@ -1358,8 +1687,6 @@ refault:
 	}
 	/* update the page table TODO: careful with MAP_PRIVATE etc.  might do
 	 * this separately (file, no file) */
-	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
-	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	ret = map_page_at_addr(p, a_page, va, pte_prot);
 	/* fall through, even for errors */
 out_put_pg:
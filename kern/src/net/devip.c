@@ -36,7 +36,11 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <time.h>
+#include <process.h>
+#include <trap.h>
 #include <net/ip.h>
+#include <net/tcp.h>
 
 struct dev ipdevtab;
 
@@ -211,13 +215,16 @@ static int ip3gen(struct chan *c, int i, struct dir *dp)
 static int ip2gen(struct chan *c, int i, struct dir *dp)
 {
 	struct qid q;
+	struct Proto *x;
 
 	mkqid(&q, QID(PROTO(c->qid), 0, i), 0, QTFILE);
 	switch (i) {
 	case Qclone:
 		return founddevdir(c, q, "clone", 0, network, 0666, dp);
 	case Qstats:
-		return founddevdir(c, q, "stats", 0, network, 0444, dp);
+		x = ipfs[c->dev]->p[PROTO(c->qid)];
+		return founddevdir(c, q, "stats", 0, network,
+				   x->statsctl ? 0644 : 0444, dp);
 	}
 	return -1;
 }
@@ -365,6 +372,7 @@ static struct Fs *ipgetfs(int dev)
 		rwinit(&f->rwlock);
 		qlock_init(&f->iprouter.qlock);
 		ip_init(f);
+		routeinit(f);
 		arpinit(f);
 		netloginit(f);
 		for (i = 0; ipprotoinit[i]; i++)
@@ -477,11 +485,15 @@ static struct chan *ipopen(struct chan *c, int omode)
 	case Qstatus:
 	case Qremote:
 	case Qlocal:
-	case Qstats:
 	case Qipselftab:
 		if (omode & O_WRITE)
 			error(EPERM, ERROR_FIXME);
 		break;
+	case Qstats:
+		p = f->p[PROTO(c->qid)];
+		if ((omode & O_WRITE) && (!p->statsctl || !iseve()))
+			error(EPERM, ERROR_FIXME);
+		break;
 	case Qsnoop:
 		if (omode & O_WRITE)
 			error(EPERM, ERROR_FIXME);
@@ -792,8 +804,49 @@ static void ipclose(struct chan *c)
 
 enum {
 	Statelen = 32 * 1024,
+	Maxbusypoll = 1000,	/* usec */
 };
 
+/* Returns TRUE if a busy-polling reader should give up and block: the core has
+ * routine work (maybe the very ktask that would feed us), or the syscall was
+ * aborted, or the process is on its way out. */
+static bool conv_busypoll_stop(void)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	struct cv_lookup_elm cle;
+
+	if (has_routine_kmsg())
+		return TRUE;
+	cle.kthread = pcpui->cur_kthread;
+	if (is_ktask(cle.kthread) || !current)
+		return FALSE;
+	if (proc_is_dying(current))
+		return TRUE;
+	cle.proc = current;
+	cle.sysc = cle.kthread->sysc;
+	return should_abort(&cle);
+}
+
+/* Spins polling the NICs until c has data or busypoll_us is up.  Called before
+ * a read blocks, so a reader on a dedicated core takes its messages straight
+ * off the RX ring instead of waiting for the IRQ and the driver's wakeups. */
+static void conv_busypoll(struct conv *c)
+{
+	uint64_t end;
+
+	if (!c->busypoll_us || qlen(c->rq))
+		return;
+	end = nsec() + c->busypoll_us * 1000ULL;
+	do {
+		ipifcpoll(c->p->f);
+		if (qlen(c->rq))
+			return;
+		if (conv_busypoll_stop())
+			return;
+		cpu_relax();
+	} while (nsec() < end);
+}
+
 static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 {
 	struct conv *c;
@@ -873,8 +926,8 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 		c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
 		if (ch->flag & O_NONBLOCK)
 			return qread_nonblock(c->rq, a, n);
-		else
-			return qread(c->rq, a, n);
+		conv_busypoll(c);
+		return qread(c->rq, a, n);
 	case Qerr:
 		c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
 		return qread(c->eq, a, n);
@@ -902,8 +955,8 @@ static struct block *ipbread(struct chan *ch, size_t n, off64_t offset)
 		c = chan2conv(ch);
 		if (ch->flag & O_NONBLOCK)
 			return qbread_nonblock(c->rq, n);
-		else
-			return qbread(c->rq, n);
+		conv_busypoll(c);
+		return qbread(c->rq, n);
 	default:
 		return devbread(ch, n, offset);
 	}
@@ -1240,6 +1293,47 @@ void bypass_or_drop(struct conv *cv, struct block *bp)
 	qunlock(&cv->qlock);
 }
 
+/* Bypass users can ask for TSO with the "tso" ctl.  After that, their TCP
+ * packets carry only the pseudo-header checksum, the same as tcp.c's, and the
+ * NIC or ptclcsum_finalize() finishes it.  Packets with more than mss bytes of
+ * payload go out as TSO.  If the interface can't do TSO, the user needs to
+ * segment them. */
+static struct block *bypass_tso4(struct conv *cv, struct block *bp)
+{
+	struct Ip4hdr *ih = (struct Ip4hdr*)bp->rp;
+	struct tcphdr *th;
+	struct route *r;
+	int ip_hlen, tcp_hlen, len;
+
+	if (ih->proto != IP_TCPPROTO)
+		return bp;
+	ip_hlen = (ih->vihl & 0xf) << 2;
+	bp = pullupblock(bp, ip_hlen + TCP4_HDRSIZE);
+	if (!bp)
+		error(EINVAL, "Proto bypass unable to pullup TCP header");
+	ih = (struct Ip4hdr*)bp->rp;
+	th = (struct tcphdr*)(bp->rp + ip_hlen);
+	tcp_hlen = (th->tcpflag[0] >> 4) << 2;
+	len = blocklen(bp);
+
+	bp->flag |= Btcpck;
+	bp->network_offset = 0;
+	bp->transport_offset = ip_hlen;
+	bp->tx_csum_offset = th->tcpcksum - th->tcpsport;
+	if (len - ip_hlen - tcp_hlen <= cv->bypass_tso_mss)
+		return bp;
+	r = v4lookup(cv->p->f, ih->dst, NULL);
+	/* len is the IP length; maxtu includes the medium's header. */
+	if (r && r->rt.ifc && !(r->rt.ifc->feat & NETF_TSO)
+	    && len > r->rt.ifc->maxtu - r->rt.ifc->m->hsize) {
+		freeb(bp);
+		error(E2BIG, "Proto bypass TSO, but the interface can't");
+	}
+	bp->flag |= Btso;
+	bp->mss = cv->bypass_tso_mss;
+	return bp;
+}
+
 /* Push the block directly to the approprite ipoput function.
  *
  * It's the protocol's responsibility (and thus ours here) to make sure there is
@@ -1268,6 +1362,8 @@ static void proto_bypass_kick(void *arg, struct block *bp)
 		if (!bp)
 			error(EINVAL,
 			      "Proto bypass unable to pullup v4 header");
+		if (cv->bypass_tso_mss)
+			bp = bypass_tso4(cv, bp);
 		ipoput4(f, bp, FALSE, MAXTTL, DFLTTOS, NULL);
 		break;
 	case IP_VER6:
@@ -1326,6 +1422,7 @@ static void undo_proto_qio_bypass(struct conv *cv)
 	cv->wq = cv->wq_save;
 	cv->rq_save = NULL;
 	cv->wq_save = NULL;
+	cv->bypass_tso_mss = 0;
 }
 
 void Fsstdbypass(struct conv *cv, char *argv[], int argc)
@@ -1386,6 +1483,40 @@ static void tosctlmsg(struct conv *c, struct cmdbuf *cb)
 		c->tos = atoi(cb->f[1]);
 }
 
+/* "tso MSS" turns on TSO for a bypassed conv; 0 or no MSS turns it off. */
+static void tsoctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	long mss;
+	char *end;
+
+	if (c->state != Bypass)
+		error(EINVAL, "tso is only for bypassed convs");
+	if (cb->nf < 2) {
+		c->bypass_tso_mss = 0;
+		return;
+	}
+	mss = strtol(cb->f[1], &end, 0);
+	if (end == cb->f[1] || *end || mss < 0 ||
+	    mss > 0xffff - IPV4HDR_LEN - TCP4_HDRSIZE)
+		error(EINVAL, "tso takes an mss from 0 to %d",
+		      0xffff - IPV4HDR_LEN - TCP4_HDRSIZE);
+	c->bypass_tso_mss = mss;
+}
+
+static void busypollctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	long usec;
+
+	if (cb->nf < 2) {
+		c->busypoll_us = 0;
+		return;
+	}
+	usec = strtol(cb->f[1], 0, 0);
+	if (usec < 0 || usec > Maxbusypoll)
+		error(EINVAL, "busypoll takes 0 to %d usec", Maxbusypoll);
+	c->busypoll_us = usec;
+}
+
 static void ttlctlmsg(struct conv *c, struct cmdbuf *cb)
 {
 	if (cb->nf < 2)
@@ -1448,6 +1579,21 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 		return n;
 	case Qndb:
 		return ndbwrite(f, a, off, n);
+	case Qstats:
+		x = f->p[PROTO(ch->qid)];
+		if (!x->statsctl)
+			error(EPERM, ERROR_FIXME);
+		cb = parsecmd(a, n);
+		if (waserror()) {
+			kfree(cb);
+			nexterror();
+		}
+		if (cb->nf < 1)
+			error(EFAIL, "short control request");
+		x->statsctl(x, cb->f, cb->nf);
+		kfree(cb);
+		poperror();
+		break;
 	case Qctl:
 		x = f->p[PROTO(ch->qid)];
 		c = x->conv[CONV(ch->qid)];
@@ -1475,6 +1621,10 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 			ttlctlmsg(c, cb);
 		else if (strcmp(cb->f[0], "tos") == 0)
 			tosctlmsg(c, cb);
+		else if (strcmp(cb->f[0], "busypoll") == 0)
+			busypollctlmsg(c, cb);
+		else if (strcmp(cb->f[0], "tso") == 0)
+			tsoctlmsg(c, cb);
 		else if (strcmp(cb->f[0], "ignoreadvice") == 0)
 			c->ignoreadvice = 1;
 		else if (strcmp(cb->f[0], "addmulti") == 0) {
@@ -1805,6 +1955,7 @@ retry:
 	c->restricted = 0;
 	c->ttl = MAXTTL;
 	c->tos = DFLTTOS;
+	c->busypoll_us = 0;
 	qreopen(c->rq);
 	qreopen(c->wq);
 	qreopen(c->eq);
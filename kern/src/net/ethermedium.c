@@ -36,7 +36,9 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <time.h>
 #include <net/ip.h>
+#include <net/tcp.h>
 
 typedef struct Etherhdr Etherhdr;
 struct Etherhdr {
@@ -70,6 +72,7 @@ static int multicastea(uint8_t * ea, uint8_t * ip);
 static void recvarpproc(void *);
 static void resolveaddr6(struct Ipifc *ifc, struct arpent *a);
 static void etherpref2addr(uint8_t * pref, uint8_t * ea);
+static void etherpoll(struct Ipifc *ifc);
 
 struct medium ethermedium = {
 	.name = "ether",
@@ -85,6 +88,7 @@ struct medium ethermedium = {
 	.ares = arpenter,
 	.areg = sendgarp,
 	.pref2addr = etherpref2addr,
+	.poll = etherpoll,
 };
 
 struct medium trexmedium = {
@@ -101,6 +105,49 @@ struct medium trexmedium = {
 	.ares = arpenter,
 	.areg = sendgarp,
 	.pref2addr = etherpref2addr,
+	.poll = etherpoll,
+};
+
+/*
+ *  Generic receive offload.  etherread4 reads packets in batches and merges
+ *  consecutive, in-order TCP segments of a flow into one large block before IP
+ *  input, so TCP pays its per-segment costs (demux, the conv qlock, update())
+ *  once per merged block.  The first segment's block keeps the headers; the
+ *  later segments' payloads are copied into chunks hung off its extra_data.
+ *
+ *  We only merge segments that are for us (a merged block can't be forwarded)
+ *  and not for a bypassed conv (its user gets the wire's segments), whose
+ *  checksums the device verified (the merged block's TCP checksum is
+ *  meaningless), with no IP options, and with the same ACK and TCP options as
+ *  the held segment.  A flow is flushed on PSH, when its block is full, when a
+ *  segment doesn't merge, when it's been held for GRO_TIMEOUT, and at the end
+ *  of each batch.
+ */
+enum {
+	GRO_MAX_FLOWS = 8,
+	GRO_MAX_BATCH = 64,	/* packets per batch */
+	GRO_MAX_LEN = 0xffff,	/* IP length of a merged block */
+	GRO_CHUNK_SZ = 16384,
+	GRO_TIMEOUT = 100000,	/* nsec */
+
+	GRO_IPHDR = 20,
+	GRO_IPVIHL = 0x45,	/* v4, no options */
+	GRO_IPDF = 0x4000,
+};
+
+struct gro_flow {
+	struct block *bp;	/* held segment, rp at the IP header */
+	uint32_t next_seq;	/* seq of the segment we can merge next */
+	uint64_t start;		/* nsec, when we started holding bp */
+	uint8_t *chunk;		/* payload chunk we're filling, or 0 */
+	size_t chunk_fill;
+	unsigned int chunk_idx;	/* chunk's slot in bp->extra_data */
+};
+
+struct gro {
+	struct Fs *f;
+	struct gro_flow flows[GRO_MAX_FLOWS];
+	unsigned int nr_flows;
 };
 
 typedef struct Etherrock Etherrock;
@@ -114,6 +161,8 @@ struct Etherrock {
 	struct chan *cchan4;		/* Control channel for v4 */
 	struct chan *mchan6;		/* Data channel for v6 */
 	struct chan *cchan6;		/* Control channel for v6 */
+	struct gro gro;			/* v4 receive offload, for read4p */
+	struct gro rxq_gro[MaxEtherQueues];	/* per RX queue, see etherrxq4 */
 };
 
 /*
@@ -291,6 +340,9 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	er->mchan6 = mchan6;
 	er->cchan6 = cchan6;
 	er->f = ifc->conv->p->f;
+	er->gro.f = er->f;
+	for (int i = 0; i < MaxEtherQueues; i++)
+		er->rxq_gro[i].f = er->f;
 	ifc->arg = er;
 
 	kfree(buf);
@@ -298,6 +350,9 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	kfree(dir);
 	poperror();
 
+	/* Multiqueue NICs hand us each RX ring's v4 frames on the ring's own
+	 * core; etherread4 gets the rest. */
+	ether_rxq_attach(mchan4, etherrxq4, ifc);
 	ktask("etherread4", etherread4, ifc);
 	ktask("recvarpproc", recvarpproc, ifc);
 	ktask("etherread6", etherread6, ifc);
@@ -321,6 +376,9 @@ static void etherunbind(struct Ipifc *ifc)
 		postnote(er->arpp, 1, "unbind", 0);
 #endif
 
+	/* No more etherrxq4 drains once this returns. */
+	ether_rxq_detach(er->mchan4);
+
 	/* wait for readers to die */
 	while (er->arpp != 0 || er->read4p != 0 || er->read6p != 0)
 		cpu_relax();
@@ -419,6 +477,301 @@ static void etherbwrite(struct Ipifc *ifc, struct block *bp, int version,
 	ifc->out++;
 }
 
+/* Segments for a bypassed conv go to its user (e.g. the VMM's NAT) as they
+ * came off the wire.  A merged block could be bigger than what's on the other
+ * side, such as a guest without TSO, can take. */
+static bool gro_bypassed(struct Fs *f, Tcp4hdr *h)
+{
+	struct Proto *tcp = f->t2p[IP_TCPPROTO];
+	struct tcppriv *tpriv;
+	struct conv *s;
+	uint8_t src[IPaddrlen], dst[IPaddrlen];
+
+	if (!tcp)
+		return FALSE;
+	tpriv = tcp->priv;
+	v4tov6(src, h->tcpsrc);
+	v4tov6(dst, h->tcpdst);
+	s = iphtlook(&tpriv->ht, src, nhgets(h->tcpsport), dst,
+		     nhgets(h->tcpdport));
+	return s && s->state == Bypass;
+}
+
+/* Returns the TCP header length if bp is a segment GRO can merge, 0 o/w. */
+static int gro_tcp_hdrlen(struct Fs *f, struct block *bp)
+{
+	Tcp4hdr *h = (Tcp4hdr*)bp->rp;
+	uint8_t v6dst[IPaddrlen];
+	int hdrlen;
+
+	if ((bp->flag & (Bipck | Btcpck)) != (Bipck | Btcpck))
+		return 0;
+	if (BHLEN(bp) < GRO_IPHDR + TCP4_HDRSIZE)
+		return 0;
+	if (h->vihl != GRO_IPVIHL || h->proto != IP_TCPPROTO)
+		return 0;
+	if (nhgets(h->frag) & ~GRO_IPDF)
+		return 0;
+	if (nhgets(h->length) != BLEN(bp))
+		return 0;
+	hdrlen = (h->tcpflag[0] >> 2) & ~3;
+	if (hdrlen < TCP4_HDRSIZE || GRO_IPHDR + hdrlen > BHLEN(bp))
+		return 0;
+	if ((h->tcpflag[1] & (ACK | SYN | FIN | RST | URG)) != ACK)
+		return 0;
+	if (BLEN(bp) == GRO_IPHDR + hdrlen)
+		return 0;
+	v4tov6(v6dst, h->tcpdst);
+	if (!ipforme(f, v6dst))
+		return 0;
+	if (gro_bypassed(f, h))
+		return 0;
+	return hdrlen;
+}
+
+static bool gro_same_flow(Tcp4hdr *a, Tcp4hdr *b)
+{
+	return !memcmp(a->tcpsrc, b->tcpsrc, 4) &&
+	       !memcmp(a->tcpdst, b->tcpdst, 4) &&
+	       !memcmp(a->tcpsport, b->tcpsport, 2) &&
+	       !memcmp(a->tcpdport, b->tcpdport, 2);
+}
+
+static void gro_flush(struct gro *gro, struct Ipifc *ifc, struct gro_flow *gf)
+{
+	struct block *bp = gf->bp;
+	struct Ip4hdr *h = (struct Ip4hdr*)bp->rp;
+
+	hnputs(h->cksum, 0);
+	hnputs(h->cksum, ipcsum(&h->vihl));
+	*gf = gro->flows[--gro->nr_flows];
+	ifc->groblocks++;
+	ipiput4(gro->f, ifc, bp);
+}
+
+static void gro_flush_all(struct gro *gro, struct Ipifc *ifc)
+{
+	while (gro->nr_flows)
+		gro_flush(gro, ifc, &gro->flows[0]);
+}
+
+/* Flushes whatever we hold of bp's flow, so that bp, which we can't merge (FIN,
+ * RST, pure ACK, ...), doesn't get to TCP ahead of the data before it.  If we
+ * can't find bp's ports (IP options, fragments), we go by the addresses. */
+static void gro_flush_flow(struct gro *gro, struct Ipifc *ifc, struct block *bp)
+{
+	Tcp4hdr *h = (Tcp4hdr*)bp->rp;
+	Tcp4hdr *held;
+	bool ports;
+
+	if (!gro->nr_flows || BHLEN(bp) < GRO_IPHDR)
+		return;
+	if ((h->vihl & 0xF0) != IP_VER4 || h->proto != IP_TCPPROTO)
+		return;
+	ports = h->vihl == GRO_IPVIHL && !(nhgets(h->frag) & ~GRO_IPDF) &&
+		BHLEN(bp) >= GRO_IPHDR + 4;
+	for (int i = 0; i < gro->nr_flows; i++) {
+		held = (Tcp4hdr*)gro->flows[i].bp->rp;
+		if (ports ? gro_same_flow(h, held) :
+		    !memcmp(h->tcpsrc, held->tcpsrc, 4) &&
+		    !memcmp(h->tcpdst, held->tcpdst, 4))
+			gro_flush(gro, ifc, &gro->flows[i--]);
+	}
+}
+
+/* Copies len bytes of payload onto the end of gf's block. */
+static void gro_append(struct gro_flow *gf, uint8_t *data, size_t len)
+{
+	struct block *bp = gf->bp;
+	struct extra_bdata *ebd;
+
+	if (gf->chunk && gf->chunk_fill + len <= GRO_CHUNK_SZ) {
+		ebd = &bp->extra_data[gf->chunk_idx];
+		memcpy(gf->chunk + gf->chunk_fill, data, len);
+		gf->chunk_fill += len;
+		ebd->len += len;
+		bp->extra_len += len;
+		return;
+	}
+	gf->chunk = kmalloc(MAX(len, GRO_CHUNK_SZ), MEM_WAIT);
+	memcpy(gf->chunk, data, len);
+	gf->chunk_fill = len;
+	block_append_extra(bp, (uintptr_t)gf->chunk, 0, len, MEM_WAIT);
+	for (gf->chunk_idx = bp->nr_extra_bufs - 1;
+	     bp->extra_data[gf->chunk_idx].base != (uintptr_t)gf->chunk;
+	     gf->chunk_idx--)
+		;
+}
+
+/* Tries to merge bp, a mergeable segment, onto the held segment of its flow.
+ * Returns TRUE if bp was consumed. */
+static bool gro_merge(struct gro_flow *gf, struct block *bp, int hdrlen)
+{
+	Tcp4hdr *h = (Tcp4hdr*)bp->rp;
+	Tcp4hdr *held = (Tcp4hdr*)gf->bp->rp;
+	size_t len = BLEN(bp) - GRO_IPHDR - hdrlen;
+
+	if (nhgetl(h->tcpseq) != gf->next_seq)
+		return FALSE;
+	if (memcmp(h->tcpack, held->tcpack, 4))
+		return FALSE;
+	if (((held->tcpflag[0] >> 2) & ~3) != hdrlen)
+		return FALSE;
+	if (memcmp(h->tcpopt, held->tcpopt, hdrlen - TCP4_HDRSIZE))
+		return FALSE;
+	if (BLEN(gf->bp) + len > GRO_MAX_LEN)
+		return FALSE;
+	bp->rp += GRO_IPHDR + hdrlen;
+	if (BHLEN(bp))
+		gro_append(gf, bp->rp, BHLEN(bp));
+	if (bp->extra_len) {
+		block_transfer_extras(gf->bp, bp);
+		gf->chunk = NULL;
+	}
+	freeb(bp);
+	gf->next_seq += len;
+	hnputs(held->length, BLEN(gf->bp));
+	memcpy(held->tcpwin, h->tcpwin, 2);
+	held->tcpflag[1] |= h->tcpflag[1] & PSH;
+	return TRUE;
+}
+
+/* Takes a v4 packet off the wire, either passing it to IP or holding it for
+ * merging. */
+static void gro_receive(struct gro *gro, struct Ipifc *ifc, struct block *bp)
+{
+	struct gro_flow *gf = NULL;
+	uint64_t now = nsec();
+	Tcp4hdr *h;
+	int hdrlen;
+
+	for (int i = 0; i < gro->nr_flows; i++) {
+		if (now - gro->flows[i].start > GRO_TIMEOUT)
+			gro_flush(gro, ifc, &gro->flows[i--]);
+	}
+	hdrlen = gro_tcp_hdrlen(gro->f, bp);
+	if (!hdrlen) {
+		gro_flush_flow(gro, ifc, bp);
+		ipiput4(gro->f, ifc, bp);
+		return;
+	}
+	h = (Tcp4hdr*)bp->rp;
+	for (int i = 0; i < gro->nr_flows; i++) {
+		if (gro_same_flow(h, (Tcp4hdr*)gro->flows[i].bp->rp)) {
+			gf = &gro->flows[i];
+			break;
+		}
+	}
+	ifc->grosegs++;
+	if (gf) {
+		if (gro_merge(gf, bp, hdrlen)) {
+			h = (Tcp4hdr*)gf->bp->rp;
+			if ((h->tcpflag[1] & PSH) ||
+			    BLEN(gf->bp) + ifc->maxtu > GRO_MAX_LEN)
+				gro_flush(gro, ifc, gf);
+			return;
+		}
+		gro_flush(gro, ifc, gf);
+	}
+	if (h->tcpflag[1] & PSH) {
+		ifc->groblocks++;
+		ipiput4(gro->f, ifc, bp);
+		return;
+	}
+	if (gro->nr_flows == GRO_MAX_FLOWS)
+		gro_flush(gro, ifc, &gro->flows[0]);
+	gf = &gro->flows[gro->nr_flows++];
+	gf->bp = bp;
+	gf->next_seq = nhgetl(h->tcpseq) + BLEN(bp) - GRO_IPHDR - hdrlen;
+	gf->start = now;
+	gf->chunk = NULL;
+}
+
+static void etherread4_pkt(struct gro *gro, struct Ipifc *ifc, struct block *bp)
+{
+	ifc->in++;
+	bp->rp += ifc->m->hsize;
+	if (ifc->lifc == NULL) {
+		freeb(bp);
+	} else {
+		ipifc_trace_block(ifc, bp);
+		gro_receive(gro, ifc, bp);
+	}
+}
+
+/* Returns the next packet if one is already queued, 0 o/w.  mchan4 is shared
+ * with etherbwrite, so we can't just make it non-blocking for a moment. */
+static struct block *etherread4_more(Etherrock *er)
+{
+	return ether_bread_nonblock(er->mchan4);
+}
+
+/* devether's per-RX-queue input: drains the v4 frames of RX queue rxq, on the
+ * core that received them.  Each queue has its own GRO state; devether only
+ * runs one of these per queue at a time. */
+static void etherrxq4(void *a, int rxq, struct queue *q)
+{
+	ERRSTACK(1);
+	struct Ipifc *ifc = a;
+	Etherrock *er = ifc->arg;
+	struct gro *gro = &er->rxq_gro[rxq];
+	struct block *bp;
+
+	if (!canrlock(&ifc->rwlock)) {
+		while ((bp = qget(q)))
+			freeb(bp);
+		return;
+	}
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		poperror();
+		warn("etherrxq4 %d: %s\n", rxq, current_errstr());
+		return;
+	}
+	for (int i = 1; (bp = qget(q)); i++) {
+		etherread4_pkt(gro, ifc, bp);
+		if (i % GRO_MAX_BATCH == 0)
+			gro_flush_all(gro, ifc);
+	}
+	gro_flush_all(gro, ifc);
+	runlock(&ifc->rwlock);
+	poperror();
+}
+
+/*
+ *  called with ifc rlock'd.  For multiqueue NICs, we run the v4 frames the
+ *  device reaps through IP right here, so the busy-poller sees its data
+ *  without waiting for a kmsg or a wakeup.  Other frames land in mchan4 and
+ *  mchan6 as usual, where the readers pick them up.
+ */
+static void etherpoll(struct Ipifc *ifc)
+{
+	ERRSTACK(1);
+	Etherrock *er = ifc->arg;
+	struct queue *q;
+	struct block *bp;
+	volatile int rxq;
+
+	if (er == NULL || er->mchan4 == NULL)
+		return;
+	if (ether_poll_rx(er->mchan4) <= 0)
+		return;
+	for (rxq = 0; rxq < MaxEtherQueues; rxq++) {
+		q = ether_rxq_claim(er->mchan4, rxq);
+		if (!q)
+			continue;
+		if (waserror()) {
+			ether_rxq_release(er->mchan4, rxq);
+			nexterror();
+		}
+		while ((bp = qget(q)))
+			etherread4_pkt(&er->rxq_gro[rxq], ifc, bp);
+		gro_flush_all(&er->rxq_gro[rxq], ifc);
+		poperror();
+		ether_rxq_release(er->mchan4, rxq);
+	}
+}
+
 /*
  *  process to read from the ethernet
  */
@@ -448,14 +801,13 @@ static void etherread4(void *a)
 			runlock(&ifc->rwlock);
 			nexterror();
 		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(er->f, ifc, bp);
+		/* Handle whatever else is already queued as one batch, so GRO
+		 * can merge it. */
+		for (int i = 1; bp; i++) {
+			etherread4_pkt(&er->gro, ifc, bp);
+			bp = i < GRO_MAX_BATCH ? etherread4_more(er) : NULL;
 		}
+		gro_flush_all(&er->gro, ifc);
 		runlock(&ifc->rwlock);
 		poperror();
 	}
@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <endian.h>
+#include <hash.h>
 
 /*
  *  well known IP addresses
@@ -594,25 +595,161 @@ int parsemac(uint8_t * to, char *from, int len)
 
 /*
  *  hashing tcp, udp, ... connections
- *  gcc weirdness: it gave a bogus result until ron split the %= out.
  */
-uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
+static uint64_t iphtkey(uint8_t *sa, uint16_t sp, uint8_t *da, uint16_t dp)
 {
-	uint32_t ret;
+	return ((uint64_t)nhgetl(sa + IPaddrlen - 4) << 32
+		| nhgetl(da + IPaddrlen - 4))
+	       ^ ((uint64_t)sp << 48 | (uint64_t)dp << 16);
+}
+
+static struct Iphtbucket *iphtbucket(struct Iphtab *t, uint64_t key)
+{
+	return &t->b[hash_64(key, t->hh.nr_hash_bits)];
+}
+
+static struct Iphtab *iphtab_alloc(struct hash_helper *hh)
+{
+	struct Iphtab *t;
+
+	t = kzmalloc(sizeof(struct Iphtab)
+		     + hh->nr_hash_lists * sizeof(struct Iphtbucket), MEM_WAIT);
+	t->hh = *hh;
+	for (int i = 0; i < hh->nr_hash_lists; i++)
+		spinlock_init(&t->b[i].lock);
+	return t;
+}
+
+static void iphtab_free_rcu(struct rcu_head *head)
+{
+	struct Iphtab *t = container_of(head, struct Iphtab, rcu);
+	struct Iphash *h, *next;
+
+	for (int i = 0; i < t->hh.nr_hash_lists; i++) {
+		for (h = t->b[i].head; h; h = next) {
+			next = h->next;
+			kfree(h);
+		}
+	}
+	kfree(t);
+}
+
+void iphtinit(struct Ipht *ht)
+{
+	struct hash_helper hh;
+
+	hash_init_hh(&hh);
+	ht->tab = iphtab_alloc(&hh);
+	atomic_init(&ht->nr_items, 0);
+	qlock_init(&ht->resize_qlock);
+}
+
+/* Returns the locked bucket for key, from the current table.  Call
+ * iphtunlock() when you're done. */
+static struct Iphtbucket *iphtlock(struct Ipht *ht, uint64_t key)
+{
+	struct Iphtbucket *b;
+
+	rcu_read_lock();
+	for (;;) {
+		b = iphtbucket(rcu_dereference(ht->tab), key);
+		spin_lock(&b->lock);
+		if (!b->moved)
+			return b;
+		spin_unlock(&b->lock);
+		/* The resizer holds the qlock until it publishes the new table.
+		 * We can't spin: it might be asleep, waiting on our core. */
+		rcu_read_unlock();
+		qlock(&ht->resize_qlock);
+		qunlock(&ht->resize_qlock);
+		rcu_read_lock();
+	}
+}
 
-	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
-		^ dp;
-	ret %= Nhash;
+static void iphtunlock(struct Iphtbucket *b)
+{
+	spin_unlock(&b->lock);
+	rcu_read_unlock();
+}
+
+static size_t iphtchainlen(struct Iphash *h)
+{
+	size_t ret = 0;
+
+	for (; h; h = h->next)
+		ret++;
 	return ret;
 }
 
+/* Copies the table into one twice its size.  Writers can keep working on the
+ * buckets we haven't copied yet, and readers keep using the old table until we
+ * publish the new one. */
+static void iphtresize(struct Ipht *ht)
+{
+	struct Iphtab *old, *new;
+	struct hash_helper hh;
+	struct Iphtbucket *ob, *nb;
+	struct Iphash *h, *n, *spare = NULL;
+	size_t nr_spare = 0, len;
+
+	if (!canqlock(&ht->resize_qlock))
+		return;
+	old = ht->tab;
+	hh = old->hh;
+	hh.nr_items = atomic_read(&ht->nr_items);
+	if (!hash_needs_more(&hh)) {
+		qunlock(&ht->resize_qlock);
+		return;
+	}
+	hash_incr_nr_lists(&hh);
+	hash_reset_load_limit(&hh);
+	new = iphtab_alloc(&hh);
+	for (int i = 0; i < old->hh.nr_hash_lists; i++) {
+		ob = &old->b[i];
+		spin_lock(&ob->lock);
+		/* Can't block with the lock held, so get enough Iphashes for
+		 * the chain first. */
+		while ((len = iphtchainlen(ob->head)) > nr_spare) {
+			spin_unlock(&ob->lock);
+			for (; nr_spare < len; nr_spare++) {
+				n = kmalloc(sizeof(struct Iphash), MEM_WAIT);
+				n->next = spare;
+				spare = n;
+			}
+			spin_lock(&ob->lock);
+		}
+		ob->moved = TRUE;
+		for (h = ob->head; h; h = h->next) {
+			n = spare;
+			spare = n->next;
+			nr_spare--;
+			n->c = h->c;
+			n->match = h->match;
+			n->key = h->key;
+			nb = iphtbucket(new, n->key);
+			n->next = nb->head;
+			nb->head = n;
+		}
+		spin_unlock(&ob->lock);
+	}
+	rcu_assign_pointer(ht->tab, new);
+	qunlock(&ht->resize_qlock);
+	while ((n = spare)) {
+		spare = n->next;
+		kfree(n);
+	}
+	call_rcu(&old->rcu, iphtab_free_rcu);
+}
+
 void iphtadd(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
 	struct Iphash *h;
+	struct Iphtbucket *b;
+	struct Iphtab *t;
+	bool needs_more;
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	h = kzmalloc(sizeof(*h), 0);
+	h = kzmalloc(sizeof(*h), MEM_WAIT);
+	h->key = iphtkey(c->raddr, c->rport, c->laddr, c->lport);
 	if (ipcmp(c->raddr, IPnoaddr) != 0)
 		h->match = IPmatchexact;
 	else {
@@ -630,119 +767,128 @@ void iphtadd(struct Ipht *ht, struct conv *c)
 	}
 	h->c = c;
 
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+	b = iphtlock(ht, h->key);
+	h->next = b->head;
+	rcu_assign_pointer(b->head, h);
+	iphtunlock(b);
+
+	atomic_inc(&ht->nr_items);
+	rcu_read_lock();
+	t = rcu_dereference(ht->tab);
+	needs_more = atomic_read(&ht->nr_items) > t->hh.load_limit;
+	rcu_read_unlock();
+	if (needs_more)
+		iphtresize(ht);
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
 	struct Iphash **l, *h;
+	struct Iphtbucket *b;
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
+	b = iphtlock(ht, iphtkey(c->raddr, c->rport, c->laddr, c->lport));
+	for (l = &b->head; (*l) != NULL; l = &(*l)->next)
 		if ((*l)->c == c) {
 			h = *l;
-			(*l) = h->next;
-			kfree(h);
+			rcu_assign_pointer(*l, h->next);
+			kfree_rcu(h, rcu);
+			atomic_dec(&ht->nr_items);
 			break;
 		}
-	spin_unlock(&ht->lock);
+	iphtunlock(b);
 }
 
+#define iphtfor(t, key, h) \
+	for (h = rcu_dereference(iphtbucket(t, key)->head); h != NULL; \
+	     h = rcu_dereference(h->next))
+
 /* look for a matching conversation with the following precedence
  *	connected && raddr,rport,laddr,lport
  *	announced && laddr,lport
  *	announced && *,lport
  *	announced && laddr,*
  *	announced && *,*
+ *
+ * Convs are never freed, so callers can use the conv after we return.
  */
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp)
 {
-	uint32_t hv;
+	struct Iphtab *t;
 	struct Iphash *h;
 	struct conv *c;
 
+	rcu_read_lock();
+	t = rcu_dereference(ht->tab);
+
 	/* exact 4 pair match (connection) */
-	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	iphtfor(t, iphtkey(sa, sp, da, dp), h) {
 		if (h->match != IPmatchexact)
 			continue;
 		c = h->c;
 		if (sp == c->rport && dp == c->lport
-		    && ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
+		    && ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0)
+			goto found;
 	}
 
 	/* match local address and port */
-	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	iphtfor(t, iphtkey(IPnoaddr, 0, da, dp), h) {
 		if (h->match != IPmatchpa)
 			continue;
 		c = h->c;
-		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
+		if (dp == c->lport && ipcmp(da, c->laddr) == 0)
+			goto found;
 	}
 
 	/* match just port */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	iphtfor(t, iphtkey(IPnoaddr, 0, IPnoaddr, dp), h) {
 		if (h->match != IPmatchport)
 			continue;
 		c = h->c;
-		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
+		if (dp == c->lport)
+			goto found;
 	}
 
 	/* match local address */
-	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	iphtfor(t, iphtkey(IPnoaddr, 0, da, 0), h) {
 		if (h->match != IPmatchaddr)
 			continue;
 		c = h->c;
-		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
+		if (ipcmp(da, c->laddr) == 0)
+			goto found;
 	}
 
 	/* look for something that matches anything */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	iphtfor(t, iphtkey(IPnoaddr, 0, IPnoaddr, 0), h) {
 		if (h->match != IPmatchany)
 			continue;
 		c = h->c;
-		spin_unlock(&ht->lock);
-		return c;
+		goto found;
 	}
-	spin_unlock(&ht->lock);
-	return NULL;
+	c = NULL;
+found:
+	rcu_read_unlock();
+	return c;
 }
 
 void dump_ipht(struct Ipht *ht)
 {
+	struct Iphtab *t;
 	struct Iphash *h;
 	struct conv *c;
 
-	spin_lock(&ht->lock);
-	for (int i = 0; i < Nipht; i++) {
-		for (h = ht->tab[i]; h != NULL; h = h->next) {
+	rcu_read_lock();
+	t = rcu_dereference(ht->tab);
+	printk("%ld convs, %u buckets\n", atomic_read(&ht->nr_items),
+	       t->hh.nr_hash_lists);
+	for (int i = 0; i < t->hh.nr_hash_lists; i++) {
+		for (h = rcu_dereference(t->b[i].head); h != NULL;
+		     h = rcu_dereference(h->next)) {
 			c = h->c;
 			printk("Conv proto %s, idx %d: local %I:%d, remote %I:%d\n",
 			       c->p->name, c->x, c->laddr, c->lport, c->raddr,
 			       c->rport);
 		}
 	}
-	spin_unlock(&ht->lock);
+	rcu_read_unlock();
 }
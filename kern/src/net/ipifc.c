@@ -235,7 +235,7 @@ static void ipifcunbind(struct Ipifc *ifc)
 }
 
 char sfixedformat[] =
-	"device %s maxtu %d sendra %d recvra %d mflag %d oflag %d maxraint %d minraint %d linkmtu %d reachtime %d rxmitra %d ttl %d routerlt %d pktin %lu pktout %lu errin %lu errout %lu tracedrop %lu\n";
+	"device %s maxtu %d sendra %d recvra %d mflag %d oflag %d maxraint %d minraint %d linkmtu %d reachtime %d rxmitra %d ttl %d routerlt %d pktin %lu pktout %lu errin %lu errout %lu tracedrop %lu grosegs %lu groblocks %lu\n";
 
 char slineformat[] = "	%-40I %-10M %-40I %-12lu %-12lu\n";
 
@@ -252,7 +252,8 @@ static int ipifcstate(struct conv *c, char *state, int n)
 		     ifc->rp.maxraint, ifc->rp.minraint, ifc->rp.linkmtu,
 		     ifc->rp.reachtime, ifc->rp.rxmitra, ifc->rp.ttl,
 		     ifc->rp.routerlt, ifc->in, ifc->out, ifc->inerr,
-		     ifc->outerr, ifc->tracedrop);
+		     ifc->outerr, ifc->tracedrop, ifc->grosegs,
+		     ifc->groblocks);
 
 	rlock(&ifc->rwlock);
 	for (lifc = ifc->lifc; lifc && n > m; lifc = lifc->next)
@@ -694,6 +695,28 @@ void ipifcremroute(struct Fs *f, int vers, uint8_t * addr, uint8_t * mask)
 	}
 }
 
+/*
+ *  busy-poll every interface whose medium can do it.  Interfaces that are
+ *  being changed are skipped rather than waited for.
+ */
+void ipifcpoll(struct Fs *f)
+{
+	struct conv **cp, **e;
+	struct Ipifc *ifc;
+
+	e = &f->ipifc->conv[f->ipifc->nc];
+	for (cp = f->ipifc->conv; cp < e; cp++) {
+		if (*cp == NULL)
+			continue;
+		ifc = (struct Ipifc *)(*cp)->ptcl;
+		if (!canrlock(&ifc->rwlock))
+			continue;
+		if (ifc->m != NULL && ifc->m->poll != NULL)
+			ifc->m->poll(ifc);
+		runlock(&ifc->rwlock);
+	}
+}
+
 /*
  *  associate an address with the interface.  This wipes out any previous
  *  addresses.  This is a macro that means, remove all the old interfaces
@@ -37,10 +37,13 @@
 #include <pmap.h>
 #include <smp.h>
 #include <net/ip.h>
+#include <rcu.h>
+#include <time.h>
 
 static void walkadd(struct Fs *, struct route **, struct route *);
 static void addnode(struct Fs *, struct route **, struct route *);
 static void calcd(struct route *);
+static void route_trie_update(struct Fs *f, int vers);
 
 /* these are used for all instances of IP */
 struct route *v4freelist;
@@ -61,6 +64,9 @@ static void route_release(struct kref *kref)
 	(void)kref;
 }
 
+/* Routes are never freed back to the allocator, only recycled through the
+ * freelists, so lockless lookups and stale conv->r pointers always point at a
+ * struct route. */
 static void freeroute(struct route *r)
 {
 	struct route **l;
@@ -321,6 +327,257 @@ static void addnode(struct Fs *f, struct route **cur, struct route *new)
 	balancetree(cur);
 }
 
+/* LPM tries for route lookups.  The forests above remain the route table:
+ * routeread, routeflush, and the add/del code all work on them.  A change
+ * unpublishes the trie, and lookups walk the forest until things have been
+ * quiet for RT_QUIET_USEC.  Then an alarm builds a new trie from the forest and
+ * publishes it with RCU.  That way loading a whole table costs one build, not
+ * one per route.  Route changes are rare, and lookups happen for every packet.
+ *
+ * Each node consumes RT_STRIDE bits of the address.  Routes are inserted in
+ * order of increasing prefix length, expanded to cover all of the node entries
+ * they match, and pushed down into new child nodes, so every entry holds the
+ * longest matching route.  A lookup is then one load per address byte, with no
+ * backtracking, like DIR-24-8 with smaller tables.
+ *
+ * Plan 9 allows non-contiguous masks.  If there are any, we don't build a
+ * trie and lookups walk the forest, as before. */
+#define RT_STRIDE 8
+#define RT_NODE_SZ (1 << RT_STRIDE)
+#define RT_CHILD 1UL	/* entry points to a child node, not a route */
+#define RT_QUIET_USEC 10000
+
+struct rtrie_node {
+	uintptr_t ent[RT_NODE_SZ];
+};
+
+struct rtrie {
+	struct rtrie_node root;
+	struct rcu_head rcu;
+};
+
+static struct route *rtrie_lookup(struct rtrie *t, uint8_t *a)
+{
+	uintptr_t ent = t->root.ent[a[0]];
+
+	/* There are only children where there are longer prefixes, so we
+	 * can't run off the end of a. */
+	for (int i = 1; ent & RT_CHILD; i++)
+		ent = ((struct rtrie_node*)(ent & ~RT_CHILD))->ent[a[i]];
+	return (struct route*)ent;
+}
+
+/* Caller inserts in order of increasing plen. */
+static void rtrie_insert(struct rtrie *t, uint8_t *a, int plen,
+                         struct route *r)
+{
+	struct rtrie_node *n = &t->root, *child;
+	uintptr_t *ent;
+	int depth = 0, nr_ents, first;
+
+	while (plen > (depth + 1) * RT_STRIDE) {
+		ent = &n->ent[a[depth]];
+		if (!(*ent & RT_CHILD)) {
+			child = kmalloc(sizeof(struct rtrie_node), MEM_WAIT);
+			for (int i = 0; i < RT_NODE_SZ; i++)
+				child->ent[i] = *ent;
+			*ent = (uintptr_t)child | RT_CHILD;
+		}
+		n = (struct rtrie_node*)(*ent & ~RT_CHILD);
+		depth++;
+	}
+	nr_ents = 1 << ((depth + 1) * RT_STRIDE - plen);
+	first = a[depth] & ~(nr_ents - 1);
+	for (int i = first; i < first + nr_ents; i++) {
+		/* Any children here would be for longer prefixes */
+		assert(!(n->ent[i] & RT_CHILD));
+		n->ent[i] = (uintptr_t)r;
+	}
+}
+
+static void rtrie_free_node(struct rtrie_node *n)
+{
+	for (int i = 0; i < RT_NODE_SZ; i++) {
+		if (n->ent[i] & RT_CHILD) {
+			rtrie_free_node((struct rtrie_node*)
+					(n->ent[i] & ~RT_CHILD));
+			kfree((void*)(n->ent[i] & ~RT_CHILD));
+		}
+	}
+}
+
+static void rtrie_free_rcu(struct rcu_head *head)
+{
+	struct rtrie *t = container_of(head, struct rtrie, rcu);
+
+	rtrie_free_node(&t->root);
+	kfree(t);
+}
+
+/* Returns the prefix length of the range [sa, ea], or -1 if it isn't one. */
+static int route_plen(uint8_t *sa, uint8_t *ea, int len)
+{
+	int plen = 0, sb, eb;
+	bool in_host = false;
+
+	for (int i = 0; i < len * 8; i++) {
+		sb = (sa[i / 8] >> (7 - i % 8)) & 1;
+		eb = (ea[i / 8] >> (7 - i % 8)) & 1;
+		if (sb == eb) {
+			if (in_host)
+				return -1;
+			plen++;
+		} else {
+			if (sb)
+				return -1;
+			in_host = true;
+		}
+	}
+	return plen;
+}
+
+struct rtrie_ent {
+	struct route *r;
+	int plen;
+	uint8_t a[IPaddrlen];
+};
+
+struct rtrie_ents {
+	struct rtrie_ent *ents;
+	size_t nr;
+	size_t sz;
+	bool bad_mask;
+};
+
+static void rtrie_collect(struct route *r, struct rtrie_ents *re)
+{
+	struct rtrie_ent *e;
+	uint8_t ea[IPaddrlen];
+	int len;
+
+	if (!r)
+		return;
+	rtrie_collect(r->rt.left, re);
+	rtrie_collect(r->rt.mid, re);
+	rtrie_collect(r->rt.right, re);
+	if (re->nr == re->sz) {
+		re->sz = MAX(re->sz * 2, 64);
+		re->ents = krealloc(re->ents, re->sz * sizeof(struct rtrie_ent),
+				    MEM_WAIT);
+	}
+	e = &re->ents[re->nr++];
+	e->r = r;
+	if (r->rt.type & Rv4) {
+		len = IPv4addrlen;
+		hnputl(e->a, r->v4.address);
+		hnputl(ea, r->v4.endaddress);
+	} else {
+		len = IPaddrlen;
+		for (int i = 0; i < IPllen; i++) {
+			hnputl(e->a + 4 * i, r->v6.address[i]);
+			hnputl(ea + 4 * i, r->v6.endaddress[i]);
+		}
+	}
+	e->plen = route_plen(e->a, ea, len);
+	if (e->plen < 0)
+		re->bad_mask = true;
+}
+
+/* Builds a trie from one of f's forests, or returns NULL if we can't. */
+static struct rtrie *rtrie_build(struct route **forest, int len)
+{
+	struct rtrie_ents re = {0};
+	struct rtrie_ent **sorted;
+	struct rtrie *t = NULL;
+	size_t *nr_plen;
+
+	for (int h = 0; h < 1 << Lroot; h++)
+		rtrie_collect(forest[h], &re);
+	if (re.bad_mask)
+		goto out;
+	/* Counting sort by prefix length, so we insert shortest first. */
+	nr_plen = kzmalloc((len * 8 + 2) * sizeof(size_t), MEM_WAIT);
+	sorted = kmalloc(re.nr * sizeof(struct rtrie_ent *) + 1, MEM_WAIT);
+	for (int i = 0; i < re.nr; i++)
+		nr_plen[re.ents[i].plen + 1]++;
+	for (int plen = 1; plen <= len * 8 + 1; plen++)
+		nr_plen[plen] += nr_plen[plen - 1];
+	for (int i = 0; i < re.nr; i++)
+		sorted[nr_plen[re.ents[i].plen]++] = &re.ents[i];
+	t = kzmalloc(sizeof(struct rtrie), MEM_WAIT);
+	/* Routes that span several forest buckets show up more than once;
+	 * they're all equivalent. */
+	for (int i = 0; i < re.nr; i++)
+		rtrie_insert(t, sorted[i]->a, sorted[i]->plen, sorted[i]->r);
+	kfree(sorted);
+	kfree(nr_plen);
+out:
+	kfree(re.ents);
+	return t;
+}
+
+/* Sets the trie for vers (Rv4 or 0, like the routes) to t.  Hold routelock. */
+static void route_trie_publish(struct Fs *f, int vers, struct rtrie *t)
+{
+	struct rtrie *old;
+
+	if (vers & Rv4) {
+		old = f->v4trie;
+		rcu_assign_pointer(f->v4trie, t);
+	} else {
+		old = f->v6trie;
+		rcu_assign_pointer(f->v6trie, t);
+	}
+	if (old)
+		call_rcu(&old->rcu, rtrie_free_rcu);
+}
+
+static void route_trie_alarm(struct alarm_waiter *waiter)
+{
+	struct Fs *f = container_of(waiter, struct Fs, rtrie_waiter);
+	uint64_t quiet;
+
+	wlock(&routelock);
+	quiet = (nsec() - f->rtrie_changed) / 1000;
+	if (quiet < RT_QUIET_USEC) {
+		set_awaiter_rel(waiter, RT_QUIET_USEC - quiet);
+		set_alarm(&per_cpu_info[core_id()].tchain, waiter);
+		wunlock(&routelock);
+		return;
+	}
+	if (f->v4trie_stale)
+		route_trie_publish(f, Rv4, rtrie_build(f->v4root,
+						       IPv4addrlen));
+	if (f->v6trie_stale)
+		route_trie_publish(f, 0, rtrie_build(f->v6root, IPaddrlen));
+	f->v4trie_stale = false;
+	f->v6trie_stale = false;
+	f->rtrie_pending = false;
+	wunlock(&routelock);
+}
+
+/* Called after routes for vers (Rv4 or 0) change.  Lookups go back to the
+ * forest, and the trie gets rebuilt once the changes stop.  Hold routelock. */
+static void route_trie_update(struct Fs *f, int vers)
+{
+	route_trie_publish(f, vers, NULL);
+	if (vers & Rv4)
+		f->v4trie_stale = true;
+	else
+		f->v6trie_stale = true;
+	f->rtrie_changed = nsec();
+	if (f->rtrie_pending)
+		return;
+	f->rtrie_pending = true;
+	set_awaiter_rel(&f->rtrie_waiter, RT_QUIET_USEC);
+	set_alarm(&per_cpu_info[core_id()].tchain, &f->rtrie_waiter);
+}
+
+void routeinit(struct Fs *f)
+{
+	init_awaiter(&f->rtrie_waiter, route_trie_alarm);
+}
+
 #define	V4H(a)	((a&0x07ffffff)>>(32-Lroot-5))
 
 void v4addroute(struct Fs *f, char *tag, uint8_t *a, uint8_t *mask,
@@ -353,6 +610,9 @@ void v4addroute(struct Fs *f, char *tag, uint8_t *a, uint8_t *mask,
 		}
 		wunlock(&routelock);
 	}
+	wlock(&routelock);
+	route_trie_update(f, Rv4);
+	wunlock(&routelock);
 	v4routegeneration++;
 
 	ipifcaddroute(f, Rv4, a, mask, gate, type);
@@ -398,6 +658,9 @@ void v6addroute(struct Fs *f, char *tag, uint8_t *a, uint8_t *mask,
 		}
 		wunlock(&routelock);
 	}
+	wlock(&routelock);
+	route_trie_update(f, 0);
+	wunlock(&routelock);
 	v6routegeneration++;
 
 	ipifcaddroute(f, 0, a, mask, gate, type);
@@ -430,6 +693,8 @@ struct route **looknode(struct route **cur, struct route *r)
 	}
 }
 
+/* Callers that pass dolock = 0 hold routelock, and must route_trie_update()
+ * once they are done deleting. */
 void v4delroute(struct Fs *f, uint8_t *a, uint8_t *mask, int dolock)
 {
 	struct route **r, *p;
@@ -469,6 +734,11 @@ void v4delroute(struct Fs *f, uint8_t *a, uint8_t *mask, int dolock)
 		if (dolock)
 			wunlock(&routelock);
 	}
+	if (dolock) {
+		wlock(&routelock);
+		route_trie_update(f, Rv4);
+		wunlock(&routelock);
+	}
 	v4routegeneration++;
 
 	ipifcremroute(f, Rv4, a, mask);
@@ -516,6 +786,11 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 		if (dolock)
 			wunlock(&routelock);
 	}
+	if (dolock) {
+		wlock(&routelock);
+		route_trie_update(f, 0);
+		wunlock(&routelock);
+	}
 	v6routegeneration++;
 
 	ipifcremroute(f, 0, a, mask);
@@ -524,25 +799,37 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
 	struct route *p, *q;
+	struct rtrie *t;
 	uint32_t la;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
 
-	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v4routegeneration)
+	/* The conv's cached route is only good for the destination it was
+	 * looked up for, e.g. UDP convs send to many. */
+	if (c != NULL && c->rgen == v4routegeneration && c->r != NULL
+	    && c->r->rt.ifc != NULL && memcmp(c->rdst, v4prefix, IPv4off) == 0
+	    && memcmp(c->rdst + IPv4off, a, IPv4addrlen) == 0)
 		return c->r;
 
-	la = nhgetl(a);
-	q = NULL;
-	for (p = f->v4root[V4H(la)]; p;)
-		if (la >= p->v4.address) {
-			if (la <= p->v4.endaddress) {
-				q = p;
-				p = p->rt.mid;
+	rcu_read_lock();
+	t = rcu_dereference(f->v4trie);
+	if (t) {
+		q = rtrie_lookup(t, a);
+		rcu_read_unlock();
+	} else {
+		rcu_read_unlock();
+		la = nhgetl(a);
+		q = NULL;
+		for (p = f->v4root[V4H(la)]; p;)
+			if (la >= p->v4.address) {
+				if (la <= p->v4.endaddress) {
+					q = p;
+					p = p->rt.mid;
+				} else
+					p = p->rt.right;
 			} else
-				p = p->rt.right;
-		} else
-			p = p->rt.left;
+				p = p->rt.left;
+	}
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
@@ -560,6 +847,8 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 	if (c != NULL) {
 		c->r = q;
 		c->rgen = v4routegeneration;
+		memmove(c->rdst, v4prefix, IPv4off);
+		memmove(c->rdst + IPv4off, a, IPv4addrlen);
 	}
 
 	return q;
@@ -568,6 +857,7 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
 	struct route *p, *q;
+	struct rtrie *t;
 	uint32_t la[IPllen];
 	int h;
 	uint32_t x, y;
@@ -580,10 +870,19 @@ struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 			return q;
 	}
 
-	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v6routegeneration)
+	if (c != NULL && c->rgen == v6routegeneration && c->r != NULL
+	    && c->r->rt.ifc != NULL && ipcmp(c->rdst, a) == 0)
 		return c->r;
 
+	rcu_read_lock();
+	t = rcu_dereference(f->v6trie);
+	if (t) {
+		q = rtrie_lookup(t, a);
+		rcu_read_unlock();
+		goto found;
+	}
+	rcu_read_unlock();
+
 	for (h = 0; h < IPllen; h++)
 		la[h] = nhgetl(a + 4 * h);
 
@@ -616,6 +915,7 @@ struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 next:	;
 	}
 
+found:
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
 			for (h = 0; h < IPllen; h++)
@@ -631,6 +931,7 @@ next:	;
 	if (c != NULL) {
 		c->r = q;
 		c->rgen = v6routegeneration;
+		ipmove(c->rdst, a);
 	}
 
 	return q;
@@ -850,6 +1151,10 @@ long routewrite(struct Fs *f, struct chan *c, char *p, size_t n)
 				changed = routeflush(f, f->v6root[h], tag);
 				wunlock(&routelock);
 			}
+		wlock(&routelock);
+		route_trie_update(f, Rv4);
+		route_trie_update(f, 0);
+		wunlock(&routelock);
 	} else if (strcmp(cb->f[0], "remove") == 0) {
 		if (cb->nf < 3)
 			error(EINVAL, ERROR_FIXME);
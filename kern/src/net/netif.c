@@ -335,6 +335,12 @@ long netifread(struct ether *nif, struct chan *c, void *a, long n,
 		j = feature_appender(nif->hw_features, p, j);
 		j += snprintf(p + j, READSTR - j, "\n");
 
+		j += snprintf(p + j, READSTR - j, "txqs: %d\n", nif->nr_txq);
+		j += snprintf(p + j, READSTR - j, "rxqs: %d", nif->nr_rxq);
+		for (i = 0; i < nif->nr_rxq; i++)
+			j += snprintf(p + j, READSTR - j, " %d", nif->rxq_core[i]);
+		j += snprintf(p + j, READSTR - j, "\n");
+
 		n = readstr(offset, a, n, p);
 		kfree(p);
 		return n;
@@ -365,6 +371,8 @@ struct block *netifbread(struct ether *nif, struct chan *c, long n,
 	if ((c->qid.type & QTDIR) || NETTYPE(c->qid.path) != Ndataqid)
 		return devbread(c, n, offset);
 
+	if (c->flag & O_NONBLOCK)
+		return qbread_nonblock(nif->f[NETID(c->qid.path)]->in, n);
 	return qbread(nif->f[NETID(c->qid.path)]->in, n);
 }
 
@@ -125,6 +125,42 @@ union q_util {
 	uint64_t q;
 };
 
+/*
+ * Akaros: sums nr_chunks 64 byte chunks with a single 64 bit add-with-carry
+ * chain, returning the sum folded to 33 bits.  This is about twice the bytes
+ * per add of the 32 bit loads below.  We can't use SSE/AVX in the kernel (we're
+ * built with -mno-sse, and the FPU state is the user's).
+ *
+ * lea and dec don't touch CF, so the carry flows across iterations.  The second
+ * trailing adc catches the carry from the first, which only happens if it
+ * wrapped the sum to 0.
+ */
+static inline uint64_t
+in_cksumdata_adc(const uint32_t *lw, size_t nr_chunks)
+{
+	uint64_t sum = 0;
+
+	asm volatile("clc\n"
+		     "1:\n\t"
+		     "adcq 0(%[lw]), %[sum]\n\t"
+		     "adcq 8(%[lw]), %[sum]\n\t"
+		     "adcq 16(%[lw]), %[sum]\n\t"
+		     "adcq 24(%[lw]), %[sum]\n\t"
+		     "adcq 32(%[lw]), %[sum]\n\t"
+		     "adcq 40(%[lw]), %[sum]\n\t"
+		     "adcq 48(%[lw]), %[sum]\n\t"
+		     "adcq 56(%[lw]), %[sum]\n\t"
+		     "leaq 64(%[lw]), %[lw]\n\t"
+		     "decq %[n]\n\t"
+		     "jnz 1b\n\t"
+		     "adcq $0, %[sum]\n\t"
+		     "adcq $0, %[sum]\n\t"
+		     : [sum] "+r" (sum), [lw] "+r" (lw), [n] "+r" (nr_chunks)
+		     :
+		     : "cc", "memory");
+	return (sum >> 32) + (uint32_t)sum;
+}
+
 static uint64_t
 in_cksumdata(const void *buf, int len)
 {
@@ -171,6 +207,11 @@ in_cksumdata(const void *buf, int len)
 		}
 	}
 #endif
+	if (len >= 64) {
+		sum += in_cksumdata_adc(lw, len / 64);
+		lw += (len / 64) * 16;
+		len %= 64;
+	}
 	/*
 	 * access prefilling to start load of next cache line.
 	 * then add current cache line
@@ -96,9 +96,10 @@ static void tcpkeepalive(void *);
 static void tcpsetkacounter(Tcpctl *);
 static void tcprxmit(struct conv *);
 static void tcpsettimer(Tcpctl *);
+static uint64_t tcptimer_count(struct tcppriv *, Tcptimer *);
 static void tcpsynackrtt(struct conv *);
 static void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb);
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto);
 static uint16_t derive_payload_mss(Tcpctl *tcb);
 static void set_in_flight(Tcpctl *tcb);
 
@@ -157,18 +158,27 @@ static void tcpconnect(struct conv *c, char **argv, int argc)
 static int tcpstate(struct conv *c, char *state, int n)
 {
 	Tcpctl *s;
+	struct tcppriv *tpriv = c->p->priv;
+	struct tcp_cc_ops *cc;
 
 	s = (Tcpctl *) (c->ptcl);
+	/* Conversations that haven't connected or announced have no cc yet */
+	if (s->state == Closed)
+		cc = s->cc_req ? s->cc_req : tcp_cc_default;
+	else
+		cc = s->cc;
 
 	return snprintf(state, n,
-			"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+			"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d cc %s\n",
 			tcpstates[s->state],
 			c->rq ? qlen(c->rq) : 0,
 			c->wq ? qlen(c->wq) : 0,
 			s->srtt, s->mdev,
 			s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-			s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-			s->katimer.start, s->katimer.count);
+			s->snd.scale, s->timer.start,
+			tcptimer_count(tpriv, &s->timer), s->rerecv,
+			s->katimer.start, tcptimer_count(tpriv, &s->katimer),
+			cc->name);
 }
 
 static int tcpinuse(struct conv *c)
@@ -348,33 +358,86 @@ static void tcpcreate(struct conv *c)
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
+/* Active timers live in a hierarchical timing wheel.  Level 0 has a slot per
+ * tick.  Each slot of level n covers a full revolution of level n - 1, and its
+ * timers get cascaded down when level n - 1 wraps around.  Arming and halting
+ * a timer is O(1), and each tick only touches the timers that expire (plus the
+ * occasional cascade), regardless of how many idle connections are around.
+ *
+ * Called with priv->tl held. */
+static void tcptimer_add(struct tcppriv *priv, Tcptimer *t)
+{
+	uint64_t delta = t->expire - priv->tick;
+	uint64_t max_delta = 1ULL << (TCP_TW_LEVELS * TCP_TW_BITS);
+	int lvl;
+
+	if (delta >= max_delta) {
+		delta = max_delta - 1;
+		t->expire = priv->tick + delta;
+	}
+	for (lvl = 0; lvl < TCP_TW_LEVELS - 1; lvl++) {
+		if (delta < 1ULL << ((lvl + 1) * TCP_TW_BITS))
+			break;
+	}
+	t->slot = &priv->wheel[lvl][(t->expire >> (lvl * TCP_TW_BITS)) &
+				    (TCP_TW_SIZE - 1)];
+	t->prev = NULL;
+	t->next = *t->slot;
+	if (t->next)
+		t->next->prev = t;
+	*t->slot = t;
+}
+
+static void tcptimer_del(Tcptimer *t)
+{
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		*t->slot = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	t->slot = NULL;
+}
+
+/* Moves every timer in a level's current slot down to the lower levels.
+ * Returns the slot index, so the caller knows if this level wrapped too. */
+static int tcptimer_cascade(struct tcppriv *priv, int lvl)
+{
+	int idx = (priv->tick >> (lvl * TCP_TW_BITS)) & (TCP_TW_SIZE - 1);
+	Tcptimer *t, *tn;
+
+	t = priv->wheel[lvl][idx];
+	priv->wheel[lvl][idx] = NULL;
+	for (; t != NULL; t = tn) {
+		tn = t->next;
+		tcptimer_add(priv, t);
+	}
+	return idx;
+}
+
+/* Ticks left before a timer fires, counting the next tick. */
+static uint64_t tcptimer_count(struct tcppriv *priv, Tcptimer *t)
+{
+	if (t->state != TcptimerON)
+		return t->count;
+	return t->expire - priv->tick + 1;
+}
+
 static void timerstate(struct tcppriv *priv, Tcptimer *t, int newstate)
 {
 	if (newstate != TcptimerON) {
 		if (t->state == TcptimerON) {
-			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
-				if (t->prev != NULL)
-					panic("timerstate1");
-			}
-			if (t->next)
-				t->next->prev = t->prev;
-			if (t->prev)
-				t->prev->next = t->next;
-			t->next = t->prev = NULL;
+			t->count = newstate == TcptimerDONE ? 0
+				   : tcptimer_count(priv, t);
+			tcptimer_del(t);
 		}
 	} else {
-		if (t->state != TcptimerON) {
-			// chain
-			if (t->prev != NULL || t->next != NULL)
-				panic("timerstate2");
-			t->prev = NULL;
-			t->next = priv->timers;
-			if (t->next)
-				t->next->prev = t;
-			priv->timers = t;
-		}
+		if (t->state == TcptimerON)
+			tcptimer_del(t);
+		/* The next tick is the first one of the count */
+		t->expire = priv->tick + t->count - 1;
+		tcptimer_add(priv, t);
 	}
 	t->state = newstate;
 }
@@ -385,36 +448,36 @@ static void tcpackproc(void *a)
 	Tcptimer *t, *tp, *timeo;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
+	int lvl, idx;
 
 	tcp = a;
 	priv = tcp->priv;
 
 	for (;;) {
-		kthread_usleep(MSPTICK * 1000);
+		/* Timers are only kept to the tick, so a little drift in
+		 * when the tick runs is fine. */
+		kthread_usleep_slack(MSPTICK * 1000, MSPTICK * 1000 / 8);
 
 		qlock(&priv->tl);
+		idx = priv->tick & (TCP_TW_SIZE - 1);
+		/* When level 0 wraps, pull the next batch down from above */
+		if (!idx) {
+			for (lvl = 1; lvl < TCP_TW_LEVELS; lvl++) {
+				if (tcptimer_cascade(priv, lvl))
+					break;
+			}
+		}
 		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
+		for (t = priv->wheel[0][idx]; t != NULL; t = tp) {
 			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
-				}
-			}
+			timerstate(priv, t, TcptimerDONE);
+			t->readynext = timeo;
+			timeo = t;
 		}
+		priv->tick++;
 		qunlock(&priv->tl);
 
-		loop = 0;
 		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
 			if (t->state == TcptimerDONE && t->func != NULL) {
 				/* discard error style */
 				if (!waserror())
@@ -477,6 +540,8 @@ static void localclose(struct conv *s, char *reason)
 		kfree(rp);
 	}
 	tcb->reseq = NULL;
+	/* Don't hand this conversation's choice to the next one to use it */
+	tcb->cc_req = NULL;
 
 	if (tcb->state == Syn_sent)
 		Fsconnected(s, reason);
@@ -533,9 +598,11 @@ static void inittcpctl(struct conv *s, int mode)
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
 	int mss;
+	struct tcp_cc_ops *cc;
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	cc = tcb->cc_req ? tcb->cc_req : tcp_cc_default;
 	memset(tcb, 0, sizeof(Tcpctl));
 
 	tcb->ssthresh = UINT32_MAX;
@@ -590,6 +657,8 @@ static void inittcpctl(struct conv *s, int mode)
 	tcb->mss = mss;
 	tcb->typical_mss = mss;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
+	tcb->cc = cc;
+	tcb->cc->init(tcb);
 
 	/* default is no window scaling */
 	tcb->window = QMAX;
@@ -1475,9 +1544,12 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	if (new == NULL)
 		return NULL;
 
+	/* This copies the listener's cc too, so "cc" on a listener picks the
+	 * algorithm for the calls it accepts. */
 	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
 	tcb->flags &= ~CLONE;
+	tcb->cc_req = NULL;
 	tcb->timer.arg = new;
 	tcb->timer.state = TcptimerOFF;
 	tcb->acktimer.arg = new;
@@ -1520,6 +1592,7 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
+	tcb->cc->init(tcb);
 
 	/* set initial round trip time */
 	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
@@ -1705,7 +1778,7 @@ static void sack_has_changed(struct conv *s, Tcpctl *tcb,
 			       tcb->snd.rtx, tcb_sack->left, tcb_sack->right,
 			       tcb->snd.una, tcb->snd.recovery_pt);
 			/* Redo retrans, but keep the sacks and recovery point*/
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.rtx = tcb->snd.una;
 			tcb->snd.sack_loss_hint = 0;
 			/* Act like an RTO.  We just detected it earlier.  This
@@ -1973,9 +2046,9 @@ static void update_rtt(Tcpctl *tcb, int rtt_sample, int expected_samples)
 
 static void update(struct conv *s, Tcp *seg)
 {
-	int rtt;
+	int rtt = -1;
 	Tcpctl *tcb;
-	uint32_t acked, expand;
+	uint32_t acked;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
@@ -2004,7 +2077,7 @@ static void update(struct conv *s, Tcp *seg)
 			       s->laddr, s->lport, s->raddr, s->rport,
 			       tcb->snd.nr_sacks, tcb->snd.nxt, tcb->snd.una,
 			       tcb->cwind);
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.recovery_pt = tcb->snd.nxt;
 			if (tcb->snd.nr_sacks) {
 				tcb->snd.recovery = SACK_RETRANS_RECOVERY;
@@ -2053,39 +2126,9 @@ static void update(struct conv *s, Tcp *seg)
 		goto done;
 	}
 
-	/* slow start as long as we're not recovering from lost packets */
-	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			/* We increase the cwind by every byte we receive.  We
-			 * want to increase the cwind by one MSS for every MSS
-			 * that gets ACKed.  Note that multiple MSSs can be
-			 * ACKed in a single ACK.  If we had a remainder of
-			 * acked / MSS, we'd add just that remainder - not 0 or
-			 * 1 MSS. */
-			expand = acked;
-		} else {
-			/* Every RTT, which consists of CWND bytes, we're
-			 * supposed to expand by MSS bytes.  The classic
-			 * algorithm was
-			 * 	expand = (tcb->mss * tcb->mss) / tcb->cwind;
-			 * which assumes the ACK was for MSS bytes.  Instead,
-			 * for every 'acked' bytes, we increase the window by
-			 * acked / CWND (in units of MSS). */
-			expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
-			         / tcb->cwind;
-		}
-
-		if (tcb->cwind + expand < tcb->cwind)
-			expand = tcb->snd.wnd - tcb->cwind;
-		if (tcb->cwind + expand > tcb->snd.wnd)
-			expand = tcb->snd.wnd - tcb->cwind;
-		tcb->cwind += expand;
-	}
-	adjust_tx_qio_limit(s);
-
 	if (tcb->ts_recent) {
-		update_rtt(tcb, abs(milliseconds() - seg->ts_ecr),
-		           expected_samples_ts(tcb, acked));
+		rtt = abs(milliseconds() - seg->ts_ecr);
+		update_rtt(tcb, rtt, expected_samples_ts(tcb, acked));
 	} else if (tcb->rtt_timer.state == TcptimerON &&
 	           seq_ge(seg->ack, tcb->rttseq)) {
 		/* Adjust the timers according to the round trip time */
@@ -2101,6 +2144,11 @@ static void update(struct conv *s, Tcp *seg)
 		}
 	}
 
+	/* The CC algorithm grows (or sets) the cwind, e.g. slow start as long
+	 * as we're not recovering from lost packets. */
+	tcb->cc->on_ack(tcb, acked, rtt);
+	adjust_tx_qio_limit(s);
+
 done:
 	if (qdiscard(s->wq, acked) < acked) {
 		tcb->flgcnt--;
@@ -2748,6 +2796,44 @@ static uint32_t throttle_for_mss(Tcpctl *tcb, uint32_t ssize,
 	return ssize;
 }
 
+/* Pacing, for CC algorithms with a pacing_rate.  We don't have a fine-grained
+ * timer to release paced segments, so pacing is ACK-clocked: each ACK lets out
+ * whatever the rate allows by then.  With nothing in flight, no ACK is coming,
+ * so we send right away. */
+static bool tcp_pace_ok(Tcpctl *tcb)
+{
+	if (!tcb->cc->pacing_rate || !tcb->snd.in_flight)
+		return TRUE;
+	return nsec() >= tcb->pace_next;
+}
+
+/* Paced connections send about a msec of data at a time, instead of TSO-sized
+ * bursts. */
+static uint32_t tcp_pace_quantum(Tcpctl *tcb)
+{
+	uint64_t rate;
+
+	if (!tcb->cc->pacing_rate)
+		return UINT32_MAX;
+	rate = tcb->cc->pacing_rate(tcb);
+	if (!rate)
+		return UINT32_MAX;
+	return MIN(MAX(rate / 1000, 2 * tcb->typical_mss), UINT32_MAX);
+}
+
+static void tcp_pace_sent(Tcpctl *tcb, uint32_t ssize)
+{
+	uint64_t rate;
+
+	if (!tcb->cc->pacing_rate || !ssize)
+		return;
+	rate = tcb->cc->pacing_rate(tcb);
+	if (!rate)
+		return;
+	tcb->pace_next = MAX(tcb->pace_next, nsec()) +
+	                 (uint64_t)ssize * 1000000000ULL / rate;
+}
+
 /* Reduces ssize for a variety of reasons.  Returns FALSE if we should abort
  * sending the packet.  o/w returns TRUE and modifies ssize by reference. */
 static bool throttle_ssize(struct conv *s, Tcpctl *tcb, uint32_t *ssize_p,
@@ -2797,6 +2883,14 @@ static bool throttle_ssize(struct conv *s, Tcpctl *tcb, uint32_t *ssize_p,
 		       tcb->snd.wnd, tcb->cwind);
 	if (usable < ssize)
 		ssize = usable;
+	/* Pacing spaces out new data, not SACK retransmissions.  We can still
+	 * send a forced ACK. */
+	if (ssize && !retrans && !tcp_pace_ok(tcb)) {
+		if ((tcb->flags & FORCE) == 0)
+			return FALSE;
+		ssize = 0;
+	}
+	ssize = MIN(ssize, tcp_pace_quantum(tcb));
 
 	ssize = throttle_for_mss(tcb, ssize, payload_mss, retrans);
 
@@ -2893,6 +2987,8 @@ static bool get_xmit_segment(struct conv *s, Tcpctl *tcb, uint16_t payload_mss,
 	/* This counts flags, which is a little hokey, but it's okay since
 	 * in_flight gets reset on each ACK */
 	tcb->snd.in_flight += ssize;
+	if (!sack_retrans)
+		tcp_pace_sent(tcb, ssize);
 	/* Log and track rxmit.  This covers both SACK (retrans) and fast rxmit.
 	 */
 	if (ssize && seq_lt(tcb->snd.rtx, tcb->snd.nxt)) {
@@ -3273,16 +3369,19 @@ static void tcpsetchecksum(struct conv *s, char **f, int unused)
 	tcb->nochecksum = !atoi(f[1]);
 }
 
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb)
+/* A loss, detected by dupacks/SACKs or by an RTO.  The CC algorithm decides
+ * what happens to the cwind. */
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto)
 {
 	uint32_t old_cwnd = tcb->cwind;
 
-	/* Reno */
-	tcb->ssthresh = tcb->cwind / 2;
-	tcb->cwind = tcb->ssthresh;
+	if (rto)
+		tcb->cc->on_rto(tcb);
+	else
+		tcb->cc->on_loss(tcb);
 	netlog(s->p->f, Logtcprxmt,
-	       "%I.%d -> %I.%d: loss event, cwnd was %d, now %d\n",
-	       s->laddr, s->lport, s->raddr, s->rport,
+	       "%I.%d -> %I.%d: %s loss event, cwnd was %d, now %d\n",
+	       s->laddr, s->lport, s->raddr, s->rport, tcb->cc->name,
 	       old_cwnd, tcb->cwind);
 }
 
@@ -3369,7 +3468,7 @@ static void tcptimeout(void *arg)
 		       tcb->snd.una, tcb->snd.rtx, tcb->snd.nxt,
 		       tcb->snd.in_flight, tcb->timer.start);
 		tcpsettimer(tcb);
-		tcp_loss_event(s, tcb);
+		tcp_loss_event(s, tcb, TRUE);
 		/* Advance the recovery point.  Any dupacks/sacks below this
 		 * won't trigger a new loss, since we won't reset_recovery()
 		 * until we ack past recovery_pt. */
@@ -3418,6 +3517,7 @@ static void procsyn(struct conv *s, Tcp *seg)
 
 	tcb->snd.wnd = seg->wnd;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
+	tcb->cc->init(tcb);
 }
 
 static int addreseq(Tcpctl *tcb, struct tcppriv *tpriv, Tcp *seg,
@@ -3630,6 +3730,34 @@ static void tcpporthogdefensectl(char *val)
 		error(EINVAL, "unknown value for tcpporthogdefense");
 }
 
+static struct tcp_cc_ops *tcp_cc_parse(char **f, int n)
+{
+	struct tcp_cc_ops *cc;
+
+	if (n != 2)
+		error(EINVAL, "usage: %s NAME", f[0]);
+	cc = tcp_cc_find(f[1]);
+	if (!cc)
+		error(EINVAL, "unknown congestion control %s", f[1]);
+	return cc;
+}
+
+/* "cc NAME" switches this conversation's congestion control, keeping its
+ * current cwind.  Before connect or announce, it is remembered for
+ * inittcpctl().  A listener's choice is inherited by the calls it accepts. */
+static void tcpsetcc(struct conv *c, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) c->ptcl;
+	struct tcp_cc_ops *cc = tcp_cc_parse(f, n);
+
+	if (tcb->state == Closed) {
+		tcb->cc_req = cc;
+		return;
+	}
+	tcb->cc = cc;
+	tcb->cc->init(tcb);
+}
+
 /* called with c qlocked */
 static void tcpctl(struct conv *c, char **f, int n)
 {
@@ -3641,6 +3769,18 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpsetchecksum(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n >= 1 && strcmp(f[0], "cc") == 0)
+		tcpsetcc(c, f, n);
+	else
+		error(EINVAL, "unknown command to %s", __func__);
+}
+
+/* Protocol-wide ctl, written to /net/tcp/stats.  "cc_default NAME" picks the
+ * congestion control for new conversations. */
+static void tcpstatsctl(struct Proto *tcp, char **f, int n)
+{
+	if (strcmp(f[0], "cc_default") == 0)
+		tcp_cc_default = tcp_cc_parse(f, n);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3732,6 +3872,7 @@ void tcpinit(struct Fs *fs)
 	debug_priv = tpriv;
 	qlock_init(&tpriv->tl);
 	qlock_init(&tpriv->apl);
+	iphtinit(&tpriv->ht);
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
@@ -3744,6 +3885,7 @@ void tcpinit(struct Fs *fs)
 	tcp->rcv = tcpiput;
 	tcp->advise = tcpadvise;
 	tcp->stats = tcpstats;
+	tcp->statsctl = tcpstatsctl;
 	tcp->inuse = tcpinuse;
 	tcp->gc = tcpgc;
 	tcp->ipproto = IP_TCPPROTO;
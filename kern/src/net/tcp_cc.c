@@ -0,0 +1,475 @@
+/* Copyright (c) 2019 Google Inc
+ * See LICENSE for details.
+ *
+ * TCP congestion control algorithms: Reno, CUBIC, and BBR.
+ *
+ * Each conversation points at a struct tcp_cc_ops, which tcp.c calls with the
+ * conv qlocked.  Algorithms keep their state in tcb->cc_priv, and init() must
+ * be safe to call on a live connection, since userspace can switch algorithms
+ * with the "cc" ctl message.  New connections use tcp_cc_default, which is
+ * set with "cc_default".
+ *
+ * All of the math is integer.  RTTs are in msec, which is what tcp.c measures,
+ * and rates are in bytes per second. */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+/* Grows the cwnd by expand, but never past the peer's window.  Algorithms that
+ * grow the window (as opposed to setting it from a model) should use this. */
+void tcp_cc_grow_cwnd(Tcpctl *tcb, uint32_t expand)
+{
+	if (tcb->cwind >= tcb->snd.wnd)
+		return;
+	if (tcb->cwind + expand < tcb->cwind)
+		expand = tcb->snd.wnd - tcb->cwind;
+	if (tcb->cwind + expand > tcb->snd.wnd)
+		expand = tcb->snd.wnd - tcb->cwind;
+	tcb->cwind += expand;
+}
+
+static void reno_init(Tcpctl *tcb)
+{
+}
+
+static void reno_on_ack(Tcpctl *tcb, uint32_t acked, int rtt)
+{
+	uint32_t expand;
+
+	/* no growth while we're recovering from lost packets */
+	if (tcb->snd.recovery)
+		return;
+	if (tcb->cwind < tcb->ssthresh) {
+		/* We increase the cwind by every byte we receive.  We want to
+		 * increase the cwind by one MSS for every MSS that gets ACKed.
+		 * Note that multiple MSSs can be ACKed in a single ACK.  If we
+		 * had a remainder of acked / MSS, we'd add just that remainder
+		 * - not 0 or 1 MSS. */
+		expand = acked;
+	} else {
+		/* Every RTT, which consists of CWND bytes, we're supposed to
+		 * expand by MSS bytes.  The classic algorithm was
+		 * 	expand = (tcb->mss * tcb->mss) / tcb->cwind;
+		 * which assumes the ACK was for MSS bytes.  Instead, for every
+		 * 'acked' bytes, we increase the window by acked / CWND (in
+		 * units of MSS). */
+		expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
+		         / tcb->cwind;
+	}
+	tcp_cc_grow_cwnd(tcb, expand);
+}
+
+static void reno_on_loss(Tcpctl *tcb)
+{
+	tcb->ssthresh = tcb->cwind / 2;
+	tcb->cwind = tcb->ssthresh;
+}
+
+struct tcp_cc_ops tcp_cc_reno = {
+	.name = "reno",
+	.init = reno_init,
+	.on_ack = reno_on_ack,
+	.on_loss = reno_on_loss,
+	.on_rto = reno_on_loss,
+};
+
+/* CUBIC, RFC 8312.  After a loss, the window follows a cubic function of the
+ * time since the loss, plateauing at the window where we lost (w_max), then
+ * probing beyond it.  The growth depends on time, not on ACKs, so it fills
+ * long-RTT pipes much faster than Reno.  We never grow slower than Reno would
+ * (the "TCP-friendly region", tracked by w_est). */
+#define CUBIC_BETA		717	/* multiplicative decrease, 0.7 * 1024 */
+#define CUBIC_C_NUM		4	/* C = 0.4 */
+#define CUBIC_C_DEN		10
+/* 3 * (1 - beta) / (1 + beta), Reno's equivalent additive increase */
+#define CUBIC_RENO_NUM		529
+#define CUBIC_RENO_DEN		1000
+/* Keeps t^3, in msec^3, within an int64 */
+#define CUBIC_MAX_T		100000
+
+struct cubic {
+	uint32_t			w_max;		/* cwnd at the last loss */
+	uint32_t			origin;		/* the curve's plateau */
+	uint32_t			w_est;		/* Reno's cwnd, roughly */
+	uint64_t			epoch_start;	/* msec, 0 for none */
+	uint64_t			k;		/* msec, epoch to origin */
+};
+
+static struct cubic *tcb_cubic(Tcpctl *tcb)
+{
+	static_assert(sizeof(struct cubic) <= sizeof(tcb->cc_priv));
+	return (struct cubic*)tcb->cc_priv;
+}
+
+/* Integer cube root, from Hacker's Delight */
+static uint64_t cbrt64(uint64_t x)
+{
+	uint64_t y = 0, b;
+
+	for (int s = 63; s >= 0; s -= 3) {
+		y <<= 1;
+		b = 3 * y * (y + 1) + 1;
+		if ((x >> s) >= b) {
+			x -= b << s;
+			y++;
+		}
+	}
+	return y;
+}
+
+static void cubic_init(Tcpctl *tcb)
+{
+	memset(tcb_cubic(tcb), 0, sizeof(struct cubic));
+}
+
+static void cubic_on_ack(Tcpctl *tcb, uint32_t acked, int rtt)
+{
+	struct cubic *c = tcb_cubic(tcb);
+	uint32_t mss = tcb->typical_mss;
+	uint64_t now, t, expand;
+	int64_t dt, target;
+
+	if (tcb->snd.recovery)
+		return;
+	if (tcb->cwind < tcb->ssthresh) {
+		tcp_cc_grow_cwnd(tcb, acked);
+		return;
+	}
+	now = milliseconds();
+	if (!c->epoch_start) {
+		c->epoch_start = now;
+		c->w_est = tcb->cwind;
+		if (tcb->cwind < c->w_max) {
+			/* K^3 = (w_max - cwnd) / C, in MSS and seconds */
+			c->k = cbrt64((uint64_t)(c->w_max - tcb->cwind) / mss *
+			              1000000000ULL * CUBIC_C_DEN /
+			              CUBIC_C_NUM);
+			c->origin = c->w_max;
+		} else {
+			c->k = 0;
+			c->origin = tcb->cwind;
+		}
+	}
+	/* Aim for where the curve will be an RTT from now */
+	t = MIN(now - c->epoch_start + tcb->srtt, CUBIC_MAX_T);
+	dt = (int64_t)t - (int64_t)c->k;
+	target = dt * dt * dt * CUBIC_C_NUM / CUBIC_C_DEN / 1000;
+	target = target * mss / 1000000 + c->origin;
+	if (target > tcb->cwind)
+		expand = (target - tcb->cwind) * acked / tcb->cwind;
+	else
+		expand = (uint64_t)acked * mss / (100 * tcb->cwind);
+	c->w_est += (uint64_t)acked * mss * CUBIC_RENO_NUM / CUBIC_RENO_DEN /
+	            tcb->cwind;
+	if (c->w_est > tcb->cwind + expand)
+		expand = c->w_est - tcb->cwind;
+	tcp_cc_grow_cwnd(tcb, MIN(expand, UINT32_MAX));
+}
+
+static void cubic_on_loss(Tcpctl *tcb)
+{
+	struct cubic *c = tcb_cubic(tcb);
+
+	c->epoch_start = 0;
+	/* Fast convergence: if we lost below the last plateau, another flow
+	 * probably joined, so give up some more. */
+	if (tcb->cwind < c->w_max)
+		c->w_max = (uint64_t)tcb->cwind * (1024 + CUBIC_BETA) / 2048;
+	else
+		c->w_max = tcb->cwind;
+	tcb->ssthresh = MAX((uint64_t)tcb->cwind * CUBIC_BETA / 1024,
+	                    2 * tcb->typical_mss);
+	tcb->cwind = tcb->ssthresh;
+}
+
+struct tcp_cc_ops tcp_cc_cubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.on_ack = cubic_on_ack,
+	.on_loss = cubic_on_loss,
+	.on_rto = cubic_on_loss,
+};
+
+/* BBR (v1).  Instead of reacting to loss, BBR models the path: the bottleneck
+ * bandwidth (max delivery rate over the last several rounds) and the min RTT
+ * (over the last 10 seconds).  It paces at gain * bandwidth and caps the
+ * window at gain * BDP.
+ *
+ * - STARTUP doubles the rate each round until the bandwidth stops growing.
+ * - DRAIN empties the queue STARTUP built.
+ * - PROBE_BW cycles its pacing gain to probe for more bandwidth, then to drain
+ *   whatever queue the probe built.
+ * - PROBE_RTT periodically shrinks the window to refresh the min RTT.
+ *
+ * Our delivery rate samples are per round trip: the bytes ACKed during the
+ * round over the round's duration, rather than per packet. */
+enum {
+	BBR_STARTUP,
+	BBR_DRAIN,
+	BBR_PROBE_BW,
+	BBR_PROBE_RTT,
+};
+
+#define BBR_UNIT		1000	/* gains are in thousandths */
+#define BBR_HIGH_GAIN		2885	/* 2 / ln(2) */
+#define BBR_DRAIN_GAIN		347	/* 1 / BBR_HIGH_GAIN */
+#define BBR_CWND_GAIN		2000
+#define BBR_BW_RTTS		10	/* rounds in the bandwidth filter */
+#define BBR_FULL_BW_RTTS	3	/* rounds without growth ends STARTUP */
+#define BBR_MIN_RTT_WIN		10000	/* msec */
+#define BBR_PROBE_RTT_TIME	200	/* msec */
+#define BBR_MIN_CWND_SEGS	4
+#define BBR_CYCLE_LEN		8
+
+static const uint32_t bbr_cycle_gains[BBR_CYCLE_LEN] = {
+	1250, 750, 1000, 1000, 1000, 1000, 1000, 1000
+};
+
+struct bbr {
+	uint64_t			bw[BBR_BW_RTTS]; /* bytes/sec, per round */
+	uint64_t			round_cnt;
+	uint32_t			round_end;	/* seq ending the round */
+	uint64_t			round_start;	/* nsec */
+	uint64_t			round_delivered; /* bytes this round */
+	uint32_t			min_rtt;	/* msec, 0 if unknown */
+	uint64_t			min_rtt_stamp;	/* msec */
+	uint64_t			probe_rtt_done;	/* msec, 0 if not yet */
+	uint64_t			full_bw;
+	uint32_t			full_bw_cnt;
+	uint32_t			mode;
+	uint32_t			pacing_gain;
+	uint32_t			cwnd_gain;
+	uint32_t			cycle_idx;
+	uint64_t			cycle_stamp;	/* msec */
+	uint32_t			prior_cwnd;
+};
+
+static struct bbr *tcb_bbr(Tcpctl *tcb)
+{
+	static_assert(sizeof(struct bbr) <= sizeof(tcb->cc_priv));
+	return (struct bbr*)tcb->cc_priv;
+}
+
+static uint64_t bbr_max_bw(struct bbr *b)
+{
+	uint64_t max = 0;
+
+	for (int i = 0; i < BBR_BW_RTTS; i++)
+		max = MAX(max, b->bw[i]);
+	return max;
+}
+
+static uint32_t bbr_min_cwnd(Tcpctl *tcb)
+{
+	return BBR_MIN_CWND_SEGS * tcb->typical_mss;
+}
+
+/* gain * the bandwidth-delay product, plus some room for delayed ACKs */
+static uint64_t bbr_target_cwnd(Tcpctl *tcb, struct bbr *b, uint32_t gain)
+{
+	uint64_t bdp = bbr_max_bw(b) * b->min_rtt / 1000;
+
+	return bdp * gain / BBR_UNIT + 3 * tcb->typical_mss;
+}
+
+static void bbr_enter_probe_bw(struct bbr *b, uint64_t now)
+{
+	b->mode = BBR_PROBE_BW;
+	b->cwnd_gain = BBR_CWND_GAIN;
+	/* Start cruising, not probing */
+	b->cycle_idx = 2;
+	b->pacing_gain = bbr_cycle_gains[b->cycle_idx];
+	b->cycle_stamp = now;
+}
+
+static void bbr_init(Tcpctl *tcb)
+{
+	struct bbr *b = tcb_bbr(tcb);
+
+	memset(b, 0, sizeof(struct bbr));
+	b->mode = BBR_STARTUP;
+	b->pacing_gain = BBR_HIGH_GAIN;
+	b->cwnd_gain = BBR_HIGH_GAIN;
+	b->round_end = tcb->snd.nxt;
+	b->round_start = nsec();
+}
+
+/* Helper: accounts for acked bytes, returning TRUE at the end of a round, when
+ * we take a bandwidth sample. */
+static bool bbr_update_round(Tcpctl *tcb, struct bbr *b, uint32_t acked)
+{
+	uint64_t now = nsec();
+	uint64_t elapsed;
+
+	b->round_delivered += acked;
+	if (seq_lt(tcb->snd.una, b->round_end))
+		return FALSE;
+	elapsed = now - b->round_start;
+	b->round_cnt++;
+	b->bw[b->round_cnt % BBR_BW_RTTS] = elapsed ?
+		b->round_delivered * 1000000000ULL / elapsed : 0;
+	b->round_delivered = 0;
+	b->round_start = now;
+	b->round_end = tcb->snd.nxt;
+	return TRUE;
+}
+
+static void bbr_update_state(Tcpctl *tcb, struct bbr *b, bool round_done,
+                             uint64_t now)
+{
+	uint64_t bw = bbr_max_bw(b);
+
+	switch (b->mode) {
+	case BBR_STARTUP:
+		if (!round_done)
+			break;
+		if (bw >= b->full_bw * 5 / 4) {
+			b->full_bw = bw;
+			b->full_bw_cnt = 0;
+		} else if (++b->full_bw_cnt >= BBR_FULL_BW_RTTS) {
+			b->mode = BBR_DRAIN;
+			b->pacing_gain = BBR_DRAIN_GAIN;
+		}
+		break;
+	case BBR_DRAIN:
+		if (tcb->snd.in_flight <= bbr_target_cwnd(tcb, b, BBR_UNIT))
+			bbr_enter_probe_bw(b, now);
+		break;
+	case BBR_PROBE_BW:
+		if (now - b->cycle_stamp > b->min_rtt) {
+			b->cycle_idx = (b->cycle_idx + 1) % BBR_CYCLE_LEN;
+			b->pacing_gain = bbr_cycle_gains[b->cycle_idx];
+			b->cycle_stamp = now;
+		}
+		break;
+	case BBR_PROBE_RTT:
+		if (!b->probe_rtt_done) {
+			if (tcb->snd.in_flight <= bbr_min_cwnd(tcb))
+				b->probe_rtt_done = now + BBR_PROBE_RTT_TIME;
+			break;
+		}
+		if (now < b->probe_rtt_done)
+			break;
+		b->min_rtt_stamp = now;
+		tcb->cwind = MAX(tcb->cwind, b->prior_cwnd);
+		if (b->full_bw_cnt >= BBR_FULL_BW_RTTS) {
+			bbr_enter_probe_bw(b, now);
+		} else {
+			b->mode = BBR_STARTUP;
+			b->pacing_gain = BBR_HIGH_GAIN;
+			b->cwnd_gain = BBR_HIGH_GAIN;
+		}
+		break;
+	}
+	/* Our min RTT is stale; drain the queue to measure a fresh one. */
+	if (b->mode != BBR_PROBE_RTT && b->min_rtt &&
+	    now - b->min_rtt_stamp > BBR_MIN_RTT_WIN) {
+		b->mode = BBR_PROBE_RTT;
+		b->pacing_gain = BBR_UNIT;
+		b->prior_cwnd = tcb->cwind;
+		b->probe_rtt_done = 0;
+	}
+}
+
+static void bbr_set_cwnd(Tcpctl *tcb, struct bbr *b, uint32_t acked)
+{
+	uint64_t target, cwnd = tcb->cwind;
+
+	if (b->mode == BBR_PROBE_RTT) {
+		tcb->cwind = MIN(tcb->cwind, bbr_min_cwnd(tcb));
+		return;
+	}
+	if (!bbr_max_bw(b) || !b->min_rtt) {
+		/* No model yet, so grow like slow start */
+		tcp_cc_grow_cwnd(tcb, acked);
+		return;
+	}
+	target = bbr_target_cwnd(tcb, b, b->cwnd_gain);
+	if (b->mode == BBR_STARTUP) {
+		if (cwnd < target)
+			cwnd += acked;
+	} else {
+		cwnd = MIN(cwnd + acked, target);
+	}
+	cwnd = MAX(cwnd, bbr_min_cwnd(tcb));
+	cwnd = MIN(cwnd, MAX(tcb->snd.wnd, bbr_min_cwnd(tcb)));
+	tcb->cwind = cwnd;
+}
+
+static void bbr_on_ack(Tcpctl *tcb, uint32_t acked, int rtt)
+{
+	struct bbr *b = tcb_bbr(tcb);
+	uint64_t now = milliseconds();
+	bool round_done;
+
+	if (rtt >= 0) {
+		/* Our RTT samples are in msec; LAN RTTs round down to 0. */
+		rtt = MAX(rtt, 1);
+		if (!b->min_rtt || rtt <= b->min_rtt ||
+		    now - b->min_rtt_stamp > BBR_MIN_RTT_WIN) {
+			b->min_rtt = rtt;
+			b->min_rtt_stamp = now;
+		}
+	}
+	round_done = bbr_update_round(tcb, b, acked);
+	bbr_update_state(tcb, b, round_done, now);
+	bbr_set_cwnd(tcb, b, acked);
+}
+
+/* BBR doesn't treat loss as a congestion signal; the model sets the window.
+ * We just remember the window for after an RTO. */
+static void bbr_on_loss(Tcpctl *tcb)
+{
+	tcb_bbr(tcb)->prior_cwnd = tcb->cwind;
+}
+
+/* Everything in flight is presumed lost.  Start from the minimum window; the
+ * window climbs back to the model's target as ACKs arrive. */
+static void bbr_on_rto(Tcpctl *tcb)
+{
+	tcb_bbr(tcb)->prior_cwnd = tcb->cwind;
+	tcb->cwind = bbr_min_cwnd(tcb);
+}
+
+static uint64_t bbr_pacing_rate(Tcpctl *tcb)
+{
+	struct bbr *b = tcb_bbr(tcb);
+	uint64_t bw = bbr_max_bw(b);
+
+	/* Before our first bandwidth sample, pace the initial window over an
+	 * RTT (at STARTUP's gain). */
+	if (!bw && b->min_rtt)
+		bw = (uint64_t)tcb->cwind * 1000 / b->min_rtt;
+	return bw * b->pacing_gain / BBR_UNIT;
+}
+
+struct tcp_cc_ops tcp_cc_bbr = {
+	.name = "bbr",
+	.init = bbr_init,
+	.on_ack = bbr_on_ack,
+	.on_loss = bbr_on_loss,
+	.on_rto = bbr_on_rto,
+	.pacing_rate = bbr_pacing_rate,
+};
+
+static struct tcp_cc_ops *tcp_ccs[] = {
+	&tcp_cc_reno,
+	&tcp_cc_cubic,
+	&tcp_cc_bbr,
+};
+
+struct tcp_cc_ops *tcp_cc_default = &tcp_cc_reno;
+
+/* Returns the algorithm called name, or NULL. */
+struct tcp_cc_ops *tcp_cc_find(const char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(tcp_ccs); i++) {
+		if (!strcmp(tcp_ccs[i]->name, name))
+			return tcp_ccs[i];
+	}
+	return NULL;
+}
@@ -673,9 +673,11 @@ int udpstats(struct Proto *udp, char *buf, int len)
 void udpinit(struct Fs *fs)
 {
 	struct Proto *udp;
+	Udppriv *upriv;
 
 	udp = kzmalloc(sizeof(struct Proto), 0);
-	udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	upriv = udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	iphtinit(&upriv->ht);
 	udp->name = "udp";
 	udp->connect = udpconnect;
 	udp->bind = udpbind;
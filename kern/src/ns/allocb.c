@@ -38,6 +38,8 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <process.h>
+#include <percpu.h>
+#include <linker_func.h>
 
 /* Note that Hdrspc is only available via padblock (to the 'left' of the rp). */
 enum {
@@ -46,6 +48,88 @@ enum {
 	BLOCKALIGN = 32,	/* was the old BY2V in inferno, which was 8 */
 };
 
+/* Blocks for full-sized packets come from their own slabs, so that the RX and
+ * TX paths (etheriq/etheroq, qio, TCP) reuse cache-hot buffers out of the
+ * per-core magazines instead of going through the general kmalloc classes.
+ *
+ * Each object is a kmalloc tag, the block, and the body.  The tag lets blocks
+ * be refcounted and kfreed like any other kmalloc buffer (e.g. qclone's
+ * point_to_body()), and a block's final kfree() returns it to its cache.  The
+ * ctor sets base and lim, which never change for a cached block.
+ *
+ * Requests for less than half of a cache's body stay with kmalloc, so we don't
+ * burn a 2K buffer on an ACK. */
+struct block_cache {
+	const char *name;
+	size_t body_sz;
+	struct kmem_cache *kc;
+};
+
+static struct block_cache block_caches[] = {
+	{"block_mtu", 2048},
+	{"block_jumbo", 9216},
+};
+
+/* Approximate per-core count of block_allocs that went to kmalloc.  The slab
+ * layer counts the cached allocs for us. */
+static DEFINE_PERCPU(unsigned long, block_nr_kmalloc);
+
+static size_t block_cache_obj_sz(struct block_cache *bc)
+{
+	return sizeof(struct kmalloc_tag) + sizeof(struct block) +
+		(BLOCKALIGN - 1) + Hdrspc + bc->body_sz;
+}
+
+/* Points b's buffer at the whole body of its cache object.  Drivers trim lim
+ * (e.g. to wp on RX), so this runs on every alloc, not just in the ctor. */
+static void block_cache_set_buf(struct block_cache *bc, struct block *b)
+{
+	void *obj = (void*)b - sizeof(struct kmalloc_tag);
+
+	b->base = (uint8_t*)ROUNDUP((uintptr_t)(b + 1), BLOCKALIGN);
+	b->lim = obj + block_cache_obj_sz(bc);
+}
+
+static int block_cache_ctor(void *obj, void *priv, int flags)
+{
+	struct block_cache *bc = priv;
+	struct block *b = obj + sizeof(struct kmalloc_tag);
+
+	memset(b, 0, sizeof(struct block));
+	b->flag = Bcached;
+	block_cache_set_buf(bc, b);
+	return 0;
+}
+
+static void __init block_cache_init(void)
+{
+	struct block_cache *bc;
+
+	for (int i = 0; i < ARRAY_SIZE(block_caches); i++) {
+		bc = &block_caches[i];
+		bc->kc = kmem_cache_create(bc->name, block_cache_obj_sz(bc),
+					   BLOCKALIGN, 0, NULL,
+					   block_cache_ctor, NULL, bc);
+	}
+}
+init_func_1(block_cache_init);
+
+/* Returns the block_cache for a block_alloc of size, or NULL for kmalloc. */
+static struct block_cache *block_cache_for(size_t size)
+{
+	struct block_cache *bc;
+
+	for (int i = 0; i < ARRAY_SIZE(block_caches); i++) {
+		bc = &block_caches[i];
+		if (size > bc->body_sz)
+			continue;
+		if (size <= bc->body_sz / 2 || !bc->kc)
+			return NULL;
+		return bc;
+	}
+	return NULL;
+}
+
 /*
  *  allocate blocks (round data base address to 64 bit boundary).
  *  if mallocz gives us more than we asked for, leave room at the front
@@ -53,6 +137,7 @@ enum {
  */
 struct block *block_alloc(size_t size, int mem_flags)
 {
+	struct block_cache *bc;
 	struct block *b;
 	uintptr_t addr;
 	int n;
@@ -60,15 +145,38 @@ struct block *block_alloc(size_t size, int mem_flags)
 	/* If Hdrspc is not block aligned it will cause issues. */
 	static_assert(Hdrspc % BLOCKALIGN == 0);
 
-	b = kmalloc(sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1),
-				mem_flags);
-	if (b == NULL)
-		return NULL;
+	bc = block_cache_for(size);
+	if (bc) {
+		/* lim is the end of the object, not just size. */
+		b = kmalloc_from_cache(bc->kc, mem_flags);
+		if (b == NULL)
+			return NULL;
+		b->flag = Bcached;
+		block_cache_set_buf(bc, b);
+	} else {
+		PERCPU_VAR(block_nr_kmalloc)++;
+		b = kmalloc(sizeof(struct block) + size + Hdrspc +
+			    (BLOCKALIGN - 1), mem_flags);
+		if (b == NULL)
+			return NULL;
+		b->flag = 0;
+		addr = (uintptr_t) b;
+		addr = ROUNDUP(addr + sizeof(struct block), BLOCKALIGN);
+		b->base = (uint8_t *) addr;
+		/* TODO: support this */
+		/* interesting. We can ask the allocator, after allocating,
+		 * the *real* size of the block we got. Very nice.
+		 * Not on akaros yet.
+		 b->lim = ((uint8_t*)b) + msize(b);
+		 * See use of n in commented code below
+		 */
+		b->lim = ((uint8_t *) b) + sizeof(struct block) + size +
+			Hdrspc + (BLOCKALIGN - 1);
+	}
 
 	b->next = NULL;
 	b->list = NULL;
 	b->free = NULL;
-	b->flag = 0;
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
 	b->extra_data = 0;
@@ -76,18 +184,6 @@ struct block *block_alloc(size_t size, int mem_flags)
 	b->network_offset = 0;
 	b->transport_offset = 0;
 
-	addr = (uintptr_t) b;
-	addr = ROUNDUP(addr + sizeof(struct block), BLOCKALIGN);
-	b->base = (uint8_t *) addr;
-	/* TODO: support this */
-	/* interesting. We can ask the allocator, after allocating,
-	 * the *real* size of the block we got. Very nice.
-	 * Not on akaros yet.
-	 b->lim = ((uint8_t*)b) + msize(b);
-	 * See use of n in commented code below
-	 */
-	b->lim = ((uint8_t *) b) + sizeof(struct block) + size + Hdrspc +
-		(BLOCKALIGN - 1);
 	b->rp = b->base;
 	/* TODO: support this */
 	/* n is supposed to be Hdrspc + rear padding + extra reserved memory,
@@ -107,6 +203,42 @@ struct block *block_alloc(size_t size, int mem_flags)
 	return b;
 }
 
+/* Reports the block caches' usage.  Allocs from a core's magazine are the
+ * cache-hot hits; slab allocs had to go back to the slab layer.  Free with
+ * kfree. */
+struct sized_alloc *block_cache_stats(void)
+{
+	struct sized_alloc *sza;
+	struct block_cache *bc;
+	struct kmem_pcpu_cache *pcc;
+	unsigned long nr_kmalloc = 0;
+	unsigned long mag_allocs, slab_allocs;
+
+	sza = sized_kzmalloc(200 * (ARRAY_SIZE(block_caches) + 1), MEM_WAIT);
+	for (int i = 0; i < ARRAY_SIZE(block_caches); i++) {
+		bc = &block_caches[i];
+		if (!bc->kc)
+			continue;
+		mag_allocs = 0;
+		/* Lockless peek at the pcpu state, like kmemstat */
+		for (int j = 0; j < kmc_nr_pcpu_caches(); j++) {
+			pcc = &bc->kc->pcpu_caches[j];
+			mag_allocs += pcc->nr_allocs_ever;
+		}
+		slab_allocs = bc->kc->nr_direct_allocs_ever;
+		sza_printf(sza, "%s (%lu bytes): %lu magazine allocs, ",
+			   bc->name, bc->body_sz, mag_allocs);
+		sza_printf(sza, "%lu slab allocs, %lu%% hit, %lu in use\n",
+			   slab_allocs,
+			   mag_allocs * 100 / MAX(mag_allocs + slab_allocs, 1),
+			   bc->kc->nr_cur_alloc);
+	}
+	for (int i = 0; i < num_cores; i++)
+		nr_kmalloc += _PERCPU_VAR(block_nr_kmalloc, i);
+	sza_printf(sza, "kmalloc: %lu allocs\n", nr_kmalloc);
+	return sza;
+}
+
 /* Makes sure b has nr_bufs extra_data.  Will grow, but not shrink, an existing
  * extra_data array.  When growing, it'll copy over the old entries.  All new
  * entries will be zeroed.  mem_flags determines if we'll block on kmallocs.
@@ -331,8 +463,11 @@ size_t freeb(struct block *b)
 	b->next = dead;
 	b->rp = dead;
 	b->wp = dead;
-	b->lim = dead;
-	b->base = dead;
+	/* cached blocks go back to their slab still constructed */
+	if (!(b->flag & Bcached)) {
+		b->lim = dead;
+		b->base = dead;
+	}
 	kfree(b);
 	return ret;
 }
@@ -379,6 +379,8 @@ size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
 			break;
 		pg_off = PGOFF(offset + so_far);
 		pg_idx = LA2PPN(offset + so_far);
+		pm_readahead(f->pm, pg_idx,
+			     LA2PPN(ROUNDUP(fs_file_get_length(f), PGSIZE)));
 		error = pm_load_page(f->pm, pg_idx, &page);
 		if (error)
 			error(-error, "read pm_load_page failed");
@@ -507,6 +507,7 @@ int sysmount(int fd, int afd, char *old, int flags, char *spec)
 	mntparam.chan = bc.c;
 	mntparam.authchan = ac.c;
 	mntparam.spec = spec;
+	mntparam.flags = flags;
 	c0.c = devtab[devno("mnt", 0)].attach((char *)&mntparam);
 	if (flags & MCACHE)
 		c0.c = devtab[devno("gtfs", 0)].attach((char*)c0.c);
@@ -9,13 +9,329 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <arena.h>
+#include <smp.h>
+
+#define NUMA_MAX_RANGES		8
+
+struct numa_range {
+	uintptr_t			start;	/* KVAs */
+	uintptr_t			end;
+};
+
+struct numa_node {
+	struct arena			base;
+	struct arena			kpages;
+	struct numa_range		ranges[NUMA_MAX_RANGES];
+	int				nr_ranges;
+	size_t				amt_total;
+	/* Node IDs, nearest first.  fallback[0] is us. */
+	int				fallback[MAX_NUMA_NODES];
+	/* Stats, in the spirit of Linux's numastat */
+	atomic_t			nr_pages;	/* currently allocated */
+	atomic_t			nr_hit;		/* wanted here, got here */
+	atomic_t			nr_miss;	/* wanted elsewhere */
+	atomic_t			nr_foreign;	/* wanted here, went elsewhere */
+	atomic_t			nr_interleave;
+};
+
+static struct numa_node numa_nodes[MAX_NUMA_NODES];
+/* Set once, at the end of numa_pages_init().  0 means no NUMA. */
+static int nr_numa_nodes;
+
+/* A node's base arena is self-sourced so that its import function can find the
+ * node.  It pulls from the global base_arena, but only from the node's ranges.
+ */
+static void *numa_base_import(struct arena *a, size_t size, int flags)
+{
+	struct numa_node *n = container_of(a, struct numa_node, base);
+	void *ret;
+
+	for (int i = 0; i < n->nr_ranges; i++) {
+		ret = arena_xalloc(base_arena, size, PGSIZE, 0, 0,
+		                   (void*)n->ranges[i].start,
+		                   (void*)n->ranges[i].end, flags | MEM_ATOMIC);
+		if (ret)
+			return ret;
+	}
+	return NULL;
+}
+
+static void numa_base_release(struct arena *a, void *addr, size_t size)
+{
+	arena_xfree(base_arena, addr, size);
+}
+
+/* Records [start, start + len) of physical memory as belonging to node.  Call
+ * this for all of the ranges before numa_pages_init(). */
+void numa_add_mem(int node, physaddr_t start, size_t len)
+{
+	struct numa_node *n;
+	physaddr_t end = MIN(start + len, max_paddr);
+
+	assert(node < MAX_NUMA_NODES);
+	n = &numa_nodes[node];
+	if (start >= end)
+		return;
+	if (n->nr_ranges == NUMA_MAX_RANGES) {
+		warn("NUMA node %d has too many memory ranges, skipping %p",
+		     node, start);
+		return;
+	}
+	n->ranges[n->nr_ranges].start = (uintptr_t)KADDR(start);
+	n->ranges[n->nr_ranges].end = (uintptr_t)KADDR(end);
+	n->nr_ranges++;
+	n->amt_total += end - start;
+}
+
+/* Builds the per-node arenas and each node's fallback order.  distance() is in
+ * ACPI SLIT units, but all we care about is the ordering. */
+void numa_pages_init(int nr_nodes, int (*distance)(int from, int to))
+{
+	struct numa_node *n;
+	char name[ARENA_NAME_SZ];
+	int *fb, tmp;
+
+	assert(nr_nodes <= MAX_NUMA_NODES);
+	for (int i = 0; i < nr_nodes; i++) {
+		n = &numa_nodes[i];
+		snprintf(name, sizeof(name), "base-%d", i);
+		__arena_create(&n->base, name, PGSIZE, numa_base_import,
+			       numa_base_release, ARENA_SELF_SOURCE, 0);
+		snprintf(name, sizeof(name), "kpages-%d", i);
+		__arena_create(&n->kpages, name, PGSIZE, arena_alloc,
+			       arena_free, &n->base, 8 * PGSIZE);
+		/* Insertion sort by distance; ties go to the lower ID */
+		fb = n->fallback;
+		for (int j = 0; j < nr_nodes; j++) {
+			fb[j] = j;
+			for (int k = j; k > 0; k--) {
+				if (distance(i, fb[k - 1]) <= distance(i, fb[k]))
+					break;
+				tmp = fb[k - 1];
+				fb[k - 1] = fb[k];
+				fb[k] = tmp;
+			}
+		}
+		printk("NUMA node %d: %lu MB, fallback", i,
+		       n->amt_total >> 20);
+		for (int j = 0; j < nr_nodes; j++)
+			printk(" %d", fb[j]);
+		printk("\n");
+	}
+	wmb();
+	nr_numa_nodes = nr_nodes;
+}
+
+int numa_nr_nodes(void)
+{
+	return nr_numa_nodes;
+}
+
+static int numa_local_node(void)
+{
+	return per_cpu_info[core_id_early()].numa_node;
+}
+
+/* Picks the node p's policy wants a page from.  Kernel allocations (p == 0)
+ * are always local. */
+static int numa_policy_node(struct proc *p, bool *bind)
+{
+	int node;
+
+	*bind = FALSE;
+	if (!p)
+		return numa_local_node();
+	switch (p->mem_policy.mode) {
+	case MPOL_INTERLEAVE:
+		node = (unsigned long)atomic_fetch_and_add(
+				&p->mem_policy.il_next, 1) % nr_numa_nodes;
+		atomic_inc(&numa_nodes[node].nr_interleave);
+		return node;
+	case MPOL_BIND:
+		if (p->mem_policy.node < nr_numa_nodes) {
+			*bind = TRUE;
+			return p->mem_policy.node;
+		}
+		break;
+	}
+	return numa_local_node();
+}
+
+/* Allocates from node's kpages, falling back to the other nodes in distance
+ * order unless we're bound.  Marks the first page so the free can find the
+ * node.  Returns 0 if no node could satisfy the request. */
+static void *numa_kpages_alloc(int node, bool bind, size_t size, size_t align,
+                               int flags)
+{
+	struct numa_node *want = &numa_nodes[node];
+	struct numa_node *n;
+	void *ret;
+
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		n = &numa_nodes[want->fallback[i]];
+		if (align)
+			ret = arena_xalloc(&n->kpages, size, align, 0, 0, NULL,
+			                   NULL, flags | MEM_ATOMIC);
+		else
+			ret = arena_alloc(&n->kpages, size, flags | MEM_ATOMIC);
+		if (ret) {
+			kva2page(ret)->pg_numa_node = n - numa_nodes + 1;
+			atomic_add(&n->nr_pages, ROUNDUP(size, PGSIZE) >>
+			                         PGSHIFT);
+			if (n == want) {
+				atomic_inc(&n->nr_hit);
+			} else {
+				atomic_inc(&n->nr_miss);
+				atomic_inc(&want->nr_foreign);
+			}
+			return ret;
+		}
+		if (bind)
+			break;
+	}
+	return NULL;
+}
+
+/* Returns TRUE if addr came from a node's kpages, in which case we freed it. */
+static bool numa_kpages_free(void *addr, size_t size, bool xfree)
+{
+	struct page *pg = kva2page(addr);
+	struct numa_node *n;
+
+	if (!pg->pg_numa_node)
+		return FALSE;
+	n = &numa_nodes[pg->pg_numa_node - 1];
+	/* Clear before freeing; the page could be reallocated right away. */
+	pg->pg_numa_node = 0;
+	atomic_add(&n->nr_pages, -(long)(ROUNDUP(size, PGSIZE) >> PGSHIFT));
+	if (xfree)
+		arena_xfree(&n->kpages, addr, size);
+	else
+		arena_free(&n->kpages, addr, size);
+	return TRUE;
+}
+
+/* Helper: allocates from the node p's policy picks, then from the global
+ * kpages_arena.  Bound processes don't get the global fallback. */
+static void *__kpages_alloc(struct proc *p, size_t size, size_t align,
+                            int flags)
+{
+	void *ret;
+	int node;
+	bool bind;
+
+	if (nr_numa_nodes) {
+		node = numa_policy_node(p, &bind);
+		ret = numa_kpages_alloc(node, bind, size, align, flags);
+		if (ret || bind)
+			return ret;
+	}
+	if (align)
+		return arena_xalloc(kpages_arena, size, align, 0, 0, NULL, NULL,
+		                    flags);
+	return arena_alloc(kpages_arena, size, flags);
+}
+
+/* Pre-zeroed pages, per core.  Idle cores refill their own pool with
+ * zero_pool_refill(), and zeroing page allocations on that core take from it
+ * first.  The pages come from the core's local node, so processes with other
+ * NUMA policies skip the pool. */
+#define ZERO_POOL_NR_PGS	64
+#define ZERO_POOL_BATCH		8
+
+struct zero_pool {
+	struct page			*pages[ZERO_POOL_NR_PGS];
+	unsigned int			nr_pgs;
+	/* Stats, for #mem/zero_pool */
+	uint64_t			nr_hits;
+	uint64_t			nr_misses;
+	uint64_t			nr_zeroed;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct zero_pool zero_pools[MAX_NUM_CORES];
+
+/* Helper: pops a zeroed page from our core's pool, or returns NULL. */
+static struct page *zero_pool_get(struct proc *p)
+{
+	struct zero_pool *zp;
+	struct page *pg = NULL;
+	int8_t irq_state = 0;
+
+	if (nr_numa_nodes && p && p->mem_policy.mode != MPOL_LOCAL)
+		return NULL;
+	disable_irqsave(&irq_state);
+	zp = &zero_pools[core_id()];
+	if (zp->nr_pgs) {
+		pg = zp->pages[--zp->nr_pgs];
+		zp->nr_hits++;
+	} else {
+		zp->nr_misses++;
+	}
+	enable_irqsave(&irq_state);
+	return pg;
+}
+
+/* Called from the idle loop, with IRQs disabled.  Zeroes up to a batch of pages
+ * into our core's pool, with IRQs enabled while we zero.  Returns TRUE if the
+ * pool could use more, in which case the caller should check for work and call
+ * us again instead of halting. */
+bool zero_pool_refill(void)
+{
+	struct zero_pool *zp = &zero_pools[core_id()];
+	void *kva;
+
+	for (int i = 0; i < ZERO_POOL_BATCH; i++) {
+		if (zp->nr_pgs == ZERO_POOL_NR_PGS)
+			return FALSE;
+		kva = __kpages_alloc(NULL, PGSIZE, 0, MEM_ATOMIC);
+		if (!kva)
+			return FALSE;
+		enable_irq();
+		zero_page_nt(kva);
+		disable_irq();
+		/* An IRQ handler could have drained or filled the pool. */
+		if (zp->nr_pgs == ZERO_POOL_NR_PGS) {
+			kpages_free(kva, PGSIZE);
+			return FALSE;
+		}
+		zp->pages[zp->nr_pgs++] = kva2page(kva);
+		zp->nr_zeroed++;
+	}
+	return zp->nr_pgs < ZERO_POOL_NR_PGS;
+}
+
+/* Per-core zero pool stats, for #mem/zero_pool */
+struct sized_alloc *zero_pool_stats(void)
+{
+	struct sized_alloc *sza;
+	struct zero_pool *zp;
+	uint64_t hits = 0, misses = 0, zeroed = 0;
+
+	sza = sized_kzmalloc(200 + 80 * num_cores, MEM_WAIT);
+	sza_printf(sza, "%4s %8s %12s %12s %12s\n", "Core", "Pages", "Hits",
+	           "Misses", "Zeroed");
+	for (int i = 0; i < num_cores; i++) {
+		zp = &zero_pools[i];
+		hits += zp->nr_hits;
+		misses += zp->nr_misses;
+		zeroed += zp->nr_zeroed;
+		if (!zp->nr_zeroed && !zp->nr_misses)
+			continue;
+		sza_printf(sza, "%4d %8u %12llu %12llu %12llu\n", i,
+		           zp->nr_pgs, zp->nr_hits, zp->nr_misses,
+		           zp->nr_zeroed);
+	}
+	sza_printf(sza, "%4s %8s %12llu %12llu %12llu\n", "All", "", hits,
+	           misses, zeroed);
+	return sza;
+}
 
 /* Helper, allocates a free page. */
-static struct page *get_a_free_page(void)
+static struct page *get_a_free_page(struct proc *p)
 {
 	void *addr;
 
-	addr = kpages_alloc(PGSIZE, MEM_ATOMIC);
+	addr = __kpages_alloc(p, PGSIZE, 0, MEM_ATOMIC);
 	if (!addr)
 		return NULL;
 	return kva2page(addr);
@@ -34,8 +350,13 @@ static struct page *get_a_free_page(void)
  */
 error_t upage_alloc(struct proc *p, page_t **page, bool zero)
 {
-	struct page *pg = get_a_free_page();
+	struct page *pg;
 
+	if (zero && (pg = zero_pool_get(p))) {
+		*page = pg;
+		return 0;
+	}
+	pg = get_a_free_page(p);
 	if (!pg)
 		return -ENOMEM;
 	*page = pg;
@@ -44,9 +365,28 @@ error_t upage_alloc(struct proc *p, page_t **page, bool zero)
 	return 0;
 }
 
+/* Allocates a HUGE_PGSIZE, HUGE_PGSIZE-aligned block of user memory.  *page is
+ * the head of the block, which the caller maps with a single jumbo PTE. */
+error_t upage_alloc_huge(struct proc *p, page_t **page, bool zero)
+{
+	void *addr = __kpages_alloc(p, HUGE_PGSIZE, HUGE_PGSIZE, MEM_ATOMIC);
+	struct page *head;
+
+	if (!addr)
+		return -ENOMEM;
+	if (zero)
+		memset(addr, 0, HUGE_PGSIZE);
+	head = kva2page(addr);
+	for (int i = 0; i < HUGE_NR_PGS; i++)
+		atomic_or(&head[i].pg_flags, PG_HUGE);
+	atomic_set(&head->pg_huge_refs, HUGE_NR_PGS);
+	*page = head;
+	return 0;
+}
+
 error_t kpage_alloc(page_t **page)
 {
-	struct page *pg = get_a_free_page();
+	struct page *pg = get_a_free_page(NULL);
 
 	if (!pg)
 		return -ENOMEM;
@@ -58,7 +398,7 @@ error_t kpage_alloc(page_t **page)
  * returns the kernel address (kernbase), or 0 on error. */
 void *kpage_alloc_addr(void)
 {
-	struct page *pg = get_a_free_page();
+	struct page *pg = get_a_free_page(NULL);
 
 	if (!pg)
 		return 0;
@@ -67,22 +407,27 @@ void *kpage_alloc_addr(void)
 
 void *kpage_zalloc_addr(void)
 {
-	void *retval = kpage_alloc_addr();
+	struct page *pg = zero_pool_get(NULL);
+	void *retval;
+
+	if (pg)
+		return page2kva(pg);
+	retval = kpage_alloc_addr();
 	if (retval)
 		memset(retval, 0, PGSIZE);
 	return retval;
 }
 
-/* Helper function for allocating from the kpages_arena.  This may be useful
- * later since we might send the caller to a different NUMA domain. */
+/* Allocates from the local NUMA node's kpages arena, if we have nodes, falling
+ * back to the other nodes and then to the global kpages_arena. */
 void *kpages_alloc(size_t size, int flags)
 {
-	return arena_alloc(kpages_arena, size, flags);
+	return __kpages_alloc(NULL, size, 0, flags);
 }
 
 void *kpages_zalloc(size_t size, int flags)
 {
-	void *ret = arena_alloc(kpages_arena, size, flags);
+	void *ret = kpages_alloc(size, flags);
 
 	if (!ret)
 		return NULL;
@@ -90,9 +435,23 @@ void *kpages_zalloc(size_t size, int flags)
 	return ret;
 }
 
+/* Helper: returns addr to its node or to the global kpages_arena.  xfree is for
+ * allocations that were made with an alignment. */
+static void __kpages_free(void *addr, size_t size, bool xfree)
+{
+	if (numa_kpages_free(addr, size, xfree))
+		return;
+	if (xfree)
+		arena_xfree(kpages_arena, addr, size);
+	else
+		arena_free(kpages_arena, addr, size);
+}
+
 void kpages_free(void *addr, size_t size)
 {
-	arena_free(kpages_arena, addr, size);
+	if (!addr)
+		return;
+	__kpages_free(addr, size, FALSE);
 }
 
 /* Returns naturally aligned, contiguous pages of amount PGSIZE << order.  Linux
@@ -100,22 +459,124 @@ void kpages_free(void *addr, size_t size)
  * bnx2x). */
 void *get_cont_pages(size_t order, int flags)
 {
-	return arena_xalloc(kpages_arena, PGSIZE << order, PGSIZE << order,
-	                    0, 0, NULL, NULL, flags);
+	return __kpages_alloc(NULL, PGSIZE << order, PGSIZE << order, flags);
 }
 
 void free_cont_pages(void *buf, size_t order)
 {
-	arena_xfree(kpages_arena, buf, PGSIZE << order);
+	if (!buf)
+		return;
+	__kpages_free(buf, PGSIZE << order, TRUE);
 }
 
-/* Frees the page */
+/* Free memory in the node's ranges, still in the global base_arena.  This walks
+ * the base arena's segments, so it's only for diagnostics. */
+static size_t numa_base_unclaimed(struct numa_node *n)
+{
+	struct rb_node *rb_i;
+	struct btag *bt;
+	uintptr_t lo, hi;
+	size_t amt = 0;
+
+	spin_lock_irqsave(&base_arena->lock);
+	for (rb_i = rb_first(&base_arena->all_segs); rb_i;
+	     rb_i = rb_next(rb_i)) {
+		bt = container_of(rb_i, struct btag, all_link);
+		if (bt->status != BTAG_FREE)
+			continue;
+		for (int i = 0; i < n->nr_ranges; i++) {
+			lo = MAX(bt->start, n->ranges[i].start);
+			hi = MIN(bt->start + bt->size, n->ranges[i].end);
+			if (lo < hi)
+				amt += hi - lo;
+		}
+	}
+	spin_unlock_irqsave(&base_arena->lock);
+	return amt;
+}
+
+/* Per-node memory and placement stats, for #mem/numa_stats */
+struct sized_alloc *numa_stats(void)
+{
+	struct sized_alloc *sza;
+	struct numa_node *n;
+	size_t amt_free;
+
+	sza = sized_kzmalloc(200 + 300 * MAX_NUMA_NODES, MEM_WAIT);
+	if (!nr_numa_nodes) {
+		sza_printf(sza, "No NUMA nodes, using the global kpages arena\n");
+		return sza;
+	}
+	sza_printf(sza, "%4s %12s %12s %12s %12s %12s %12s %12s\n", "Node",
+	           "Total KB", "Free KB", "Used KB", "Hit", "Miss", "Foreign",
+	           "Interleave");
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		n = &numa_nodes[i];
+		amt_free = numa_base_unclaimed(n) + arena_amt_free(&n->base) +
+		           arena_amt_free(&n->kpages);
+		sza_printf(sza, "%4d %12lu %12lu %12lu %12lu %12lu %12lu %12lu\n",
+		           i, n->amt_total >> 10, amt_free >> 10,
+		           atomic_read(&n->nr_pages) * (PGSIZE >> 10),
+		           atomic_read(&n->nr_hit), atomic_read(&n->nr_miss),
+		           atomic_read(&n->nr_foreign),
+		           atomic_read(&n->nr_interleave));
+	}
+	return sza;
+}
+
+static struct page *huge_head(struct page *page)
+{
+	return pa2page(ROUNDDOWN(page2pa(page), HUGE_PGSIZE));
+}
+
+/* Helper: drops a reference on a huge block, freeing all of it on the last. */
+static void __huge_page_put(struct page *head)
+{
+	if (!atomic_sub_and_test(&head->pg_huge_refs, 1))
+		return;
+	for (int i = 0; i < HUGE_NR_PGS; i++)
+		atomic_and(&head[i].pg_flags, ~PG_HUGE);
+	__kpages_free(page2kva(head), HUGE_PGSIZE, TRUE);
+}
+
+/* Frees the page, unless it is still mapped copy-on-write by someone else.
+ * The last mapper to let go leaves pg_cow_refs at 0 for the next user.  Small
+ * pages from a split huge page go back with the rest of their block. */
 void page_decref(page_t *page)
 {
 	assert(!page_is_pagemap(page));
+	if (atomic_fetch_and_add(&page->pg_cow_refs, -1) > 0)
+		return;
+	atomic_set(&page->pg_cow_refs, 0);
+	if (atomic_read(&page->pg_flags) & PG_HUGE) {
+		__huge_page_put(huge_head(page));
+		return;
+	}
 	kpages_free(page2kva(page), PGSIZE);
 }
 
+/* Drops a jumbo PTE's reference on each page of the huge block. */
+void page_decref_huge(struct page *head)
+{
+	for (int i = 0; i < HUGE_NR_PGS; i++)
+		page_decref(head + i);
+}
+
+/* Adds another copy-on-write mapper of an anonymous page.  Each mapper will
+ * eventually page_decref() it. */
+void page_cow_share(struct page *page)
+{
+	assert(!page_is_pagemap(page));
+	atomic_inc(&page->pg_cow_refs);
+}
+
+/* Adds another copy-on-write jumbo mapper of an anonymous huge block. */
+void page_cow_share_huge(struct page *head)
+{
+	for (int i = 0; i < HUGE_NR_PGS; i++)
+		page_cow_share(head + i);
+}
+
 /* Attempts to get a lock on the page for IO operations.  If it is already
  * locked, it will block the kthread until it is unlocked.  Note that this is
  * really a "sleep on some event", not necessarily the IO, but it is "the page
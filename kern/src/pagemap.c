@@ -13,6 +13,8 @@
 #include <stdio.h>
 #include <pagemap.h>
 #include <rcu.h>
+#include <kmalloc.h>
+#include <trap.h>
 
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
@@ -96,10 +98,20 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	qlock_init(&pm->pm_qlock);
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
+	spinlock_init(&pm->pm_ra.lock);
+	pm->pm_ra.next_idx = 0;
+	pm->pm_ra.async_idx = ULONG_MAX;
+	pm->pm_ra.end_idx = 0;
+	pm->pm_ra.nr_pgs = 0;
+	pm->pm_ra.nr_inflight = 0;
+	cv_init_with_lock(&pm->pm_ra.inflight_cv, &pm->pm_ra.lock);
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
- * that need to be dropped with pm_put_page, or 0 if it was not in the map. */
+ * that need to be dropped with pm_put_page, or 0 if it was not in the map.
+ *
+ * This never takes a lock: readers of a file on many cores only contend on the
+ * slot's cache line. */
 static struct page *pm_find_page(struct page_map *pm, unsigned long index)
 {
 	void **tree_slot;
@@ -268,6 +280,139 @@ int pm_load_page_nowait(struct page_map *pm, unsigned long index,
 	return 0;
 }
 
+/* A batch of locked, !UPTODATE pages that readahead put in the PM.  We hold a
+ * PM slot ref on each. */
+struct pm_ra_batch {
+	struct page_map			*pm;
+	unsigned int			nr_pgs;
+	struct page			*pages[];
+};
+
+/* Runs as an RKM, so the reads overlap with the reader, which is usually
+ * blocked on its own readpage by the time we run. */
+static void __pm_ra_read(struct pm_ra_batch *batch)
+{
+	struct page_map *pm = batch->pm;
+	struct page *page;
+
+	for (int i = 0; i < batch->nr_pgs; i++) {
+		page = batch->pages[i];
+		/* If this fails, the page stays !UPTODATE, and pm_load_page()
+		 * will try again for whoever wants it. */
+		pm->pm_op->readpage(pm, page);
+		unlock_page(page);
+		pm_put_page(page);
+	}
+	kfree(batch);
+	/* Once we unlock, pm_destroy() can free the PM out from under us. */
+	spin_lock(&pm->pm_ra.lock);
+	pm->pm_ra.nr_inflight--;
+	cv_broadcast(&pm->pm_ra.inflight_cv);
+	spin_unlock(&pm->pm_ra.lock);
+}
+
+/* Puts locked, empty pages for [start, end) in the PM, skipping any that are
+ * already there, and kicks off their reads. */
+static void pm_ra_issue(struct page_map *pm, unsigned long start,
+                        unsigned long end)
+{
+	struct pm_ra_batch *batch;
+	struct page *page;
+
+	batch = kmalloc(sizeof(struct pm_ra_batch) +
+	                (end - start) * sizeof(struct page*), MEM_WAIT);
+	if (!batch)
+		return;
+	batch->pm = pm;
+	batch->nr_pgs = 0;
+	for (unsigned long i = start; i < end; i++) {
+		/* Readahead is just a hint; stop if we're out of memory. */
+		if (kpage_alloc(&page))
+			break;
+		atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP);
+		sem_init(&page->pg_sem, 0);
+		if (pm_insert_page(pm, i, page)) {
+			atomic_set(&page->pg_flags, 0);
+			page_decref(page);
+			continue;
+		}
+		batch->pages[batch->nr_pgs++] = page;
+	}
+	if (!batch->nr_pgs) {
+		kfree(batch);
+		return;
+	}
+	spin_lock(&pm->pm_ra.lock);
+	pm->pm_ra.nr_inflight++;
+	spin_unlock(&pm->pm_ra.lock);
+	run_as_rkm(__pm_ra_read, batch);
+}
+
+/* Tells the PM that someone is about to pm_load_page() index for a read of the
+ * file, which is nr_file_pgs long.  If the reads are sequential, we'll read
+ * ahead of them.  See struct pm_readahead.
+ *
+ * This runs on every fs_file_read(), and the rest of that path (pm_find_page())
+ * is lockless.  Rereads and sequential reads inside the current window only
+ * touch next_idx, so they skip the lock.  Everyone else only trylocks: if
+ * several cores are reading the same file at once, there's no single stream to
+ * predict anyway, and readahead is just a hint. */
+void pm_readahead(struct page_map *pm, unsigned long index,
+                  unsigned long nr_file_pgs)
+{
+	struct pm_readahead *ra = &pm->pm_ra;
+	unsigned long start = 0, end = 0;
+	unsigned long next_idx = READ_ONCE(ra->next_idx);
+	struct page *page;
+
+	if (index + 1 == next_idx)
+		return;
+	if (index == next_idx && index < READ_ONCE(ra->end_idx) &&
+	    index != READ_ONCE(ra->async_idx)) {
+		WRITE_ONCE(ra->next_idx, index + 1);
+		return;
+	}
+	if (!spin_trylock(&ra->lock))
+		return;
+	/* Multiple small reads of the same page */
+	if (index + 1 == ra->next_idx)
+		goto out;
+	if (index != ra->next_idx) {
+		ra->next_idx = index + 1;
+		ra->async_idx = ULONG_MAX;
+		ra->end_idx = 0;
+		ra->nr_pgs = 0;
+		goto out;
+	}
+	ra->next_idx = index + 1;
+	if (index >= ra->end_idx) {
+		/* Either our first sequential read, or the reader outran us. */
+		ra->nr_pgs = ra->nr_pgs ? MIN(ra->nr_pgs * 2, PM_RA_MAX_PGS)
+		                        : PM_RA_MIN_PGS;
+		start = index + 1;
+	} else if (index == ra->async_idx) {
+		/* The reader made it to our last window.  If that window's
+		 * first page is gone, we're reading too far ahead. */
+		page = pm_find_page(pm, index);
+		if (page) {
+			pm_put_page(page);
+			ra->nr_pgs = MIN(ra->nr_pgs * 2, PM_RA_MAX_PGS);
+		} else {
+			ra->nr_pgs = MAX(ra->nr_pgs / 2, PM_RA_MIN_PGS);
+		}
+		start = ra->end_idx;
+	} else {
+		goto out;
+	}
+	end = MIN(start + ra->nr_pgs, nr_file_pgs);
+	ra->async_idx = start;
+	ra->end_idx = MAX(start, end);
+out:
+	spin_unlock(&ra->lock);
+	if (start < end)
+		pm_ra_issue(pm, start, end);
+}
+
 static bool vmr_has_page_idx(struct vm_region *vmr, unsigned long pg_idx)
 {
 	unsigned long nr_pgs = (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
@@ -545,6 +690,11 @@ static bool __destroy_cb(void **slot, unsigned long tree_idx, void *arg)
 
 void pm_destroy(struct page_map *pm)
 {
+	/* Readahead batches hold slot refs until their reads finish. */
+	spin_lock(&pm->pm_ra.lock);
+	while (pm->pm_ra.nr_inflight)
+		cv_wait(&pm->pm_ra.inflight_cv);
+	spin_unlock(&pm->pm_ra.lock);
 	radix_for_each_slot(&pm->pm_tree, __destroy_cb, pm);
 	radix_tree_destroy(&pm->pm_tree);
 }
@@ -249,7 +249,8 @@ int page_insert(pgdir_t pgdir, struct page *page, void *va, int perm)
  * of the pte for this page.  This is used by page_remove
  * but should not be used by other callers.
  *
- * For jumbos, right now this returns the first Page* in the 4MB range
+ * For jumbos, this assumes a HUGE_PGSIZE user page and returns the small page
+ * within it that backs va.
  *
  * @param[in]  pgdir     the page directory from which we should do the lookup
  * @param[in]  va        the virtual address of the page we are looking up
@@ -267,6 +268,9 @@ page_t *page_lookup(pgdir_t pgdir, void *va, pte_t *pte_store)
 		return 0;
 	if (pte_store)
 		*pte_store = pte;
+	if (pte_is_jumbo(pte))
+		return pa2page(pte_get_paddr(pte) +
+		               ROUNDDOWN(PGOFF_HUGE(va), PGSIZE));
 	return pa2page(pte_get_paddr(pte));
 }
 
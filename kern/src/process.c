@@ -396,6 +396,8 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	if (parent) {
 		p->ppid = parent->pid;
 		proc_inherit_parent_username(p, parent);
+		p->mem_policy.mode = parent->mem_policy.mode;
+		p->mem_policy.node = parent->mem_policy.node;
 		proc_incref(p, 1);	/* storing a ref in the parent */
 		/* using the CV's lock to protect anything related to child
 		 * waiting */
@@ -417,6 +419,7 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	spinlock_init(&p->pte_lock);
 	TAILQ_INIT(&p->vm_regions); /* could init this in the slab */
 	p->vmr_history = 0;
+	spinlock_init_irqsave(&p->tlbsd.lock);
 	/* Initialize the vcore lists, we'll build the inactive list so that it
 	 * includes all vcores when we initialize procinfo.  Do this before
 	 * initing procinfo. */
@@ -750,6 +753,7 @@ static void __send_bulkp_events(struct proc *p)
 void __proc_run_m(struct proc *p)
 {
 	struct vcore *vc_i;
+	struct kmsg_batch batch;
 	switch (p->state) {
 	case (PROC_WAITING):
 	case (PROC_DYING):
@@ -769,13 +773,15 @@ void __proc_run_m(struct proc *p)
 			/* Send kernel messages to all online vcores (which were
 			 * added to the list and mapped in __proc_give_cores()),
 			 * making them turn online */
+			kmsg_batch_init(&batch);
 			TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-				send_kernel_message(vc_i->pcoreid, __startcore,
-					(long)p,
+				kmsg_batch_add(&batch, vc_i->pcoreid,
+					__startcore, (long)p,
 					(long)vcore2vcoreid(p, vc_i),
 					(long)vc_i->nr_preempts_sent,
 					KMSG_ROUTINE);
 			}
+			kmsg_batch_send(&batch);
 		} else {
 			warn("Tried to proc_run() an _M with no vcores!");
 		}
@@ -1683,19 +1689,22 @@ static void __proc_give_cores_running(struct proc *p, uint32_t *pc_arr,
                                       uint32_t num)
 {
 	struct vcore *vc_i;
+	struct kmsg_batch batch;
 	/* Up the refcnt, since num cores are going to start using this
 	 * process and have it loaded in their owning_proc and 'current'. */
 	proc_incref(p, num * 2);	/* keep in sync with __startcore */
 	__seq_start_write(&p->procinfo->coremap_seqctr);
 	p->procinfo->num_vcores += num;
 	assert(TAILQ_EMPTY(&p->bulk_preempted_vcs));
+	kmsg_batch_init(&batch);
 	for (int i = 0; i < num; i++) {
 		assert(__proc_give_a_pcore(p, pc_arr[i], &p->inactive_vcs,
 					   &vc_i));
-		send_kernel_message(pc_arr[i], __startcore, (long)p,
-		                    (long)vcore2vcoreid(p, vc_i),
-		                    (long)vc_i->nr_preempts_sent, KMSG_ROUTINE);
+		kmsg_batch_add(&batch, pc_arr[i], __startcore, (long)p,
+		               (long)vcore2vcoreid(p, vc_i),
+		               (long)vc_i->nr_preempts_sent, KMSG_ROUTINE);
 	}
+	kmsg_batch_send(&batch);
 	__seq_end_write(&p->procinfo->coremap_seqctr);
 }
 
@@ -1974,51 +1983,153 @@ void switch_back(struct proc *new_p, uintptr_t old_ret)
 	}
 }
 
-/* Will send a TLB shootdown message to every vcore in the main address space
- * (aka, all vcores for now).  The message will take the start and end virtual
- * addresses as well, in case we want to be more clever about how much we
- * shootdown and batching our messages.  Should do the sanity about rounding up
- * and down in this function too.
+/* Source of TLB shootdown generations.  They are unique across processes, so a
+ * core's tlb_gen from some old address space never looks caught up on a newer
+ * one. */
+static atomic_t tlb_shootdown_gen;
+
+/* Past this many pages, flushing the whole TLB beats INVLPGing each page. */
+#define TLB_FLUSH_MAX_PAGES		32
+
+/* Helper, flushes [start, end) from this core's TLB.  An empty range means
+ * everything. */
+static void __tlb_flush_range(uintptr_t start, uintptr_t end)
+{
+	start = ROUNDDOWN(start, PGSIZE);
+	end = ROUNDUP(end, PGSIZE);
+	if (start >= end || (end - start) / PGSIZE > TLB_FLUSH_MAX_PAGES) {
+		tlbflush();
+		return;
+	}
+	for (uintptr_t va = start; va < end; va += PGSIZE)
+		invlpg((void*)va);
+}
+
+/* Helper, brings this core's TLB up to date with p's shootdowns.  p's address
+ * space must be loaded.  Can be called from IRQ context. */
+static void __tlb_catch_up(struct proc *p)
+{
+	struct per_cpu_info *pcpui = this_pcpui_ptr();
+	struct tlb_shootdown *ts = &p->tlbsd;
+	struct tlb_shootdown_range todo[TLB_SHOOTDOWN_RING];
+	struct tlb_shootdown_range *r;
+	int nr_todo = 0;
+	size_t nr_pages = 0;
+	uint64_t gen;
+	bool full;
+
+	spin_lock_irqsave(&ts->lock);
+	gen = ts->gen;
+	if (pcpui->tlb_gen >= gen) {
+		spin_unlock_irqsave(&ts->lock);
+		return;
+	}
+	full = pcpui->tlb_gen < ts->lost_gen;
+	for (int i = 0; !full && i < TLB_SHOOTDOWN_RING; i++) {
+		r = &ts->ranges[i];
+		if (r->gen <= pcpui->tlb_gen)
+			continue;
+		if (r->start >= r->end)
+			full = TRUE;
+		nr_pages += (ROUNDUP(r->end, PGSIZE) -
+		             ROUNDDOWN(r->start, PGSIZE)) / PGSIZE;
+		todo[nr_todo++] = *r;
+	}
+	if (nr_pages > TLB_FLUSH_MAX_PAGES)
+		full = TRUE;
+	if (full)
+		ts->nr_full_flushes++;
+	else
+		ts->nr_range_flushes++;
+	spin_unlock_irqsave(&ts->lock);
+	if (full) {
+		tlbflush();
+	} else {
+		for (int i = 0; i < nr_todo; i++)
+			__tlb_flush_range(todo[i].start, todo[i].end);
+	}
+	pcpui->tlb_gen = gen;
+}
+
+/* Helper, records a shootdown of [start, end) in p's ring. */
+static void __tlb_record_shootdown(struct proc *p, uintptr_t start,
+                                   uintptr_t end)
+{
+	struct tlb_shootdown *ts = &p->tlbsd;
+	struct tlb_shootdown_range *r;
+
+	spin_lock_irqsave(&ts->lock);
+	r = &ts->ranges[ts->ring_idx];
+	ts->ring_idx = (ts->ring_idx + 1) % TLB_SHOOTDOWN_RING;
+	ts->lost_gen = MAX(ts->lost_gen, r->gen);
+	ts->gen = atomic_fetch_and_add(&tlb_shootdown_gen, 1) + 1;
+	r->gen = ts->gen;
+	r->start = start;
+	r->end = end;
+	ts->nr_shootdowns++;
+	spin_unlock_irqsave(&ts->lock);
+}
+
+/* Shoots down [start, end) (or everything, if the range is empty) from every
+ * core running p's address space.
  *
- * Would be nice to have a broadcast kmsg at this point.  Note this may send a
- * message to the calling core (interrupting it, possibly while holding the
- * proc_lock).  We don't need to process routine messages since it's an
- * immediate message. */
+ * Shootdowns are batched.  We record the range with a new generation in the
+ * process, and only send a __tlbshootdown kmsg to cores that don't already have
+ * one on the way.  Whenever that kmsg runs, it catches the core up on every
+ * shootdown it hasn't applied yet, so a burst of munmaps costs each core one
+ * IPI.  The calling core catches up directly, instead of IPIing itself. */
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
 {
 	/* TODO: need a better way to find cores running our address space.  we
 	 * can have kthreads running syscalls, async calls, processes being
 	 * created. */
 	struct vcore *vc_i;
+	struct kmsg_batch batch;
+	bool local = FALSE;
 
+	__tlb_record_shootdown(p, start, end);
 	/* TODO: we might be able to avoid locking here in the future (we must
 	 * hit all online, and we can check __mapped).  it'll be complicated. */
 	spin_lock(&p->proc_lock);
 	switch (p->state) {
 	case (PROC_RUNNING_S):
-		tlbflush();
+		local = TRUE;
 		break;
 	case (PROC_RUNNING_M):
-		/* TODO: (TLB) sanity checks and rounding on the ranges.
-		 *
-		 * We need to make sure that once a core that was online has
+		/* We need to make sure that once a core that was online has
 		 * been removed from the online list, then it must receive a TLB
 		 * flush (abandon_core()) before running the process again.
 		 * Either that, or make other decisions about who to
 		 * TLB-shootdown. */
+		kmsg_batch_init(&batch);
 		TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-			send_kernel_message(vc_i->pcoreid, __tlbshootdown,
-					    start, end, 0, KMSG_IMMEDIATE);
+			if (vc_i->pcoreid == core_id()) {
+				local = TRUE;
+				continue;
+			}
+			/* Pairs with the swap in __tlbshootdown.  Either the
+			 * core hasn't looked at p's gen yet, or it cleared the
+			 * flag and we send another. */
+			if (atomic_swap(&pcpui_var(vc_i->pcoreid,
+			                           tlb_kmsg_pending), 1)) {
+				p->tlbsd.nr_coalesced++;
+				continue;
+			}
+			kmsg_batch_add(&batch, vc_i->pcoreid, __tlbshootdown,
+				       0, 0, 0, KMSG_IMMEDIATE);
+			p->tlbsd.nr_kmsgs++;
 		}
+		kmsg_batch_send(&batch);
 		break;
 	default:
 		/* TODO: til we fix shootdowns, there are some odd cases where
 		 * we have the address space loaded, but the state is in
 		 * transition. */
-		if (p == current)
-			tlbflush();
+		local = TRUE;
 	}
 	spin_unlock(&p->proc_lock);
+	if (local && p == current)
+		__tlb_catch_up(p);
 	proc_iotlb_flush(p);
 }
 
@@ -2403,12 +2514,18 @@ void __death(uint32_t srcid, long a0, long a1, long a2)
 	clear_owning_proc(coreid);
 }
 
-/* Kernel message handler, usually sent IMMEDIATE, to shoot down virtual
- * addresses from a0 to a1. */
+/* Kernel message handler, sent IMMEDIATE, to catch this core up on the TLB
+ * shootdowns of whatever address space it has loaded. */
 void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 {
-	/* TODO: (TLB) something more intelligent with the range */
-	tlbflush();
+	struct per_cpu_info *pcpui = this_pcpui_ptr();
+
+	/* Clear the flag before reading the gen (the swap is a full barrier),
+	 * so a shootdown racing with us either gets caught up here, or sees the
+	 * flag clear and sends another kmsg. */
+	atomic_swap(&pcpui->tlb_kmsg_pending, 0);
+	if (pcpui->cur_proc)
+		__tlb_catch_up(pcpui->cur_proc);
 }
 
 void print_allpids(void)
@@ -2584,7 +2701,8 @@ void check_my_owner(void)
 				/* Immediate message was sent, we should get it
 				 * when we enable interrupts, which should cause
 				 * us to skip cpu_halt() */
-				if (!STAILQ_EMPTY(&pcpui->immed_amsgs))
+				if (!STAILQ_EMPTY(&pcpui->immed_amsgs) ||
+				    READ_ONCE(pcpui->immed_amsg_inbox))
 					continue;
 				printk("Owned pcore (%d) has no owner, by %p, vc %d!\n",
 				       core_id(), p, vcore2vcoreid(p, vc_i));
@@ -79,9 +79,10 @@ void rendez_debug_waiter(struct alarm_waiter *awaiter)
 	cv_unlock_irqsave(cv, &irq_state);
 }
 
-/* Like sleep, but it will timeout in 'usec' microseconds. */
-bool rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
-                          uint64_t usec)
+/* Like sleep, but it will timeout in 'usec' microseconds.  The timeout may
+ * fire up to 'slack' usec late, if that lets it share an alarm with others. */
+bool rendez_sleep_timeout_slack(struct rendez *rv, int (*cond)(void*),
+                                void *arg, uint64_t usec, uint64_t slack)
 {
 	int8_t irq_state = 0;
 	struct alarm_waiter awaiter;
@@ -106,6 +107,7 @@ bool rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
 	init_awaiter(&awaiter, rendez_alarm_handler);
 	awaiter.data = rv;
 	set_awaiter_rel(&awaiter, usec);
+	set_awaiter_slack(&awaiter, slack);
 	/* Set our alarm on this cpu's tchain.  Note that when we sleep in
 	 * cv_wait, we could be migrated, and later on we could be unsetting the
 	 * alarm remotely. */
@@ -142,6 +144,12 @@ bool rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
 	return ret;
 }
 
+bool rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
+                          uint64_t usec)
+{
+	return rendez_sleep_timeout_slack(rv, cond, arg, usec, 0);
+}
+
 /* plan9 rendez returned a pointer to the proc woken up.  we return "true" if we
  * woke someone up. */
 bool rendez_wakeup(struct rendez *rv)
@@ -466,10 +466,33 @@ static void depot_destroy(struct kmem_cache *kc)
 	unlock_depot(depot);
 }
 
+/* Slabs that import from the generic kpages_arena get their memory from the
+ * nearest NUMA node instead.  kpages_arena's own qcaches can't: they are how
+ * kpages_arena hands out small allocations. */
+static bool __import_from_kpages(struct kmem_cache *cp)
+{
+	return cp->source == kpages_arena && !(cp->flags & KMC_QCACHE);
+}
+
+static void *kmem_import(struct kmem_cache *cp, size_t amt)
+{
+	if (__import_from_kpages(cp))
+		return kpages_alloc(amt, MEM_ATOMIC);
+	return arena_alloc(cp->source, amt, MEM_ATOMIC);
+}
+
+static void kmem_unimport(struct kmem_cache *cp, void *obj, size_t amt)
+{
+	if (__import_from_kpages(cp))
+		kpages_free(obj, amt);
+	else
+		arena_free(cp->source, obj, amt);
+}
+
 static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 {
 	if (!__use_bufctls(cp)) {
-		arena_free(cp->source, a_slab->source_obj, PGSIZE);
+		kmem_unimport(cp, a_slab->source_obj, PGSIZE);
 	} else {
 		struct kmem_bufctl *i, *temp;
 
@@ -478,7 +501,7 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 			 * since we init the freelist when we reuse the slab. */
 			kmem_cache_free(kmem_bufctl_cache, i);
 		}
-		arena_free(cp->source, a_slab->source_obj, cp->import_amt);
+		kmem_unimport(cp, a_slab->source_obj, cp->import_amt);
 		kmem_cache_free(kmem_slab_cache, a_slab);
 	}
 }
@@ -818,7 +841,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 	if (!__use_bufctls(cp)) {
 		void *a_page;
 
-		a_page = arena_alloc(cp->source, PGSIZE, MEM_ATOMIC);
+		a_page = kmem_import(cp, PGSIZE);
 		if (!a_page)
 			return FALSE;
 		/* The slab struct is stored at the end of the page.  Keep it
@@ -849,7 +872,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		a_slab = kmem_cache_alloc(kmem_slab_cache, MEM_ATOMIC);
 		if (!a_slab)
 			return FALSE;
-		buf = arena_alloc(cp->source, cp->import_amt, MEM_ATOMIC);
+		buf = kmem_import(cp, cp->import_amt);
 		if (!buf)
 			goto err_slab;
 		a_slab->source_obj = buf;
@@ -894,7 +917,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 	return TRUE;
 
 err_source_obj:
-	arena_free(cp->source, a_slab->source_obj, cp->import_amt);
+	kmem_unimport(cp, a_slab->source_obj, cp->import_amt);
 err_slab:
 	kmem_cache_free(kmem_slab_cache, a_slab);
 	return FALSE;
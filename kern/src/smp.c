@@ -78,6 +78,10 @@ static void __attribute__((noreturn)) __smp_idle(void *arg)
 		process_routine_kmsg();
 		try_run_proc();
 		cpu_bored();		/* call out to the ksched */
+		/* Spare time: zero pages for later faults, a batch per loop so
+		 * we still notice kmsgs. */
+		if (zero_pool_refill())
+			continue;
 		/* cpu_halt() atomically turns on interrupts and halts the core.
 		 * Important to do this, since we could have a RKM come in via
 		 * an interrupt right while PRKM is returning, and we wouldn't
@@ -118,9 +122,9 @@ void smp_percpu_init(void)
 	kthread->flags = KTH_KTASK_FLAGS;
 	per_cpu_info[coreid].spare = 0;
 	/* Init relevant lists */
-	spinlock_init_irqsave(&per_cpu_info[coreid].immed_amsg_lock);
+	per_cpu_info[coreid].immed_amsg_inbox = NULL;
 	STAILQ_INIT(&per_cpu_info[coreid].immed_amsgs);
-	spinlock_init_irqsave(&per_cpu_info[coreid].routine_amsg_lock);
+	per_cpu_info[coreid].routine_amsg_inbox = NULL;
 	STAILQ_INIT(&per_cpu_info[coreid].routine_amsgs);
 	init_timer_chain(&this_pcpui_var(tchain), set_pcpu_alarm_interrupt);
 	/* Init generic tracing ring */
@@ -267,21 +271,22 @@ void smp_do_in_cores(const struct core_set *cset, void (*func)(void *),
 {
 	int cpu = core_id();
 	struct all_cpu_work acw;
+	struct kmsg_batch batch;
 
 	memset(&acw, 0, sizeof(acw));
 	completion_init(&acw.comp, core_set_remote_count(cset));
 	acw.func = func;
 	acw.opaque = opaque;
 
+	kmsg_batch_init(&batch);
 	for (int i = 0; i < num_cores; i++) {
-		if (core_set_getcpu(cset, i)) {
-			if (i == cpu)
-				func(opaque);
-			else
-				send_kernel_message(i, smp_do_core_work,
-						    (long)&acw, 0, 0,
-						    KMSG_ROUTINE);
-		}
+		if (core_set_getcpu(cset, i) && i != cpu)
+			kmsg_batch_add(&batch, i, smp_do_core_work, (long)&acw,
+				       0, 0, KMSG_ROUTINE);
 	}
+	kmsg_batch_send(&batch);
+	/* Our share runs while the others are getting their IPIs */
+	if (core_set_getcpu(cset, cpu))
+		func(opaque);
 	completion_wait(&acw.comp);
 }
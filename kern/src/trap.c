@@ -117,10 +117,58 @@ void kernel_msg_init(void)
 	                                     ARCH_CL_SIZE, 0, NULL, 0, 0, NULL);
 }
 
-uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
-                             long arg2, int type)
+/* A core's immediate inbox points here (instead of being empty) while the core
+ * is running its immediate messages.  Senders that push onto it know the core
+ * will see their message before it stops, so they skip the IPI. */
+static struct kernel_message kmsg_draining;
+
+/* Helper, pushes kmsg onto a core's inbox.  Returns TRUE if the core needs an
+ * IPI to find it, i.e. the inbox was empty.  There's no ABA problem, since the
+ * only thing that pulls from an inbox is a swap of the entire thing. */
+static bool __kmsg_push(struct kernel_message **inbox,
+                        struct kernel_message *kmsg)
+{
+	struct kernel_message *old;
+
+	do {
+		old = READ_ONCE(*inbox);
+		STAILQ_NEXT(kmsg, link) = old;
+	} while (!atomic_cas_ptr((void**)inbox, old, kmsg));
+	return !old;
+}
+
+/* Helper, empties inbox (leaving 'end' in it), and puts its messages on the
+ * tail of list, in the order they were sent.  Only the inbox's core calls
+ * this, with IRQs disabled. */
+static void __kmsg_take_inbox(struct kernel_message **inbox,
+                              struct kernel_msg_list *list,
+                              struct kernel_message *end)
+{
+	struct kernel_message *kmsg, *next, *fifo = NULL;
+
+	kmsg = atomic_swap_ptr((void**)inbox, end);
+	/* Inboxes are LIFO */
+	while (kmsg && kmsg != &kmsg_draining) {
+		next = STAILQ_NEXT(kmsg, link);
+		STAILQ_NEXT(kmsg, link) = fifo;
+		fifo = kmsg;
+		kmsg = next;
+	}
+	while (fifo) {
+		next = STAILQ_NEXT(fifo, link);
+		STAILQ_INSERT_TAIL(list, fifo, link);
+		fifo = next;
+	}
+}
+
+/* Helper, builds and queues a kmsg for dst.  Returns TRUE if dst needs an
+ * IPI. */
+static bool __queue_kernel_message(uint32_t dst, amr_t pc, long arg0,
+                                   long arg1, long arg2, int type)
 {
 	kernel_message_t *k_msg;
+	bool need_ipi;
+
 	assert(pc);
 	// note this will be freed on the destination core
 	k_msg = kmem_cache_alloc(kernel_msg_cache, 0);
@@ -132,27 +180,58 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 	k_msg->arg2 = arg2;
 	switch (type) {
 	case KMSG_IMMEDIATE:
-		spin_lock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
-		STAILQ_INSERT_TAIL(&per_cpu_info[dst].immed_amsgs, k_msg, link);
-		spin_unlock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
+		need_ipi = __kmsg_push(&per_cpu_info[dst].immed_amsg_inbox,
+		                       k_msg);
 		break;
 	case KMSG_ROUTINE:
-		spin_lock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
-		STAILQ_INSERT_TAIL(&per_cpu_info[dst].routine_amsgs, k_msg, link);
-		spin_unlock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
+		need_ipi = __kmsg_push(&per_cpu_info[dst].routine_amsg_inbox,
+		                       k_msg);
+		/* if we're sending a routine message locally, we don't
+		 * want/need an IPI */
+		if (dst == k_msg->srcid)
+			need_ipi = FALSE;
 		break;
 	default:
 		panic("Unknown type of kernel message!");
 	}
-	/* since we touched memory the other core will touch (the lock), we
-	 * don't need an wmb_f() */
-	/* if we're sending a routine message locally, we don't want/need an IPI
-	 */
-	if ((dst != k_msg->srcid) || (type == KMSG_IMMEDIATE))
+	/* the CAS on the inbox is a full barrier, so we don't need an wmb_f()
+	 * before any IPI */
+	return need_ipi;
+}
+
+uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
+                             long arg2, int type)
+{
+	if (__queue_kernel_message(dst, pc, arg0, arg1, arg2, type))
 		send_ipi(dst, I_KERNEL_MSG);
 	return 0;
 }
 
+void kmsg_batch_init(struct kmsg_batch *batch)
+{
+	core_set_init(&batch->ipi_cores);
+}
+
+/* Queues a kmsg, like send_kernel_message(), but holds off on the IPI until
+ * kmsg_batch_send().  Other senders to dst might be counting on that IPI, so
+ * don't sit on a batch. */
+void kmsg_batch_add(struct kmsg_batch *batch, uint32_t dst, amr_t pc,
+                    long arg0, long arg1, long arg2, int type)
+{
+	if (__queue_kernel_message(dst, pc, arg0, arg1, arg2, type))
+		core_set_setcpu(&batch->ipi_cores, dst);
+}
+
+/* Sends one IPI to every core in the batch that needs one. */
+void kmsg_batch_send(struct kmsg_batch *batch)
+{
+	for_each_core(i) {
+		if (core_set_getcpu(&batch->ipi_cores, i))
+			send_ipi(i, I_KERNEL_MSG);
+	}
+	core_set_init(&batch->ipi_cores);
+}
+
 /* Kernel message IPI/IRQ handler.
  *
  * This processes immediate messages, and that's it (it used to handle routines
@@ -161,32 +240,42 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
  * before halting).
  *
  * Note that all of this happens from interrupt context, and interrupts are
- * disabled. */
+ * disabled.  Immediate messages must return, o/w we'd leave the inbox marked as
+ * draining, and no one would IPI us again. */
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	struct kernel_message *kmsg_i, *temp;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->immed_amsgs))
+	struct kernel_message *kmsg_i;
+
+	/* Avoid the atomics if the inbox appears empty (lockless peek is okay,
+	 * a sender that races with us will IPI us again) */
+	if (!READ_ONCE(pcpui->immed_amsg_inbox))
 		return;
-	/* The lock serves as a cmb to force a re-read of the head of the list*/
-	spin_lock_irqsave(&pcpui->immed_amsg_lock);
-	STAILQ_FOREACH_SAFE(kmsg_i, &pcpui->immed_amsgs, link, temp) {
-		pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg_i->pc);
-		kmsg_i->pc(kmsg_i->srcid, kmsg_i->arg0, kmsg_i->arg1,
-			   kmsg_i->arg2);
-		STAILQ_REMOVE(&pcpui->immed_amsgs, kmsg_i, kernel_message,
-			      link);
-		kmem_cache_free(kernel_msg_cache, (void*)kmsg_i);
+	__kmsg_take_inbox(&pcpui->immed_amsg_inbox, &pcpui->immed_amsgs,
+	                  &kmsg_draining);
+	for (;;) {
+		while ((kmsg_i = STAILQ_FIRST(&pcpui->immed_amsgs))) {
+			STAILQ_REMOVE_HEAD(&pcpui->immed_amsgs, link);
+			pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg_i->pc);
+			kmsg_i->pc(kmsg_i->srcid, kmsg_i->arg0, kmsg_i->arg1,
+				   kmsg_i->arg2);
+			kmem_cache_free(kernel_msg_cache, (void*)kmsg_i);
+		}
+		/* Anything sent while we were draining skipped its IPI */
+		if (atomic_cas_ptr((void**)&pcpui->immed_amsg_inbox,
+		                   &kmsg_draining, NULL))
+			break;
+		__kmsg_take_inbox(&pcpui->immed_amsg_inbox,
+		                  &pcpui->immed_amsgs, &kmsg_draining);
 	}
-	spin_unlock_irqsave(&pcpui->immed_amsg_lock);
 }
 
 bool has_routine_kmsg(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	/* lockless peek */
-	return !STAILQ_EMPTY(&pcpui->routine_amsgs);
+	return !STAILQ_EMPTY(&pcpui->routine_amsgs) ||
+	       READ_ONCE(pcpui->routine_amsg_inbox);
 }
 
 /* Helper function, gets the next routine KMSG (RKM).  Returns 0 if the list was
@@ -195,16 +284,18 @@ static kernel_message_t *get_next_rkmsg(struct per_cpu_info *pcpui)
 {
 	struct kernel_message *kmsg;
 
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->routine_amsgs))
-		return 0;
-	/* The lock serves as a cmb to force a re-read of the head of the list.
-	 * IRQs are disabled by our caller. */
-	spin_lock(&pcpui->routine_amsg_lock);
+	/* Only refill from the inbox once we've run everything we pulled out
+	 * of it already.  IRQs are disabled by our caller. */
+	if (STAILQ_EMPTY(&pcpui->routine_amsgs)) {
+		/* Avoid the swap if the inbox appears empty */
+		if (!READ_ONCE(pcpui->routine_amsg_inbox))
+			return 0;
+		__kmsg_take_inbox(&pcpui->routine_amsg_inbox,
+		                  &pcpui->routine_amsgs, NULL);
+	}
 	kmsg = STAILQ_FIRST(&pcpui->routine_amsgs);
 	if (kmsg)
 		STAILQ_REMOVE_HEAD(&pcpui->routine_amsgs, link);
-	spin_unlock(&pcpui->routine_amsg_lock);
 	return kmsg;
 }
 
@@ -258,8 +349,20 @@ void print_kmsgs(uint32_t coreid)
 			       kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
 		}
 	}
+	void __print_inbox(struct kernel_message *kmsg_i, char *type)
+	{
+		for (; kmsg_i && kmsg_i != &kmsg_draining;
+		     kmsg_i = STAILQ_NEXT(kmsg_i, link)) {
+			printk("%s KMSG on %d from %d to run %p(%s)(%p, %p, %p) (inbox)\n",
+			       type, kmsg_i->dstid, kmsg_i->srcid, kmsg_i->pc,
+			       get_fn_name((long)kmsg_i->pc),
+			       kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
+		}
+	}
 	__print_kmsgs(&pcpui->immed_amsgs, "Immedte");
+	__print_inbox(pcpui->immed_amsg_inbox, "Immedte");
 	__print_kmsgs(&pcpui->routine_amsgs, "Routine");
+	__print_inbox(pcpui->routine_amsg_inbox, "Routine");
 }
 
 void __kmsg_trampoline(uint32_t srcid, long a0, long a1, long a2)
@@ -273,34 +376,37 @@ void kmsg_queue_stat(void)
 	struct kernel_message *kmsg;
 	bool immed_emp, routine_emp;
 
+	void __print_kmsg(struct kernel_message *kmsg, char *type, int i)
+	{
+		printk("%s msg on core %d:\n", type, i);
+		printk("\tsrc:  %d\n", kmsg->srcid);
+		printk("\tdst:  %d\n", kmsg->dstid);
+		printk("\tpc:   %p\n", kmsg->pc);
+		printk("\targ0: %p\n", kmsg->arg0);
+		printk("\targ1: %p\n", kmsg->arg1);
+		printk("\targ2: %p\n", kmsg->arg2);
+	}
+	/* Racy, remote peeks.  The core could be consuming these as we look. */
 	for (int i = 0; i < num_cores; i++) {
-		spin_lock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		immed_emp = STAILQ_EMPTY(&per_cpu_info[i].immed_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		spin_lock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		routine_emp = STAILQ_EMPTY(&per_cpu_info[i].routine_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].routine_amsg_lock);
+		immed_emp = STAILQ_EMPTY(&per_cpu_info[i].immed_amsgs) &&
+		            !READ_ONCE(per_cpu_info[i].immed_amsg_inbox);
+		routine_emp = STAILQ_EMPTY(&per_cpu_info[i].routine_amsgs) &&
+		              !READ_ONCE(per_cpu_info[i].routine_amsg_inbox);
 		printk("Core %d's immed_emp: %d, routine_emp %d\n", i,
 		       immed_emp, routine_emp);
 		if (!immed_emp) {
 			kmsg = STAILQ_FIRST(&per_cpu_info[i].immed_amsgs);
-			printk("Immed msg on core %d:\n", i);
-			printk("\tsrc:  %d\n", kmsg->srcid);
-			printk("\tdst:  %d\n", kmsg->dstid);
-			printk("\tpc:   %p\n", kmsg->pc);
-			printk("\targ0: %p\n", kmsg->arg0);
-			printk("\targ1: %p\n", kmsg->arg1);
-			printk("\targ2: %p\n", kmsg->arg2);
+			if (!kmsg)
+				kmsg = READ_ONCE(per_cpu_info[i].immed_amsg_inbox);
+			if (kmsg && kmsg != &kmsg_draining)
+				__print_kmsg(kmsg, "Immed", i);
 		}
 		if (!routine_emp) {
 			kmsg = STAILQ_FIRST(&per_cpu_info[i].routine_amsgs);
-			printk("Routine msg on core %d:\n", i);
-			printk("\tsrc:  %d\n", kmsg->srcid);
-			printk("\tdst:  %d\n", kmsg->dstid);
-			printk("\tpc:   %p\n", kmsg->pc);
-			printk("\targ0: %p\n", kmsg->arg0);
-			printk("\targ1: %p\n", kmsg->arg1);
-			printk("\targ2: %p\n", kmsg->arg2);
+			if (!kmsg)
+				kmsg = READ_ONCE(per_cpu_info[i].routine_amsg_inbox);
+			if (kmsg)
+				__print_kmsg(kmsg, "Routine", i);
 		}
 
 	}
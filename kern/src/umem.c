@@ -245,6 +245,16 @@ uintptr_t uva2kva(struct proc *p, void *uva, size_t len, int prot)
 	u_page = page_lookup(p->env_pgdir, uva, 0);
 	if (!u_page)
 		return 0;
+	/* Writes through the KVA bypass the PTE, so we need our own copy of a
+	 * CoW page first. */
+	if ((prot & PROT_WRITE) && !page_is_pagemap(u_page) &&
+	    page_is_cow_shared(u_page)) {
+		if (handle_page_fault_nofile(p, (uintptr_t)uva, PROT_WRITE))
+			return 0;
+		u_page = page_lookup(p->env_pgdir, uva, 0);
+		if (!u_page)
+			return 0;
+	}
 	return (uintptr_t)page2kva(u_page) + offset;
 }
 
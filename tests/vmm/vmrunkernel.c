@@ -102,38 +102,7 @@ static struct virtio_mmio_dev net_mmio_dev = {
 	.poke_guest = virtio_poke_guest,
 };
 
-static struct virtio_net_config net_cfg = {
-	.max_virtqueue_pairs = 1
-};
-static struct virtio_net_config net_cfg_d = {
-	.max_virtqueue_pairs = 1
-};
-
-static struct virtio_vq_dev net_vqdev = {
-	.name = "network",
-	.dev_id = VIRTIO_ID_NET,
-	.dev_feat = (1ULL << VIRTIO_F_VERSION_1 | 1 << VIRTIO_NET_F_MAC),
-
-	.num_vqs = 2,
-	.cfg = &net_cfg,
-	.cfg_d = &net_cfg_d,
-	.cfg_sz = sizeof(struct virtio_net_config),
-	.transport_dev = &net_mmio_dev,
-	.vqs = {
-		{
-			.name = "net_receiveq",
-			.qnum_max = 64,
-			.srv_fn = net_receiveq_fn,
-			.vqdev = &net_vqdev
-		},
-		{
-			.name = "net_transmitq",
-			.qnum_max = 64,
-			.srv_fn = net_transmitq_fn,
-			.vqdev = &net_vqdev
-		},
-	}
-};
+static struct virtio_vq_dev *net_vqdev;
 
 static struct virtio_mmio_dev blk_mmio_dev = {
 	.poke_guest = virtio_poke_guest,
@@ -148,7 +117,9 @@ static struct virtio_blk_config blk_cfg_d = {
 static struct virtio_vq_dev blk_vqdev = {
 	.name = "block",
 	.dev_id = VIRTIO_ID_BLOCK,
-	.dev_feat = (1ULL << VIRTIO_F_VERSION_1),
+	.dev_feat = (1ULL << VIRTIO_F_VERSION_1)
+	            | (1ULL << VIRTIO_BLK_F_FLUSH)
+	            | (1ULL << VIRTIO_BLK_F_DISCARD),
 
 	.num_vqs = 1,
 	.cfg = &blk_cfg,
@@ -623,7 +594,10 @@ int main(int argc, char **argv)
 
 	net_mmio_dev.addr =
 		virtio_mmio_base_addr + PGSIZE * VIRTIO_MMIO_NETWORK_DEV;
-	net_mmio_dev.vqdev = &net_vqdev;
+	/* One queue pair per guest core */
+	net_vqdev = virtio_net_alloc_vqdev(&net_mmio_dev,
+	                                   MIN(vm->nr_gpcs,
+	                                       VIRTIO_NET_MAX_QUEUE_PAIRS));
 	vm->virtio_mmio_devices[VIRTIO_MMIO_NETWORK_DEV] = &net_mmio_dev;
 
 	if (disk_image_file != NULL) {
@@ -631,11 +605,11 @@ int main(int argc, char **argv)
 			virtio_mmio_base_addr + PGSIZE * VIRTIO_MMIO_BLOCK_DEV;
 		blk_mmio_dev.vqdev = &blk_vqdev;
 		vm->virtio_mmio_devices[VIRTIO_MMIO_BLOCK_DEV] = &blk_mmio_dev;
-		blk_init_fn(&blk_vqdev, disk_image_file);
+		blk_init_fn(vm, &blk_vqdev, disk_image_file);
 	}
 
 	set_vnet_opts(net_opts);
-	vnet_init(vm, &net_vqdev);
+	vnet_init(vm, net_vqdev);
 	set_vnet_port_fwds(net_opts);
 
 	/* Set the kernel command line parameters */
@@ -12,12 +12,106 @@
 #include <parlib/parlib.h>
 #include <signal.h>
 #include <stdio.h>
+#include <sys/param.h>
 #include <unistd.h>
 
 static short endian = 1;
 static uint8_t *aendian = (uint8_t *)&endian;
 #define LITTLE *aendian
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#include <parlib/cpu_feat.h>
+
+/* The SIMD sums widen each 16 bit word into a 32 bit lane.  Each lane gets two
+ * words per vector, so we fold the lanes well before they could overflow. */
+#define SIMD_FOLD_BYTES (64 * 1024)
+
+static uint32_t fold_simd_sum(uint64_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* Sums the native-endian 16 bit words in [addr, addr + len), len a multiple of
+ * 16, folded to 16 bits. */
+static uint32_t sum_words_sse2(const uint8_t *addr, size_t len)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc, v;
+	uint32_t lanes[4];
+	uint64_t sum = 0;
+	size_t n;
+
+	while (len) {
+		n = MIN(len, SIMD_FOLD_BYTES);
+		acc = zero;
+		for (size_t i = 0; i < n; i += 16) {
+			v = _mm_loadu_si128((const __m128i *)(addr + i));
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+		}
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		addr += n;
+		len -= n;
+	}
+	return fold_simd_sum(sum);
+}
+
+/* Same, but len is a multiple of 32. */
+__attribute__((target("avx2")))
+static uint32_t sum_words_avx2(const uint8_t *addr, size_t len)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc, v;
+	uint32_t lanes[8];
+	uint64_t sum = 0;
+	size_t n;
+
+	while (len) {
+		n = MIN(len, SIMD_FOLD_BYTES);
+		acc = zero;
+		for (size_t i = 0; i < n; i += 32) {
+			v = _mm256_loadu_si256((const __m256i *)(addr + i));
+			acc = _mm256_add_epi32(acc,
+			                       _mm256_unpacklo_epi16(v, zero));
+			acc = _mm256_add_epi32(acc,
+			                       _mm256_unpackhi_epi16(v, zero));
+		}
+		_mm256_storeu_si256((__m256i *)lanes, acc);
+		for (int i = 0; i < 8; i++)
+			sum += lanes[i];
+		addr += n;
+		len -= n;
+	}
+	return fold_simd_sum(sum);
+}
+
+/* Sums the words of the largest multiple of 32 bytes at addr, returning the
+ * number of bytes summed.  Small buffers aren't worth it. */
+static size_t sum_words_simd(const uint8_t *addr, size_t len, uint32_t *sum)
+{
+	if (len < 64)
+		return 0;
+	len &= ~31;
+	if (cpu_has_feat(CPU_FEAT_X86_AVX2))
+		*sum += sum_words_avx2(addr, len);
+	else
+		*sum += sum_words_sse2(addr, len);
+	return len;
+}
+
+#else
+
+static size_t sum_words_simd(const uint8_t *addr, size_t len, uint32_t *sum)
+{
+	return 0;
+}
+
+#endif
+
 /* "Returns the one's complement checksum used in IP protocols."  That's from
  * Plan 9's man page.  This is not a usable, as is - you want to call
  * ip_calc_xsum(). */
@@ -25,6 +119,7 @@ uint16_t ptclbsum(uint8_t *addr, int len)
 {
 	uint32_t losum, hisum, mdsum, x;
 	uint32_t t1, t2;
+	size_t simd_len;
 
 	losum = 0;
 	hisum = 0;
@@ -39,6 +134,9 @@ uint16_t ptclbsum(uint8_t *addr, int len)
 		}
 		x = 1;
 	}
+	simd_len = sum_words_simd(addr, len, &mdsum);
+	addr += simd_len;
+	len -= simd_len;
 	while(len >= 16) {
 		t1 = *(uint16_t*)(addr + 0);
 		t2 = *(uint16_t*)(addr + 2);	mdsum += t1;
@@ -4,7 +4,10 @@
  * Kevin Klues <klueska@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * Slab allocator, based on the SunOS 5.4 allocator paper.
+ * Slab allocator, based on the SunOS 5.4 allocator paper, with the magazine
+ * and depot layer from Bonwick and Adams's 2001 paper.  Each vcore has a pair
+ * of magazines per cache, which it can use without locking as long as it
+ * disables notifs.  The depot holds magazines for the vcores to swap with.
  *
  * There is a list of kmem_cache, which are the caches of objects of a given
  * size.  This list is sorted in order of size.  Each kmem_cache has three
@@ -42,6 +45,35 @@ __BEGIN_DECLS
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+#define KMC_MAG_MIN_SZ		8
+#define KMC_MAG_MAX_SZ		62	/* chosen for mag size and caching */
+
+struct kmem_magazine {
+	SLIST_ENTRY(kmem_magazine)	link;
+	unsigned int			nr_rounds;
+	void				*rounds[KMC_MAG_MAX_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+SLIST_HEAD(kmem_mag_slist, kmem_magazine);
+
+/* One per vcore.  The magazines are allocated on the vcore's first use. */
+struct kmem_pcpu_cache {
+	unsigned int			magsize;
+	struct kmem_magazine		*loaded;
+	struct kmem_magazine		*prev;
+	size_t				nr_allocs_ever;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct kmem_depot {
+	struct spin_pdr_lock		lock;
+	struct kmem_mag_slist		not_empty;
+	struct kmem_mag_slist		empty;
+	unsigned int			magsize;
+	unsigned int			nr_empty;
+	unsigned int			nr_not_empty;
+	unsigned int			busy_count;
+	uint64_t			busy_start;
+};
+
 struct kmem_slab;
 
 /* Control block for buffers for large-object slabs */
@@ -71,6 +103,8 @@ TAILQ_HEAD(kmem_slab_list, kmem_slab);
 /* Actual cache */
 struct kmem_cache {
 	SLIST_ENTRY(kmem_cache) link;
+	struct kmem_pcpu_cache *pcpu_caches;
+	struct kmem_depot depot;
 	struct spin_pdr_lock cache_lock;
 	const char *name;
 	size_t obj_size;
@@ -10,12 +10,20 @@
  * objects, so we use the same style for small objects: store the pointer to the
  * controlling bufctl at the top of the slab object.  Fix this with TODO (BUF).
  *
+ * Unlike the kernel, objects in the slab layer are constructed: the ctor runs
+ * when a slab grows and the dtor when it is destroyed.  So the magazines hold
+ * constructed objects, and draining a magazine doesn't call the dtor.
+ *
  * Ported directly from the kernel's slab allocator. */
 
 #include <parlib/slab.h>
 #include <parlib/assert.h>
 #include <parlib/parlib.h>
 #include <parlib/stdio.h>
+#include <parlib/vcore.h>
+#include <parlib/uthread.h>
+#include <parlib/timing.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/param.h>
 
@@ -25,10 +33,142 @@ struct spin_pdr_lock kmem_caches_lock;
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
 static void kmem_cache_grow(struct kmem_cache *cp);
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp);
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf);
 
 /* Cache of the kmem_cache objects, needed for bootstrapping */
 struct kmem_cache kmem_cache_cache;
 struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache;
+struct kmem_cache kmem_magazine_cache;
+
+/* Depot contention tuning: more than resize_threshold contended acquisitions
+ * within resize_timeout_ns grows the magazines. */
+static uint64_t resize_timeout_ns = 1000000000;
+static unsigned int resize_threshold = 1;
+
+/* Each vcore has its own pcpu cache.  Disabling notifs keeps a uthread on its
+ * vcore, so it has exclusive use of the pcc until it enables them. */
+static struct kmem_pcpu_cache *lock_pcu_cache(struct kmem_cache *kc)
+{
+	uth_disable_notifs();
+	return &kc->pcpu_caches[vcore_id()];
+}
+
+static void unlock_pcu_cache(struct kmem_pcpu_cache *pcc)
+{
+	uth_enable_notifs();
+}
+
+static void lock_depot(struct kmem_depot *depot)
+{
+	uint64_t time;
+
+	if (spin_pdr_trylock(&depot->lock))
+		return;
+	/* The lock is contended.  When we finally get the lock, we'll up the
+	 * contention count and see if we've had too many contentions over time.
+	 * See the kernel's slab allocator for details. */
+	time = nsec();
+	spin_pdr_lock(&depot->lock);
+	/* If there are no not-empty mags, we're probably fighting for the lock
+	 * not because the magazines aren't big enough, but because there aren't
+	 * enough mags in the system yet. */
+	if (!depot->nr_not_empty)
+		return;
+	if (time - depot->busy_start > resize_timeout_ns) {
+		depot->busy_count = 0;
+		depot->busy_start = time;
+	}
+	depot->busy_count++;
+	if (depot->busy_count > resize_threshold) {
+		depot->busy_count = 0;
+		depot->magsize = MIN(KMC_MAG_MAX_SZ, depot->magsize + 1);
+		/* That's all we do - the pccs will eventually notice and up
+		 * their magazine sizes. */
+	}
+}
+
+static void unlock_depot(struct kmem_depot *depot)
+{
+	spin_pdr_unlock(&depot->lock);
+}
+
+static void depot_init(struct kmem_depot *depot)
+{
+	spin_pdr_init(&depot->lock);
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->magsize = KMC_MAG_MIN_SZ;
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	depot->busy_count = 0;
+	depot->busy_start = 0;
+}
+
+static bool mag_is_empty(struct kmem_magazine *mag)
+{
+	return mag->nr_rounds == 0;
+}
+
+/* Helper, swaps the loaded and previous mags.  Hold the pcc lock. */
+static void __swap_mags(struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_magazine *temp;
+
+	temp = pcc->prev;
+	pcc->prev = pcc->loaded;
+	pcc->loaded = temp;
+}
+
+/* Helper, returns a magazine to the depot.  Hold the depot lock. */
+static void __return_to_depot(struct kmem_cache *kc, struct kmem_magazine *mag)
+{
+	struct kmem_depot *depot = &kc->depot;
+
+	if (mag_is_empty(mag)) {
+		SLIST_INSERT_HEAD(&depot->empty, mag, link);
+		depot->nr_empty++;
+	} else {
+		SLIST_INSERT_HEAD(&depot->not_empty, mag, link);
+		depot->nr_not_empty++;
+	}
+}
+
+/* Helper, gives the contents of the magazine back to the slab layer. */
+static void drain_mag(struct kmem_cache *kc, struct kmem_magazine *mag)
+{
+	for (int i = 0; i < mag->nr_rounds; i++)
+		__kmem_free_to_slab(kc, mag->rounds[i]);
+	mag->nr_rounds = 0;
+}
+
+/* Helper, gives a pcc its magazines on first use.  Hold the pcc lock.  We get
+ * the mags straight from the magazine cache's slab layer, so we don't recurse
+ * on the pcc. */
+static void __pcc_load(struct kmem_pcpu_cache *pcc)
+{
+	if (pcc->loaded)
+		return;
+	pcc->loaded = __kmem_alloc_from_slab(&kmem_magazine_cache);
+	pcc->prev = __kmem_alloc_from_slab(&kmem_magazine_cache);
+}
+
+static struct kmem_pcpu_cache *build_pcpu_caches(void)
+{
+	struct kmem_pcpu_cache *pcc;
+	int ret;
+
+	ret = posix_memalign((void**)&pcc, __alignof__(struct kmem_pcpu_cache),
+	                     sizeof(struct kmem_pcpu_cache) * max_vcores());
+	assert(!ret);
+	for (int i = 0; i < max_vcores(); i++) {
+		pcc[i].magsize = KMC_MAG_MIN_SZ;
+		pcc[i].loaded = NULL;
+		pcc[i].prev = NULL;
+		pcc[i].nr_allocs_ever = 0;
+	}
+	return pcc;
+}
 
 static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -50,6 +190,8 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->dtor = dtor;
 	kc->priv = priv;
 	kc->nr_cur_alloc = 0;
+	depot_init(&kc->depot);
+	kc->pcpu_caches = build_pcpu_caches();
 	
 	/* put in cache list based on it's size */
 	struct kmem_cache *i, *prev = NULL;
@@ -68,10 +210,25 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	spin_pdr_unlock(&kmem_caches_lock);
 }
 
+static int __mag_ctor(void *obj, void *priv, int flags)
+{
+	struct kmem_magazine *mag = (struct kmem_magazine*)obj;
+
+	mag->nr_rounds = 0;
+	return 0;
+}
+
 static void kmem_cache_init(void *arg)
 {
 	spin_pdr_init(&kmem_caches_lock);
 	SLIST_INIT(&kmem_caches);
+	/* magazine must be first - all caches, including mags, will do a slab
+	 * alloc from the mag cache. */
+	parlib_static_assert(sizeof(struct kmem_magazine) <= SLAB_LARGE_CUTOFF);
+	__kmem_cache_create(&kmem_magazine_cache, "kmem_magazine",
+	                    sizeof(struct kmem_magazine),
+	                    __alignof__(struct kmem_magazine), 0, __mag_ctor,
+	                    NULL, NULL);
 	/* We need to call the __ version directly to bootstrap the global
 	 * kmem_cache_cache. */
 	__kmem_cache_create(&kmem_cache_cache, "kmem_cache",
@@ -140,12 +297,53 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 	}
 }
 
+/* Gives every vcore's magazines back to the depot.  Only call this when no one
+ * else is using the cache. */
+static void drain_pcpu_caches(struct kmem_cache *kc)
+{
+	struct kmem_pcpu_cache *pcc;
+
+	for (int i = 0; i < max_vcores(); i++) {
+		pcc = &kc->pcpu_caches[i];
+		if (!pcc->loaded)
+			continue;
+		lock_depot(&kc->depot);
+		__return_to_depot(kc, pcc->loaded);
+		__return_to_depot(kc, pcc->prev);
+		unlock_depot(&kc->depot);
+		pcc->loaded = NULL;
+		pcc->prev = NULL;
+	}
+}
+
+static void depot_destroy(struct kmem_cache *kc)
+{
+	struct kmem_magazine *mag_i;
+	struct kmem_depot *depot = &kc->depot;
+
+	lock_depot(depot);
+	while ((mag_i = SLIST_FIRST(&depot->not_empty))) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		drain_mag(kc, mag_i);
+		kmem_cache_free(&kmem_magazine_cache, mag_i);
+	}
+	while ((mag_i = SLIST_FIRST(&depot->empty))) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		assert(mag_i->nr_rounds == 0);
+		kmem_cache_free(&kmem_magazine_cache, mag_i);
+	}
+	unlock_depot(depot);
+}
+
 /* Once you call destroy, never use this cache again... o/w there may be weird
  * races, and other serious issues.  */
 void kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 
+	drain_pcpu_caches(cp);
+	depot_destroy(cp);
+	free(cp->pcpu_caches);
 	spin_pdr_lock(&cp->cache_lock);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
@@ -166,7 +364,44 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 }
 
 /* Front end: clients of caches use these */
-void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+void *kmem_cache_alloc(struct kmem_cache *kc, int flags)
+{
+	struct kmem_pcpu_cache *pcc = lock_pcu_cache(kc);
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_magazine *mag;
+	void *ret;
+
+	__pcc_load(pcc);
+try_alloc:
+	if (pcc->loaded->nr_rounds) {
+		ret = pcc->loaded->rounds[pcc->loaded->nr_rounds - 1];
+		pcc->loaded->nr_rounds--;
+		pcc->nr_allocs_ever++;
+		unlock_pcu_cache(pcc);
+		return ret;
+	}
+	if (!mag_is_empty(pcc->prev)) {
+		__swap_mags(pcc);
+		goto try_alloc;
+	}
+	/* Note the lock ordering: pcc -> depot */
+	lock_depot(depot);
+	mag = SLIST_FIRST(&depot->not_empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		depot->nr_not_empty--;
+		__return_to_depot(kc, pcc->prev);
+		unlock_depot(depot);
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		goto try_alloc;
+	}
+	unlock_depot(depot);
+	unlock_pcu_cache(pcc);
+	return __kmem_alloc_from_slab(kc);
+}
+
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp)
 {
 	void *retval = NULL;
 	spin_pdr_lock(&cp->cache_lock);
@@ -214,7 +449,57 @@ static inline struct kmem_bufctl *buf2bufctl(void *buf, size_t offset)
 	return *((struct kmem_bufctl**)(buf + offset));
 }
 
-void kmem_cache_free(struct kmem_cache *cp, void *buf)
+void kmem_cache_free(struct kmem_cache *kc, void *buf)
+{
+	struct kmem_pcpu_cache *pcc = lock_pcu_cache(kc);
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_magazine *mag;
+
+	assert(buf);	/* catch bugs */
+	__pcc_load(pcc);
+try_free:
+	if (pcc->loaded->nr_rounds < pcc->magsize) {
+		pcc->loaded->rounds[pcc->loaded->nr_rounds] = buf;
+		pcc->loaded->nr_rounds++;
+		unlock_pcu_cache(pcc);
+		return;
+	}
+	/* We just care if prev has room left, not that it is completely empty.
+	 * This could be the case due to magazine resize. */
+	if (pcc->prev->nr_rounds < pcc->magsize) {
+		__swap_mags(pcc);
+		goto try_free;
+	}
+	lock_depot(depot);
+	/* Here's where the resize magic happens.  We'll start using it for the
+	 * next magazine. */
+	pcc->magsize = depot->magsize;
+	mag = SLIST_FIRST(&depot->empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		depot->nr_empty--;
+		__return_to_depot(kc, pcc->prev);
+		unlock_depot(depot);
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		goto try_free;
+	}
+	unlock_depot(depot);
+	/* Need to unlock, in case we end up calling back into ourselves. */
+	unlock_pcu_cache(pcc);
+	mag = kmem_cache_alloc(&kmem_magazine_cache, 0);
+	assert(mag->nr_rounds == 0);
+	lock_depot(depot);
+	SLIST_INSERT_HEAD(&depot->empty, mag, link);
+	depot->nr_empty++;
+	unlock_depot(depot);
+	/* We might be on a different vcore now. */
+	pcc = lock_pcu_cache(kc);
+	__pcc_load(pcc);
+	goto try_free;
+}
+
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
@@ -376,6 +661,11 @@ void print_kmem_cache(struct kmem_cache *cp)
 	printf("Slab Empty: 0x%08x\n", cp->empty_slab_list);
 	printf("Current Allocations: %d\n", cp->nr_cur_alloc);
 	spin_pdr_unlock(&cp->cache_lock);
+	lock_depot(&cp->depot);
+	printf("Magsize: %d\n", cp->depot.magsize);
+	printf("Nr not-empty mags: %d\n", cp->depot.nr_not_empty);
+	printf("Nr empty mags: %d\n", cp->depot.nr_empty);
+	unlock_depot(&cp->depot);
 }
 
 void print_kmem_slab(struct kmem_slab *slab)
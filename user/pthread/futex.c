@@ -7,56 +7,118 @@
 #include <parlib/stdio.h>
 #include <errno.h>
 #include <parlib/slab.h>
-#include <parlib/mcs.h>
+#include <parlib/spinlock.h>
 #include <parlib/alarm.h>
 
+/* Waiters are hashed by uaddr into buckets, each with its own lock, so wakers
+ * only look at the waiters that share their bucket.  A requeue can move a
+ * waiter to another bucket, so e->bucket is protected by the lock of the bucket
+ * it points to.  See futex_lock_elem_bucket(). */
+#define FUTEX_NR_BUCKETS_SHIFT 8
+#define FUTEX_NR_BUCKETS (1 << FUTEX_NR_BUCKETS_SHIFT)
+
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+
+struct futex_bucket;
+
 struct futex_element {
 	TAILQ_ENTRY(futex_element) link;
 	int *uaddr;
+	struct futex_bucket *bucket;
 	bool on_list;
 	bool waker_using;
 	uth_cond_var_t cv;
 };
 TAILQ_HEAD(futex_queue, futex_element);
 
-struct futex_data {
-	struct mcs_pdr_lock lock;
+struct futex_bucket {
+	struct spin_pdr_lock lock;
 	struct futex_queue queue;
-};
-static struct futex_data __futex;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct futex_bucket __futex_buckets[FUTEX_NR_BUCKETS];
 
 static inline void futex_init(void *arg)
 {
-	mcs_pdr_init(&__futex.lock);
-	TAILQ_INIT(&__futex.queue);
+	for (int i = 0; i < FUTEX_NR_BUCKETS; i++) {
+		spin_pdr_init(&__futex_buckets[i].lock);
+		TAILQ_INIT(&__futex_buckets[i].queue);
+	}
+}
+
+static struct futex_bucket *futex_hash(int *uaddr)
+{
+	uint64_t key = (uintptr_t)uaddr >> 2;
+
+	return &__futex_buckets[(key * GOLDEN_RATIO_64) >>
+	                        (64 - FUTEX_NR_BUCKETS_SHIFT)];
+}
+
+/* Locks and returns e's bucket.  A requeue changes e->bucket while holding the
+ * locks of both the old and new buckets, so once we hold the lock of the bucket
+ * e points to, it won't change. */
+static struct futex_bucket *futex_lock_elem_bucket(struct futex_element *e)
+{
+	struct futex_bucket *b;
+
+	while (1) {
+		b = READ_ONCE(e->bucket);
+		spin_pdr_lock(&b->lock);
+		if (b == e->bucket)
+			return b;
+		spin_pdr_unlock(&b->lock);
+	}
+}
+
+/* Lock ordering for buckets is by address. */
+static void futex_lock_two(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+	if (b1 == b2) {
+		spin_pdr_lock(&b1->lock);
+	} else if (b1 < b2) {
+		spin_pdr_lock(&b1->lock);
+		spin_pdr_lock(&b2->lock);
+	} else {
+		spin_pdr_lock(&b2->lock);
+		spin_pdr_lock(&b1->lock);
+	}
+}
+
+static void futex_unlock_two(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+	spin_pdr_unlock(&b1->lock);
+	if (b1 != b2)
+		spin_pdr_unlock(&b2->lock);
 }
 
 static inline int futex_wait(int *uaddr, int val,
                              const struct timespec *abs_timeout)
 {
 	struct futex_element e[1];
+	struct futex_bucket *b = futex_hash(uaddr);
 	bool timed_out;
 
-	mcs_pdr_lock(&__futex.lock);
+	spin_pdr_lock(&b->lock);
 	if (*uaddr != val) {
-		mcs_pdr_unlock(&__futex.lock);
+		spin_pdr_unlock(&b->lock);
 		return 0;
 	}
 	e->uaddr = uaddr;
+	e->bucket = b;
 	uth_cond_var_init(&e->cv);
 	e->waker_using = false;
 	e->on_list = true;
-	TAILQ_INSERT_TAIL(&__futex.queue, e, link);
-	/* Lock switch.  Any waker will grab the global lock, then grab ours.
+	TAILQ_INSERT_TAIL(&b->queue, e, link);
+	/* Lock switch.  Any waker will grab the bucket lock, then grab ours.
 	 * We're downgrading to the CV lock, which still protects us from
 	 * missing the signal (which is someone calling Wake after changing
 	 * *uaddr).  The CV code will atomically block (with timeout) and unlock
 	 * the CV lock.
 	 *
-	 * Ordering is __futex.lock -> CV lock, but you can have the inner lock
+	 * Ordering is bucket lock -> CV lock, but you can have the inner lock
 	 * without holding the outer lock. */
 	uth_cond_var_lock(&e->cv);
-	mcs_pdr_unlock(&__futex.lock);
+	spin_pdr_unlock(&b->lock);
 
 	timed_out = !uth_cond_var_timed_wait(&e->cv, NULL, abs_timeout);
 	/* CV wait returns with the lock held, which is unneccessary for
@@ -66,16 +128,17 @@ static inline int futex_wait(int *uaddr, int val,
 	uth_cond_var_unlock(&e->cv);
 
 	/* In the common case, the waker woke us and already cleared on_list,
-	 * and we'd rather not grab the __futex lock again.  Note the outer
+	 * and we'd rather not grab the bucket lock again.  Note the outer
 	 * on_list check is an optimization, and we need the lock to be sure.
 	 * Also note the waker sets waker_using before on_list, so if we happen
 	 * to see !on_list (while the waker is mucking with the list), we'll see
-	 * waker_using and spin below. */
+	 * waker_using and spin below.  We might have been requeued, so our
+	 * bucket might not be b anymore. */
 	if (e->on_list) {
-		mcs_pdr_lock(&__futex.lock);
+		b = futex_lock_elem_bucket(e);
 		if (e->on_list)
-			TAILQ_REMOVE(&__futex.queue, e, link);
-		mcs_pdr_unlock(&__futex.lock);
+			TAILQ_REMOVE(&b->queue, e, link);
+		spin_pdr_unlock(&b->lock);
 	}
 	rmb();	/* read on_list before waker_using */
 	/* The waker might have yanked us and is about to kick the CV.  Need to
@@ -90,40 +153,100 @@ static inline int futex_wait(int *uaddr, int val,
 	return 0;
 }
 
-static inline int futex_wake(int *uaddr, int count)
+/* Moves up to count waiters on uaddr from b to q, returning how many.  Caller
+ * holds b's lock and must futex_kick_waiters(q) with notifs disabled. */
+static int __futex_dequeue_waiters(struct futex_bucket *b, int *uaddr,
+                                   int count, struct futex_queue *q)
 {
-	int max = count;
 	struct futex_element *e, *temp;
-	struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+	int nr = 0;
 
-	/* The waiter spins on us with cpu_relax_any().  That code assumes the
-	 * target of the wait/spin is in vcore context, or at least has notifs
-	 * disabled. */
-	uth_disable_notifs();
-	mcs_pdr_lock(&__futex.lock);
-	TAILQ_FOREACH_SAFE(e, &__futex.queue, link, temp) {
-		if (count <= 0)
+	TAILQ_FOREACH_SAFE(e, &b->queue, link, temp) {
+		if (nr >= count)
 			break;
 		if (e->uaddr == uaddr) {
 			e->waker_using = true;
 			/* flag waker_using before saying !on_list */
 			wmb();
 			e->on_list = false;
-			TAILQ_REMOVE(&__futex.queue, e, link);
-			TAILQ_INSERT_TAIL(&q, e, link);
-			count--;
+			TAILQ_REMOVE(&b->queue, e, link);
+			TAILQ_INSERT_TAIL(q, e, link);
+			nr++;
 		}
 	}
-	mcs_pdr_unlock(&__futex.lock);
-	TAILQ_FOREACH_SAFE(e, &q, link, temp) {
-		TAILQ_REMOVE(&q, e, link);
+	return nr;
+}
+
+static void futex_kick_waiters(struct futex_queue *q)
+{
+	struct futex_element *e, *temp;
+
+	TAILQ_FOREACH_SAFE(e, q, link, temp) {
+		TAILQ_REMOVE(q, e, link);
 		uth_cond_var_signal(&e->cv);
 		/* Do not touch e after marking it. */
 		e->waker_using = false;
 	}
+}
+
+static inline int futex_wake(int *uaddr, int count)
+{
+	struct futex_bucket *b = futex_hash(uaddr);
+	struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+	int nr_woken;
+
+	/* The waiter spins on us with cpu_relax_any().  That code assumes the
+	 * target of the wait/spin is in vcore context, or at least has notifs
+	 * disabled. */
+	uth_disable_notifs();
+	spin_pdr_lock(&b->lock);
+	nr_woken = __futex_dequeue_waiters(b, uaddr, count, &q);
+	spin_pdr_unlock(&b->lock);
+	futex_kick_waiters(&q);
+	uth_enable_notifs();
+
+	return nr_woken;
+}
+
+/* Wakes up to nr_wake waiters on uaddr and moves up to nr_requeue of the rest
+ * to wait on uaddr2, returning the total.  For FUTEX_CMP_REQUEUE, we only do
+ * this if *uaddr still equals cmpval, checked under the bucket lock. */
+static inline int futex_requeue(int *uaddr, int nr_wake, int nr_requeue,
+                                int *uaddr2, bool do_cmp, int cmpval)
+{
+	struct futex_bucket *b1 = futex_hash(uaddr);
+	struct futex_bucket *b2 = futex_hash(uaddr2);
+	struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+	struct futex_element *e, *temp;
+	int nr_woken, nr_moved = 0;
+
+	uth_disable_notifs();
+	futex_lock_two(b1, b2);
+	if (do_cmp && *uaddr != cmpval) {
+		futex_unlock_two(b1, b2);
+		uth_enable_notifs();
+		errno = EAGAIN;
+		return -1;
+	}
+	nr_woken = __futex_dequeue_waiters(b1, uaddr, nr_wake, &q);
+	TAILQ_FOREACH_SAFE(e, &b1->queue, link, temp) {
+		if (nr_moved >= nr_requeue)
+			break;
+		if (e->uaddr != uaddr)
+			continue;
+		e->uaddr = uaddr2;
+		if (b1 != b2) {
+			TAILQ_REMOVE(&b1->queue, e, link);
+			TAILQ_INSERT_TAIL(&b2->queue, e, link);
+			e->bucket = b2;
+		}
+		nr_moved++;
+	}
+	futex_unlock_two(b1, b2);
+	futex_kick_waiters(&q);
 	uth_enable_notifs();
 
-	return max - count;
+	return nr_woken + nr_moved;
 }
 
 int futex(int *uaddr, int op, int val, const struct timespec *timeout,
@@ -133,11 +256,15 @@ int futex(int *uaddr, int op, int val, const struct timespec *timeout,
 	struct timespec abs_timeout[1];
 
 	parlib_run_once(&once, futex_init, NULL);
-	assert(uaddr2 == NULL);
-	assert(val3 == 0);
 
-	/* futex timeouts are relative.  Internally, we use absolute timeouts */
-	if (timeout) {
+	switch (op & ~FUTEX_PRIVATE_FLAG) {
+	case FUTEX_WAIT:
+		assert(uaddr2 == NULL);
+		assert(val3 == 0);
+		if (!timeout)
+			return futex_wait(uaddr, val, NULL);
+		/* futex timeouts are relative.  Internally, we use absolute
+		 * timeouts */
 		clock_gettime(CLOCK_MONOTONIC, abs_timeout);
 		/* timespec_add is available inside glibc, but not out here. */
 		abs_timeout->tv_sec += timeout->tv_sec;
@@ -146,13 +273,19 @@ int futex(int *uaddr, int op, int val, const struct timespec *timeout,
 			abs_timeout->tv_nsec -= 1000000000;
 			abs_timeout->tv_sec++;
 		}
-	}
-
-	switch (op) {
-	case FUTEX_WAIT:
-		return futex_wait(uaddr, val, timeout ? abs_timeout : NULL);
+		return futex_wait(uaddr, val, abs_timeout);
 	case FUTEX_WAKE:
+		assert(uaddr2 == NULL);
+		assert(val3 == 0);
 		return futex_wake(uaddr, val);
+	/* For requeues, the timeout arg is actually the max number to requeue,
+	 * like Linux's val2. */
+	case FUTEX_REQUEUE:
+		return futex_requeue(uaddr, val, (int)(uintptr_t)timeout, uaddr2,
+		                     false, 0);
+	case FUTEX_CMP_REQUEUE:
+		return futex_requeue(uaddr, val, (int)(uintptr_t)timeout, uaddr2,
+		                     true, val3);
 	default:
 		errno = ENOSYS;
 		return -1;
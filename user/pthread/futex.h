@@ -4,9 +4,14 @@
 
 __BEGIN_DECLS
 
+/* Same values as Linux, since the VMM's linuxemu passes ops straight through */
 enum {
-	FUTEX_WAIT,
-	FUTEX_WAKE
+	FUTEX_WAIT = 0,
+	FUTEX_WAKE = 1,
+	FUTEX_REQUEUE = 3,
+	FUTEX_CMP_REQUEUE = 4,
+	/* All futexes are process-private; we ignore the flag. */
+	FUTEX_PRIVATE_FLAG = 128,
 };
 
 int futex(int *uaddr, int op, int val, const struct timespec *timeout,
@@ -35,11 +35,28 @@
  * pthread.c.  After that, we can have a signal handling thread (even for
  * 'thread0'), which allows us to close() or do other vcore-ctx-unsafe ops. */
 
-struct pthread_queue ready_queue = TAILQ_HEAD_INITIALIZER(ready_queue);
-struct pthread_queue active_queue = TAILQ_HEAD_INITIALIZER(active_queue);
-struct mcs_pdr_lock queue_lock;
-int threads_ready = 0;
-int threads_active = 0;
+/* Per-vcore run queues.  A thread that becomes runnable goes on the queue of
+ * the vcore it last ran on, so it comes back to a warm cache, and a vcore with
+ * nothing to run steals from a random other vcore before yielding.  Each queue
+ * has its own lock, so context switches on different vcores don't contend.
+ * The active list has the threads running on the vcore, which are also
+ * tracked by the vcore's lock.
+ *
+ * The stats (nr_steals, nr_migrations, rand) are only written by the vcore
+ * that owns the runq, in vcore context. */
+struct pth_runq {
+	struct spin_pdr_lock		lock;
+	struct pthread_queue		ready;
+	struct pthread_queue		active;
+	unsigned int			nr_ready;
+	unsigned int			nr_active;
+	uint32_t			rand;
+	uint64_t			nr_steals;
+	uint64_t			nr_migrations;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct pth_runq *runqs;
+atomic_t threads_ready;
 atomic_t threads_total;
 bool need_tls = TRUE;
 static uint64_t fork_generation;
@@ -92,6 +109,100 @@ static void __pthread_free_stack(struct pthread_tcb *pt);
 static int __pthread_allocate_stack(struct pthread_tcb *pt);
 static void __pth_yield_cb(struct uthread *uthread, void *junk);
 
+/* Cheap per-vcore PRNG (xorshift) for picking steal victims. */
+static uint32_t pth_runq_rand(struct pth_runq *rq)
+{
+	uint32_t x = rq->rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	rq->rand = x;
+	return x;
+}
+
+/* Pops the first thread on rq that belongs to this fork generation.  Caller
+ * holds rq's lock. */
+static struct pthread_tcb *__pth_runq_pop(struct pth_runq *rq)
+{
+	struct pthread_tcb *pth;
+
+	TAILQ_FOREACH(pth, &rq->ready, tq_next) {
+		if (pth->fork_generation < fork_generation)
+			continue;
+		TAILQ_REMOVE(&rq->ready, pth, tq_next);
+		rq->nr_ready--;
+		atomic_dec(&threads_ready);
+		return pth;
+	}
+	return NULL;
+}
+
+/* Takes a thread from another vcore's runq, starting at a random vcore.  We
+ * peek at nr_ready without the lock, so we don't bounce the locks of empty
+ * queues around. */
+static struct pthread_tcb *pth_steal(uint32_t vcoreid)
+{
+	struct pth_runq *rq = &runqs[vcoreid];
+	struct pth_runq *victim;
+	struct pthread_tcb *pth;
+	uint32_t nr = max_vcores();
+	uint32_t start = pth_runq_rand(rq) % nr;
+
+	for (int i = 0; i < nr; i++) {
+		victim = &runqs[(start + i) % nr];
+		if (victim == rq || !READ_ONCE(victim->nr_ready))
+			continue;
+		spin_pdr_lock(&victim->lock);
+		pth = __pth_runq_pop(victim);
+		spin_pdr_unlock(&victim->lock);
+		if (pth) {
+			rq->nr_steals++;
+			return pth;
+		}
+	}
+	return NULL;
+}
+
+/* Gets a thread for vcoreid to run, from its own runq or by stealing, and puts
+ * it on vcoreid's active list. */
+static struct pthread_tcb *pth_get_next_thread(uint32_t vcoreid)
+{
+	struct pth_runq *rq = &runqs[vcoreid];
+	struct pthread_tcb *pth;
+
+	spin_pdr_lock(&rq->lock);
+	pth = __pth_runq_pop(rq);
+	spin_pdr_unlock(&rq->lock);
+	if (!pth)
+		pth = pth_steal(vcoreid);
+	if (!pth)
+		return NULL;
+	assert(pth->state == PTH_RUNNABLE);
+	pth->state = PTH_RUNNING;
+	if (pth->vcoreid != vcoreid) {
+		rq->nr_migrations++;
+		pth->vcoreid = vcoreid;
+	}
+	spin_pdr_lock(&rq->lock);
+	TAILQ_INSERT_TAIL(&rq->active, pth, tq_next);
+	rq->nr_active++;
+	spin_pdr_unlock(&rq->lock);
+	return pth;
+}
+
+/* Picks the runq for a thread that is becoming runnable: the vcore it last ran
+ * on, if that vcore is still around.  o/w, we keep it local, and if we're busy,
+ * another vcore will steal it. */
+static struct pth_runq *pth_pick_runq(struct pthread_tcb *pthread)
+{
+	uint32_t vcoreid = pthread->vcoreid;
+
+	if (vcoreid >= max_vcores() || !vcore_is_mapped(vcoreid))
+		vcoreid = vcore_id();
+	return &runqs[vcoreid];
+}
+
 /* Called from vcore entry.  Options usually include restarting whoever was
  * running there before or running a new thread.  Events are handled out of
  * event.c (table of function pointers, stuff like that). */
@@ -106,7 +217,7 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 		run_current_uthread();
 		assert(0);
 	}
-	/* no one currently running, so lets get someone from the ready queue */
+	/* no one currently running, so lets get someone from a ready queue */
 	struct pthread_tcb *new_thread = NULL;
 
 	/* Try to get a thread.  If we get one, we'll break out and run it.  If
@@ -116,20 +227,8 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 	do {
 		handle_events(vcoreid);
 		__check_preempt_pending(vcoreid);
-		mcs_pdr_lock(&queue_lock);
-		TAILQ_FOREACH(new_thread, &ready_queue, tq_next) {
-			if (new_thread->fork_generation < fork_generation)
-				continue;
-			break;
-		}
+		new_thread = pth_get_next_thread(vcoreid);
 		if (new_thread) {
-			TAILQ_REMOVE(&ready_queue, new_thread, tq_next);
-			assert(new_thread->state == PTH_RUNNABLE);
-			new_thread->state = PTH_RUNNING;
-			TAILQ_INSERT_TAIL(&active_queue, new_thread, tq_next);
-			threads_active++;
-			threads_ready--;
-			mcs_pdr_unlock(&queue_lock);
 			/* If you see what looks like the same uthread running
 			 * in multiple places, your list might be jacked up.
 			 * Turn this on. */
@@ -139,7 +238,6 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 			       ((struct uthread*)new_thread)->flags);
 			break;
 		}
-		mcs_pdr_unlock(&queue_lock);
 		/* no new thread, try to yield */
 		printd("[P] No threads, vcore %d is yielding\n", vcore_id());
 		/* TODO: you can imagine having something smarter here, like
@@ -166,6 +264,7 @@ static void __pthread_run(void)
 static void pth_thread_runnable(struct uthread *uthread)
 {
 	struct pthread_tcb *pthread = (struct pthread_tcb*)uthread;
+	struct pth_runq *rq;
 
 	/* At this point, the 2LS can see why the thread blocked and was woken
 	 * up in the first place (coupling these things together).  On the yield
@@ -187,16 +286,18 @@ static void pth_thread_runnable(struct uthread *uthread)
 		      pthread);
 	}
 	pthread->state = PTH_RUNNABLE;
-	/* Insert the newly created thread into the ready queue of threads.  It
+	/* Insert the newly created thread into a ready queue of threads.  It
 	 * will be removed from this queue later when vcore_entry() comes up */
-	mcs_pdr_lock(&queue_lock);
+	rq = pth_pick_runq(pthread);
+	spin_pdr_lock(&rq->lock);
 	/* Again, GIANT WARNING: if you change this, change batch wakeup code */
-	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
-	threads_ready++;
-	mcs_pdr_unlock(&queue_lock);
+	TAILQ_INSERT_TAIL(&rq->ready, pthread, tq_next);
+	rq->nr_ready++;
+	atomic_inc(&threads_ready);
+	spin_pdr_unlock(&rq->lock);
 	/* Smarter schedulers should look at the num_vcores() and how much work
 	 * is going on to make a decision about how many vcores to request. */
-	vcore_request_more(threads_ready);
+	vcore_request_more(atomic_read(&threads_ready));
 }
 
 /* For some reason not under its control, the uthread stopped running (compared
@@ -505,17 +606,27 @@ static void pth_thread_bulk_runnable(uth_sync_t *wakees)
 {
 	struct uthread *uth_i;
 	struct pthread_tcb *pth_i;
+	struct pth_runq *rq, *locked = NULL;
 
-	/* Amortize the lock grabbing over all restartees */
-	mcs_pdr_lock(&queue_lock);
+	/* Amortize the lock grabbing over restartees that go to the same runq,
+	 * which is the common case when they last ran on the same vcore. */
 	while ((uth_i = __uth_sync_get_next(wakees))) {
 		pth_i = (struct pthread_tcb*)uth_i;
+		rq = pth_pick_runq(pth_i);
+		if (rq != locked) {
+			if (locked)
+				spin_pdr_unlock(&locked->lock);
+			spin_pdr_lock(&rq->lock);
+			locked = rq;
+		}
 		pth_i->state = PTH_RUNNABLE;
-		TAILQ_INSERT_TAIL(&ready_queue, pth_i, tq_next);
-		threads_ready++;
+		TAILQ_INSERT_TAIL(&rq->ready, pth_i, tq_next);
+		rq->nr_ready++;
+		atomic_inc(&threads_ready);
 	}
-	mcs_pdr_unlock(&queue_lock);
-	vcore_request_more(threads_ready);
+	if (locked)
+		spin_pdr_unlock(&locked->lock);
+	vcore_request_more(atomic_read(&threads_ready));
 }
 
 /* Akaros pthread extensions / hacks */
@@ -660,7 +771,16 @@ void pth_sched_init(void)
 	struct pthread_tcb *t;
 	int ret;
 
-	mcs_pdr_init(&queue_lock);
+	runqs = malloc(sizeof(struct pth_runq) * max_vcores());
+	assert(runqs);
+	for (int i = 0; i < max_vcores(); i++) {
+		memset(&runqs[i], 0, sizeof(struct pth_runq));
+		spin_pdr_init(&runqs[i].lock);
+		TAILQ_INIT(&runqs[i].ready);
+		TAILQ_INIT(&runqs[i].active);
+		runqs[i].rand = i + 1;
+	}
+	atomic_init(&threads_ready, 0);
 	fork_generation = INIT_FORK_GENERATION;
 	/* Create a pthread_tcb for the main thread */
 	ret = posix_memalign((void**)&t, __alignof__(struct pthread_tcb),
@@ -676,11 +796,12 @@ void pth_sched_init(void)
 	/* implies that sigmasks are longs, which they are. */
 	assert(t->id == 0);
 	SLIST_INIT(&t->cr_stack);
-	/* Put the new pthread (thread0) on the active queue */
-	mcs_pdr_lock(&queue_lock);
-	threads_active++;
-	TAILQ_INSERT_TAIL(&active_queue, t, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	/* Put the new pthread (thread0) on vcore 0's active queue */
+	t->vcoreid = 0;
+	spin_pdr_lock(&runqs[0].lock);
+	runqs[0].nr_active++;
+	TAILQ_INSERT_TAIL(&runqs[0].active, t, tq_next);
+	spin_pdr_unlock(&runqs[0].lock);
 	/* Tell the kernel where and how we want to receive events.  This is
 	 * just an example of what to do to have a notification turned on.
 	 * We're turning on USER_IPIs, posting events to vcore 0's vcpd, and
@@ -776,6 +897,8 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	pthread->state = PTH_CREATED;
 	pthread->id = get_next_pid();
 	pthread->fork_generation = fork_generation;
+	/* New threads start on the creator's vcore, unless someone steals them */
+	pthread->vcoreid = vcore_id();
 	SLIST_INIT(&pthread->cr_stack);
 	/* Respect the attributes */
 	if (attr) {
@@ -816,10 +939,24 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
  * active queue is keeping us honest.  Need to export for sem and friends. */
 void __pthread_generic_yield(struct pthread_tcb *pthread)
 {
-	mcs_pdr_lock(&queue_lock);
-	threads_active--;
-	TAILQ_REMOVE(&active_queue, pthread, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	struct pth_runq *rq = &runqs[pthread->vcoreid];
+
+	spin_pdr_lock(&rq->lock);
+	rq->nr_active--;
+	TAILQ_REMOVE(&rq->active, pthread, tq_next);
+	spin_pdr_unlock(&rq->lock);
+}
+
+int pthread_get_sched_stats(struct pthread_sched_stats *stats, int nr)
+{
+	nr = MIN(nr, max_vcores());
+	for (int i = 0; i < nr; i++) {
+		stats[i].nr_steals = READ_ONCE(runqs[i].nr_steals);
+		stats[i].nr_migrations = READ_ONCE(runqs[i].nr_migrations);
+		stats[i].nr_ready = READ_ONCE(runqs[i].nr_ready);
+		stats[i].nr_active = READ_ONCE(runqs[i].nr_active);
+	}
+	return nr;
 }
 
 int pthread_join(struct pthread_tcb *join_target, void **retval)
@@ -42,6 +42,7 @@ struct pthread_tcb {
 	int state;
 	uint32_t id;
 	uint64_t fork_generation;
+	uint32_t vcoreid;		/* last vcore we ran on */
 	uint32_t stacksize;
 	void *stacktop;
 	void *(*start_routine)(void*);
@@ -140,6 +141,19 @@ void pthread_need_tls(bool need);			/* default is TRUE */
 void pthread_mcp_init(void);
 void __pthread_generic_yield(struct pthread_tcb *pthread);
 
+/* Per-vcore scheduler stats.  nr_steals counts threads the vcore took from
+ * other vcores' run queues, and nr_migrations counts threads that ran on the
+ * vcore after last running elsewhere.  nr_ready and nr_active are the current
+ * lengths of the vcore's ready and active queues. */
+struct pthread_sched_stats {
+	uint64_t			nr_steals;
+	uint64_t			nr_migrations;
+	unsigned int			nr_ready;
+	unsigned int			nr_active;
+};
+/* Fills in stats for up to nr vcores, returning how many it filled in. */
+int pthread_get_sched_stats(struct pthread_sched_stats *stats, int nr);
+
 /* Profiling alarms for pthreads.  (profalarm.c) */
 void enable_profalarm(uint64_t usecs);
 void disable_profalarm(void);
@@ -41,5 +41,7 @@ void vnet_port_forward(char *protocol, char *host_port, char *guest_port);
 
 
 /***** Glue between virtio and NAT */
-int vnet_transmit_packet(struct iovec *iov, int iovcnt);
-int vnet_receive_packet(struct iovec *iov, int iovcnt);
+int vnet_transmit_packet(struct iovec *iov, int iovcnt,
+                         struct virtio_net_hdr_v1 *hdr);
+int vnet_receive_packet(int qidx, struct iovec *iov, int iovcnt);
+void vnet_set_nr_queues(int nr);
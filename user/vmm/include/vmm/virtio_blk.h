@@ -25,6 +25,8 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE. */
 #include <stdint.h>
+#include <vmm/vmm.h>
+#include <vmm/virtio.h>
 #include <vmm/virtio_ids.h>
 #include <vmm/virtio_config.h>
 
@@ -36,6 +38,8 @@
 #define VIRTIO_BLK_F_BLK_SIZE	6	/* Block size of disk is available*/
 #define VIRTIO_BLK_F_TOPOLOGY	10	/* Topology information is available */
 #define VIRTIO_BLK_F_MQ		12	/* support more than one vq */
+#define VIRTIO_BLK_F_DISCARD	13	/* DISCARD is supported */
+#define VIRTIO_BLK_F_WRITE_ZEROES	14	/* WRITE ZEROES is supported */
 
 /* Legacy feature bits */
 #ifndef VIRTIO_BLK_NO_LEGACY
@@ -84,6 +88,25 @@ struct virtio_blk_config {
 
 	/* number of vqs, only available when VIRTIO_BLK_F_MQ is set */
 	uint16_t num_queues;
+
+	/* the next 3 entries are guarded by VIRTIO_BLK_F_DISCARD */
+	/* The maximum discard sectors (in 512-byte sectors) for one segment. */
+	uint32_t max_discard_sectors;
+	/* The maximum number of discard segments in a discard command. */
+	uint32_t max_discard_seg;
+	/* Discard commands must be aligned to this number of sectors. */
+	uint32_t discard_sector_alignment;
+
+	/* the next 3 entries are guarded by VIRTIO_BLK_F_WRITE_ZEROES */
+	/* The maximum number of write zeroes sectors in one segment. */
+	uint32_t max_write_zeroes_sectors;
+	/* The maximum number of segments in a write zeroes command. */
+	uint32_t max_write_zeroes_seg;
+	/* Set if a VIRTIO_BLK_T_WRITE_ZEROES request may result in the
+	 * deallocation of one or more of the sectors. */
+	uint8_t write_zeroes_may_unmap;
+
+	uint8_t unused1[3];
 } __attribute__((packed));
 
 /*
@@ -112,6 +135,12 @@ struct virtio_blk_config {
 /* Get device ID command */
 #define VIRTIO_BLK_T_GET_ID    8
 
+/* Discard command */
+#define VIRTIO_BLK_T_DISCARD	11
+
+/* Write zeroes command */
+#define VIRTIO_BLK_T_WRITE_ZEROES	13
+
 #ifndef VIRTIO_BLK_NO_LEGACY
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER	0x80000000
@@ -131,6 +160,19 @@ struct virtio_blk_outhdr {
 	uint64_t sector;
 };
 
+/* Unmap this range (only valid for write zeroes command) */
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP	0x00000001
+
+/* Discard/write zeroes range for each request. */
+struct virtio_blk_discard_write_zeroes {
+	/* discard/write zeroes start sector */
+	uint64_t sector;
+	/* number of discard/write zeroes sectors */
+	uint32_t num_sectors;
+	/* flags for this range */
+	uint32_t flags;
+};
+
 #ifndef VIRTIO_BLK_NO_LEGACY
 struct virtio_scsi_inhdr {
 	uint32_t errors;
@@ -146,4 +188,5 @@ struct virtio_scsi_inhdr {
 #define VIRTIO_BLK_S_UNSUPP	2
 
 void *blk_request(void *_vq);
-void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename);
+void blk_init_fn(struct virtual_machine *vm, struct virtio_vq_dev *vqdev,
+		 const char *filename);
@@ -35,6 +35,11 @@ void *virtio_check_pointer(struct virtio_vq *vq, uint64_t addr,
 // Based on add_used in Linux's lguest.c
 void virtio_add_used_desc(struct virtio_vq *vq, uint32_t head, uint32_t len);
 
+// Adds several descriptor chains to the used ring, making them visible to the
+// guest all at once.  Mergeable RX buffers need this.
+void virtio_add_used_descs(struct virtio_vq *vq, uint32_t *heads,
+                           uint32_t *lens, int nr);
+
 // Waits for the next available descriptor chain and writes the addresses
 // and sizes of the buffers it describes to an iovec to make them easy to use.
 // Based on wait_for_vq_desc in Linux lguest.c
@@ -243,6 +243,13 @@ struct virtio_net_ctrl_mq {
 #define VIRTIO_NET_CTRL_GUEST_OFFLOADS   5
 #define VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET        0
 
+/* Our limit on VIRTIO_NET_F_MQ queue pairs */
+#define VIRTIO_NET_MAX_QUEUE_PAIRS 16
+
 void virtio_net_set_mac(struct virtio_vq_dev *vqdev, uint8_t *guest_mac);
 void *net_receiveq_fn(void *_vq);
 void *net_transmitq_fn(void *_vq);
+void *net_controlq_fn(void *_vq);
+struct virtio_mmio_dev;
+struct virtio_vq_dev *virtio_net_alloc_vqdev(struct virtio_mmio_dev *mmio_dev,
+                                             int nr_pairs);
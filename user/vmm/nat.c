@@ -63,8 +63,11 @@
  *   it comes to getting the packet to us, not the actual network's broadcast
  *   domain.
  *
- * - Why is the RX path single threaded?  So it's possible to rewrite
- *   __poll_inbound() such that readv() is not called while holding the rx_mtx.
+ * - Why is each RX queue single threaded?  With multiqueue, each virtio RX
+ *   queue has its own thread, mutex, and inbound_todo list, and a map is
+ *   steered to a single queue, so the queues run in parallel without sharing
+ *   anything.  Within a queue, it's possible to rewrite __poll_inbound() such
+ *   that readv() is not called while holding the queue's mtx.
  *   To do so, we pop the first item off the inbound_todo list (so we have the
  *   ref), do the read, then put it back on the list if it hasn't been drained
  *   to empty.  The main issue, apart from being more complicated, is that since
@@ -196,7 +199,12 @@ struct ip_nat_map {
 	int				host_data_fd;
 	bool				is_static;
 	bool				is_stale;
-	/* These fields are protected by the rx mutex */
+	/* Bypass ctl, for turning on TSO.  tso_mss is the MSS the host conv
+	 * was told; no_tso means the host can't TSO for this map. */
+	int				host_ctl_fd;
+	uint16_t			tso_mss;
+	bool				no_tso;
+	/* These fields are protected by the mutex of the map's rx queue */
 	TAILQ_ENTRY(ip_nat_map)		inbound;
 	bool				is_on_inbound;
 };
@@ -209,9 +217,9 @@ struct spin_pdr_lock maps_lock = SPINPDR_INITIALIZER;
 struct ip_nat_map_tailq map_hash_tuple[NR_VNET_HASH];
 struct ip_nat_map_tailq map_hash_fd[NR_VNET_HASH];
 
-/* The todo list, used to track FDs that had activity but haven't told us EAGAIN
- * yet.  The list is protected by the rx_mtx */
-struct ip_nat_map_tailq inbound_todo = TAILQ_HEAD_INITIALIZER(inbound_todo);
+/* Protects map creation, so that concurrent TX queues don't create two maps
+ * for the same tuple. */
+uth_mutex_t *map_create_mtx;
 
 /* buf_pkt: tracks a packet, used for injecting packets (usually synthetic
  * responses) into the guest via receive_packet. */
@@ -222,9 +230,25 @@ struct buf_pkt {
 };
 STAILQ_HEAD(buf_pkt_stailq, buf_pkt);
 
+/* Each virtio RX queue has its own rxq.  The todo list tracks FDs that had
+ * activity but haven't told us EAGAIN yet, and it is protected by the rxq's
+ * mtx.  A map is on the todo list of rxq (host_data_fd % nr_rxqs_active), so
+ * that a connection's packets stay in order.  Injected packets always go to
+ * rxq 0, which the guest uses regardless of how many queues it turned on.
+ *
+ * rxq_steer_mtx protects nr_rxqs_active.  Lock ordering: rxq_steer_mtx, then
+ * the rxq mtxs in index order. */
+struct vnet_rxq {
+	uth_mutex_t			*mtx;
+	uth_cond_var_t			*cv;
+	struct ip_nat_map_tailq		inbound_todo;
+};
+
 struct buf_pkt_stailq inject_pkts = STAILQ_HEAD_INITIALIZER(inject_pkts);
-uth_mutex_t *rx_mtx;
-uth_cond_var_t *rx_cv;
+struct vnet_rxq *rxqs;
+int nr_rxqs;
+int nr_rxqs_active = 1;
+uth_mutex_t *rxq_steer_mtx;
 struct event_queue *inbound_evq;
 
 static void tap_inbound_conv(int fd);
@@ -296,6 +320,7 @@ static void map_release(struct kref *kref)
 	struct ip_nat_map *map = container_of(kref, struct ip_nat_map, kref);
 
 	close(map->host_data_fd);
+	close(map->host_ctl_fd);
 	free(map);
 }
 
@@ -322,6 +347,8 @@ static struct ip_nat_map *create_map(uint8_t protocol, uint16_t guest_port,
 	map->is_static = is_static;
 	map->is_stale = FALSE;
 	map->is_on_inbound = FALSE;
+	map->tso_mss = 0;
+	map->no_tso = FALSE;
 
 	switch (protocol) {
 	case IP_UDPPROTO:
@@ -352,7 +379,8 @@ static struct ip_nat_map *create_map(uint8_t protocol, uint16_t guest_port,
 
 	tap_inbound_conv(map->host_data_fd);
 
-	close(bypass_fd);
+	/* We keep the ctl open for the life of the map, for TSO. */
+	map->host_ctl_fd = bypass_fd;
 	return map;
 }
 
@@ -365,11 +393,17 @@ static struct ip_nat_map *get_map_by_tuple(uint8_t protocol,
 	map = lookup_map_by_tuple(protocol, guest_port);
 	if (map)
 		return map;
-	map = create_map(protocol, guest_port, "*", FALSE);
-	if (!map)
-		return NULL;
-	kref_get(&map->kref, 1);
-	add_map(map);
+	uth_mutex_lock(map_create_mtx);
+	/* Another TX queue could have created it while we waited. */
+	map = lookup_map_by_tuple(protocol, guest_port);
+	if (!map) {
+		map = create_map(protocol, guest_port, "*", FALSE);
+		if (map) {
+			kref_get(&map->kref, 1);
+			add_map(map);
+		}
+	}
+	uth_mutex_unlock(map_create_mtx);
 	return map;
 }
 
@@ -457,10 +491,10 @@ static void free_bpkt(struct buf_pkt *bpkt)
 /* Queues a buf_pkt, which the rx thread will inject when it wakes. */
 static void inject_buf_pkt(struct buf_pkt *bpkt)
 {
-	uth_mutex_lock(rx_mtx);
+	uth_mutex_lock(rxqs[0].mtx);
 	STAILQ_INSERT_TAIL(&inject_pkts, bpkt, next);
-	uth_mutex_unlock(rx_mtx);
-	uth_cond_var_broadcast(rx_cv);
+	uth_mutex_unlock(rxqs[0].mtx);
+	uth_cond_var_broadcast(rxqs[0].cv);
 }
 
 /* Helper for xsum_update, mostly for paranoia with integer promotion and
@@ -657,6 +691,7 @@ static void *fdtap_watcher(void *arg)
 {
 	struct event_msg msg[1];
 	struct ip_nat_map *map;
+	struct vnet_rxq *rxq;
 
 	while (1) {
 		uth_blockon_evqs(msg, NULL, 1, inbound_evq);
@@ -665,19 +700,58 @@ static void *fdtap_watcher(void *arg)
 		 */
 		if (!map)
 			continue;
-		uth_mutex_lock(rx_mtx);
+		uth_mutex_lock(rxq_steer_mtx);
+		rxq = &rxqs[map->host_data_fd % nr_rxqs_active];
+		uth_mutex_lock(rxq->mtx);
 		if (!map->is_on_inbound) {
 			map->is_on_inbound = TRUE;
-			TAILQ_INSERT_TAIL(&inbound_todo, map, inbound);
-			uth_cond_var_broadcast(rx_cv);
+			TAILQ_INSERT_TAIL(&rxq->inbound_todo, map, inbound);
+			uth_cond_var_broadcast(rxq->cv);
 		} else {
 			kref_put(&map->kref);
 		}
-		uth_mutex_unlock(rx_mtx);
+		uth_mutex_unlock(rxq->mtx);
+		uth_mutex_unlock(rxq_steer_mtx);
 	}
 	return 0;
 }
 
+/* virtio-net calls this when the guest changes the number of queue pairs it
+ * uses.  Maps are steered by nr_rxqs_active, so we re-steer every map on a
+ * todo list. */
+void vnet_set_nr_queues(int nr)
+{
+	struct ip_nat_map_tailq todo = TAILQ_HEAD_INITIALIZER(todo);
+	struct ip_nat_map *i, *temp;
+	struct vnet_rxq *rxq;
+
+	if (nr < 1 || nr > nr_rxqs) {
+		fprintf(stderr, "Bad number of vnet queues %d, ignoring!\n",
+			nr);
+		return;
+	}
+	uth_mutex_lock(rxq_steer_mtx);
+	for (int q = 0; q < nr_rxqs; q++)
+		uth_mutex_lock(rxqs[q].mtx);
+	for (int q = 0; q < nr_rxqs; q++) {
+		TAILQ_FOREACH_SAFE(i, &rxqs[q].inbound_todo, inbound, temp) {
+			TAILQ_REMOVE(&rxqs[q].inbound_todo, i, inbound);
+			TAILQ_INSERT_TAIL(&todo, i, inbound);
+		}
+	}
+	nr_rxqs_active = nr;
+	TAILQ_FOREACH_SAFE(i, &todo, inbound, temp) {
+		rxq = &rxqs[i->host_data_fd % nr_rxqs_active];
+		TAILQ_REMOVE(&todo, i, inbound);
+		TAILQ_INSERT_TAIL(&rxq->inbound_todo, i, inbound);
+	}
+	for (int q = nr_rxqs - 1; q >= 0; q--) {
+		uth_mutex_unlock(rxqs[q].mtx);
+		uth_cond_var_broadcast(rxqs[q].cv);
+	}
+	uth_mutex_unlock(rxq_steer_mtx);
+}
+
 static struct event_queue *get_inbound_evq(void)
 {
 	struct event_queue *ceq;
@@ -729,8 +803,17 @@ void vnet_init(struct virtual_machine *vm, struct virtio_vq_dev *vqdev)
 	if (vnet_real_ip_addrs)
 		guest_eth_addr[5] = 0xc;
 	virtio_net_set_mac(vqdev, guest_eth_addr);
-	rx_mtx = uth_mutex_alloc();
-	rx_cv = uth_cond_var_alloc();
+	/* Every queue pair has one RX and one TX vq, plus maybe a control vq */
+	nr_rxqs = vqdev->num_vqs / 2;
+	rxqs = malloc(sizeof(struct vnet_rxq) * nr_rxqs);
+	assert(rxqs);
+	for (int i = 0; i < nr_rxqs; i++) {
+		rxqs[i].mtx = uth_mutex_alloc();
+		rxqs[i].cv = uth_cond_var_alloc();
+		TAILQ_INIT(&rxqs[i].inbound_todo);
+	}
+	rxq_steer_mtx = uth_mutex_alloc();
+	map_create_mtx = uth_mutex_alloc();
 	if (vnet_snoop)
 		snoop_on_virtio();
 	init_map_lookup(vm);
@@ -1197,7 +1280,181 @@ static uint8_t ipv4_get_version(struct iovec *iov, int iovcnt, size_t ip_off)
 	return iov_get_byte(iov, iovcnt, ip_off + 0) & 0xf0;
 }
 
-static void handle_ipv4_tx(struct iovec *iov, int iovcnt)
+/* Sums the iov from off to the end, like ptclbsum().  ptclbsum() sums as if
+ * its buffer starts on an even byte, so we swap the sums of segments that start
+ * on an odd one. */
+static uint16_t iov_ptclbsum(struct iovec *iov, int iovcnt, size_t off)
+{
+	uint32_t sum = 0;
+	uint16_t seg_sum;
+	bool odd = FALSE;
+	uint8_t *p;
+	size_t len;
+
+	for (int i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		len = iov[i].iov_len;
+		if (off >= len) {
+			off -= len;
+			continue;
+		}
+		p += off;
+		len -= off;
+		off = 0;
+		seg_sum = ptclbsum(p, len);
+		if (odd)
+			seg_sum = (seg_sum << 8) | (seg_sum >> 8);
+		sum += seg_sum;
+		odd ^= len & 1;
+	}
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* Finishes a VIRTIO_NET_HDR_F_NEEDS_CSUM packet.  The guest put the partial
+ * sum (the pseudo header) at csum_start + csum_offset; the rest is the sum from
+ * csum_start to the end of the packet. */
+static void finish_partial_xsum(struct iovec *iov, int iovcnt,
+                                size_t csum_start, size_t csum_offset)
+{
+	if (!iov_has_bytes(iov, iovcnt, csum_start + csum_offset + 2)) {
+		fprintf(stderr, "Bad partial xsum offset, not finishing it!\n");
+		return;
+	}
+	iov_put_be16(iov, iovcnt, csum_start + csum_offset,
+	             ones_comp(iov_ptclbsum(iov, iovcnt, csum_start)));
+}
+
+/* Returns the sum of the TCP pseudo header for the IP header at ip_hdr. */
+static uint16_t tcp_pseudo_sum(uint8_t *ip_hdr, uint16_t tcp_len)
+{
+	uint8_t ph[12];
+
+	memcpy(ph, ip_hdr + IPV4_OFF_SRC, IPV4_ADDR_LEN * 2);
+	ph[8] = 0;
+	ph[9] = IP_TCPPROTO;
+	hnputs(ph + 10, tcp_len);
+	return ptclbsum(ph, sizeof(ph));
+}
+
+#define TCP_FL_FIN		0x01
+#define TCP_FL_PSH		0x08
+#define TCP_FL_CWR		0x80
+
+/* Software TSO: sends the TCP packet in iov (starting at the IP header) as
+ * segments of at most mss bytes of payload, each with complete xsums.  This
+ * is for when the host can't TSO for us. */
+static void tcp_segment_tx(struct ip_nat_map *map, struct iovec *iov,
+                           int iovcnt, size_t tcp_off, uint16_t mss)
+{
+	size_t ip_len = iov_get_be16(iov, iovcnt, IPV4_OFF_LEN);
+	size_t hdr_len, payload, seg_len, off;
+	uint8_t *pkt, *seg;
+	uint32_t seq, sum;
+	uint16_t id, flags, seg_flags;
+
+	if (!iov_has_bytes(iov, iovcnt, ip_len)) {
+		fprintf(stderr, "Short TSO packet, dropping!\n");
+		return;
+	}
+	pkt = malloc(ip_len);
+	assert(pkt);
+	iov_linearize(iov, iovcnt, pkt, ip_len);
+	hdr_len = tcp_off + (pkt[tcp_off + TCP_OFF_DATA] >> 4) * 4;
+	if (hdr_len > ip_len) {
+		fprintf(stderr, "Bad TSO packet header, dropping!\n");
+		free(pkt);
+		return;
+	}
+	payload = ip_len - hdr_len;
+	seg = malloc(hdr_len + mss);
+	assert(seg);
+	id = nhgets(pkt + IPV4_OFF_ID);
+	seq = nhgetl(pkt + tcp_off + TCP_OFF_SEQ);
+	flags = nhgets(pkt + tcp_off + TCP_OFF_FL);
+	/* A header-only packet (e.g. a bare FIN) still goes out once. */
+	off = 0;
+	do {
+		seg_len = MIN(mss, payload - off);
+		memcpy(seg, pkt, hdr_len);
+		memcpy(seg + hdr_len, pkt + hdr_len + off, seg_len);
+
+		hnputs(seg + IPV4_OFF_LEN, hdr_len + seg_len);
+		hnputs(seg + IPV4_OFF_ID, id++);
+		hnputs(seg + IPV4_OFF_XSUM, 0);
+		hnputs(seg + IPV4_OFF_XSUM, ip_calc_xsum(seg, tcp_off));
+
+		hnputl(seg + tcp_off + TCP_OFF_SEQ, seq + off);
+		/* FIN and PSH belong on the last segment, CWR on the first. */
+		seg_flags = flags;
+		if (off + seg_len < payload)
+			seg_flags &= ~(TCP_FL_FIN | TCP_FL_PSH);
+		if (off)
+			seg_flags &= ~TCP_FL_CWR;
+		hnputs(seg + tcp_off + TCP_OFF_FL, seg_flags);
+		hnputs(seg + tcp_off + TCP_OFF_XSUM, 0);
+		sum = tcp_pseudo_sum(seg, hdr_len - tcp_off + seg_len);
+		sum += ptclbsum(seg + tcp_off, hdr_len - tcp_off + seg_len);
+		while (sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+		hnputs(seg + tcp_off + TCP_OFF_XSUM, ones_comp(sum));
+
+		write(map->host_data_fd, seg, hdr_len + seg_len);
+		off += seg_len;
+	} while (off < payload);
+	free(seg);
+	free(pkt);
+}
+
+/* Tells the host's bypass conv to TSO packets for us, with mss.  0 turns it
+ * off.  Returns TRUE on success. */
+static bool map_set_tso(struct ip_nat_map *map, uint16_t mss)
+{
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "tso %d", mss);
+	if (write(map->host_ctl_fd, buf, len) != len)
+		return FALSE;
+	map->tso_mss = mss;
+	return TRUE;
+}
+
+/* Sends a TCP packet from the guest, starting at the IP header.  gso_size is
+ * non-zero for a GSO packet from the guest, which we try to hand to the host
+ * as-is.  Once a map's conv is in TSO mode, the host stack finishes every TCP
+ * xsum: it wants the pseudo-header sum in the xsum field.
+ *
+ * If the host can't TSO (the route's interface can't, and the packet is bigger
+ * than its MTU), we segment in software and stop trying for this map. */
+static void tcp_tx(struct ip_nat_map *map, struct iovec *iov, int iovcnt,
+                   size_t tcp_off, uint16_t gso_size)
+{
+	uint8_t ip_hdr[IPV4_HDR_LEN];
+	uint16_t tcp_len;
+
+	if (gso_size && !map->no_tso && map->tso_mss != gso_size) {
+		if (!map_set_tso(map, gso_size))
+			map->no_tso = TRUE;
+	}
+	if (map->tso_mss) {
+		iov_memcpy_from(iov, iovcnt, 0, ip_hdr, IPV4_HDR_LEN);
+		tcp_len = nhgets(ip_hdr + IPV4_OFF_LEN) - tcp_off;
+		iov_put_be16(iov, iovcnt, tcp_off + TCP_OFF_XSUM,
+		             tcp_pseudo_sum(ip_hdr, tcp_len));
+		if (writev(map->host_data_fd, iov, iovcnt) >= 0 || !gso_size)
+			return;
+		map_set_tso(map, 0);
+		map->no_tso = TRUE;
+	}
+	if (gso_size)
+		tcp_segment_tx(map, iov, iovcnt, tcp_off, gso_size);
+	else
+		writev(map->host_data_fd, iov, iovcnt);
+}
+
+static void handle_ipv4_tx(struct iovec *iov, int iovcnt, uint16_t gso_size)
 {
 	size_t ip_off = ETH_HDR_LEN;
 	uint8_t protocol;
@@ -1260,7 +1517,10 @@ static void handle_ipv4_tx(struct iovec *iov, int iovcnt)
 	/* As far as blocking goes, this is like blasting out a raw IP packet.
 	 * It shouldn't block, preferring to drop, though there might be some
 	 * cases where a qlock is grabbed or the medium/NIC blocks. */
-	writev(map->host_data_fd, iov, iovcnt);
+	if (protocol == IP_TCPPROTO)
+		tcp_tx(map, iov, iovcnt, proto_hdr_off - ip_off, gso_size);
+	else
+		writev(map->host_data_fd, iov, iovcnt);
 	map->is_stale = FALSE;
 	kref_put(&map->kref);
 }
@@ -1269,10 +1529,25 @@ static void handle_ipv6_tx(struct iovec *iov, int iovcnt)
 {
 }
 
-/* virtio-net calls this when the guest transmits a packet */
-int vnet_transmit_packet(struct iovec *iov, int iovcnt)
+/* Returns TRUE if the ethernet frame in iov is a TCP over IPv4 packet. */
+static bool is_ipv4_tcp(struct iovec *iov, int iovcnt)
+{
+	if (!iov_has_bytes(iov, iovcnt, ETH_HDR_LEN + IPV4_HDR_LEN))
+		return FALSE;
+	if (iov_get_be16(iov, iovcnt, ETH_OFF_ETYPE) != ETH_TYPE_IPV4)
+		return FALSE;
+	return iov_get_byte(iov, iovcnt, ETH_HDR_LEN + IPV4_OFF_PROTO) ==
+	       IP_TCPPROTO;
+}
+
+/* virtio-net calls this when the guest transmits a packet.  hdr is the
+ * packet's virtio-net header, which says whether the guest left the xsum or
+ * the segmentation to us. */
+int vnet_transmit_packet(struct iovec *iov, int iovcnt,
+                         struct virtio_net_hdr_v1 *hdr)
 {
 	uint16_t ether_type;
+	uint16_t gso_size = 0;
 
 	if (vnet_snoop)
 		writev(snoop_fd, iov, iovcnt);
@@ -1281,13 +1556,33 @@ int vnet_transmit_packet(struct iovec *iov, int iovcnt)
 			"Short ethernet frame from the guest, dropping!\n");
 		return -1;
 	}
+	switch (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_NONE:
+		if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+			finish_partial_xsum(iov, iovcnt, hdr->csum_start,
+			                    hdr->csum_offset);
+		break;
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		/* The TCP xsum is partial; tcp_tx() deals with it.  That only
+		 * works for TCP over IPv4, with an actual MSS. */
+		if (!hdr->gso_size || !is_ipv4_tcp(iov, iovcnt)) {
+			fprintf(stderr, "Bad TCPv4 GSO packet, dropping!\n");
+			return -1;
+		}
+		gso_size = hdr->gso_size;
+		break;
+	default:
+		fprintf(stderr, "Unsupported GSO type %d, dropping!\n",
+			hdr->gso_type);
+		return -1;
+	}
 	ether_type = iov_get_be16(iov, iovcnt, ETH_OFF_ETYPE);
 	switch (ether_type) {
 	case ETH_TYPE_ARP:
 		handle_arp_tx(iov, iovcnt);
 		break;
 	case ETH_TYPE_IPV4:
-		handle_ipv4_tx(iov, iovcnt);
+		handle_ipv4_tx(iov, iovcnt, gso_size);
 		break;
 	case ETH_TYPE_IPV6:
 		handle_ipv6_tx(iov, iovcnt);
@@ -1442,15 +1737,16 @@ static size_t handle_rx(struct iovec *iov, int iovcnt, size_t len,
  * success and returning the amount.  0 means 'nothing there.'
  *
  * Notes on concurrency:
- * - The inbound_todo list is protected by the rx_mtx.  Since we're readv()ing
- *   while holding the mtx (because we're in a FOREACH), we're single threaded
- *   in the RX path.
+ * - The inbound_todo list is protected by the rxq's mtx.  Since we're
+ *   readv()ing while holding the mtx (because we're in a FOREACH), we're single
+ *   threaded in each queue's RX path.
  * - The inbound_todo list is filled by another thread that puts maps on the
  *   list whenever their FD tap fires.
  * - The maps on the inbound_todo list are refcounted.  It's possible for them
  *   to be reaped and removed from the mapping lookup, but the mapping would
  *   stay around until we drained all of the packets from the inbound conv. */
-static size_t __poll_inbound(struct iovec *iov, int iovcnt)
+static size_t __poll_inbound(struct vnet_rxq *rxq, struct iovec *iov,
+                             int iovcnt)
 {
 	struct ip_nat_map *i, *temp;
 	ssize_t pkt_sz = 0;
@@ -1461,36 +1757,40 @@ static size_t __poll_inbound(struct iovec *iov, int iovcnt)
 	 * point to the same memory (minus the stripping). */
 	memcpy(iov_copy, iov, sizeof(struct iovec) * iovcnt);
 	iov_strip_bytes(iov_copy, iovcnt, ETH_HDR_LEN);
-	TAILQ_FOREACH_SAFE(i, &inbound_todo, inbound, temp) {
+	TAILQ_FOREACH_SAFE(i, &rxq->inbound_todo, inbound, temp) {
 		pkt_sz = readv(i->host_data_fd, iov_copy, iovcnt);
 		if (pkt_sz > 0) {
 			i->is_stale = FALSE;
 			return handle_rx(iov, iovcnt, pkt_sz + ETH_HDR_LEN, i);
 		}
 		parlib_assert_perror(errno == EAGAIN);
-		TAILQ_REMOVE(&inbound_todo, i, inbound);
+		TAILQ_REMOVE(&rxq->inbound_todo, i, inbound);
 		i->is_on_inbound = FALSE;
 		kref_put(&i->kref);
 	}
 	return 0;
 }
 
-/* virtio-net calls this when it wants us to fill iov with a packet. */
-int vnet_receive_packet(struct iovec *iov, int iovcnt)
+/* virtio-net calls this when it wants us to fill iov with a packet for RX
+ * queue qidx. */
+int vnet_receive_packet(int qidx, struct iovec *iov, int iovcnt)
 {
+	struct vnet_rxq *rxq = &rxqs[qidx];
 	size_t rx_amt;
 
-	uth_mutex_lock(rx_mtx);
+	uth_mutex_lock(rxq->mtx);
 	while (1) {
-		rx_amt = __poll_injection(iov, iovcnt);
-		if (rx_amt)
-			break;
-		rx_amt = __poll_inbound(iov, iovcnt);
+		if (qidx == 0) {
+			rx_amt = __poll_injection(iov, iovcnt);
+			if (rx_amt)
+				break;
+		}
+		rx_amt = __poll_inbound(rxq, iov, iovcnt);
 		if (rx_amt)
 			break;
-		uth_cond_var_wait(rx_cv, rx_mtx);
+		uth_cond_var_wait(rxq->cv, rxq->mtx);
 	}
-	uth_mutex_unlock(rx_mtx);
+	uth_mutex_unlock(rxq->mtx);
 	iov_trim_len_to(iov, iovcnt, rx_amt);
 	if (vnet_snoop)
 		writev(snoop_fd, iov, iovcnt);
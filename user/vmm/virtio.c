@@ -15,6 +15,7 @@
 #include <vmm/virtio.h>
 #include <vmm/virtio_ids.h>
 #include <vmm/virtio_config.h>
+#include <vmm/virtio_net.h>
 
 // Returns NULL if the features are valid, otherwise returns
 // an error string describing what part of validation failed
@@ -36,6 +37,19 @@ const char *virtio_validate_feat(struct virtio_vq_dev *vqdev, uint64_t feat)
 		// There is no "mandatory" feature bit that we always want to
 		// have, either the device can set its own MAC Address (as it
 		// does now) or the driver can set it using a controller thread.
+		// The offloads and multiqueue do depend on other features.
+		if ((feat & (1ULL << VIRTIO_NET_F_HOST_TSO4))
+		    && !(feat & (1ULL << VIRTIO_NET_F_CSUM)))
+			return "VIRTIO_NET_F_HOST_TSO4 requires VIRTIO_NET_F_CSUM.\n"
+			       "  See virtio-v1.0-cs04 s5.1.3.1.";
+		if ((feat & (1ULL << VIRTIO_NET_F_GUEST_TSO4))
+		    && !(feat & (1ULL << VIRTIO_NET_F_GUEST_CSUM)))
+			return "VIRTIO_NET_F_GUEST_TSO4 requires VIRTIO_NET_F_GUEST_CSUM.\n"
+			       "  See virtio-v1.0-cs04 s5.1.3.1.";
+		if ((feat & (1ULL << VIRTIO_NET_F_MQ))
+		    && !(feat & (1ULL << VIRTIO_NET_F_CTRL_VQ)))
+			return "VIRTIO_NET_F_MQ requires VIRTIO_NET_F_CTRL_VQ.\n"
+			       "  See virtio-v1.0-cs04 s5.1.3.1.";
 		break;
 	case VIRTIO_ID_BLOCK:
 		break;
@@ -1,7 +1,10 @@
 #define _LARGEFILE64_SOURCE /* See feature_test_macros(7) */
 #include <fcntl.h>
 #include <parlib/stdio.h>
+#include <parlib/uthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -18,10 +21,39 @@ do {                                                                           \
 	}                                                                      \
 } while (0)
 
+/* blk_request() pulls descriptor chains off the vq as fast as the guest posts
+ * them and hands them to a pool of worker task threads.  Each worker issues its
+ * request with positional I/O, so several requests are in flight at once, and
+ * completes it as soon as it is done, regardless of the order the guest posted
+ * them in. */
+#define BLK_NR_WORKERS 8
+
+struct blk_req {
+	TAILQ_ENTRY(blk_req)		link;
+	uint32_t			head;
+	uint32_t			olen;
+	uint32_t			ilen;
+	struct iovec			*iov;
+};
+TAILQ_HEAD(blk_req_tq, blk_req);
+
 /* TODO(ganshun): multiple disks */
 static int diskfd;
 
-void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename)
+static struct virtio_vq *blk_vq;
+static struct blk_req_tq blk_pending = TAILQ_HEAD_INITIALIZER(blk_pending);
+static struct blk_req_tq blk_free = TAILQ_HEAD_INITIALIZER(blk_free);
+/* Protects the pending and free lists */
+static uth_mutex_t *blk_mtx;
+static uth_cond_var_t *blk_work_cv;
+static uth_cond_var_t *blk_free_cv;
+/* Serializes completions on the used ring and guest IRQs */
+static uth_mutex_t *blk_used_mtx;
+
+static void *blk_worker(void *arg);
+
+void blk_init_fn(struct virtual_machine *vm, struct virtio_vq_dev *vqdev,
+		 const char *filename)
 {
 	struct virtio_blk_config *cfg = vqdev->cfg;
 	struct virtio_blk_config *cfg_d = vqdev->cfg_d;
@@ -39,6 +71,214 @@ void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename)
 
 	cfg->capacity = len;
 	cfg_d->capacity = len;
+
+	/* We don't deallocate anything on a discard, so there's nothing to
+	 * limit.  One segment per request keeps the guest's requests simple. */
+	cfg->max_discard_sectors = cfg_d->max_discard_sectors = UINT32_MAX;
+	cfg->max_discard_seg = cfg_d->max_discard_seg = 1;
+	cfg->discard_sector_alignment = cfg_d->discard_sector_alignment = 1;
+
+	blk_mtx = uth_mutex_alloc();
+	blk_used_mtx = uth_mutex_alloc();
+	blk_work_cv = uth_cond_var_alloc();
+	blk_free_cv = uth_cond_var_alloc();
+	for (int i = 0; i < BLK_NR_WORKERS; i++) {
+		if (!vmm_run_task(vm, blk_worker, NULL))
+			VIRTIO_DEV_ERRX(vqdev, "Could not start a blk worker");
+	}
+}
+
+/* Helper: positional I/O on the disk for an iovec.  Returns the number of
+ * bytes transferred, or -1 on error. */
+static ssize_t blk_rw(struct iovec *iov, int iovcnt, uint64_t offset,
+		      bool write)
+{
+	ssize_t ret, tot = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		for (size_t done = 0; done < iov[i].iov_len; done += ret) {
+			if (write)
+				ret = pwrite(diskfd, iov[i].iov_base + done,
+					     iov[i].iov_len - done,
+					     offset + tot);
+			else
+				ret = pread(diskfd, iov[i].iov_base + done,
+					    iov[i].iov_len - done,
+					    offset + tot);
+			if (ret < 0)
+				return -1;
+			/* Short read past EOF; the guest gets zeros */
+			if (!ret) {
+				memset(iov[i].iov_base + done, 0,
+				       iov[i].iov_len - done);
+				ret = iov[i].iov_len - done;
+			}
+			tot += ret;
+		}
+	}
+	return tot;
+}
+
+static size_t iov_total_len(struct iovec *iov, int iovcnt)
+{
+	size_t tot = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		tot += iov[i].iov_len;
+	return tot;
+}
+
+static bool blk_range_ok(struct virtio_vq *vq, uint64_t sector, size_t len)
+{
+	struct virtio_blk_config *cfg = vq->vqdev->cfg;
+	uint64_t offset = sector * 512;
+
+	return (offset / 512 == sector) && (offset + len >= offset) &&
+	       (offset + len <= cfg->capacity * 512);
+}
+
+static void blk_hexdump(struct iovec *iov, int iovcnt)
+{
+	char *pf = "";
+
+	for (int j = 0; j < iovcnt; j++) {
+		for (int i = 0; i + 1 < iov[j].iov_len; i += 2) {
+			uint8_t *p = (uint8_t*)iov[j].iov_base + i;
+
+			fprintf(stderr, "%s%02x", pf, *(p + 1));
+			fprintf(stderr, "%02x", *p);
+			fprintf(stderr, " ");
+			pf = ((i + 2) % 16) ? " " : "\n";
+		}
+	}
+}
+
+/* Discards are a hint.  The disk image is a plain file and we have no way to
+ * punch holes in it, so we just check the ranges and report success, which the
+ * spec allows. */
+static uint8_t blk_discard(struct virtio_vq *vq, struct iovec *iov, int iovcnt)
+{
+	struct virtio_blk_discard_write_zeroes *range;
+	size_t nr_ranges;
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len % sizeof(*range))
+			return VIRTIO_BLK_S_IOERR;
+		range = iov[i].iov_base;
+		nr_ranges = iov[i].iov_len / sizeof(*range);
+		for (int j = 0; j < nr_ranges; j++) {
+			if (!blk_range_ok(vq, range[j].sector,
+					  (size_t)range[j].num_sectors * 512))
+				return VIRTIO_BLK_S_IOERR;
+		}
+	}
+	return VIRTIO_BLK_S_OK;
+}
+
+/* Returns the number of bytes written into the guest's buffers, including the
+ * status byte. */
+static uint32_t blk_handle_req(struct virtio_vq *vq, struct blk_req *req)
+{
+	struct iovec *iov = req->iov;
+	struct iovec *last = &iov[req->olen + req->ilen - 1];
+	struct virtio_blk_outhdr *out;
+	uint8_t *status;
+	uint32_t wlen = sizeof(*status);
+	ssize_t ret;
+
+	/* The header is first, and the status byte is the last byte of the
+	 * last writable buffer.  The data, if any, is in between. */
+	if (!req->olen || iov[0].iov_len < sizeof(*out))
+		VIRTIO_DRI_ERRX(vq->vqdev, "no room for the request header\n");
+	if (!req->ilen || !last->iov_len)
+		VIRTIO_DEV_ERRX(vq->vqdev, "no room for status\n");
+	out = iov[0].iov_base;
+	status = last->iov_base + last->iov_len - 1;
+	last->iov_len--;
+
+	switch (out->type & ~VIRTIO_BLK_T_BARRIER) {
+	case VIRTIO_BLK_T_IN:
+		if (!blk_range_ok(vq, out->sector,
+				  iov_total_len(&iov[req->olen], req->ilen))) {
+			*status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		ret = blk_rw(&iov[req->olen], req->ilen, out->sector * 512,
+			     FALSE);
+		if (ret < 0) {
+			*status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		wlen += ret;
+		*status = VIRTIO_BLK_S_OK;
+		if (debug_virtio_blk)
+			blk_hexdump(&iov[req->olen], req->ilen);
+		break;
+	case VIRTIO_BLK_T_OUT:
+		if (!blk_range_ok(vq, out->sector,
+				  iov_total_len(&iov[1], req->olen - 1))) {
+			DPRINTF("write past end of file at sector %llu\n",
+				out->sector);
+			*status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		ret = blk_rw(&iov[1], req->olen - 1, out->sector * 512, TRUE);
+		*status = ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		/* Covers every write we completed before the guest sent the
+		 * flush, which is all the guest may assume. */
+		*status = fsync(diskfd) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+		break;
+	case VIRTIO_BLK_T_DISCARD:
+		*status = blk_discard(vq, &iov[1], req->olen - 1);
+		break;
+	default:
+		DPRINTF("unsupported request type %u\n", out->type);
+		*status = VIRTIO_BLK_S_UNSUPP;
+		break;
+	}
+	return wlen;
+}
+
+static void blk_complete(struct virtio_vq *vq, struct blk_req *req,
+			 uint32_t wlen)
+{
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	uint32_t head = req->head;
+
+	/* Recycle the req before the guest can see the head is used.  After
+	 * that, the guest can post another chain, and blk_request() will want a
+	 * req for it. */
+	uth_mutex_lock(blk_mtx);
+	TAILQ_INSERT_TAIL(&blk_free, req, link);
+	uth_mutex_unlock(blk_mtx);
+	uth_cond_var_signal(blk_free_cv);
+
+	uth_mutex_lock(blk_used_mtx);
+	virtio_add_used_desc(vq, head, wlen);
+	virtio_mmio_set_vring_irq(dev);
+	dev->poke_guest(dev->vec, dev->dest);
+	uth_mutex_unlock(blk_used_mtx);
+}
+
+static void *blk_worker(void *arg)
+{
+	struct blk_req *req;
+	uint32_t wlen;
+
+	for (;;) {
+		uth_mutex_lock(blk_mtx);
+		while (TAILQ_EMPTY(&blk_pending))
+			uth_cond_var_wait(blk_work_cv, blk_mtx);
+		req = TAILQ_FIRST(&blk_pending);
+		TAILQ_REMOVE(&blk_pending, req, link);
+		uth_mutex_unlock(blk_mtx);
+
+		wlen = blk_handle_req(blk_vq, req);
+		blk_complete(blk_vq, req, wlen);
+	}
+	return 0;
 }
 
 void *blk_request(void *_vq)
@@ -48,15 +288,7 @@ void *blk_request(void *_vq)
 	assert(vq != NULL);
 
 	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
-	struct iovec *iov;
-	uint32_t head;
-	uint32_t olen, ilen;
-	struct virtio_blk_outhdr *out;
-	uint64_t offset;
-	int64_t ret;
-	size_t wlen;
-	uint8_t *status;
-	struct virtio_blk_config *cfg = vq->vqdev->cfg;
+	struct blk_req *req;
 
 	if (vq->qready != 0x1)
 		VIRTIO_DEV_ERRX(vq->vqdev,
@@ -67,75 +299,39 @@ void *blk_request(void *_vq)
 		VIRTIO_DEV_ERRX(vq->vqdev,
 			"The 'poke_guest' function pointer was not set.");
 
-	iov = malloc(vq->qnum_max * sizeof(struct iovec));
-	if (iov == NULL)
-		VIRTIO_DEV_ERRX(vq->vqdev,
-			"malloc returned null trying to allocate iov.\n");
+	/* The guest can't have more than a ring's worth of chains outstanding,
+	 * so that's as many reqs as we'll ever need. */
+	for (int i = 0; i < vq->qnum_max; i++) {
+		req = malloc(sizeof(struct blk_req));
+		if (req)
+			req->iov = malloc(vq->qnum_max * sizeof(struct iovec));
+		if (!req || !req->iov)
+			VIRTIO_DEV_ERRX(vq->vqdev,
+				"malloc returned null trying to allocate a request.\n");
+		TAILQ_INSERT_TAIL(&blk_free, req, link);
+	}
+	blk_vq = vq;
 
 	for (;;) {
-		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
-		/* There are always three iovecs.
-		 * The first is the header.
-		 * The second is the actual data.
-		 * The third contains just the status byte.
-		 */
-		assert(olen + ilen == 3);
-
-		status = iov[2].iov_base;
-		if (!status)
-			VIRTIO_DEV_ERRX(vq->vqdev, "no room for status\n");
-
-		out = iov[0].iov_base;
-		if (out->type & VIRTIO_BLK_T_FLUSH)
-			VIRTIO_DEV_ERRX(vq->vqdev, "Flush not supported.\n");
-
-		offset = out->sector * 512;
-		if (lseek64(diskfd, offset, SEEK_SET) != offset)
-			VIRTIO_DEV_ERRX(vq->vqdev, "Bad seek at sector %llu\n",
-			                out->sector);
+		uth_mutex_lock(blk_mtx);
+		while (TAILQ_EMPTY(&blk_free))
+			uth_cond_var_wait(blk_free_cv, blk_mtx);
+		req = TAILQ_FIRST(&blk_free);
+		TAILQ_REMOVE(&blk_free, req, link);
+		uth_mutex_unlock(blk_mtx);
 
-		if (out->type & VIRTIO_BLK_T_OUT) {
-
-			if ((offset + iov[1].iov_len) > (cfg->capacity * 512))
-				VIRTIO_DEV_ERRX(vq->vqdev,
-						"write past end of file!\n");
-
-			ret = writev(diskfd, &iov[1], 1);
-
-			if (ret >= 0 && ret == iov[1].iov_len)
-				*status = VIRTIO_BLK_S_OK;
-			else
-				*status = VIRTIO_BLK_S_IOERR;
-			wlen = sizeof(*status);
-		} else {
-			ret = readv(diskfd, &iov[1], 1);
-			if (ret >= 0) {
-				wlen = sizeof(*status) + ret;
-				*status = VIRTIO_BLK_S_OK;
-			} else {
-				wlen = sizeof(*status);
-				*status = VIRTIO_BLK_S_IOERR;
-			}
-
-			// Hexdump for debugging.
-			if (debug_virtio_blk && ret >= 0) {
-				char *pf = "";
-
-				for (int i = 0; i < iov[olen].iov_len; i += 2) {
-					uint8_t *p =
-					  (uint8_t*)iov[olen].iov_base + i;
-
-					fprintf(stderr, "%s%02x", pf, *(p + 1));
-					fprintf(stderr, "%02x", *p);
-					fprintf(stderr, " ");
-					pf = ((i + 2) % 16) ? " " : "\n";
-				}
-			}
-		}
+		/* Blocks until the guest posts something.  When the guest posts
+		 * a batch, we'll loop back around without blocking and queue up
+		 * the whole batch for the workers. */
+		req->head = virtio_next_avail_vq_desc(vq, req->iov, &req->olen,
+						      &req->ilen);
+		DPRINTF("request head %u olen %u ilen %u\n", req->head,
+			req->olen, req->ilen);
 
-		virtio_add_used_desc(vq, head, wlen);
-		virtio_mmio_set_vring_irq(dev);
-		dev->poke_guest(dev->vec, dev->dest);
+		uth_mutex_lock(blk_mtx);
+		TAILQ_INSERT_TAIL(&blk_pending, req, link);
+		uth_mutex_unlock(blk_mtx);
+		uth_cond_var_signal(blk_work_cv);
 	}
 	return 0;
 }
@@ -134,6 +134,25 @@ void virtio_add_used_desc(struct virtio_vq *vq, uint32_t head, uint32_t len)
 	vq->vring.used->idx++;
 }
 
+void virtio_add_used_descs(struct virtio_vq *vq, uint32_t *heads,
+                           uint32_t *lens, int nr)
+{
+	uint16_t idx = vq->vring.used->idx;
+
+	if (!vq->qready)
+		VIRTIO_DEV_ERRX(vq->vqdev,
+			"The device may not process queues with QueueReady set to 0x0.\n"
+			"  See virtio-v1.0-cs04 s4.2.2.1 MMIO Device Register Layout");
+
+	for (int i = 0; i < nr; i++, idx++) {
+		vq->vring.used->ring[idx % vq->vring.num].id = heads[i];
+		vq->vring.used->ring[idx % vq->vring.num].len = lens[i];
+	}
+	// The driver can't see any of them until we update the used idx.
+	wmb();
+	vq->vring.used->idx = idx;
+}
+
 // Based on wait_for_vq_desc in Linux's'lguest.c, which came with
 // the following comment:
 /*
@@ -38,6 +38,24 @@
 
 #define VIRTIO_HEADER_SIZE	12
 
+/* Our side of the virtual wire.  Anything longer than this from the host is
+ * TSO'd or GRO'd TCP, which the guest can take as GSO with mergeable
+ * buffers. */
+#define VNET_MTU		1500
+#define VNET_MAX_PKT		(ETH_HDR_LEN + 65536)
+#define VNET_QNUM_MAX		256
+
+static bool net_has_feat(struct virtio_vq_dev *vqdev, int feat)
+{
+	return vqdev->dri_feat & (1ULL << feat);
+}
+
+/* RX and TX queues come in pairs, with the control queue after them. */
+static int net_vq_pair(struct virtio_vq *vq)
+{
+	return (vq - vq->vqdev->vqs) / 2;
+}
+
 void virtio_net_set_mac(struct virtio_vq_dev *vqdev, uint8_t *guest_mac)
 {
 	memcpy(((struct virtio_net_config*)(vqdev->cfg))->mac, guest_mac,
@@ -46,18 +64,62 @@ void virtio_net_set_mac(struct virtio_vq_dev *vqdev, uint8_t *guest_mac)
 	       ETH_ADDR_LEN);
 }
 
+/* Tells the guest about the checksum and GSO state of the packet in iov. */
+static void net_rx_offloads(struct virtio_vq_dev *vqdev,
+                            struct virtio_net_hdr_v1 *net_header,
+                            struct iovec *iov, int iovcnt, size_t len)
+{
+	size_t ip_hlen, tcp_hlen;
+
+	net_header->flags = 0;
+	net_header->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+	net_header->hdr_len = 0;
+	net_header->gso_size = 0;
+	net_header->csum_start = 0;
+	net_header->csum_offset = 0;
+	/* The host's stack checked the transport checksum before handing the
+	 * packet to the bypass conv, and the NAT kept it valid. */
+	if (net_has_feat(vqdev, VIRTIO_NET_F_GUEST_CSUM))
+		net_header->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+	if (len <= ETH_HDR_LEN + VNET_MTU)
+		return;
+	if (!net_has_feat(vqdev, VIRTIO_NET_F_GUEST_TSO4))
+		return;
+	if (iov_get_be16(iov, iovcnt, ETH_OFF_ETYPE) != ETH_TYPE_IPV4)
+		return;
+	if (iov_get_byte(iov, iovcnt, ETH_HDR_LEN + IPV4_OFF_PROTO)
+	    != IP_TCPPROTO)
+		return;
+	ip_hlen = (iov_get_byte(iov, iovcnt, ETH_HDR_LEN) & 0x0f) * 4;
+	tcp_hlen = (iov_get_byte(iov, iovcnt,
+	                         ETH_HDR_LEN + ip_hlen + TCP_OFF_DATA) >> 4) * 4;
+	net_header->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+	net_header->hdr_len = ETH_HDR_LEN + ip_hlen + tcp_hlen;
+	net_header->gso_size = VNET_MTU - ip_hlen - tcp_hlen;
+}
+
 /* net_receiveq_fn receives packets for the guest through the virtio networking
  * device and the _vq virtio queue.
+ *
+ * With VIRTIO_NET_F_MRG_RXBUF, a packet can span several of the guest's
+ * buffers.  We read into the first buffer, with a bounce buffer behind it for
+ * anything that doesn't fit, and copy the rest into as many more buffers as it
+ * takes.  The guest sees them all at once.
  */
 void *net_receiveq_fn(void *_vq)
 {
 	struct virtio_vq *vq = _vq;
 	uint32_t head;
 	uint32_t olen, ilen;
-	int num_read;
+	int num_read, qidx;
 	struct iovec *iov;
 	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
 	struct virtio_net_hdr_v1 *net_header;
+	uint8_t *bounce;
+	uint32_t *heads, *lens;
+	size_t first_len, copied, amt;
+	int nr_bufs, iovcnt;
+	bool mrg;
 
 	if (!vq)
 		VIRTIO_DEV_ERRX(vq->vqdev,
@@ -71,8 +133,14 @@ void *net_receiveq_fn(void *_vq)
 			"The service function for queue '%s' was launched before the driver set QueueReady to 0x1.",
 			vq->name);
 
-	iov = malloc(vq->qnum_max * sizeof(struct iovec));
+	/* One extra iov for the bounce buffer */
+	iov = malloc((vq->qnum_max + 1) * sizeof(struct iovec));
 	assert(iov != NULL);
+	heads = malloc(vq->qnum_max * sizeof(uint32_t));
+	lens = malloc(vq->qnum_max * sizeof(uint32_t));
+	bounce = malloc(VNET_MAX_PKT);
+	assert(heads && lens && bounce);
+	qidx = net_vq_pair(vq);
 
 	if (!dev->poke_guest) {
 		free(iov);
@@ -86,7 +154,7 @@ void *net_receiveq_fn(void *_vq)
 			free(iov);
 			VIRTIO_DRI_ERRX(vq->vqdev,
 				"The driver placed a device-readable buffer in the net device's receiveq.\n"
-				"  See virtio-v1.0-cs04 s5.3.6.1 Device Operation");
+				"  See virtio-v1.0-cs04 s5.3.6 Device Operation");
 		}
 
 		/* The virtio_net header comes first.  We'll assume they didn't
@@ -95,25 +163,53 @@ void *net_receiveq_fn(void *_vq)
 		net_header = iov[0].iov_base;
 		assert(iov[0].iov_len >= VIRTIO_HEADER_SIZE);
 		iov_strip_bytes(iov, ilen, VIRTIO_HEADER_SIZE);
-
-		num_read = vnet_receive_packet(iov, ilen);
-		if (num_read < 0) {
-			free(iov);
-			VIRTIO_DEV_ERRX(vq->vqdev,
-				"Encountered an error trying to read input from the ethernet device.");
-		}
+		first_len = iov_get_len(iov, ilen);
 
 		/* See virtio spec virtio-v1.0-cs04 s5.1.6.3.2 Device
 		 * Requirements: Setting Up Receive Buffers
 		 *
-		 * VIRTIO_NET_F_MRG_RXBUF is not currently negotiated.
 		 * num_buffers will always be 1 if VIRTIO_NET_F_MRG_RXBUF is not
 		 * negotiated.
 		 */
-		net_header->num_buffers = 1;
-		net_header->flags = 0;
-		net_header->gso_type = VIRTIO_NET_HDR_GSO_NONE;
-		virtio_add_used_desc(vq, head, num_read + VIRTIO_HEADER_SIZE);
+		mrg = net_has_feat(vq->vqdev, VIRTIO_NET_F_MRG_RXBUF);
+		iovcnt = ilen;
+		if (mrg) {
+			iov[iovcnt].iov_base = bounce;
+			iov[iovcnt].iov_len = VNET_MAX_PKT;
+			iovcnt++;
+		}
+
+		num_read = vnet_receive_packet(qidx, iov, iovcnt);
+		if (num_read < 0) {
+			free(iov);
+			VIRTIO_DEV_ERRX(vq->vqdev,
+				"Encountered an error trying to read input from the ethernet device.");
+		}
+		net_rx_offloads(vq->vqdev, net_header, iov, iovcnt, num_read);
+
+		heads[0] = head;
+		lens[0] = MIN(num_read, first_len) + VIRTIO_HEADER_SIZE;
+		nr_bufs = 1;
+		/* The bounce buffer's data starts at whatever didn't fit. */
+		for (copied = 0; num_read > first_len + copied; nr_bufs++) {
+			if (nr_bufs == vq->qnum_max)
+				VIRTIO_DRI_ERRX(vq->vqdev,
+					"The driver's receive buffers are too small for a packet of %d bytes.",
+					num_read);
+			heads[nr_bufs] = virtio_next_avail_vq_desc(vq, iov,
+			                                           &olen, &ilen);
+			if (olen)
+				VIRTIO_DRI_ERRX(vq->vqdev,
+					"The driver placed a device-readable buffer in the net device's receiveq.\n"
+					"  See virtio-v1.0-cs04 s5.3.6 Device Operation");
+			amt = MIN(num_read - first_len - copied,
+			          iov_get_len(iov, ilen));
+			iov_memcpy_to(iov, ilen, 0, bounce + copied, amt);
+			lens[nr_bufs] = amt;
+			copied += amt;
+		}
+		net_header->num_buffers = nr_bufs;
+		virtio_add_used_descs(vq, heads, lens, nr_bufs);
 
 		virtio_mmio_set_vring_irq(dev);
 		dev->poke_guest(dev->vec, dev->dest);
@@ -123,6 +219,9 @@ void *net_receiveq_fn(void *_vq)
 
 /* net_transmitq_fn transmits packets from the guest through the virtio
  * networking device through the _vq virtio queue.
+ *
+ * We only interrupt the guest once we've drained the queue, so a burst of
+ * packets costs one interrupt.
  */
 void *net_transmitq_fn(void *_vq)
 {
@@ -131,7 +230,7 @@ void *net_transmitq_fn(void *_vq)
 	uint32_t olen, ilen;
 	struct iovec *iov;
 	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
-	void *stripped;
+	struct virtio_net_hdr_v1 net_header;
 
 	iov = malloc(vq->qnum_max * sizeof(struct iovec));
 	assert(iov != NULL);
@@ -153,14 +252,128 @@ void *net_transmitq_fn(void *_vq)
 		}
 
 		/* Strip off the virtio header (the first 12 bytes), as it is
-		 * not a part of the actual ethernet frame. */
+		 * not a part of the actual ethernet frame.  The guest can
+		 * change the header under us, so we work from a copy. */
+		iov_memcpy_from(iov, olen, 0, &net_header, VIRTIO_HEADER_SIZE);
 		iov_strip_bytes(iov, olen, VIRTIO_HEADER_SIZE);
-		vnet_transmit_packet(iov, olen);
+		vnet_transmit_packet(iov, olen, &net_header);
 
 		virtio_add_used_desc(vq, head, 0);
 
+		if (vq->last_avail != vq->vring.avail->idx)
+			continue;
+		virtio_mmio_set_vring_irq(dev);
+		dev->poke_guest(dev->vec, dev->dest);
+	}
+	return 0;
+}
+
+/* net_controlq_fn handles the guest's commands on the control queue.  The only
+ * one we offer is VIRTIO_NET_CTRL_MQ, to set the number of queue pairs. */
+void *net_controlq_fn(void *_vq)
+{
+	struct virtio_vq *vq = _vq;
+	uint32_t head;
+	uint32_t olen, ilen;
+	struct iovec *iov;
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	struct virtio_net_config *cfg = vq->vqdev->cfg;
+	struct virtio_net_ctrl_hdr ctrl;
+	struct virtio_net_ctrl_mq mq;
+	uint8_t ack;
+
+	iov = malloc(vq->qnum_max * sizeof(struct iovec));
+	assert(iov != NULL);
+
+	for (;;) {
+		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
+		if (!olen || !ilen)
+			VIRTIO_DRI_ERRX(vq->vqdev,
+				"Control commands need a device-readable and a device-writeable buffer.\n"
+				"  See virtio-v1.0-cs04 s5.1.6.5 Control Virtqueue");
+
+		ack = VIRTIO_NET_ERR;
+		iov_memcpy_from(iov, olen, 0, &ctrl, sizeof(ctrl));
+		if (ctrl.class == VIRTIO_NET_CTRL_MQ &&
+		    ctrl.cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET &&
+		    iov_has_bytes(iov, olen, sizeof(ctrl) + sizeof(mq))) {
+			iov_memcpy_from(iov, olen, sizeof(ctrl), &mq,
+			                sizeof(mq));
+			if (mq.virtqueue_pairs >= 1 &&
+			    mq.virtqueue_pairs <= cfg->max_virtqueue_pairs) {
+				vnet_set_nr_queues(mq.virtqueue_pairs);
+				ack = VIRTIO_NET_OK;
+			}
+		}
+		iov_memcpy_to(&iov[olen], ilen, 0, &ack, sizeof(ack));
+		virtio_add_used_desc(vq, head, sizeof(ack));
+
 		virtio_mmio_set_vring_irq(dev);
 		dev->poke_guest(dev->vec, dev->dest);
 	}
 	return 0;
 }
+
+static char *net_vq_name(const char *base, int idx)
+{
+	char *name = malloc(32);
+
+	assert(name);
+	snprintf(name, 32, "%s%d", base, idx);
+	return name;
+}
+
+/* Builds a network device with nr_pairs of RX/TX queues.  With more than one
+ * pair, there's also a control queue, which the guest uses to turn the other
+ * pairs on. */
+struct virtio_vq_dev *virtio_net_alloc_vqdev(struct virtio_mmio_dev *mmio_dev,
+                                             int nr_pairs)
+{
+	struct virtio_vq_dev *vqdev;
+	struct virtio_net_config *cfg, *cfg_d;
+	int nr_vqs = nr_pairs > 1 ? 2 * nr_pairs + 1 : 2;
+
+	vqdev = calloc(1, sizeof(struct virtio_vq_dev)
+	                  + nr_vqs * sizeof(struct virtio_vq));
+	cfg = calloc(1, sizeof(struct virtio_net_config));
+	cfg_d = calloc(1, sizeof(struct virtio_net_config));
+	assert(vqdev && cfg && cfg_d);
+	cfg_d->max_virtqueue_pairs = nr_pairs;
+	*cfg = *cfg_d;
+
+	vqdev->name = "network";
+	vqdev->dev_id = VIRTIO_ID_NET;
+	vqdev->dev_feat = 1ULL << VIRTIO_F_VERSION_1
+	                  | 1ULL << VIRTIO_NET_F_MAC
+	                  | 1ULL << VIRTIO_NET_F_MRG_RXBUF
+	                  | 1ULL << VIRTIO_NET_F_CSUM
+	                  | 1ULL << VIRTIO_NET_F_HOST_TSO4
+	                  | 1ULL << VIRTIO_NET_F_GUEST_CSUM
+	                  | 1ULL << VIRTIO_NET_F_GUEST_TSO4;
+	if (nr_pairs > 1)
+		vqdev->dev_feat |= 1ULL << VIRTIO_NET_F_CTRL_VQ
+		                   | 1ULL << VIRTIO_NET_F_MQ;
+	vqdev->num_vqs = nr_vqs;
+	vqdev->cfg = cfg;
+	vqdev->cfg_d = cfg_d;
+	vqdev->cfg_sz = sizeof(struct virtio_net_config);
+	vqdev->transport_dev = mmio_dev;
+	for (int i = 0; i < nr_pairs; i++) {
+		vqdev->vqs[2 * i].name = net_vq_name("net_receiveq", i);
+		vqdev->vqs[2 * i].qnum_max = VNET_QNUM_MAX;
+		vqdev->vqs[2 * i].srv_fn = net_receiveq_fn;
+		vqdev->vqs[2 * i].vqdev = vqdev;
+		vqdev->vqs[2 * i + 1].name = net_vq_name("net_transmitq", i);
+		vqdev->vqs[2 * i + 1].qnum_max = VNET_QNUM_MAX;
+		vqdev->vqs[2 * i + 1].srv_fn = net_transmitq_fn;
+		vqdev->vqs[2 * i + 1].vqdev = vqdev;
+	}
+	if (nr_pairs > 1) {
+		vqdev->vqs[nr_vqs - 1].name = "net_controlq";
+		vqdev->vqs[nr_vqs - 1].qnum_max = 64;
+		vqdev->vqs[nr_vqs - 1].srv_fn = net_controlq_fn;
+		vqdev->vqs[nr_vqs - 1].vqdev = vqdev;
+	}
+	mmio_dev->vqdev = vqdev;
+	return vqdev;
+}